@@ -0,0 +1,81 @@
+<?php
+/*
+ * Generate a synthetic SuiteCRM-shaped application tree
+ *
+ * Usage: php mktree.php [-f files] [-d depth] [-w fanout] <dir>
+ *
+ * Creates <dir>/dist (the readonly application tree) and <dir>/scratch
+ * (the writable tree).  The files within dist are split between
+ * modules (plain included files, as for SuiteCRM's entry points and
+ * modules) and PSR-4 classes (loaded via an autoloader), distributed
+ * across a directory tree with the specified depth and fan-out.  A
+ * small fraction of module files have customised copies within
+ * scratch/custom.  The lists of included files and classes are
+ * written to dist/bench for use by workload.php.
+ */
+
+$opts = getopt('f:d:w:', [], $optind);
+$files = (int) ($opts['f'] ?? 5000);
+$depth = (int) ($opts['d'] ?? 3);
+$fanout = (int) ($opts['w'] ?? 6);
+$dir = $argv[$optind] ?? null;
+if (($dir === null) || ($files < 1) || ($depth < 1) || ($fanout < 1)) {
+    fwrite(STDERR, "Usage: php mktree.php [-f files] [-d depth] " .
+	   "[-w fanout] <dir>\n");
+    exit(1);
+}
+
+/* Every twentieth module file is customised */
+const CUSTOM_EVERY = 20;
+
+function mkfile($path, $contents) {
+    if (! is_dir(dirname($path)))
+	mkdir(dirname($path), 0755, true);
+    file_put_contents($path, $contents);
+}
+
+/* Enumerate leaf directories (as lists of path components) */
+$leaves = [[]];
+for ($level = 0; $level < $depth; $level++) {
+    $next = [];
+    foreach ($leaves as $leaf) {
+	for ($i = 0; $i < $fanout; $i++)
+	    $next[] = array_merge($leaf, ['D' . $i]);
+    }
+    $leaves = $next;
+}
+
+/* Generate files, alternating between module files and classes */
+$includes = [];
+$classes = [];
+for ($n = 0; $n < $files; $n++) {
+    $leaf = $leaves[intdiv($n, 2) % count($leaves)];
+    if ($n % 2) {
+	$namespace = 'Bench\\' . implode('\\', $leaf);
+	$class = 'Class' . $n;
+	mkfile("$dir/dist/lib/" . implode('/', $leaf) . "/$class.php",
+	       "<?php\n\nnamespace $namespace;\n\nclass $class {\n" .
+	       "    const ID = $n;\n}\n");
+	$classes[] = "$namespace\\$class";
+    } else {
+	$path = 'modules/' . implode('/', $leaf) . "/module$n.php";
+	$body = "<?php\n\n\$GLOBALS['bench_loaded'][] = $n;\n";
+	mkfile("$dir/dist/$path", $body);
+	if (($n / 2) % CUSTOM_EVERY == 0)
+	    mkfile("$dir/scratch/custom/$path", $body);
+	$includes[] = $path;
+    }
+}
+
+/* Write manifests */
+mkfile("$dir/dist/bench/includes.php",
+       "<?php\n\nreturn " . var_export($includes, true) . ";\n");
+mkfile("$dir/dist/bench/classes.php",
+       "<?php\n\nreturn " . var_export($classes, true) . ";\n");
+
+/* Create writable tree */
+if (! is_dir("$dir/scratch"))
+    mkdir("$dir/scratch", 0755, true);
+
+printf("%s: %d module files, %d classes, %d leaf directories\n",
+       $dir, count($includes), count($classes), count($leaves));
@@ -0,0 +1,103 @@
+<?php
+/*
+ * Simulate a SuiteCRM-style bootstrap against a generated tree
+ *
+ * Usage: php workload.php <root>
+ *
+ * Each invocation corresponds to a single request, and performs:
+ *
+ * - an include of every module file, each preceded by a check for a
+ *   customised copy (mostly missing, as for SuiteCRM's custom/
+ *   directory)
+ *
+ * - a load of every class via a PSR-4 autoloader that probes a
+ *   customised library directory (always missing) before the real
+ *   library directory, as for a Composer fallback directory
+ *
+ * - checks for nonexistent per-module extension files
+ *
+ * - cache writes: a cache file is written (via a temporary file and
+ *   a rename) for each module directory on the first request and
+ *   included thereafter, and a per-request file is written and
+ *   removed.
+ */
+
+if ($argc < 2) {
+    fwrite(STDERR, "Usage: php workload.php <root>\n");
+    exit(1);
+}
+$root = rtrim($argv[1], '/');
+chdir($root);
+
+$GLOBALS['bench_loaded'] = [];
+$stats = ['includes' => 0, 'custom' => 0, 'classes' => 0, 'misses' => 0,
+	  'writes' => 0];
+
+/* PSR-4 autoloader */
+spl_autoload_register(function ($class) use ($root) {
+    $prefix = 'Bench\\';
+    if (strncmp($class, $prefix, strlen($prefix)) != 0)
+	return;
+    $relative = str_replace('\\', '/', substr($class, strlen($prefix)));
+    foreach (["$root/custom/lib/", "$root/lib/"] as $base) {
+	$file = $base . $relative . '.php';
+	if (file_exists($file)) {
+	    require $file;
+	    return;
+	}
+    }
+});
+
+/* Include module files, preferring customised copies */
+$includes = require 'bench/includes.php';
+$dirs = [];
+foreach ($includes as $path) {
+    if (file_exists("custom/$path")) {
+	include "custom/$path";
+	$stats['custom']++;
+    } else {
+	include $path;
+    }
+    $stats['includes']++;
+    $dirs[dirname($path)] = true;
+}
+
+/* Load classes */
+$classes = require 'bench/classes.php';
+foreach ($classes as $class) {
+    if (class_exists($class))
+	$stats['classes']++;
+}
+
+/* Check for extension files and use cached module data */
+foreach (array_keys($dirs) as $dir) {
+    foreach (['Ext/Vardefs/vardefs.ext.php',
+	      'Ext/Language/en_us.lang.ext.php',
+	      'Ext/Layoutdefs/layoutdefs.ext.php'] as $ext) {
+	if (! file_exists("custom/$dir/$ext"))
+	    $stats['misses']++;
+    }
+    $cache = "cache/$dir/vardefs.php";
+    if (! file_exists($cache)) {
+	if (! is_dir(dirname($cache)))
+	    mkdir(dirname($cache), 0755, true);
+	$tmp = $cache . '.' . getmypid();
+	file_put_contents($tmp, "<?php\n\nreturn " .
+			  var_export(['module' => $dir], true) . ";\n");
+	rename($tmp, $cache);
+	$stats['writes']++;
+    }
+    $vardefs = include $cache;
+}
+
+/* Write and remove per-request file */
+if (! is_dir('cache/requests'))
+    mkdir('cache/requests', 0755, true);
+$request = 'cache/requests/' . getmypid() . '.php';
+file_put_contents($request, serialize($stats));
+unlink($request);
+$stats['writes']++;
+
+foreach ($stats as $name => $value)
+    echo "$name=$value ";
+echo "\n";
@@ -16,6 +16,7 @@ BuildRequires:	automake
 BuildRequires:	libtool
 BuildRequires:	gcc
 BuildRequires:	libselinux-devel
+BuildRequires:	systemtap-sdt-devel
 Provides:	libphpturd = %{version}-%{release}
 
 %if 0%{?with_systemd_rpm_macros}
@@ -43,8 +44,12 @@ install -D -m 644 phpturd.conf \
 	%{buildroot}%{_unitdir}/php-fpm.service.d/%{name}.conf
 
 %files
-%doc README.md
+%doc README.md bpftrace
 %license COPYING
+%{_bindir}/phpturd-index
+%{_bindir}/phpturdstat
+%{_bindir}/phpturd-trace
+%{_bindir}/phpturd-resolve
 %{_libdir}/libphpturd.so
 %{_libdir}/libphpturd.so.*
 %{_unitdir}/php-fpm.service.d/%{name}.conf
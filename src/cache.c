@@ -0,0 +1,499 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "index.h"
+#include "cache.h"
+
+/** A cache entry */
+struct cache_entry {
+	/** Segment list link (must be first) */
+	struct cache_link link;
+	/** Next entry in hash bucket */
+	struct cache_entry *chain;
+	/** Segment containing this entry */
+	struct cache_segment *segment;
+	/** Key hash */
+	uint64_t hash;
+	/** Value */
+	unsigned int value;
+	/** Length of key */
+	size_t len;
+	/** Length of data (stored immediately after key) */
+	size_t data_len;
+	/** Key */
+	char key[0];
+};
+
+/**
+ * Calculate memory used by a cache entry
+ *
+ * @v len		Length of key
+ * @v data_len		Length of data
+ * @ret bytes		Memory used
+ */
+static inline size_t cache_entry_bytes ( size_t len, size_t data_len ) {
+
+	return ( sizeof ( struct cache_entry ) + len + data_len );
+}
+
+/**
+ * Calculate memory used by an existing cache entry
+ *
+ * @v entry		Cache entry
+ * @ret bytes		Memory used
+ */
+static inline size_t cache_entry_size ( struct cache_entry *entry ) {
+
+	return cache_entry_bytes ( entry->len, entry->data_len );
+}
+
+/**
+ * Parse a cache size
+ *
+ * @v text		Size (with optional K, M or G suffix)
+ * @ret size		Size in bytes, or zero if invalid
+ */
+size_t cache_parse_size ( const char *text ) {
+	unsigned long long size;
+	char *end;
+
+	size = strtoull ( text, &end, 0 );
+	switch ( *end ) {
+	case 'G':
+	case 'g':
+		size <<= 10;
+		/* Fall through */
+	case 'M':
+	case 'm':
+		size <<= 10;
+		/* Fall through */
+	case 'K':
+	case 'k':
+		size <<= 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+	if ( *end )
+		return 0;
+	return size;
+}
+
+/**
+ * Remove entry from its segment list
+ *
+ * @v entry		Cache entry
+ */
+static inline void cache_unlink ( struct cache_entry *entry ) {
+	struct cache_link *link = &entry->link;
+
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	entry->segment->bytes -= cache_entry_size ( entry );
+	entry->segment = NULL;
+}
+
+/**
+ * Add entry to head of a segment list
+ *
+ * @v segment		Cache segment
+ * @v entry		Cache entry
+ */
+static inline void cache_link ( struct cache_segment *segment,
+				struct cache_entry *entry ) {
+	struct cache_link *link = &entry->link;
+	struct cache_link *head = &segment->list;
+
+	link->next = head->next;
+	link->prev = head;
+	head->next->prev = link;
+	head->next = link;
+	segment->bytes += cache_entry_size ( entry );
+	entry->segment = segment;
+}
+
+/**
+ * Get least recently used entry in a segment
+ *
+ * @v segment		Cache segment
+ * @ret entry		Cache entry, or NULL if segment is empty
+ */
+static inline struct cache_entry *
+cache_lru ( struct cache_segment *segment ) {
+	struct cache_link *last = segment->list.prev;
+
+	if ( last == &segment->list )
+		return NULL;
+	return ( ( struct cache_entry * ) last );
+}
+
+/**
+ * Find cache entry
+ *
+ * @v cache		Cache
+ * @v key		Key
+ * @v len		Length of key
+ * @v hash		Key hash
+ * @ret prev		Pointer to bucket link pointing to entry (if found)
+ */
+static struct cache_entry ** cache_find ( struct cache *cache,
+					  const char *key, size_t len,
+					  uint64_t hash ) {
+	struct cache_entry **prev;
+	struct cache_entry *entry;
+
+	for ( prev = &cache->buckets[ hash & cache->mask ] ;
+	      ( entry = *prev ) ; prev = &entry->chain ) {
+		if ( ( entry->hash == hash ) && ( entry->len == len ) &&
+		     ( memcmp ( entry->key, key, len ) == 0 ) )
+			break;
+	}
+	return prev;
+}
+
+/**
+ * Remove and free cache entry
+ *
+ * @v cache		Cache
+ * @v prev		Pointer to bucket link pointing to entry
+ */
+static void cache_remove ( struct cache *cache, struct cache_entry **prev ) {
+	struct cache_entry *entry = *prev;
+
+	*prev = entry->chain;
+	cache_unlink ( entry );
+	cache->stats.entries--;
+	cache->stats.bytes -= cache_entry_size ( entry );
+	free ( entry );
+}
+
+/**
+ * Evict least recently used entry
+ *
+ * @v cache		Cache
+ * @ret evicted		An entry was evicted
+ */
+static int cache_evict ( struct cache *cache ) {
+	struct cache_entry *entry;
+
+	/* Evict from probationary segment, if possible */
+	entry = cache_lru ( &cache->probation );
+	if ( ! entry )
+		entry = cache_lru ( &cache->protect );
+	if ( ! entry )
+		return 0;
+
+	/* Remove entry */
+	cache_remove ( cache, cache_find ( cache, entry->key, entry->len,
+					   entry->hash ) );
+	cache->stats.evictions++;
+	return 1;
+}
+
+/**
+ * Initialise cache
+ *
+ * @v cache		Cache
+ * @v budget		Memory budget (or zero to disable cache)
+ * @ret rc		Return status code
+ */
+int cache_init ( struct cache *cache, size_t budget ) {
+	size_t nbuckets;
+	size_t bytes;
+
+	/* Initialise (disabled) cache */
+	memset ( cache, 0, sizeof ( *cache ) );
+	pthread_mutex_init ( &cache->lock, NULL );
+	cache->probation.list.prev = cache->probation.list.next =
+		&cache->probation.list;
+	cache->protect.list.prev = cache->protect.list.next =
+		&cache->protect.list;
+	if ( ! budget )
+		return 0;
+	if ( budget < CACHE_MIN_BUDGET )
+		budget = CACHE_MIN_BUDGET;
+
+	/* Allocate hash buckets (counted against the memory budget) */
+	for ( nbuckets = 16 ;
+	      ( nbuckets * CACHE_ENTRY_ESTIMATE ) < budget ; nbuckets <<= 1 ){}
+	bytes = ( nbuckets * sizeof ( cache->buckets[0] ) );
+	cache->buckets = calloc ( nbuckets, sizeof ( cache->buckets[0] ) );
+	if ( ! cache->buckets )
+		return -1;
+	cache->mask = ( nbuckets - 1 );
+
+	/* Divide remaining budget between segments */
+	cache->budget = ( budget - bytes );
+	cache->protect.max = ( ( cache->budget / 100 ) *
+			       CACHE_PROTECT_PERCENT );
+	cache->probation.max = cache->budget;
+
+	return 0;
+}
+
+/**
+ * Find and use cache entry
+ *
+ * @v cache		Cache
+ * @v key		Key
+ * @v len		Length of key
+ * @ret entry		Cache entry, or NULL if not found
+ *
+ * The cache lock must be held.
+ */
+static struct cache_entry * cache_use ( struct cache *cache,
+					const char *key, size_t len ) {
+	struct cache_entry *entry;
+	struct cache_entry *demote;
+
+	/* Find entry */
+	entry = *cache_find ( cache, key, len, index_hash ( key, len ) );
+	if ( ! entry ) {
+		cache->stats.misses++;
+		return NULL;
+	}
+	cache->stats.hits++;
+
+	/* Move to head of protected segment */
+	cache_unlink ( entry );
+	cache_link ( &cache->protect, entry );
+
+	/* Demote least recently used protected entries to the head
+	 * of the probationary segment, to keep the protected segment
+	 * within its share of the memory budget.
+	 */
+	while ( cache->protect.bytes > cache->protect.max ) {
+		demote = cache_lru ( &cache->protect );
+		cache_unlink ( demote );
+		cache_link ( &cache->probation, demote );
+	}
+
+	return entry;
+}
+
+/**
+ * Look up cache entry
+ *
+ * @v cache		Cache
+ * @v key		Key
+ * @v len		Length of key
+ * @v value		Value to fill in
+ * @ret found		Entry was found
+ */
+int cache_lookup ( struct cache *cache, const char *key, size_t len,
+		   unsigned int *value ) {
+	struct cache_entry *entry;
+
+	/* Do nothing if cache is disabled */
+	if ( ! cache->budget )
+		return 0;
+
+	pthread_mutex_lock ( &cache->lock );
+	entry = cache_use ( cache, key, len );
+	if ( entry )
+		*value = entry->value;
+	pthread_mutex_unlock ( &cache->lock );
+
+	return ( entry != NULL );
+}
+
+/**
+ * Look up cache entry data
+ *
+ * @v cache		Cache
+ * @v key		Key
+ * @v len		Length of key
+ * @v data		Copy of data to fill in
+ * @v data_len		Length of data to fill in
+ * @ret found		Entry was found
+ *
+ * The caller is responsible for calling free() on the returned copy
+ * of the data.  An entry that is found but cannot be copied (due to
+ * lack of memory) is reported as not found.
+ */
+int cache_lookup_data ( struct cache *cache, const char *key, size_t len,
+			void **data, size_t *data_len ) {
+	struct cache_entry *entry;
+	void *copy = NULL;
+
+	/* Do nothing if cache is disabled */
+	if ( ! cache->budget )
+		return 0;
+
+	pthread_mutex_lock ( &cache->lock );
+	entry = cache_use ( cache, key, len );
+	if ( entry ) {
+		copy = malloc ( entry->data_len ? entry->data_len : 1 );
+		if ( copy ) {
+			memcpy ( copy, ( entry->key + entry->len ),
+				 entry->data_len );
+			*data_len = entry->data_len;
+		}
+	}
+	pthread_mutex_unlock ( &cache->lock );
+
+	*data = copy;
+	return ( copy != NULL );
+}
+
+/**
+ * Insert (or replace) cache entry
+ *
+ * @v cache		Cache
+ * @v key		Key
+ * @v len		Length of key
+ * @v value		Value
+ * @v data		Data (or NULL)
+ * @v data_len		Length of data
+ * @ret evicted		Number of entries evicted
+ */
+static unsigned int cache_store ( struct cache *cache, const char *key,
+				  size_t len, unsigned int value,
+				  const void *data, size_t data_len ) {
+	struct cache_entry **prev;
+	struct cache_entry *entry;
+	unsigned int evicted = 0;
+	uint64_t hash;
+
+	/* Do nothing if cache is disabled or entry could never fit */
+	if ( cache_entry_bytes ( len, data_len ) > cache->budget )
+		return 0;
+
+	pthread_mutex_lock ( &cache->lock );
+
+	/* Update existing entry, if any and if the data length is
+	 * unchanged, otherwise remove it.
+	 */
+	hash = index_hash ( key, len );
+	prev = cache_find ( cache, key, len, hash );
+	if ( ( entry = *prev ) ) {
+		if ( entry->data_len == data_len ) {
+			entry->value = value;
+			if ( data )
+				memcpy ( ( entry->key + len ), data, data_len );
+			goto done;
+		}
+		cache_remove ( cache, prev );
+	}
+
+	/* Make room for new entry */
+	while ( ( cache->stats.bytes + cache_entry_bytes ( len, data_len ) ) >
+		cache->budget ) {
+		if ( ! cache_evict ( cache ) )
+			goto done;
+		evicted++;
+	}
+
+	/* Allocate and populate entry */
+	entry = malloc ( cache_entry_bytes ( len, data_len ) );
+	if ( ! entry )
+		goto done;
+	entry->hash = hash;
+	entry->value = value;
+	entry->len = len;
+	entry->data_len = data_len;
+	memcpy ( entry->key, key, len );
+	if ( data )
+		memcpy ( ( entry->key + len ), data, data_len );
+
+	/* Add to hash bucket and head of probationary segment */
+	entry->chain = cache->buckets[ hash & cache->mask ];
+	cache->buckets[ hash & cache->mask ] = entry;
+	cache_link ( &cache->probation, entry );
+	cache->stats.inserts++;
+	cache->stats.entries++;
+	cache->stats.bytes += cache_entry_bytes ( len, data_len );
+
+ done:
+	pthread_mutex_unlock ( &cache->lock );
+	return evicted;
+}
+
+/**
+ * Insert (or update) cache entry
+ *
+ * @v cache		Cache
+ * @v key		Key
+ * @v len		Length of key
+ * @v value		Value
+ * @ret evicted		Number of entries evicted
+ */
+unsigned int cache_insert ( struct cache *cache, const char *key,
+			    size_t len, unsigned int value ) {
+
+	return cache_store ( cache, key, len, value, NULL, 0 );
+}
+
+/**
+ * Insert (or replace) cache entry data
+ *
+ * @v cache		Cache
+ * @v key		Key
+ * @v len		Length of key
+ * @v data		Data
+ * @v data_len		Length of data
+ * @ret evicted		Number of entries evicted
+ */
+unsigned int cache_insert_data ( struct cache *cache, const char *key,
+				 size_t len, const void *data,
+				 size_t data_len ) {
+
+	return cache_store ( cache, key, len, 0, data, data_len );
+}
+
+/**
+ * Remove all cache entries
+ *
+ * @v cache		Cache
+ */
+void cache_flush ( struct cache *cache ) {
+	size_t i;
+
+	/* Do nothing if cache is disabled */
+	if ( ! cache->budget )
+		return;
+
+	pthread_mutex_lock ( &cache->lock );
+	for ( i = 0 ; i <= cache->mask ; i++ ) {
+		while ( cache->buckets[i] )
+			cache_remove ( cache, &cache->buckets[i] );
+	}
+	cache->stats.flushes++;
+	pthread_mutex_unlock ( &cache->lock );
+}
+
+/**
+ * Get cache statistics
+ *
+ * @v cache		Cache
+ * @v stats		Statistics to fill in
+ */
+void cache_get_stats ( struct cache *cache, struct cache_stats *stats ) {
+
+	pthread_mutex_lock ( &cache->lock );
+	memcpy ( stats, &cache->stats, sizeof ( *stats ) );
+	pthread_mutex_unlock ( &cache->lock );
+}
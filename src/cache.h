@@ -0,0 +1,121 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Bounded resolution cache
+ *
+ * The cache maps a path (relative to a turd directory) to a small
+ * integer value or to a block of data, within a fixed memory budget.
+ * Eviction uses a segmented LRU policy: new entries are placed in a
+ * probationary segment, and are promoted to a protected segment only
+ * when hit.  Frequently hit entries are therefore not evicted by a
+ * scan through a large number of distinct paths (e.g. upload or
+ * session files).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#pragma GCC visibility push ( hidden )
+
+/** A cache list link */
+struct cache_link {
+	/** Previous link */
+	struct cache_link *prev;
+	/** Next link */
+	struct cache_link *next;
+};
+
+/** A cache segment */
+struct cache_segment {
+	/** List of entries (most recently used first) */
+	struct cache_link list;
+	/** Total size of entries */
+	size_t bytes;
+	/** Maximum total size of entries */
+	size_t max;
+};
+
+/** Cache statistics */
+struct cache_stats {
+	/** Number of lookups that hit */
+	unsigned long hits;
+	/** Number of lookups that missed */
+	unsigned long misses;
+	/** Number of entries inserted */
+	unsigned long inserts;
+	/** Number of entries evicted */
+	unsigned long evictions;
+	/** Number of times the cache was flushed */
+	unsigned long flushes;
+	/** Number of entries currently present */
+	unsigned long entries;
+	/** Total size of entries currently present */
+	size_t bytes;
+};
+
+/** A cache */
+struct cache {
+	/** Lock */
+	pthread_mutex_t lock;
+	/** Memory budget (or zero if cache is disabled) */
+	size_t budget;
+	/** Hash buckets */
+	struct cache_entry **buckets;
+	/** Hash bucket mask */
+	size_t mask;
+	/** Probationary segment */
+	struct cache_segment probation;
+	/** Protected segment */
+	struct cache_segment protect;
+	/** Statistics */
+	struct cache_stats stats;
+};
+
+/** Minimum cache memory budget */
+#define CACHE_MIN_BUDGET 4096
+
+/** Expected average memory per cache entry (used to size hash table) */
+#define CACHE_ENTRY_ESTIMATE 128
+
+/** Protected segment share of cache memory budget (percent) */
+#define CACHE_PROTECT_PERCENT 80
+
+extern size_t cache_parse_size ( const char *text );
+extern int cache_init ( struct cache *cache, size_t budget );
+extern int cache_lookup ( struct cache *cache, const char *key, size_t len,
+			  unsigned int *value );
+extern int cache_lookup_data ( struct cache *cache, const char *key,
+			       size_t len, void **data, size_t *data_len );
+extern unsigned int cache_insert ( struct cache *cache, const char *key,
+				   size_t len, unsigned int value );
+extern unsigned int cache_insert_data ( struct cache *cache, const char *key,
+					size_t len, const void *data,
+					size_t data_len );
+extern void cache_flush ( struct cache *cache );
+extern void cache_get_stats ( struct cache *cache,
+			      struct cache_stats *stats );
+
+#pragma GCC visibility pop
+
+#endif /* _CACHE_H */
@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "index.h"
+#include "dirlist.h"
+
+/** A set of names already present within a directory listing */
+struct dirlist_names {
+	/** Offsets of entries (plus one, or zero for an empty slot) */
+	size_t *offsets;
+	/** Table size mask (table size is a power of two) */
+	size_t mask;
+};
+
+/**
+ * Find name within set of names
+ *
+ * @v list		Directory listing
+ * @v names		Set of names
+ * @v name		Name
+ * @v len		Length of name
+ * @ret slot		Slot containing name, or empty slot
+ */
+static size_t * dirlist_find ( struct dirlist *list,
+			       struct dirlist_names *names,
+			       const char *name, size_t len ) {
+	struct walk_dirent64 *dirent;
+	size_t *slot;
+	size_t i;
+
+	for ( i = index_hash ( name, len ) ; ; i++ ) {
+		slot = &names->offsets[ i & names->mask ];
+		if ( ! *slot )
+			return slot;
+		dirent = dirlist_entry ( list, ( *slot - 1 ) );
+		if ( ( strncmp ( dirent->d_name, name, len ) == 0 ) &&
+		     ( dirent->d_name[len] == '\0' ) )
+			return slot;
+	}
+}
+
+/**
+ * Construct set of names already present within a directory listing
+ *
+ * @v list		Directory listing
+ * @v names		Set of names to fill in
+ * @ret rc		Return status code
+ */
+static int dirlist_names ( struct dirlist *list,
+			   struct dirlist_names *names ) {
+	struct walk_dirent64 *dirent;
+	size_t offset;
+	size_t count;
+	size_t size;
+
+	/* Count entries */
+	count = 0;
+	for ( offset = 0 ; ( dirent = dirlist_entry ( list, offset ) ) ;
+	      offset += dirent->d_reclen ) {
+		count++;
+	}
+
+	/* Allocate table with a load factor of at most one half */
+	for ( size = 16 ; size < ( 2 * count ) ; size <<= 1 ) {}
+	names->offsets = calloc ( size, sizeof ( names->offsets[0] ) );
+	if ( ! names->offsets )
+		return -1;
+	names->mask = ( size - 1 );
+
+	/* Populate table */
+	for ( offset = 0 ; ( dirent = dirlist_entry ( list, offset ) ) ;
+	      offset += dirent->d_reclen ) {
+		*dirlist_find ( list, names, dirent->d_name,
+				strlen ( dirent->d_name ) ) = ( offset + 1 );
+	}
+
+	return 0;
+}
+
+/**
+ * Append raw directory entry to directory listing
+ *
+ * @v list		Directory listing
+ * @v dirent		Raw directory entry
+ * @ret rc		Return status code
+ */
+static int dirlist_append ( struct dirlist *list,
+			    const struct walk_dirent64 *dirent ) {
+	struct walk_dirent64 *copy;
+	size_t max;
+	char *data;
+
+	/* Grow listing if necessary */
+	if ( ( list->len + dirent->d_reclen ) > list->max ) {
+		max = ( list->max ? ( list->max * 2 ) : WALK_DIRENT_BUF );
+		data = realloc ( list->data, max );
+		if ( ! data )
+			return -1;
+		list->data = data;
+		list->max = max;
+	}
+
+	/* Append entry */
+	copy = ( ( struct walk_dirent64 * ) ( list->data + list->len ) );
+	memcpy ( copy, dirent, dirent->d_reclen );
+	list->len += dirent->d_reclen;
+	copy->d_off = list->len;
+
+	return 0;
+}
+
+/**
+ * Read directory into directory listing
+ *
+ * @v list		Directory listing
+ * @v fd		Directory file descriptor
+ * @v merge		Omit entries with names already present in listing
+ * @ret rc		Return status code
+ *
+ * Entries are appended to any existing entries within the listing.
+ */
+int dirlist_read ( struct dirlist *list, int fd, int merge ) {
+	struct dirlist_names names = { NULL, 0 };
+	struct walk_dirent64 *dirent;
+	size_t name_len;
+	size_t *slot;
+	char *buf;
+	long len;
+	long pos;
+	int rc;
+
+	/* Construct set of existing names, if applicable */
+	if ( merge && ( ( rc = dirlist_names ( list, &names ) ) != 0 ) )
+		goto err_names;
+
+	/* Allocate buffer */
+	buf = malloc ( WALK_DIRENT_BUF );
+	if ( ! buf ) {
+		rc = -1;
+		goto err_alloc;
+	}
+
+	/* Read directory entries */
+	while ( ( len = walk_getdents ( fd, buf, WALK_DIRENT_BUF ) ) != 0 ) {
+		if ( len < 0 ) {
+			rc = -1;
+			goto err_getdents;
+		}
+		for ( pos = 0 ; pos < len ; pos += dirent->d_reclen ) {
+			dirent = ( ( struct walk_dirent64 * ) ( buf + pos ) );
+
+			/* Skip names already present, if applicable */
+			if ( merge ) {
+				name_len = strlen ( dirent->d_name );
+				slot = dirlist_find ( list, &names,
+						      dirent->d_name,
+						      name_len );
+				if ( *slot )
+					continue;
+			}
+
+			/* Append entry */
+			if ( ( rc = dirlist_append ( list, dirent ) ) != 0 )
+				goto err_append;
+		}
+	}
+	rc = 0;
+
+ err_append:
+ err_getdents:
+	free ( buf );
+ err_alloc:
+	free ( names.offsets );
+ err_names:
+	return rc;
+}
+
+/**
+ * Remove entries from directory listing
+ *
+ * @v list		Directory listing
+ * @v omit		Omission test
+ * @v arg		Argument for omission test
+ */
+void dirlist_filter ( struct dirlist *list,
+		      int ( * omit ) ( struct walk_dirent64 *dirent,
+				       void *arg ),
+		      void *arg ) {
+	struct walk_dirent64 *dirent;
+	struct walk_dirent64 *copy;
+	size_t offset;
+	size_t next;
+	size_t len;
+
+	/* Compact retained entries, updating offsets */
+	len = 0;
+	for ( offset = 0 ; ( dirent = dirlist_entry ( list, offset ) ) ;
+	      offset = next ) {
+		next = ( offset + dirent->d_reclen );
+		if ( omit ( dirent, arg ) )
+			continue;
+		copy = ( ( struct walk_dirent64 * ) ( list->data + len ) );
+		memmove ( copy, dirent, dirent->d_reclen );
+		len += copy->d_reclen;
+		copy->d_off = len;
+	}
+	list->len = len;
+}
+
+/**
+ * Free directory listing
+ *
+ * @v list		Directory listing
+ */
+void dirlist_free ( struct dirlist *list ) {
+
+	free ( list->data );
+	list->data = NULL;
+	list->len = list->max = 0;
+}
@@ -0,0 +1,73 @@
+#ifndef _DIRLIST_H
+#define _DIRLIST_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Directory listings
+ *
+ * A directory listing is a sequence of raw directory entries in the
+ * format returned by getdents64(), and so may be read from one or
+ * more directories without any per-entry system calls, and stored
+ * (e.g. in a cache) as a single block of data.  The d_off field of
+ * each entry holds the offset of the following entry within the
+ * listing.
+ */
+
+#include <stddef.h>
+#include "walk.h"
+
+#pragma GCC visibility push ( hidden )
+
+/** A directory listing */
+struct dirlist {
+	/** Raw directory entries */
+	char *data;
+	/** Length of raw directory entries */
+	size_t len;
+	/** Allocated length */
+	size_t max;
+};
+
+/**
+ * Get directory listing entry
+ *
+ * @v list		Directory listing
+ * @v offset		Offset of entry within listing
+ * @ret dirent		Raw directory entry, or NULL at end of listing
+ */
+static inline struct walk_dirent64 *
+dirlist_entry ( struct dirlist *list, size_t offset ) {
+
+	if ( offset >= list->len )
+		return NULL;
+	return ( ( struct walk_dirent64 * ) ( list->data + offset ) );
+}
+
+extern int dirlist_read ( struct dirlist *list, int fd, int merge );
+extern void dirlist_filter ( struct dirlist *list,
+			     int ( * omit ) ( struct walk_dirent64 *dirent,
+					      void *arg ),
+			     void *arg );
+extern void dirlist_free ( struct dirlist *list );
+
+#pragma GCC visibility pop
+
+#endif /* _DIRLIST_H */
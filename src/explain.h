@@ -0,0 +1,37 @@
+#ifndef _EXPLAIN_H
+#define _EXPLAIN_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Path resolution explanation
+ *
+ * The library exports a single entry point that resolves a path
+ * using exactly the same code as the wrapped library calls, while
+ * describing each step taken.  This allows resolution to be examined
+ * offline by a program linked against the library, without needing
+ * to run PHP.
+ */
+
+#include <stdio.h>
+
+extern int phpturd_explain ( const char *path, int create, FILE *out );
+
+#endif /* _EXPLAIN_H */
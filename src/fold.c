@@ -0,0 +1,646 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include "index.h"
+#include "walk.h"
+#include "fold.h"
+
+/** FNV-1a offset basis */
+#define FOLD_FNV_BASIS 0xcbf29ce484222325ULL
+
+/** FNV-1a prime */
+#define FOLD_FNV_PRIME 0x100000001b3ULL
+
+/** A directory being added to a case-folded name map */
+struct fold_dir {
+	/** Case-folded name map */
+	struct fold_map *map;
+	/** Walker */
+	struct walker *walker;
+	/** Worker thread index */
+	unsigned int thread;
+};
+
+/**
+ * Fold byte
+ *
+ * @v byte		Byte
+ * @ret folded		Case-folded byte
+ */
+static inline uint8_t fold_byte ( uint8_t byte ) {
+
+	return ( ( ( byte >= 'A' ) && ( byte <= 'Z' ) ) ?
+		 ( byte - 'A' + 'a' ) : byte );
+}
+
+/**
+ * Extend hash of case-folded path
+ *
+ * @v hash		Hash of preceding portion of path
+ * @v data		Following portion of path
+ * @v len		Length of following portion of path
+ * @ret hash		Hash of path
+ *
+ * The hash (FNV-1a) may be calculated incrementally, so that the hash
+ * of each parent directory is available while adding a path.
+ */
+static inline uint64_t fold_hash ( uint64_t hash, const char *data,
+				   size_t len ) {
+
+	while ( len-- ) {
+		hash ^= fold_byte ( *(data++) );
+		hash *= FOLD_FNV_PRIME;
+	}
+	return hash;
+}
+
+/**
+ * Compare names ignoring case
+ *
+ * @v name1		Name one
+ * @v name2		Name two
+ * @v len		Length of names
+ * @ret equal		Names are equal (ignoring case)
+ */
+static inline int fold_equal ( const char *name1, const char *name2,
+			       size_t len ) {
+
+	while ( len-- ) {
+		if ( fold_byte ( *(name1++) ) != fold_byte ( *(name2++) ) )
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Check if entry matches path
+ *
+ * @v entry		Entry
+ * @v path		Relative path
+ * @v len		Length of relative path
+ * @ret matches		Entry matches path (ignoring case)
+ */
+static int fold_matches ( struct fold_entry *entry, const char *path,
+			  size_t len ) {
+
+	for ( ; entry ; entry = entry->parent ) {
+		if ( len < entry->len )
+			return 0;
+		len -= entry->len;
+		if ( ! fold_equal ( &path[len], entry->name, entry->len ) )
+			return 0;
+		if ( entry->parent ) {
+			if ( ( ! len ) || ( path[ len - 1 ] != '/' ) )
+				return 0;
+			len--;
+		}
+	}
+	return ( len == 0 );
+}
+
+/**
+ * Find entry
+ *
+ * @v table		Hash table
+ * @v hash		Hash of case-folded relative path
+ * @v path		Relative path
+ * @v len		Length of relative path
+ * @ret entry		Entry, or NULL if not found
+ */
+static struct fold_entry * fold_find ( struct fold_table *table,
+				       uint64_t hash, const char *path,
+				       size_t len ) {
+	struct fold_entry *entry;
+
+	for ( entry = __atomic_load_n ( &table->buckets[ hash & table->mask ],
+					__ATOMIC_ACQUIRE ) ; entry ;
+	      entry = __atomic_load_n ( &entry->next, __ATOMIC_ACQUIRE ) ) {
+		if ( ( entry->hash == hash ) &&
+		     fold_matches ( entry, path, len ) )
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Allocate hash table
+ *
+ * @v mask		Hash bucket mask
+ * @ret table		Hash table, or NULL on error
+ */
+static struct fold_table * fold_table ( size_t mask ) {
+	struct fold_table *table;
+
+	table = calloc ( 1, ( sizeof ( *table ) +
+			      ( ( mask + 1 ) *
+				sizeof ( table->buckets[0] ) ) ) );
+	if ( ! table )
+		return NULL;
+	table->mask = mask;
+	return table;
+}
+
+/**
+ * Free list of retired memory
+ *
+ * @v list		List of retired memory
+ */
+static void fold_free_retired ( struct fold_retired *list ) {
+	struct fold_retired *retired;
+
+	while ( ( retired = list ) ) {
+		list = retired->next;
+		free ( retired->data );
+		free ( retired );
+	}
+}
+
+/**
+ * Free retired memory that no lookup can reach (with lock held)
+ *
+ * @v map		Case-folded name map
+ *
+ * Memory retired within the previous phase was unreachable before the
+ * current phase started, and so may be freed once the lookups counted
+ * against the previous phase have completed.  Memory retired within
+ * the current phase is then set aside, and the phase is switched, so
+ * that retired memory is freed after at most two calls (regardless of
+ * how many lookups are in progress in total).
+ */
+static void fold_reclaim ( struct fold_map *map ) {
+	unsigned int phase = map->phase;
+
+	/* Do nothing unless there is retired memory */
+	if ( ! ( map->retired || map->pending ) )
+		return;
+
+	/* Do nothing until lookups within the previous phase complete */
+	if ( ! readers_idle ( &map->readers[ phase ^ 1 ] ) )
+		return;
+
+	/* Free memory retired within the previous phase */
+	fold_free_retired ( map->pending );
+
+	/* Set aside memory retired within the current phase */
+	map->pending = map->retired;
+	map->retired = NULL;
+	__atomic_store_n ( &map->phase, ( phase ^ 1 ), __ATOMIC_SEQ_CST );
+}
+
+/**
+ * Retire memory that may still be in use by a lookup (with lock held)
+ *
+ * @v map		Case-folded name map
+ * @v data		Memory to free
+ *
+ * If the memory cannot be recorded, then we switch phase and wait
+ * for the lookups within both phases to complete (which cannot take
+ * long, since lookups do not take the lock and new lookups will be
+ * counted against the new phase) before freeing it immediately.
+ */
+static void fold_retire ( struct fold_map *map, void *data ) {
+	struct fold_retired *retired;
+	unsigned int phase = map->phase;
+
+	retired = malloc ( sizeof ( *retired ) );
+	if ( ! retired ) {
+		readers_wait ( &map->readers[ phase ^ 1 ] );
+		__atomic_store_n ( &map->phase, ( phase ^ 1 ),
+				   __ATOMIC_SEQ_CST );
+		readers_wait ( &map->readers[phase] );
+		free ( data );
+		return;
+	}
+	retired->data = data;
+	retired->next = map->retired;
+	map->retired = retired;
+}
+
+/**
+ * Grow hash table (with lock held)
+ *
+ * @v map		Case-folded name map
+ *
+ * Failure to grow the table is ignored, since it affects only the
+ * length of the hash chains.  Lookups that overlap the rehash may
+ * follow a chain into the new table, and so are retried.
+ */
+static void fold_grow ( struct fold_map *map ) {
+	struct fold_table *old = map->table;
+	struct fold_table *table;
+	struct fold_entry *entry;
+	struct fold_entry *next;
+	size_t mask;
+	size_t i;
+
+	mask = ( ( 2 * ( old->mask + 1 ) ) - 1 );
+	table = fold_table ( mask );
+	if ( ! table )
+		return;
+	__atomic_add_fetch ( &map->seq, 1, __ATOMIC_SEQ_CST );
+	for ( i = 0 ; i <= old->mask ; i++ ) {
+		for ( entry = old->buckets[i] ; entry ; entry = next ) {
+			next = entry->next;
+			__atomic_store_n ( &entry->next,
+					   table->buckets[ entry->hash & mask ],
+					   __ATOMIC_RELAXED );
+			table->buckets[ entry->hash & mask ] = entry;
+		}
+	}
+	__atomic_store_n ( &map->table, table, __ATOMIC_RELEASE );
+	__atomic_add_fetch ( &map->seq, 1, __ATOMIC_SEQ_CST );
+	fold_retire ( map, old );
+}
+
+/**
+ * Initialise case-folded name map
+ *
+ * @v map		Case-folded name map
+ * @ret rc		Return status code
+ */
+int fold_init ( struct fold_map *map ) {
+
+	memset ( map, 0, sizeof ( *map ) );
+	pthread_mutex_init ( &map->lock, NULL );
+	map->table = fold_table ( FOLD_MIN_BUCKETS - 1 );
+	if ( ! map->table )
+		return -1;
+	return 0;
+}
+
+/**
+ * Add path
+ *
+ * @v map		Case-folded name map
+ * @v path		Path relative to root of tree (without leading '/')
+ * @v len		Length of path
+ * @ret rc		Return status code
+ *
+ * Entries are added for the path and for any parent directories not
+ * already present.  A name that is already present with different
+ * case is marked as ambiguous.
+ */
+int fold_add ( struct fold_map *map, const char *path, size_t len ) {
+	struct fold_entry *parent = NULL;
+	struct fold_entry *entry;
+	struct fold_table *table;
+	uint64_t hash = FOLD_FNV_BASIS;
+	size_t hashed = 0;
+	size_t start = 0;
+	size_t end;
+	int rc = 0;
+
+	pthread_mutex_lock ( &map->lock );
+	for ( end = 0 ; end < len ; start = ++end ) {
+
+		/* Find end of path component */
+		while ( ( end < len ) && ( path[end] != '/' ) )
+			end++;
+		if ( end == start )
+			continue;
+		hash = fold_hash ( hash, &path[hashed], ( end - hashed ) );
+		hashed = end;
+
+		/* Use existing entry, if any */
+		table = map->table;
+		entry = fold_find ( table, hash, path, end );
+		if ( entry ) {
+			if ( memcmp ( entry->name, &path[start],
+				      entry->len ) != 0 ) {
+				__atomic_store_n ( &entry->flags,
+						   ( entry->flags |
+						     FOLD_AMBIGUOUS ),
+						   __ATOMIC_RELAXED );
+			}
+			parent = entry;
+			continue;
+		}
+
+		/* Create new entry */
+		entry = malloc ( sizeof ( *entry ) + ( end - start ) );
+		if ( ! entry ) {
+			rc = -1;
+			break;
+		}
+		entry->parent = parent;
+		entry->hash = hash;
+		entry->children = 0;
+		entry->len = ( end - start );
+		entry->flags = 0;
+		memcpy ( entry->name, &path[start], entry->len );
+		entry->next = table->buckets[ hash & table->mask ];
+		__atomic_store_n ( &table->buckets[ hash & table->mask ],
+				   entry, __ATOMIC_RELEASE );
+		if ( parent )
+			parent->children++;
+		if ( ++map->count > table->mask )
+			fold_grow ( map );
+		parent = entry;
+	}
+	fold_reclaim ( map );
+	pthread_mutex_unlock ( &map->lock );
+
+	return rc;
+}
+
+/**
+ * Add path component tree node and its descendants
+ *
+ * @v map		Case-folded name map
+ * @v index		Index
+ * @v node		Directory node
+ * @v path		Path buffer (holding path of directory node)
+ * @v len		Length of path of directory node
+ * @ret rc		Return status code
+ */
+static int fold_add_node ( struct fold_map *map, const struct index *index,
+			   const struct index_node *node, char *path,
+			   size_t len ) {
+	const struct index_node *child;
+	uint32_t first = node->children;
+	uint32_t last = ( first + node->count );
+	uint32_t i;
+	size_t pos;
+	int rc;
+
+	/* Reject corrupt child ranges */
+	if ( ( last < first ) || ( last > index->nnodes ) )
+		return 0;
+
+	/* Add each child in turn */
+	for ( i = first ; i < last ; i++ ) {
+		child = &index->nodes[i];
+		if ( ( child->name > index->names_len ) ||
+		     ( child->len > ( index->names_len - child->name ) ) ||
+		     ( ! child->len ) ||
+		     ( ( len + 1 /* '/' */ + child->len ) >= PATH_MAX ) )
+			continue;
+		pos = len;
+		if ( pos )
+			path[pos++] = '/';
+		memcpy ( &path[pos], &index->names[child->name], child->len );
+		pos += child->len;
+		if ( ( rc = fold_add ( map, path, pos ) ) != 0 )
+			return rc;
+		if ( ( child->flags & INDEX_NODE_DIR ) &&
+		     ( ( rc = fold_add_node ( map, index, child, path,
+					      pos ) ) != 0 ) )
+			return rc;
+	}
+	return 0;
+}
+
+/**
+ * Add all paths within index
+ *
+ * @v map		Case-folded name map
+ * @v index		Index (which must include a path component tree)
+ * @ret rc		Return status code
+ */
+int fold_add_index ( struct fold_map *map, const struct index *index ) {
+	char *path;
+	int rc;
+
+	/* Fail unless index includes a path component tree */
+	if ( ! index->nnodes ) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Add all descendants of root node */
+	path = malloc ( PATH_MAX );
+	if ( ! path )
+		return -1;
+	rc = fold_add_node ( map, index, &index->nodes[0], path, 0 );
+	free ( path );
+	return rc;
+}
+
+/**
+ * Handle directory entry while adding tree
+ *
+ * @v job		Directory walk job
+ * @v name		Name
+ * @v len		Length of name
+ * @v type		Entry type
+ * @v arg		Directory being added
+ * @ret rc		Return status code
+ */
+static int fold_walk_entry ( struct walk_job *job, const char *name,
+			     size_t len, unsigned int type, void *arg ) {
+	struct fold_dir *dir = arg;
+	char path[PATH_MAX];
+	size_t pos;
+
+	/* Construct relative path (without leading '/') */
+	pos = ( job->len ? ( job->len - 1 ) : 0 );
+	if ( ( pos + 1 /* '/' */ + len ) >= sizeof ( path ) )
+		return 0;
+	memcpy ( path, ( job->path + 1 ), pos );
+	if ( pos )
+		path[pos++] = '/';
+	memcpy ( &path[pos], name, len );
+	pos += len;
+
+	/* Add path, and walk subdirectories (but not symbolic links) */
+	if ( fold_add ( dir->map, path, pos ) != 0 )
+		return -1;
+	if ( type == WALK_DIR )
+		walk_push ( dir->walker, dir->thread, job, name, len, NULL );
+	return 0;
+}
+
+/**
+ * Visit directory while adding tree
+ *
+ * @v walker		Walker
+ * @v thread		Worker thread index
+ * @v job		Directory walk job
+ * @ret rc		Return status code
+ */
+static int fold_walk_visit ( struct walker *walker, unsigned int thread,
+			     struct walk_job *job ) {
+	struct fold_dir dir;
+
+	/* Ignore directories that cannot be opened or read */
+	if ( job->fd < 0 )
+		return 0;
+	dir.map = walker->priv;
+	dir.walker = walker;
+	dir.thread = thread;
+	walk_read ( job, fold_walk_entry, &dir );
+	return 0;
+}
+
+/**
+ * Add all paths within directory tree
+ *
+ * @v map		Case-folded name map
+ * @v fd		Root directory file descriptor (opened with O_PATH)
+ * @v threads		Number of worker threads
+ * @ret rc		Return status code
+ */
+int fold_add_tree ( struct fold_map *map, int fd, unsigned int threads ) {
+	struct walker walker;
+
+	memset ( &walker, 0, sizeof ( walker ) );
+	walker.visit = fold_walk_visit;
+	walker.priv = map;
+	walker.threads = threads;
+	return walk_tree ( &walker, fd, NULL );
+}
+
+/**
+ * Remove path
+ *
+ * @v map		Case-folded name map
+ * @v path		Path relative to root of tree (without leading '/')
+ * @v len		Length of path
+ *
+ * The entry is retained if it still has child entries (e.g. for a
+ * directory that remains within a lower layer).
+ */
+void fold_remove ( struct fold_map *map, const char *path, size_t len ) {
+	struct fold_table *table;
+	struct fold_entry **prev;
+	struct fold_entry *entry;
+	uint64_t hash;
+
+	hash = fold_hash ( FOLD_FNV_BASIS, path, len );
+	pthread_mutex_lock ( &map->lock );
+	table = map->table;
+	entry = fold_find ( table, hash, path, len );
+	if ( entry && ( ! entry->children ) ) {
+		for ( prev = &table->buckets[ hash & table->mask ] ;
+		      *prev != entry ; prev = &(*prev)->next ) {}
+		__atomic_store_n ( prev, entry->next, __ATOMIC_RELEASE );
+		if ( entry->parent )
+			entry->parent->children--;
+		map->count--;
+		fold_retire ( map, entry );
+	}
+	fold_reclaim ( map );
+	pthread_mutex_unlock ( &map->lock );
+}
+
+/**
+ * Convert path to the case that exists on disk
+ *
+ * @v map		Case-folded name map
+ * @v path		Path relative to root of tree (without leading '/')
+ * @v len		Length of path
+ * @v parents		Convert parent directories of a nonexistent path
+ * @ret len		Length of converted portion of path, or zero
+ *
+ * The path is modified in place (since case folding never changes
+ * its length).  Ambiguous names are left unmodified.  If the path
+ * does not exist and @c parents is specified, then the longest
+ * existing parent directory is converted instead (e.g. for a file
+ * that is about to be created).
+ *
+ * No lock is taken.  The lookup is retried if it overlaps a rehash.
+ * The lookup is counted against the phase in which it starts.
+ */
+size_t fold_resolve ( struct fold_map *map, char *path, size_t len,
+		      int parents ) {
+	struct fold_table *table;
+	struct fold_entry *entry;
+	unsigned long seq;
+	unsigned int phase;
+	uint64_t hash;
+	size_t pos;
+
+	phase = __atomic_load_n ( &map->phase, __ATOMIC_ACQUIRE );
+	readers_enter ( &map->readers[phase] );
+	while ( len ) {
+
+		/* Find path, retrying if the table is being rehashed */
+		hash = fold_hash ( FOLD_FNV_BASIS, path, len );
+		do {
+			seq = __atomic_load_n ( &map->seq, __ATOMIC_ACQUIRE );
+			table = __atomic_load_n ( &map->table,
+						  __ATOMIC_ACQUIRE );
+			entry = fold_find ( table, hash, path, len );
+			__atomic_thread_fence ( __ATOMIC_ACQUIRE );
+		} while ( ( seq & 1 ) ||
+			  ( __atomic_load_n ( &map->seq,
+					      __ATOMIC_RELAXED ) != seq ) );
+
+		/* Convert path, if found */
+		if ( entry ) {
+			for ( pos = len ; entry ; entry = entry->parent ) {
+				pos -= entry->len;
+				if ( ! ( __atomic_load_n ( &entry->flags,
+							   __ATOMIC_RELAXED ) &
+					 FOLD_AMBIGUOUS ) ) {
+					memcpy ( &path[pos], entry->name,
+						 entry->len );
+				}
+				pos--;
+			}
+			break;
+		}
+
+		/* Try parent directory, if applicable */
+		if ( ! parents ) {
+			len = 0;
+			break;
+		}
+		while ( len && ( path[ len - 1 ] != '/' ) )
+			len--;
+		if ( len )
+			len--;
+	}
+	readers_leave ( &map->readers[phase] );
+
+	return len;
+}
+
+/**
+ * Free case-folded name map
+ *
+ * @v map		Case-folded name map
+ */
+void fold_free ( struct fold_map *map ) {
+	struct fold_entry *entry;
+	struct fold_entry *next;
+	size_t i;
+
+	if ( map->table ) {
+		for ( i = 0 ; i <= map->table->mask ; i++ ) {
+			for ( entry = map->table->buckets[i] ; entry ;
+			      entry = next ) {
+				next = entry->next;
+				free ( entry );
+			}
+		}
+	}
+	free ( map->table );
+	fold_free_retired ( map->retired );
+	fold_free_retired ( map->pending );
+	pthread_mutex_destroy ( &map->lock );
+	memset ( map, 0, sizeof ( *map ) );
+}
@@ -0,0 +1,129 @@
+#ifndef _FOLD_H
+#define _FOLD_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Case-folded name map
+ *
+ * The map records every name within a tree, keyed by the hash of its
+ * case-folded path relative to the root of the tree, so that a path
+ * using the wrong case (e.g. "Custom/Modules/Foo.php" for a file
+ * created as "custom/modules/foo.php") may be converted to the path
+ * that exists on disk with a single hash lookup.  Each entry stores
+ * only its own name and a reference to its parent directory's entry.
+ *
+ * Only ASCII letters are folded.  Names that differ only in case are
+ * ambiguous, and are left unmodified.
+ *
+ * Lookups take no lock.  Entries are published to the hash chains
+ * atomically, and memory that a lookup might still be using (removed
+ * entries and replaced hash tables) is retired and freed only once
+ * every lookup that might have reached it has completed.  Lookups
+ * are counted against one of two phases, and the phase is switched
+ * each time retired memory is set aside, so that memory set aside in
+ * one phase may be freed as soon as the lookups counted against that
+ * phase have completed (even if other lookups are continuously in
+ * progress).  Modifications are serialised by the map's lock.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "index.h"
+#include "readers.h"
+
+#pragma GCC visibility push ( hidden )
+
+/** A case-folded name map entry */
+struct fold_entry {
+	/** Next entry in hash chain */
+	struct fold_entry *next;
+	/** Parent directory entry, or NULL */
+	struct fold_entry *parent;
+	/** Hash of case-folded relative path */
+	uint64_t hash;
+	/** Number of child entries */
+	unsigned int children;
+	/** Length of name */
+	uint16_t len;
+	/** Flags */
+	uint16_t flags;
+	/** Name (as it exists on disk, not NUL-terminated) */
+	char name[0];
+};
+
+/** Name has more than one case variant */
+#define FOLD_AMBIGUOUS 0x0001
+
+/** A case-folded name map hash table */
+struct fold_table {
+	/** Hash bucket mask */
+	size_t mask;
+	/** Hash buckets */
+	struct fold_entry *buckets[0];
+};
+
+/** Memory retired from a case-folded name map */
+struct fold_retired {
+	/** Next retired memory */
+	struct fold_retired *next;
+	/** Retired memory */
+	void *data;
+};
+
+/** A case-folded name map */
+struct fold_map {
+	/** Lock (held while modifying the map) */
+	pthread_mutex_t lock;
+	/** Hash table */
+	struct fold_table *table;
+	/** Number of entries */
+	size_t count;
+	/** Hash table sequence number (odd while being rehashed) */
+	unsigned long seq;
+	/** Current lookup phase */
+	unsigned int phase;
+	/** Lookups in progress within each phase */
+	struct readers readers[2];
+	/** Memory retired within the current phase */
+	struct fold_retired *retired;
+	/** Memory retired within the previous phase */
+	struct fold_retired *pending;
+};
+
+/** Initial number of hash buckets */
+#define FOLD_MIN_BUCKETS 1024
+
+extern int fold_init ( struct fold_map *map );
+extern int fold_add ( struct fold_map *map, const char *path, size_t len );
+extern int fold_add_index ( struct fold_map *map,
+			    const struct index *index );
+extern int fold_add_tree ( struct fold_map *map, int fd,
+			   unsigned int threads );
+extern void fold_remove ( struct fold_map *map, const char *path,
+			  size_t len );
+extern size_t fold_resolve ( struct fold_map *map, char *path, size_t len,
+			     int parents );
+extern void fold_free ( struct fold_map *map );
+
+#pragma GCC visibility pop
+
+#endif /* _FOLD_H */
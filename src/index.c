@@ -0,0 +1,771 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "index.h"
+
+/** Hash seed */
+#define INDEX_HASH_SEED 0x7068707475726421ULL
+
+/** Membership filter salts (one per filter block word) */
+static const uint32_t index_filter_salt[INDEX_FILTER_WORDS] = {
+	0x47b6137bUL, 0x44974d91UL, 0x8824ad5bUL, 0xa2b7289dUL,
+	0x705495c7UL, 0x2df1424bUL, 0x9efc4947UL, 0x5c6bfb31UL,
+};
+
+/**
+ * Mix a 64-bit value
+ *
+ * @v value		Value
+ * @ret mixed		Mixed value
+ */
+static inline uint64_t index_mix ( uint64_t value ) {
+
+	value ^= ( value >> 30 );
+	value *= 0xbf58476d1ce4e5b9ULL;
+	value ^= ( value >> 27 );
+	value *= 0x94d049bb133111ebULL;
+	value ^= ( value >> 31 );
+	return value;
+}
+
+/**
+ * Calculate hash of a path (or path component)
+ *
+ * @v data		Data
+ * @v len		Length of data
+ * @ret hash		Hash value
+ *
+ * The hash is calculated over native-endian words, and so an index
+ * file may be used only on a host of the same byte order as the host
+ * that created it.
+ */
+uint64_t index_hash ( const char *data, size_t len ) {
+	uint64_t hash = ( INDEX_HASH_SEED ^ len );
+	uint64_t word;
+
+	/* Hash whole words */
+	while ( len >= sizeof ( word ) ) {
+		memcpy ( &word, data, sizeof ( word ) );
+		hash = index_mix ( hash ^ word );
+		data += sizeof ( word );
+		len -= sizeof ( word );
+	}
+
+	/* Hash any trailing partial word */
+	if ( len ) {
+		word = 0;
+		memcpy ( &word, data, len );
+		hash = index_mix ( hash ^ word );
+	}
+
+	return hash;
+}
+
+/**
+ * Calculate number of membership filter blocks
+ *
+ * @v count		Number of paths to be added to the filter
+ * @v bits		Number of filter bits per path
+ * @ret nblocks		Number of filter blocks
+ */
+uint32_t index_filter_blocks ( uint64_t count, unsigned int bits ) {
+	uint64_t block_bits = ( 8 * sizeof ( struct index_filter_block ) );
+	uint64_t nblocks;
+
+	nblocks = ( ( ( count * bits ) + block_bits - 1 ) / block_bits );
+	if ( nblocks < 1 )
+		nblocks = 1;
+	if ( nblocks > UINT32_MAX )
+		nblocks = UINT32_MAX;
+	return nblocks;
+}
+
+/**
+ * Locate membership filter block and calculate block mask
+ *
+ * @v blocks		Filter blocks
+ * @v nblocks		Number of filter blocks
+ * @v hash		Path hash
+ * @v mask		Block mask to fill in
+ * @ret block		Filter block
+ */
+static inline const struct index_filter_block *
+index_filter_block ( const struct index_filter_block *blocks, uint32_t nblocks,
+		     uint64_t hash, uint32_t *mask ) {
+	uint32_t key = hash;
+	unsigned int i;
+
+	/* Calculate one bit per word from the low half of the hash */
+	for ( i = 0 ; i < INDEX_FILTER_WORDS ; i++ )
+		mask[i] = ( 1UL << ( ( key * index_filter_salt[i] ) >> 27 ) );
+
+	/* Select block using the high half of the hash */
+	return &blocks[ ( ( hash >> 32 ) * nblocks ) >> 32 ];
+}
+
+/**
+ * Add path to membership filter
+ *
+ * @v blocks		Filter blocks
+ * @v nblocks		Number of filter blocks
+ * @v hash		Path hash
+ */
+void index_filter_add ( struct index_filter_block *blocks, uint32_t nblocks,
+			uint64_t hash ) {
+	struct index_filter_block *block;
+	uint32_t mask[INDEX_FILTER_WORDS];
+	unsigned int i;
+
+	block = ( ( struct index_filter_block * )
+		  index_filter_block ( blocks, nblocks, hash, mask ) );
+	for ( i = 0 ; i < INDEX_FILTER_WORDS ; i++ )
+		block->words[i] |= mask[i];
+}
+
+/**
+ * Check if membership filter may contain path
+ *
+ * @v blocks		Filter blocks
+ * @v nblocks		Number of filter blocks
+ * @v hash		Path hash
+ * @ret maybe		Path may be present in the filter
+ */
+int index_filter_contains ( const struct index_filter_block *blocks,
+			    uint32_t nblocks, uint64_t hash ) {
+	const struct index_filter_block *block;
+	uint32_t mask[INDEX_FILTER_WORDS];
+	uint32_t missing = 0;
+	unsigned int i;
+
+	block = index_filter_block ( blocks, nblocks, hash, mask );
+	for ( i = 0 ; i < INDEX_FILTER_WORDS ; i++ )
+		missing |= ( mask[i] & ~block->words[i] );
+	return ( missing == 0 );
+}
+
+/**
+ * Check that an index file section lies within the file
+ *
+ * @v index		Index
+ * @v section		Section
+ * @v align		Required alignment
+ * @ret ok		Section is valid
+ */
+static int index_section_ok ( const struct index *index,
+			      const struct index_section *section,
+			      size_t align ) {
+
+	return ( ( section->offset <= index->size ) &&
+		 ( section->len <= ( index->size - section->offset ) ) &&
+		 ( ( section->offset % align ) == 0 ) );
+}
+
+/**
+ * Map an index file
+ *
+ * @v index		Index to fill in
+ * @v filename		Index file name
+ * @ret rc		Return status code (0 on success, -1 on error)
+ */
+int index_map ( struct index *index, const char *filename ) {
+	const struct index_header *hdr;
+	struct stat st;
+	void *data;
+	int fd;
+
+	/* Open and map file */
+	fd = openat ( AT_FDCWD, filename, ( O_RDONLY | O_CLOEXEC ) );
+	if ( fd < 0 )
+		goto err_open;
+	if ( fstat ( fd, &st ) != 0 )
+		goto err_stat;
+	if ( ( ( size_t ) st.st_size ) < sizeof ( *hdr ) ) {
+		errno = EINVAL;
+		goto err_size;
+	}
+	data = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	if ( data == MAP_FAILED )
+		goto err_mmap;
+	memset ( index, 0, sizeof ( *index ) );
+	index->data = data;
+	index->size = st.st_size;
+	index->dev = st.st_dev;
+	index->ino = st.st_ino;
+	index->mtime = st.st_mtim;
+	hdr = data;
+
+	/* Validate header */
+	if ( ( memcmp ( hdr->magic, INDEX_MAGIC,
+			sizeof ( hdr->magic ) ) != 0 ) ||
+	     ( hdr->version != INDEX_VERSION ) ||
+	     ( hdr->bom != INDEX_BOM ) ||
+	     ( hdr->size != index->size ) ) {
+		errno = EINVAL;
+		goto err_header;
+	}
+
+	/* Validate root directory */
+	if ( ( ! index_section_ok ( index, &hdr->root, 1 ) ) ||
+	     ( hdr->root.len < 1 ) ) {
+		errno = EINVAL;
+		goto err_root;
+	}
+	index->flags = hdr->flags;
+	index->generation = hdr->generation;
+	index->root = ( data + hdr->root.offset );
+	index->root_len = ( hdr->root.len - 1 /* NUL */ );
+	if ( strnlen ( index->root, hdr->root.len ) != index->root_len ) {
+		errno = EINVAL;
+		goto err_root;
+	}
+
+	/* Validate membership filter */
+	if ( ( ! index_section_ok ( index, &hdr->filter,
+				    sizeof ( uint32_t ) ) ) ||
+	     ( hdr->filter.len < sizeof ( index->blocks[0] ) ) ||
+	     ( hdr->filter.len % sizeof ( index->blocks[0] ) ) ||
+	     ( ( hdr->filter.len / sizeof ( index->blocks[0] ) ) >
+	       UINT32_MAX ) ) {
+		errno = EINVAL;
+		goto err_filter;
+	}
+	index->blocks = ( data + hdr->filter.offset );
+	index->nblocks = ( hdr->filter.len / sizeof ( index->blocks[0] ) );
+
+	/* Validate path component tree, if present.  Node contents
+	 * are range-checked during lookups.
+	 */
+	if ( hdr->nodes.len ) {
+		if ( ( ! index_section_ok ( index, &hdr->nodes,
+					    sizeof ( uint32_t ) ) ) ||
+		     ( hdr->nodes.len % sizeof ( index->nodes[0] ) ) ||
+		     ( ( hdr->nodes.len / sizeof ( index->nodes[0] ) ) >
+		       UINT32_MAX ) ||
+		     ( ! index_section_ok ( index, &hdr->names, 1 ) ) ) {
+			errno = EINVAL;
+			goto err_nodes;
+		}
+		index->nodes = ( data + hdr->nodes.offset );
+		index->nnodes = ( hdr->nodes.len /
+				  sizeof ( index->nodes[0] ) );
+		index->names = ( data + hdr->names.offset );
+		index->names_len = hdr->names.len;
+	}
+
+	/* Validate directory stamps, if present */
+	if ( hdr->stamps.len ) {
+		if ( ( ! index_section_ok ( index, &hdr->stamps,
+					    sizeof ( uint64_t ) ) ) ||
+		     ( hdr->stamps.len % sizeof ( index->stamps[0] ) ) ||
+		     ( ( hdr->stamps.len / sizeof ( index->stamps[0] ) ) >
+		       UINT32_MAX ) ) {
+			errno = EINVAL;
+			goto err_stamps;
+		}
+		index->stamps = ( data + hdr->stamps.offset );
+		index->nstamps = ( hdr->stamps.len /
+				   sizeof ( index->stamps[0] ) );
+	}
+
+	/* Close file (the mapping remains valid) */
+	close ( fd );
+
+	return 0;
+
+ err_stamps:
+ err_nodes:
+ err_filter:
+ err_root:
+ err_header:
+	munmap ( data, st.st_size );
+ err_mmap:
+ err_size:
+ err_stat:
+	close ( fd );
+ err_open:
+	return -1;
+}
+
+/**
+ * Unmap an index file
+ *
+ * @v index		Index
+ */
+void index_unmap ( struct index *index ) {
+
+	munmap ( ( ( void * ) index->data ), index->size );
+	memset ( index, 0, sizeof ( *index ) );
+}
+
+/**
+ * Find child node by name
+ *
+ * @v index		Index
+ * @v parent		Parent node
+ * @v name		Name
+ * @v len		Length of name
+ * @ret node		Child node, or NULL if not found
+ */
+const struct index_node *
+index_child ( const struct index *index, const struct index_node *parent,
+	      const char *name, size_t len ) {
+	const struct index_node *node;
+	uint32_t low = parent->children;
+	uint32_t high = ( low + parent->count );
+	uint32_t mid;
+	int diff;
+
+	/* Reject corrupt child ranges */
+	if ( ( high < low ) || ( high > index->nnodes ) )
+		return NULL;
+
+	/* Binary search for name */
+	while ( low < high ) {
+		mid = ( low + ( ( high - low ) / 2 ) );
+		node = &index->nodes[mid];
+		if ( ( node->name > index->names_len ) ||
+		     ( node->len > ( index->names_len - node->name ) ) )
+			return NULL;
+		diff = index_name_cmp ( &index->names[node->name], node->len,
+					name, len );
+		if ( diff == 0 )
+			return node;
+		if ( diff < 0 ) {
+			low = ( mid + 1 );
+		} else {
+			high = mid;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Check path component tree
+ *
+ * @v index		Index
+ * @ret rc		Return status code
+ *
+ * Lookups range-check only the nodes that they visit.  A consumer
+ * that walks the whole tree (such as phpturd-index when updating from
+ * a previous index) must first check that the tree is well-formed:
+ * that every name lies within the name table and is a valid path
+ * component, that the nodes are laid out in breadth-first order (so
+ * that every node other than the root has exactly one parent), and
+ * that the children of each node are sorted with no duplicates.
+ */
+int index_check_tree ( const struct index *index ) {
+	const struct index_node *node;
+	const struct index_node *child;
+	const struct index_node *prev;
+	const char *name;
+	uint32_t tail = 1;
+	uint32_t i;
+	uint32_t j;
+
+	for ( i = 0 ; i < index->nnodes ; i++ ) {
+		node = &index->nodes[i];
+
+		/* Check name */
+		if ( ( node->name > index->names_len ) ||
+		     ( node->len > ( index->names_len - node->name ) ) )
+			goto err_invalid;
+		name = &index->names[node->name];
+		if ( i && ( ( node->len == 0 ) ||
+			    memchr ( name, '/', node->len ) ||
+			    memchr ( name, '\0', node->len ) ||
+			    ( ( node->len == 1 ) &&
+			      ( memcmp ( name, ".", 1 ) == 0 ) ) ||
+			    ( ( node->len == 2 ) &&
+			      ( memcmp ( name, "..", 2 ) == 0 ) ) ) )
+			goto err_invalid;
+
+		/* Check child range */
+		if ( ! node->count )
+			continue;
+		if ( ( ! ( node->flags & INDEX_NODE_DIR ) ) ||
+		     ( node->children != tail ) ||
+		     ( node->count > ( index->nnodes - tail ) ) )
+			goto err_invalid;
+		tail += node->count;
+	}
+	if ( index->nnodes && ( tail != index->nnodes ) )
+		goto err_invalid;
+
+	/* Check child ordering (now that all names are known to lie
+	 * within the name table)
+	 */
+	for ( i = 0 ; i < index->nnodes ; i++ ) {
+		node = &index->nodes[i];
+		for ( j = 1 ; j < node->count ; j++ ) {
+			prev = &index->nodes[ node->children + j - 1 ];
+			child = &index->nodes[ node->children + j ];
+			if ( index_name_cmp ( &index->names[prev->name],
+					      prev->len,
+					      &index->names[child->name],
+					      child->len ) >= 0 )
+				goto err_invalid;
+		}
+	}
+
+	return 0;
+
+ err_invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Find directory stamp
+ *
+ * @v index		Index
+ * @v node		Directory node
+ * @ret stamp		Directory stamp, or NULL if not found
+ */
+const struct index_stamp *
+index_find_stamp ( const struct index *index, const struct index_node *node ) {
+	const struct index_stamp *stamp;
+	uint32_t id = ( node - index->nodes );
+	uint32_t low = 0;
+	uint32_t high = index->nstamps;
+	uint32_t mid;
+
+	/* Binary search for node index */
+	while ( low < high ) {
+		mid = ( low + ( ( high - low ) / 2 ) );
+		stamp = &index->stamps[mid];
+		if ( stamp->node == id )
+			return stamp;
+		if ( stamp->node < id ) {
+			low = ( mid + 1 );
+		} else {
+			high = mid;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Look up path within index
+ *
+ * @v index		Index
+ * @v suffix		Path relative to indexed root directory
+ * @v len		Length of path
+ * @ret result		Lookup result
+ *
+ * The path must be in canonical form (as produced by
+ * canonical_path()), and must be either empty or start with a '/'.
+ */
+enum index_result index_lookup ( const struct index *index,
+				 const char *suffix, size_t len ) {
+
+	const struct index_node *node;
+	const char *name;
+	const char *sep;
+	size_t name_len;
+	int is_dir;
+
+	/* Ignore any trailing '/', which requires a directory */
+	is_dir = ( len && ( suffix[ len - 1 ] == '/' ) );
+	if ( is_dir )
+		len--;
+
+	/* Check membership filter.  The filter cannot be used if
+	 * there are opaque directories, since it does not include the
+	 * (unknown) contents of those directories.
+	 */
+	if ( ! ( index->flags & INDEX_OPAQUE ) ) {
+		if ( ! index_filter_contains ( index->blocks, index->nblocks,
+					       index_hash ( suffix, len ) ) )
+			return INDEX_ABSENT;
+	}
+
+	/* Use path component tree, if present */
+	if ( ! index->nnodes )
+		return INDEX_MAYBE;
+	node = &index->nodes[0];
+	while ( len ) {
+
+		/* Any intermediate component must be a directory */
+		if ( ! ( node->flags & INDEX_NODE_DIR ) )
+			return INDEX_ABSENT;
+
+		/* Contents of opaque directories are unknown */
+		if ( node->flags & INDEX_NODE_OPAQUE )
+			return INDEX_MAYBE;
+
+		/* Extract next path component */
+		name = ( suffix + 1 /* '/' */ );
+		sep = memchr ( name, '/', ( len - 1 ) );
+		name_len = ( sep ? ( ( size_t ) ( sep - name ) ) :
+			     ( len - 1 ) );
+
+		/* Find child node */
+		node = index_child ( index, node, name, name_len );
+		if ( ! node )
+			return INDEX_ABSENT;
+		suffix += ( 1 /* '/' */ + name_len );
+		len -= ( 1 /* '/' */ + name_len );
+	}
+
+	/* Check that a directory was found, if applicable */
+	if ( is_dir && ! ( node->flags & INDEX_NODE_DIR ) )
+		return INDEX_ABSENT;
+
+	return INDEX_PRESENT;
+}
+
+/**
+ * Get current time (in seconds)
+ *
+ * @ret now		Current time
+ */
+static time_t index_now ( void ) {
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC_COARSE, &ts );
+	return ts.tv_sec;
+}
+
+/**
+ * Map index file for hot-swappable index
+ *
+ * @v handle		Hot-swappable index
+ * @ret index		Index, or NULL on error
+ */
+static struct index * index_handle_map ( struct index_handle *handle ) {
+	struct index *index;
+
+	/* Allocate and map index */
+	index = malloc ( sizeof ( *index ) );
+	if ( ! index )
+		goto err_alloc;
+	if ( index_map ( index, handle->filename ) != 0 )
+		goto err_map;
+
+	/* Check that index was built for the required root directory */
+	if ( ( index->root_len != handle->root_len ) ||
+	     ( memcmp ( index->root, handle->root, handle->root_len ) != 0 ) ) {
+		errno = EXDEV;
+		goto err_root;
+	}
+
+	return index;
+
+ err_root:
+	index_unmap ( index );
+ err_map:
+	free ( index );
+ err_alloc:
+	return NULL;
+}
+
+/**
+ * Open hot-swappable index
+ *
+ * @v handle		Hot-swappable index to fill in
+ * @v filename		Index file name
+ * @v root		Required indexed root directory
+ * @v root_len		Length of required indexed root directory
+ * @v interval		Interval between checks for replacement (or zero)
+ * @ret rc		Return status code (0 on success, -1 on error)
+ *
+ * If the index file cannot be used (e.g. because it does not yet
+ * exist), then the handle is still filled in (with no current index),
+ * and the index file will be used if it subsequently becomes valid.
+ * The caller may use index_close() to discard the handle instead.
+ */
+int index_open ( struct index_handle *handle, const char *filename,
+		 const char *root, size_t root_len, unsigned int interval ) {
+
+	/* Initialise handle */
+	memset ( handle, 0, sizeof ( *handle ) );
+	handle->root = root;
+	handle->root_len = root_len;
+	handle->interval = interval;
+	handle->filename = strdup ( filename );
+	if ( ! handle->filename )
+		goto err_strdup;
+
+	/* Map initial index */
+	handle->next_check = ( index_now() + interval );
+	handle->current = index_handle_map ( handle );
+	if ( ! handle->current )
+		return -1;
+
+	return 0;
+
+ err_strdup:
+	memset ( handle, 0, sizeof ( *handle ) );
+	return -1;
+}
+
+/**
+ * Close hot-swappable index
+ *
+ * @v handle		Hot-swappable index (not in use by any thread)
+ */
+void index_close ( struct index_handle *handle ) {
+	struct index *index;
+
+	/* Unmap current and retired indexes */
+	if ( handle->current ) {
+		index_unmap ( handle->current );
+		free ( handle->current );
+	}
+	while ( ( index = handle->retired ) ) {
+		handle->retired = index->next;
+		index_unmap ( index );
+		free ( index );
+	}
+
+	/* Free file name */
+	free ( handle->filename );
+	memset ( handle, 0, sizeof ( *handle ) );
+}
+
+/**
+ * Check for replacement of hot-swappable index
+ *
+ * @v handle		Hot-swappable index
+ * @v now		Current time
+ */
+static void index_check ( struct index_handle *handle, time_t now ) {
+	struct index *current;
+	struct index *index;
+	struct index **prev;
+	struct stat st;
+
+	/* Reclaim retired indexes that have no remaining readers */
+	prev = &handle->retired;
+	while ( ( index = *prev ) ) {
+		if ( ( now >= ( index->retired + INDEX_GRACE ) ) &&
+		     readers_idle ( &index->readers ) ) {
+			*prev = index->next;
+			index_unmap ( index );
+			free ( index );
+		} else {
+			prev = &index->next;
+		}
+	}
+
+	/* Check whether or not index file has been replaced.  If the
+	 * index file has been removed, then withdraw the index.
+	 */
+	current = handle->current;
+	if ( fstatat ( AT_FDCWD, handle->filename, &st, 0 ) == 0 ) {
+		if ( current && ( st.st_dev == current->dev ) &&
+		     ( st.st_ino == current->ino ) &&
+		     ( ( ( size_t ) st.st_size ) == current->size ) &&
+		     ( st.st_mtim.tv_sec == current->mtime.tv_sec ) &&
+		     ( st.st_mtim.tv_nsec == current->mtime.tv_nsec ) ) {
+			return;
+		}
+		index = index_handle_map ( handle );
+		if ( ! index ) {
+			/* Leave current index in place and retry later */
+			return;
+		}
+	} else {
+		if ( ! current )
+			return;
+		index = NULL;
+	}
+
+	/* Publish new index and retire old index */
+	__atomic_store_n ( &handle->current, index, __ATOMIC_SEQ_CST );
+	__atomic_add_fetch ( &handle->swaps, 1, __ATOMIC_SEQ_CST );
+	if ( current ) {
+		current->retired = now;
+		current->next = handle->retired;
+		handle->retired = current;
+	}
+}
+
+/**
+ * Get current index for lookups
+ *
+ * @v handle		Hot-swappable index
+ * @ret index		Index (or NULL if there is no current index)
+ *
+ * The caller must call index_put() when finished with the index.
+ * The grace period before unmapping a retired index covers the
+ * (very short) window between reading the current index pointer and
+ * recording the reference.
+ */
+struct index * index_get ( struct index_handle *handle ) {
+	struct index *index;
+	time_t now;
+
+	/* Check periodically for replacement.  Only one thread will
+	 * perform the check; other threads continue using the current
+	 * index.
+	 */
+	if ( handle->interval ) {
+		now = index_now();
+		if ( ( now >= __atomic_load_n ( &handle->next_check,
+						__ATOMIC_RELAXED ) ) &&
+		     ( ! __atomic_exchange_n ( &handle->checking, 1,
+					       __ATOMIC_ACQUIRE ) ) ) {
+			index_check ( handle, now );
+			__atomic_store_n ( &handle->next_check,
+					   ( now + handle->interval ),
+					   __ATOMIC_RELAXED );
+			__atomic_store_n ( &handle->checking, 0,
+					   __ATOMIC_RELEASE );
+		}
+	}
+
+	/* Take a reference to the current index, retrying if the
+	 * index is replaced before the reference is recorded.
+	 */
+	while ( 1 ) {
+		index = __atomic_load_n ( &handle->current, __ATOMIC_SEQ_CST );
+		if ( ! index )
+			return NULL;
+		readers_enter ( &index->readers );
+		if ( __atomic_load_n ( &handle->current,
+				       __ATOMIC_SEQ_CST ) == index )
+			return index;
+		index_put ( index );
+	}
+}
+
+/**
+ * Finish using index for lookups
+ *
+ * @v index		Index
+ */
+void index_put ( struct index *index ) {
+
+	readers_leave ( &index->readers );
+}
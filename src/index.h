@@ -0,0 +1,320 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Offline index of a readonly (distribution) tree
+ *
+ * The index is built by phpturd-index at deployment time and mapped
+ * read-only by the interception library, which uses it to avoid
+ * probing the readonly tree with a system call for every access.
+ *
+ * Code in this file is linked into the interception library, and so
+ * must not call any of the library functions that the interception
+ * library wraps.  Use the unwrapped *at() variants instead.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "readers.h"
+
+#pragma GCC visibility push ( hidden )
+
+/** Index file magic signature */
+#define INDEX_MAGIC "TURDIDX"
+
+/** Index file format version */
+#define INDEX_VERSION 4
+
+/** Index file section alignment (one cache line) */
+#define INDEX_ALIGN 64
+
+/** A section within an index file */
+struct index_section {
+	/** Offset from start of file */
+	uint64_t offset;
+	/** Length */
+	uint64_t len;
+};
+
+/** Index file header */
+struct index_header {
+	/** Magic signature (including NUL) */
+	char magic[8];
+	/** Format version */
+	uint32_t version;
+	/** Byte order marker (always written as INDEX_BOM) */
+	uint32_t bom;
+	/** Total file length */
+	uint64_t size;
+	/** Number of indexed paths */
+	uint64_t count;
+	/** Flags */
+	uint64_t flags;
+	/** Generation (time of creation, in nanoseconds since the Epoch) */
+	uint64_t generation;
+	/** Indexed root directory (NUL-terminated) */
+	struct index_section root;
+	/** Membership filter */
+	struct index_section filter;
+	/** Path component tree nodes (optional) */
+	struct index_section nodes;
+	/** Path component names */
+	struct index_section names;
+	/** Directory stamps */
+	struct index_section stamps;
+};
+
+/** Byte order marker */
+#define INDEX_BOM 0x01020304UL
+
+/** Index contains opaque directories (see INDEX_NODE_OPAQUE) */
+#define INDEX_OPAQUE 0x0001
+
+/** Number of words in a membership filter block */
+#define INDEX_FILTER_WORDS 8
+
+/**
+ * A membership filter block
+ *
+ * The membership filter is a split-block Bloom filter.  Each path
+ * hashes to a single block, within which it sets exactly one bit in
+ * each 32-bit word.  A query therefore touches at most one cache
+ * line.
+ */
+struct index_filter_block {
+	/** Bit words */
+	uint32_t words[INDEX_FILTER_WORDS];
+};
+
+/** Default number of membership filter bits per indexed path */
+#define INDEX_FILTER_BITS 16
+
+/**
+ * A path component tree node
+ *
+ * Each node represents a single path component.  The children of a
+ * node are stored contiguously and sorted by name (as defined by
+ * index_name_cmp()), so that a lookup requires one binary search per
+ * path component.  Nodes are laid out in breadth-first order, so that
+ * the shallow directories through which every lookup passes are
+ * packed together at the start of the node table.  The root node is
+ * always the first node.
+ *
+ * Component names are stored (without terminating NULs) in a separate
+ * deduplicated name table.  All references are offsets, and so the
+ * index is position-independent.
+ */
+struct index_node {
+	/** Offset of name within name table */
+	uint32_t name;
+	/** Length of name */
+	uint16_t len;
+	/** Flags */
+	uint16_t flags;
+	/** Index of first child node */
+	uint32_t children;
+	/** Number of child nodes */
+	uint32_t count;
+};
+
+/** Path component is a directory (after following symlinks) */
+#define INDEX_NODE_DIR 0x0001
+
+/** Path component is a directory whose contents are not indexed
+ *
+ * This is used for directories that could not be read, and for
+ * symbolic link loops.
+ */
+#define INDEX_NODE_OPAQUE 0x0002
+
+/** Path component is a directory containing symbolic links */
+#define INDEX_NODE_LINKS 0x0004
+
+/**
+ * A directory stamp
+ *
+ * Directory stamps record the identity and modification time of each
+ * indexed directory, and are used only by phpturd-index to determine
+ * which directories must be reread when updating an index.  Stamps
+ * are sorted by node index.
+ */
+struct index_stamp {
+	/** Node index */
+	uint32_t node;
+	/** Modification time (nanoseconds) */
+	uint32_t mtime_nsec;
+	/** Device */
+	uint64_t dev;
+	/** Inode */
+	uint64_t ino;
+	/** Modification time (seconds) */
+	int64_t mtime;
+};
+
+/** A mapped index */
+struct index {
+	/** Mapped file */
+	const void *data;
+	/** Length of mapped file */
+	size_t size;
+	/** Indexed root directory */
+	const char *root;
+	/** Length of indexed root directory */
+	size_t root_len;
+	/** Membership filter blocks */
+	const struct index_filter_block *blocks;
+	/** Number of membership filter blocks */
+	uint32_t nblocks;
+	/** Path component tree nodes (or NULL if absent) */
+	const struct index_node *nodes;
+	/** Number of path component tree nodes */
+	uint32_t nnodes;
+	/** Path component names */
+	const char *names;
+	/** Length of path component names */
+	size_t names_len;
+	/** Directory stamps */
+	const struct index_stamp *stamps;
+	/** Number of directory stamps */
+	uint32_t nstamps;
+	/** Flags */
+	unsigned int flags;
+	/** Generation */
+	uint64_t generation;
+
+	/** Device containing index file */
+	dev_t dev;
+	/** Index file inode */
+	ino_t ino;
+	/** Index file modification time */
+	struct timespec mtime;
+
+	/** Active readers */
+	struct readers readers;
+	/** Time at which index was retired */
+	time_t retired;
+	/** Next retired index */
+	struct index *next;
+};
+
+/**
+ * A hot-swappable index
+ *
+ * The index file is checked periodically for replacement (e.g. by a
+ * deployment that rebuilds the index using phpturd-index).  A
+ * replacement index is mapped and published atomically, without
+ * blocking concurrent lookups.  Lookups that are still using the
+ * previous index run to completion, and the previous index is
+ * unmapped once it has no readers and a grace period has elapsed.
+ * Readers are counted per thread, so that concurrent lookups do not
+ * contend for a single shared counter.
+ *
+ * An index file must always be replaced by renaming a new file over
+ * the old file, never by modifying the old file in place.
+ */
+struct index_handle {
+	/** Index file name */
+	char *filename;
+	/** Required indexed root directory */
+	const char *root;
+	/** Length of required indexed root directory */
+	size_t root_len;
+	/** Interval between checks for replacement (in seconds, or zero) */
+	unsigned int interval;
+
+	/** Current index (or NULL) */
+	struct index *current;
+	/** Number of times the current index has been replaced */
+	unsigned long swaps;
+
+	/** Check is in progress */
+	int checking;
+	/** Time of next check */
+	time_t next_check;
+	/** List of retired indexes */
+	struct index *retired;
+};
+
+/** Default interval between checks for index replacement (seconds) */
+#define INDEX_INTERVAL 1
+
+/** Grace period before unmapping a retired index (seconds) */
+#define INDEX_GRACE 5
+
+/** Result of an index lookup */
+enum index_result {
+	/** Path definitely does not exist */
+	INDEX_ABSENT = 0,
+	/** Path may exist */
+	INDEX_MAYBE,
+	/** Path definitely exists */
+	INDEX_PRESENT,
+};
+
+/**
+ * Compare path component names
+ *
+ * @v name1		Name one
+ * @v len1		Length of name one
+ * @v name2		Name two
+ * @v len2		Length of name two
+ * @ret diff		Difference
+ */
+static inline int index_name_cmp ( const char *name1, size_t len1,
+				   const char *name2, size_t len2 ) {
+	int diff;
+
+	diff = memcmp ( name1, name2, ( ( len1 < len2 ) ? len1 : len2 ) );
+	if ( diff )
+		return diff;
+	return ( ( len1 > len2 ) - ( len1 < len2 ) );
+}
+
+extern uint64_t index_hash ( const char *data, size_t len );
+extern uint32_t index_filter_blocks ( uint64_t count, unsigned int bits );
+extern void index_filter_add ( struct index_filter_block *blocks,
+			       uint32_t nblocks, uint64_t hash );
+extern int index_filter_contains ( const struct index_filter_block *blocks,
+				   uint32_t nblocks, uint64_t hash );
+extern int index_map ( struct index *index, const char *filename );
+extern void index_unmap ( struct index *index );
+extern const struct index_node *
+index_child ( const struct index *index, const struct index_node *parent,
+	      const char *name, size_t len );
+extern int index_check_tree ( const struct index *index );
+extern const struct index_stamp *
+index_find_stamp ( const struct index *index, const struct index_node *node );
+extern enum index_result index_lookup ( const struct index *index,
+					const char *suffix, size_t len );
+extern int index_open ( struct index_handle *handle, const char *filename,
+			const char *root, size_t root_len,
+			unsigned int interval );
+extern void index_close ( struct index_handle *handle );
+extern struct index * index_get ( struct index_handle *handle );
+extern void index_put ( struct index *index );
+
+#pragma GCC visibility pop
+
+#endif /* _INDEX_H */
@@ -0,0 +1,406 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Hot path micro-benchmarks
+ *
+ * The library source is included directly, so that the internal
+ * (static) functions on the hot path may be driven exactly as
+ * compiled for the library.  The wrapped library calls are therefore
+ * also defined within this program, and so any path-based library
+ * calls made by the program itself will be turdified.
+ */
+
+#include "phpturd.c"
+
+/** Default number of iterations */
+#define BENCH_ITERATIONS 100000
+
+/** Number of path components in a very long path */
+#define BENCH_LONG_DEPTH 64
+
+/** A benchmarked path */
+struct bench_path {
+	/** Name */
+	const char *name;
+	/** Path */
+	char *path;
+	/** Canonical path */
+	char *canonical;
+};
+
+/** A benchmarked function */
+struct bench_func {
+	/** Name */
+	const char *name;
+	/**
+	 * Run function once
+	 *
+	 * @v bpath		Benchmarked path
+	 */
+	void ( * run ) ( struct bench_path *bpath );
+};
+
+/** Number of memory allocations made by this thread */
+static __thread unsigned long allocations;
+
+/** Benchmark tree */
+static char *base;
+
+/** Writable directory within benchmark tree */
+static char *scratch;
+
+/** Result sink (to prevent benchmarked calls being optimised away) */
+static volatile unsigned long sink;
+
+/* Original memory allocation functions */
+extern void * __libc_malloc ( size_t size );
+extern void * __libc_calloc ( size_t nmemb, size_t size );
+extern void * __libc_realloc ( void *ptr, size_t size );
+
+void * malloc ( size_t size ) {
+
+	allocations++;
+	return __libc_malloc ( size );
+}
+
+void * calloc ( size_t nmemb, size_t size ) {
+
+	allocations++;
+	return __libc_calloc ( nmemb, size );
+}
+
+void * realloc ( void *ptr, size_t size ) {
+
+	allocations++;
+	return __libc_realloc ( ptr, size );
+}
+
+/**
+ * Benchmark canonical_path()
+ *
+ * @v bpath		Benchmarked path
+ */
+static void bench_canonical ( struct bench_path *bpath ) {
+
+	free ( canonical_path ( bpath->path, "bench" ) );
+}
+
+/**
+ * Benchmark path_starts_with()
+ *
+ * @v bpath		Benchmarked path
+ */
+static void bench_starts_with ( struct bench_path *bpath ) {
+
+	sink += path_starts_with ( bpath->canonical, scratch,
+				   strlen ( scratch ) );
+}
+
+/**
+ * Benchmark turd_find()
+ *
+ * @v bpath		Benchmarked path
+ */
+static void bench_find ( struct bench_path *bpath ) {
+
+	sink += ( turd_find ( bpath->canonical ) != NULL );
+}
+
+/**
+ * Benchmark turdify_path()
+ *
+ * @v bpath		Benchmarked path
+ */
+static void bench_turdify ( struct bench_path *bpath ) {
+	char *turdpath;
+
+	turdpath = turdify_path ( bpath->path, 0, "bench" );
+	if ( turdpath != bpath->path )
+		free ( turdpath );
+}
+
+/** Benchmarked functions */
+static struct bench_func funcs[] = {
+	{ "canonical_path", bench_canonical },
+	{ "path_starts_with", bench_starts_with },
+	{ "turd_find", bench_find },
+	{ "turdify_path", bench_turdify },
+};
+
+/** Benchmarked paths */
+static struct bench_path paths[] = {
+	{ .name = "absolute" },
+	{ .name = "relative" },
+	{ .name = "dotdot" },
+	{ .name = "outside" },
+	{ .name = "long" },
+};
+
+/**
+ * Create file or directory within benchmark tree
+ *
+ * @v name		Name (with a trailing '/' for a directory)
+ * @ret rc		Return status code
+ *
+ * The unwrapped mkdirat() and openat() are used, since the wrapped
+ * calls would be turdified.
+ */
+static int bench_create ( const char *name ) {
+	char *path;
+	size_t len;
+	int fd;
+	int rc;
+
+	if ( asprintf ( &path, "%s/%s", base, name ) < 0 )
+		return -1;
+	len = strlen ( path );
+	if ( path[ len - 1 ] == '/' ) {
+		path[ len - 1 ] = '\0';
+		rc = mkdirat ( AT_FDCWD, path, 0755 );
+		if ( ( rc != 0 ) && ( errno == EEXIST ) )
+			rc = 0;
+	} else {
+		fd = openat ( AT_FDCWD, path, ( O_WRONLY | O_CREAT ), 0644 );
+		rc = ( ( fd < 0 ) ? -1 : 0 );
+		if ( fd >= 0 )
+			close ( fd );
+	}
+	if ( rc != 0 )
+		perror ( path );
+	free ( path );
+	return rc;
+}
+
+/**
+ * Construct benchmark tree and paths
+ *
+ * @ret rc		Return status code
+ */
+static int bench_init ( void ) {
+	static const char *names[] = {
+		"dist/", "scratch/", "dist/modules/", "dist/modules/Accounts/",
+		"dist/modules/Accounts/Account.php", "dist/include/",
+		"dist/include/utils.php", "scratch/custom/",
+	};
+	const char *tmpdir;
+	char *turd;
+	char *path;
+	size_t len;
+	unsigned int i;
+	int fd;
+
+	/* Construct tree (reusing any existing tree, so that the
+	 * shared statistics segment is also reused)
+	 */
+	tmpdir = getenv ( "TMPDIR" );
+	if ( asprintf ( &base, "%s/phpturd-bench",
+			( tmpdir ? tmpdir : "/tmp" ) ) < 0 )
+		return -1;
+	if ( ( mkdirat ( AT_FDCWD, base, 0755 ) != 0 ) &&
+	     ( errno != EEXIST ) ) {
+		perror ( base );
+		return -1;
+	}
+	for ( i = 0 ; i < ( sizeof ( names ) / sizeof ( names[0] ) ) ; i++ ) {
+		if ( bench_create ( names[i] ) != 0 )
+			return -1;
+	}
+
+	/* Construct mapping */
+	if ( asprintf ( &scratch, "%s/scratch", base ) < 0 )
+		return -1;
+	if ( asprintf ( &turd, "%s/dist:%s", base, scratch ) < 0 )
+		return -1;
+	setenv ( PHPTURD, turd, 1 );
+	free ( turd );
+
+	/* Run relative paths from within the writable directory */
+	fd = openat ( AT_FDCWD, scratch, ( O_RDONLY | O_DIRECTORY ) );
+	if ( ( fd < 0 ) || ( fchdir ( fd ) != 0 ) ) {
+		perror ( scratch );
+		return -1;
+	}
+	close ( fd );
+
+	/* Construct paths */
+	if ( asprintf ( &paths[0].path, "%s/modules/Accounts/Account.php",
+			scratch ) < 0 )
+		return -1;
+	paths[1].path = strdup ( "modules/Accounts/Account.php" );
+	if ( ! paths[1].path )
+		return -1;
+	if ( asprintf ( &paths[2].path, "%s/modules/Accounts/../../include/"
+			"./../modules//Accounts/../Accounts/Account.php",
+			scratch ) < 0 )
+		return -1;
+	paths[3].path = strdup ( "/usr/share/php/vendor/autoload.php" );
+	if ( ! paths[3].path )
+		return -1;
+	len = ( strlen ( scratch ) + ( BENCH_LONG_DEPTH * 16 ) +
+		sizeof ( "/Missing.php" ) );
+	path = malloc ( len );
+	if ( ! path )
+		return -1;
+	strcpy ( path, scratch );
+	for ( i = 0 ; i < BENCH_LONG_DEPTH ; i++ ) {
+		sprintf ( ( path + strlen ( path ) ), "/component-%02d", i );
+	}
+	strcat ( path, "/Missing.php" );
+	paths[4].path = path;
+	for ( i = 0 ; i < ( sizeof ( paths ) / sizeof ( paths[0] ) ) ; i++ ) {
+		paths[i].canonical = canonical_path ( paths[i].path, "bench" );
+		if ( ! paths[i].canonical )
+			return -1;
+	}
+
+	/* Perform library initialisation */
+	bench_turdify ( &paths[0] );
+	if ( ! mapping_count ) {
+		fprintf ( stderr, "Could not initialise mapping %s\n",
+			  getenv ( PHPTURD ) );
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Run benchmark
+ *
+ * @v func		Benchmarked function
+ * @v bpath		Benchmarked path
+ * @v iterations	Number of iterations
+ * @v null		Null output stream (for counting system calls)
+ *
+ * Time and memory allocations are measured in one pass, and system
+ * calls are counted in a separate pass (using the explanation
+ * machinery, which would otherwise distort the timings).
+ */
+static void bench ( struct bench_func *func, struct bench_path *bpath,
+		    unsigned long iterations, FILE *null ) {
+	unsigned long allocated;
+	unsigned long syscalls;
+	uint64_t started;
+	uint64_t elapsed;
+	unsigned long i;
+
+	/* Warm up */
+	for ( i = 0 ; i < ( iterations / 10 ) ; i++ )
+		func->run ( bpath );
+
+	/* Measure time and allocations */
+	allocated = allocations;
+	started = turd_now();
+	for ( i = 0 ; i < iterations ; i++ )
+		func->run ( bpath );
+	elapsed = ( turd_now() - started );
+	allocated = ( allocations - allocated );
+
+	/* Count system calls */
+	syscalls = 0;
+	for ( i = 0 ; i < iterations ; i++ ) {
+		turd_call.explain = null;
+		turd_call.syscalls = 0;
+		func->run ( bpath );
+		turd_call.explain = NULL;
+		syscalls += turd_call.syscalls;
+	}
+
+	printf ( "%-18s %-10s %10.1f %10.2f %12.2f\n", func->name,
+		 bpath->name, ( ( ( double ) elapsed ) / iterations ),
+		 ( ( ( double ) allocated ) / iterations ),
+		 ( ( ( double ) syscalls ) / iterations ) );
+}
+
+/**
+ * Print usage information
+ *
+ * @v argv0		Program name
+ */
+static void usage ( const char *argv0 ) {
+
+	fprintf ( stderr, "Usage: %s [-n <iterations>] [<function>...]\n"
+		  "\n"
+		  "Benchmark path resolution hot path functions\n"
+		  "\n"
+		  "  -n          Number of iterations (default %d)\n"
+		  "\n"
+		  "Functions: canonical_path path_starts_with turd_find "
+		  "turdify_path\n", argv0, BENCH_ITERATIONS );
+}
+
+int main ( int argc, char **argv ) {
+	unsigned long iterations = BENCH_ITERATIONS;
+	unsigned int i;
+	unsigned int j;
+	char *end;
+	FILE *null;
+	int c;
+
+	/* Parse command line */
+	while ( ( c = getopt ( argc, argv, "n:h" ) ) != -1 ) {
+		switch ( c ) {
+		case 'n':
+			iterations = strtoul ( optarg, &end, 0 );
+			if ( ( *end ) || ( iterations < 1 ) ) {
+				fprintf ( stderr, "Invalid iterations: %s\n",
+					  optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'h':
+			usage ( argv[0] );
+			exit ( EXIT_SUCCESS );
+		default:
+			usage ( argv[0] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+
+	/* Construct benchmark tree and paths */
+	if ( bench_init() != 0 )
+		exit ( EXIT_FAILURE );
+	null = fopen ( "/dev/null", "w" );
+	if ( ! null ) {
+		perror ( "/dev/null" );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* Run benchmarks */
+	printf ( "%-18s %-10s %10s %10s %12s\n", "function", "path",
+		 "ns/op", "allocs/op", "syscalls/op" );
+	for ( i = 0 ; i < ( sizeof ( funcs ) / sizeof ( funcs[0] ) ) ; i++ ) {
+		if ( optind < argc ) {
+			for ( j = optind ; j < ( unsigned int ) argc ; j++ ) {
+				if ( strcmp ( argv[j], funcs[i].name ) == 0 )
+					break;
+			}
+			if ( j == ( unsigned int ) argc )
+				continue;
+		}
+		for ( j = 0 ; j < ( sizeof ( paths ) / sizeof ( paths[0] ) ) ;
+		      j++ ) {
+			bench ( &funcs[i], &paths[j], iterations, null );
+		}
+	}
+
+	fclose ( null );
+	return 0;
+}
@@ -0,0 +1,911 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "index.h"
+#include "walk.h"
+
+/** A path component tree node under construction */
+struct node {
+	/** Parent node (for loop detection) */
+	struct node *parent;
+	/** Name */
+	char *name;
+	/** Length of name */
+	size_t len;
+	/** Flags */
+	unsigned int flags;
+	/** Path hash */
+	uint64_t hash;
+	/** Child nodes */
+	struct node **children;
+	/** Number of child nodes */
+	size_t count;
+	/** Allocated number of child nodes */
+	size_t max;
+	/** Directory node in previous index (if any) */
+	const struct index_node *old;
+	/** Directory stamp (if stamp.ino is non-zero) */
+	struct index_stamp stamp;
+};
+
+/** A deduplicated name table entry */
+struct name_entry {
+	/** Offset within name table */
+	uint32_t offset;
+	/** Length (or zero for an empty entry) */
+	uint32_t len;
+};
+
+/** Index under construction */
+struct builder {
+	/** Root node */
+	struct node root;
+	/** Number of nodes (including the root node) */
+	size_t nnodes;
+	/** Name table */
+	char *names;
+	/** Length of name table */
+	size_t names_len;
+	/** Allocated length of name table */
+	size_t names_max;
+	/** Name deduplication hash table */
+	struct name_entry *entries;
+	/** Name deduplication hash table size (a power of two) */
+	size_t entries_max;
+	/** Index file contents */
+	char *data;
+	/** Length of index file contents */
+	size_t len;
+	/** Index flags */
+	unsigned int flags;
+	/** Previous index (if any) */
+	struct index *previous;
+	/** Number of directories reused from previous index */
+	unsigned long reused;
+	/** Number of directories read */
+	unsigned long read;
+	/** Verbosity */
+	int verbose;
+};
+
+/** A directory being walked by a worker thread */
+struct builder_dir {
+	/** Index builder */
+	struct builder *builder;
+	/** Walker */
+	struct walker *walker;
+	/** Worker thread index */
+	unsigned int thread;
+	/** Directory walk job */
+	struct walk_job *job;
+	/** Directory node */
+	struct node *node;
+};
+
+/**
+ * Add child node
+ *
+ * @v builder		Index builder
+ * @v parent		Parent node
+ * @v name		Name
+ * @v len		Length of name
+ * @v flags		Flags
+ * @ret node		Child node, or NULL on error
+ *
+ * Child nodes are added only by the worker thread walking the parent
+ * directory, and so no locking is required.
+ */
+static struct node * node_add ( struct builder *builder, struct node *parent,
+				const char *name, size_t len,
+				unsigned int flags ) {
+	struct node **children;
+	struct node *node;
+	size_t max;
+
+	/* Grow child array if necessary */
+	if ( parent->count == parent->max ) {
+		max = ( parent->max ? ( parent->max * 2 ) : 4 );
+		children = realloc ( parent->children,
+				     ( max * sizeof ( children[0] ) ) );
+		if ( ! children )
+			goto err_children;
+		parent->children = children;
+		parent->max = max;
+	}
+
+	/* Allocate and populate node */
+	node = calloc ( 1, sizeof ( *node ) );
+	if ( ! node )
+		goto err_node;
+	node->name = strndup ( name, len );
+	if ( ! node->name )
+		goto err_name;
+	node->parent = parent;
+	node->len = len;
+	node->flags = flags;
+
+	/* Add to parent */
+	parent->children[parent->count++] = node;
+	__atomic_add_fetch ( &builder->nnodes, 1, __ATOMIC_RELAXED );
+
+	return node;
+
+ err_name:
+	free ( node );
+ err_node:
+ err_children:
+	return NULL;
+}
+
+/**
+ * Free child nodes
+ *
+ * @v node		Node
+ */
+static void node_free_children ( struct node *node ) {
+	struct node *child;
+	size_t i;
+
+	for ( i = 0 ; i < node->count ; i++ ) {
+		child = node->children[i];
+		node_free_children ( child );
+		free ( child->name );
+		free ( child );
+	}
+	free ( node->children );
+	node->children = NULL;
+	node->count = node->max = 0;
+}
+
+/**
+ * Compare nodes by name (for qsort())
+ *
+ * @v first		First node pointer
+ * @v second		Second node pointer
+ * @ret diff		Difference
+ */
+static int node_cmp ( const void *first, const void *second ) {
+	const struct node *node1 = *( ( const struct node ** ) first );
+	const struct node *node2 = *( ( const struct node ** ) second );
+
+	return index_name_cmp ( node1->name, node1->len,
+				node2->name, node2->len );
+}
+
+/**
+ * Mark directory as opaque
+ *
+ * @v builder		Index builder
+ * @v node		Directory node
+ * @v path		Directory path
+ * @v len		Length of directory path
+ * @v reason		Reason
+ */
+static void node_opaque ( struct builder *builder, struct node *node,
+			  const char *path, size_t len, const char *reason ) {
+
+	fprintf ( stderr, "Not indexing contents of \"%.*s\": %s\n",
+		  ( ( int ) len ), path, reason );
+	node->flags |= INDEX_NODE_OPAQUE;
+	__atomic_or_fetch ( &builder->flags, INDEX_OPAQUE, __ATOMIC_RELAXED );
+}
+
+/**
+ * Add directory entry
+ *
+ * @v dir		Directory being walked
+ * @v name		Name
+ * @v name_len		Length of name
+ * @v flags		Flags
+ * @v old		Entry's node in previous index (or NULL)
+ * @ret rc		Return status code
+ *
+ * Subdirectories are queued to be walked by the next available
+ * worker thread.
+ */
+static int builder_entry ( struct builder_dir *dir, const char *name,
+			   size_t name_len, unsigned int flags,
+			   const struct index_node *old ) {
+	struct builder *builder = dir->builder;
+	struct walk_job *job = dir->job;
+	size_t len = ( job->len + 1 /* '/' */ + name_len );
+	struct node *child;
+	char path[PATH_MAX];
+
+	/* Construct path */
+	if ( len >= PATH_MAX ) {
+		node_opaque ( builder, dir->node, job->path, job->len,
+			      "path too long" );
+		return 0;
+	}
+	memcpy ( path, job->path, job->len );
+	path[job->len] = '/';
+	memcpy ( &path[ job->len + 1 ], name, name_len );
+	path[len] = '\0';
+	if ( builder->verbose >= 2 )
+		printf ( "%s\n", path );
+
+	/* Add node */
+	child = node_add ( builder, dir->node, name, name_len, flags );
+	if ( ! child )
+		return -1;
+	child->hash = index_hash ( path, len );
+
+	/* Queue subdirectories */
+	if ( flags & INDEX_NODE_DIR ) {
+		child->old = old;
+		if ( walk_push ( dir->walker, dir->thread, job, name,
+				 name_len, child ) != 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Walk directory using directory entries from previous index
+ *
+ * @v dir		Directory being walked
+ * @ret rc		Return status code
+ */
+static int builder_previous ( struct builder_dir *dir ) {
+	struct builder *builder = dir->builder;
+	const struct index *previous = builder->previous;
+	const struct index_node *old = dir->node->old;
+	const struct index_node *entry;
+	uint32_t i;
+	int rc;
+
+	/* Reuse each entry from the previous index */
+	__atomic_add_fetch ( &builder->reused, 1, __ATOMIC_RELAXED );
+	for ( i = 0 ; i < old->count ; i++ ) {
+		entry = &previous->nodes[ old->children + i ];
+		if ( ( rc = builder_entry ( dir, &previous->names[entry->name],
+					    entry->len,
+					    ( entry->flags & INDEX_NODE_DIR ),
+					    entry ) ) != 0 )
+			return rc;
+	}
+
+	return 0;
+}
+
+/**
+ * Handle directory entry read from filesystem
+ *
+ * @v job		Directory walk job
+ * @v name		Name
+ * @v len		Length of name
+ * @v type		Entry type
+ * @v arg		Directory being walked
+ * @ret rc		Return status code
+ */
+static int builder_read_entry ( struct walk_job *job, const char *name,
+				size_t len, unsigned int type, void *arg ) {
+	struct builder_dir *dir = arg;
+	const struct index_node *old = dir->node->old;
+	const struct index_node *entry;
+	unsigned int flags;
+
+	/* Determine type, following symlinks if needed.  Directories
+	 * containing symlinks are always reread, since the symlink
+	 * targets may have changed.
+	 */
+	if ( ( type == WALK_LINK ) || ( type == WALK_UNKNOWN ) ) {
+		dir->node->flags |= INDEX_NODE_LINKS;
+		if ( walk_type ( job->fd, name, &type ) != 0 ) {
+			/* Dangling symlink: omit from index */
+			return 0;
+		}
+	}
+	flags = ( ( type == WALK_DIR ) ? INDEX_NODE_DIR : 0 );
+
+	/* Find corresponding subdirectory in previous index, if any */
+	entry = ( ( old && flags ) ?
+		  index_child ( dir->builder->previous, old, name, len ) :
+		  NULL );
+	if ( entry && ! ( entry->flags & INDEX_NODE_DIR ) )
+		entry = NULL;
+
+	return builder_entry ( dir, name, len, flags, entry );
+}
+
+/**
+ * Visit directory
+ *
+ * @v walker		Walker
+ * @v thread		Worker thread index
+ * @v job		Directory walk job
+ * @ret rc		Return status code
+ *
+ * Symbolic links are followed (with loop detection), since the
+ * interception library's existence check uses access(), which also
+ * follows symbolic links.  Dangling symbolic links are omitted from
+ * the index.  Directories that cannot be read are marked as opaque,
+ * and lookups within them will fall back to using access().
+ *
+ * If the directory's inode and modification time are unchanged since
+ * the previous index was built, then its entries are taken from the
+ * previous index instead of being read from the filesystem.
+ */
+static int builder_visit ( struct walker *walker, unsigned int thread,
+			   struct walk_job *job ) {
+	struct builder *builder = walker->priv;
+	struct node *node = job->context;
+	const struct index_node *old = node->old;
+	const struct index_stamp *stamp;
+	struct builder_dir dir;
+	struct walk_stamp st;
+	struct node *ancestor;
+	int rc;
+
+	/* Mark directory as opaque if it could not be opened */
+	if ( job->fd < 0 ) {
+		node_opaque ( builder, node, job->path, job->len,
+			      strerror ( errno ) );
+		return 0;
+	}
+
+	/* Check for symlink loops.  Each ancestor's stamp was recorded
+	 * before this directory was queued.
+	 */
+	if ( walk_get_stamp ( job->fd, &st ) != 0 )
+		return -1;
+	for ( ancestor = node->parent ; ancestor ;
+	      ancestor = ancestor->parent ) {
+		if ( ( ancestor->stamp.dev == st.dev ) &&
+		     ( ancestor->stamp.ino == st.ino ) ) {
+			node_opaque ( builder, node, job->path, job->len,
+				      "symlink loop" );
+			return 0;
+		}
+	}
+
+	/* Record directory stamp */
+	node->stamp.dev = st.dev;
+	node->stamp.ino = st.ino;
+	node->stamp.mtime = st.mtime;
+	node->stamp.mtime_nsec = st.mtime_nsec;
+
+	/* Reuse entries from previous index if directory is unchanged */
+	dir.builder = builder;
+	dir.walker = walker;
+	dir.thread = thread;
+	dir.job = job;
+	dir.node = node;
+	stamp = ( old ? index_find_stamp ( builder->previous, old ) : NULL );
+	if ( stamp && ( stamp->dev == node->stamp.dev ) &&
+	     ( stamp->ino == node->stamp.ino ) &&
+	     ( stamp->mtime == node->stamp.mtime ) &&
+	     ( stamp->mtime_nsec == node->stamp.mtime_nsec ) &&
+	     ( ! ( old->flags & ( INDEX_NODE_OPAQUE |
+				  INDEX_NODE_LINKS ) ) ) ) {
+		return builder_previous ( &dir );
+	}
+
+	/* Otherwise, read directory entries */
+	__atomic_add_fetch ( &builder->read, 1, __ATOMIC_RELAXED );
+	if ( ( rc = walk_read ( job, builder_read_entry, &dir ) ) != 0 ) {
+		if ( ( rc != -1 ) || ( errno == ENOMEM ) )
+			return rc;
+		node_opaque ( builder, node, job->path, job->len,
+			      strerror ( errno ) );
+	}
+
+	return 0;
+}
+
+/**
+ * Add path hashes to membership filter
+ *
+ * @v node		Node
+ * @v blocks		Filter blocks
+ * @v nblocks		Number of filter blocks
+ */
+static void node_filter ( struct node *node,
+			  struct index_filter_block *blocks,
+			  uint32_t nblocks ) {
+	size_t i;
+
+	index_filter_add ( blocks, nblocks, node->hash );
+	for ( i = 0 ; i < node->count ; i++ )
+		node_filter ( node->children[i], blocks, nblocks );
+}
+
+/**
+ * Append section to index file
+ *
+ * @v builder		Index builder
+ * @v section		Section descriptor to fill in
+ * @v data		Section data, or NULL to zero-fill
+ * @v len		Length of section data
+ * @ret ptr		Section data within index file, or NULL on error
+ *
+ * The returned pointer is valid only until the next section is
+ * appended.
+ */
+static void * builder_append ( struct builder *builder,
+			       struct index_section *section,
+			       const void *data, size_t len ) {
+	size_t offset;
+	char *new;
+
+	/* Align section */
+	offset = ( ( builder->len + INDEX_ALIGN - 1 ) & ~( INDEX_ALIGN - 1 ) );
+
+	/* Extend file */
+	new = realloc ( builder->data, ( offset + len ) );
+	if ( ! new )
+		return NULL;
+	builder->data = new;
+	memset ( ( new + builder->len ), 0, ( offset - builder->len ) );
+	if ( data ) {
+		memcpy ( ( new + offset ), data, len );
+	} else {
+		memset ( ( new + offset ), 0, len );
+	}
+	builder->len = ( offset + len );
+
+	/* Fill in section descriptor, if applicable */
+	if ( section ) {
+		section->offset = offset;
+		section->len = len;
+	}
+
+	return ( new + offset );
+}
+
+/**
+ * Add name to deduplicated name table
+ *
+ * @v builder		Index builder
+ * @v name		Name
+ * @v len		Length of name (must be non-zero)
+ * @v offset		Offset within name table to fill in
+ * @ret rc		Return status code
+ */
+static int builder_name ( struct builder *builder, const char *name,
+			  size_t len, uint32_t *offset ) {
+	struct name_entry *entry;
+	size_t mask = ( builder->entries_max - 1 );
+	size_t max;
+	size_t i;
+	char *names;
+
+	/* Find existing name or empty entry */
+	for ( i = index_hash ( name, len ) ; ; i++ ) {
+		entry = &builder->entries[ i & mask ];
+		if ( ! entry->len )
+			break;
+		if ( ( entry->len == len ) &&
+		     ( memcmp ( &builder->names[entry->offset], name,
+				len ) == 0 ) ) {
+			*offset = entry->offset;
+			return 0;
+		}
+	}
+
+	/* Grow name table if necessary */
+	if ( ( builder->names_len + len ) > builder->names_max ) {
+		max = ( builder->names_max ? ( builder->names_max * 2 ) :
+			65536 );
+		if ( max < ( builder->names_len + len ) )
+			max = ( builder->names_len + len );
+		if ( max > UINT32_MAX ) {
+			errno = EFBIG;
+			return -1;
+		}
+		names = realloc ( builder->names, max );
+		if ( ! names )
+			return -1;
+		builder->names = names;
+		builder->names_max = max;
+	}
+
+	/* Add name */
+	memcpy ( &builder->names[builder->names_len], name, len );
+	entry->offset = builder->names_len;
+	entry->len = len;
+	builder->names_len += len;
+	*offset = entry->offset;
+
+	return 0;
+}
+
+/**
+ * Construct path component tree
+ *
+ * @v builder		Index builder
+ * @v hdr		Index file header
+ * @ret rc		Return status code
+ */
+static int builder_tree ( struct builder *builder,
+			  struct index_header *hdr ) {
+	struct index_stamp *stamps;
+	struct index_node *nodes;
+	struct node **queue;
+	struct node *node;
+	size_t nstamps = 0;
+	size_t tail;
+	size_t i;
+	size_t j;
+	int rc;
+
+	/* Check that node indices will fit */
+	if ( builder->nnodes > UINT32_MAX ) {
+		errno = EFBIG;
+		rc = -1;
+		goto err_nnodes;
+	}
+
+	/* Allocate breadth-first queue, node and stamp arrays, and name
+	 * hash table.
+	 */
+	queue = calloc ( builder->nnodes, sizeof ( queue[0] ) );
+	nodes = calloc ( builder->nnodes, sizeof ( nodes[0] ) );
+	stamps = calloc ( builder->nnodes, sizeof ( stamps[0] ) );
+	for ( builder->entries_max = 1 ;
+	      builder->entries_max < ( 2 * builder->nnodes ) ;
+	      builder->entries_max <<= 1 ) {}
+	builder->entries = calloc ( builder->entries_max,
+				    sizeof ( builder->entries[0] ) );
+	if ( ! ( queue && nodes && stamps && builder->entries ) ) {
+		rc = -1;
+		goto err_alloc;
+	}
+
+	/* Lay out nodes in breadth-first order.  The position of each
+	 * node within the queue is its index within the node array.
+	 */
+	queue[0] = &builder->root;
+	tail = 1;
+	for ( i = 0 ; i < tail ; i++ ) {
+		node = queue[i];
+		nodes[i].len = node->len;
+		nodes[i].flags = node->flags;
+		if ( node->len &&
+		     ( ( rc = builder_name ( builder, node->name, node->len,
+					     &nodes[i].name ) ) != 0 ) )
+			goto err_name;
+		qsort ( node->children, node->count,
+			sizeof ( node->children[0] ), node_cmp );
+		nodes[i].children = tail;
+		nodes[i].count = node->count;
+		for ( j = 0 ; j < node->count ; j++ )
+			queue[tail++] = node->children[j];
+		if ( node->stamp.ino ) {
+			memcpy ( &stamps[nstamps], &node->stamp,
+				 sizeof ( stamps[0] ) );
+			stamps[nstamps++].node = i;
+		}
+	}
+
+	/* Append node array, name table, and directory stamps */
+	if ( ( ! builder_append ( builder, &hdr->nodes, nodes,
+				  ( builder->nnodes *
+				    sizeof ( nodes[0] ) ) ) ) ||
+	     ( ! builder_append ( builder, &hdr->names, builder->names,
+				  builder->names_len ) ) ||
+	     ( ! builder_append ( builder, &hdr->stamps, stamps,
+				  ( nstamps * sizeof ( stamps[0] ) ) ) ) ) {
+		rc = -1;
+		goto err_append;
+	}
+	rc = 0;
+
+ err_append:
+ err_name:
+ err_alloc:
+	free ( builder->entries );
+	builder->entries = NULL;
+	free ( stamps );
+	free ( nodes );
+	free ( queue );
+ err_nnodes:
+	return rc;
+}
+
+/**
+ * Construct index file contents
+ *
+ * @v builder		Index builder
+ * @v root		Indexed root directory
+ * @v bits		Number of membership filter bits per path
+ * @v tree		Include path component tree
+ * @ret rc		Return status code
+ */
+static int builder_finish ( struct builder *builder, const char *root,
+			    unsigned int bits, int tree ) {
+	struct index_header hdr;
+	struct index_filter_block *blocks;
+	struct timespec now;
+	uint32_t nblocks;
+
+	/* Reserve space for header */
+	memset ( &hdr, 0, sizeof ( hdr ) );
+	if ( ! builder_append ( builder, NULL, NULL, sizeof ( hdr ) ) )
+		return -1;
+
+	/* Append root directory */
+	if ( ! builder_append ( builder, &hdr.root, root,
+				( strlen ( root ) + 1 /* NUL */ ) ) )
+		return -1;
+
+	/* Construct membership filter */
+	nblocks = index_filter_blocks ( builder->nnodes, bits );
+	blocks = builder_append ( builder, &hdr.filter, NULL,
+				  ( nblocks * sizeof ( blocks[0] ) ) );
+	if ( ! blocks )
+		return -1;
+	node_filter ( &builder->root, blocks, nblocks );
+
+	/* Construct path component tree, if applicable */
+	if ( tree && ( builder_tree ( builder, &hdr ) != 0 ) )
+		return -1;
+	if ( ( builder->flags & INDEX_OPAQUE ) && ! tree ) {
+		fprintf ( stderr, "Warning: filter-only index with opaque "
+			  "directories will not be used\n" );
+	}
+
+	/* Construct header */
+	memcpy ( hdr.magic, INDEX_MAGIC, sizeof ( hdr.magic ) );
+	hdr.version = INDEX_VERSION;
+	hdr.bom = INDEX_BOM;
+	hdr.size = builder->len;
+	hdr.count = builder->nnodes;
+	hdr.flags = builder->flags;
+	clock_gettime ( CLOCK_REALTIME, &now );
+	hdr.generation = ( ( now.tv_sec * 1000000000ULL ) + now.tv_nsec );
+	memcpy ( builder->data, &hdr, sizeof ( hdr ) );
+
+	if ( builder->verbose ) {
+		fprintf ( stderr, "Indexed %zd paths in %zd bytes "
+			  "(%d filter blocks, %zd tree bytes)\n",
+			  builder->nnodes, builder->len, nblocks,
+			  ( hdr.nodes.len + hdr.names.len ) );
+	}
+
+	return 0;
+}
+
+/**
+ * Write index file atomically
+ *
+ * @v builder		Index builder
+ * @v filename		Index file name
+ * @ret rc		Return status code
+ */
+static int builder_write ( struct builder *builder, const char *filename ) {
+	const char *data = builder->data;
+	size_t remaining = builder->len;
+	char *tmpname;
+	ssize_t len;
+	int fd;
+
+	/* Create temporary file alongside index file */
+	if ( asprintf ( &tmpname, "%s.XXXXXX", filename ) < 0 )
+		goto err_asprintf;
+	fd = mkstemp ( tmpname );
+	if ( fd < 0 )
+		goto err_mkstemp;
+	if ( fchmod ( fd, 0644 ) != 0 )
+		goto err_fchmod;
+
+	/* Write contents */
+	while ( remaining ) {
+		len = write ( fd, data, remaining );
+		if ( len < 0 ) {
+			if ( errno == EINTR )
+				continue;
+			goto err_write;
+		}
+		data += len;
+		remaining -= len;
+	}
+	if ( fsync ( fd ) != 0 )
+		goto err_fsync;
+
+	/* Replace index file */
+	if ( rename ( tmpname, filename ) != 0 )
+		goto err_rename;
+
+	close ( fd );
+	free ( tmpname );
+	return 0;
+
+ err_rename:
+ err_fsync:
+ err_write:
+ err_fchmod:
+	close ( fd );
+	unlink ( tmpname );
+ err_mkstemp:
+	free ( tmpname );
+ err_asprintf:
+	return -1;
+}
+
+/**
+ * Print usage information
+ *
+ * @v argv0		Program name
+ */
+static void usage ( const char *argv0 ) {
+
+	fprintf ( stderr, "Usage: %s [-v] [-f] [-b <bits>] [-j <threads>] "
+		  "[-p <previous>] <dir> <index>\n"
+		  "\n"
+		  "Build an index of the readonly directory <dir>\n"
+		  "\n"
+		  "  -b <bits>   Membership filter bits per path "
+		  "(default %d)\n"
+		  "  -f          Omit path component tree (filter only)\n"
+		  "  -j <count>  Number of walker threads (default %d)\n"
+		  "  -p <file>   Update incrementally from previous index\n"
+		  "  -v          Increase verbosity\n",
+		  argv0, INDEX_FILTER_BITS, walk_default_threads() );
+}
+
+int main ( int argc, char **argv ) {
+	struct builder builder;
+	struct walker walker;
+	struct index previous;
+	const struct index_node *old = NULL;
+	const char *previous_name = NULL;
+	unsigned int bits = INDEX_FILTER_BITS;
+	struct timespec start;
+	struct timespec end_time;
+	int tree = 1;
+	char *root;
+	char *end;
+	int fd;
+	int c;
+
+	/* Parse command line */
+	memset ( &builder, 0, sizeof ( builder ) );
+	memset ( &walker, 0, sizeof ( walker ) );
+	walker.threads = walk_default_threads();
+	while ( ( c = getopt ( argc, argv, "b:fj:p:vh" ) ) != -1 ) {
+		switch ( c ) {
+		case 'b':
+			bits = strtoul ( optarg, &end, 0 );
+			if ( ( *end ) || ( bits < 1 ) || ( bits > 64 ) ) {
+				fprintf ( stderr, "Invalid bits: %s\n",
+					  optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'f':
+			tree = 0;
+			break;
+		case 'j':
+			walker.threads = strtoul ( optarg, &end, 0 );
+			if ( ( *end ) || ( walker.threads < 1 ) ) {
+				fprintf ( stderr, "Invalid threads: %s\n",
+					  optarg );
+				exit ( EXIT_FAILURE );
+			}
+			break;
+		case 'p':
+			previous_name = optarg;
+			break;
+		case 'v':
+			builder.verbose++;
+			break;
+		case 'h':
+			usage ( argv[0] );
+			exit ( EXIT_SUCCESS );
+		default:
+			usage ( argv[0] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	if ( ( argc - optind ) != 2 ) {
+		usage ( argv[0] );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* Canonicalise root directory */
+	root = realpath ( argv[optind], NULL );
+	if ( ! root ) {
+		perror ( argv[optind] );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* Map previous index, if applicable.  The previous index is
+	 * usable only if it was built for the same root directory and
+	 * includes a well-formed path component tree.  An unusable
+	 * previous index is ignored, and the index is built in full.
+	 */
+	if ( previous_name ) {
+		if ( index_map ( &previous, previous_name ) != 0 ) {
+			fprintf ( stderr, "Ignoring previous index %s: %s\n",
+				  previous_name, strerror ( errno ) );
+		} else if ( ( strcmp ( previous.root, root ) != 0 ) ||
+			    ( ! previous.nnodes ) ) {
+			fprintf ( stderr, "Ignoring unsuitable previous index "
+				  "%s\n", previous_name );
+			index_unmap ( &previous );
+		} else if ( index_check_tree ( &previous ) != 0 ) {
+			fprintf ( stderr, "Ignoring previous index %s: %s\n",
+				  previous_name, strerror ( errno ) );
+			index_unmap ( &previous );
+		} else {
+			builder.previous = &previous;
+			old = &previous.nodes[0];
+		}
+	}
+
+	/* Walk root directory, including the root directory itself */
+	clock_gettime ( CLOCK_MONOTONIC, &start );
+	fd = openat ( AT_FDCWD, root, ( O_PATH | O_DIRECTORY | O_CLOEXEC ) );
+	if ( fd < 0 ) {
+		perror ( root );
+		exit ( EXIT_FAILURE );
+	}
+	builder.root.flags = INDEX_NODE_DIR;
+	builder.root.hash = index_hash ( "", 0 );
+	builder.root.old = old;
+	builder.nnodes = 1;
+	walker.visit = builder_visit;
+	walker.priv = &builder;
+	if ( walk_tree ( &walker, fd, &builder.root ) != 0 ) {
+		perror ( root );
+		exit ( EXIT_FAILURE );
+	}
+	close ( fd );
+	clock_gettime ( CLOCK_MONOTONIC, &end_time );
+	if ( builder.verbose ) {
+		fprintf ( stderr, "Read %lu directories and reused %lu "
+			  "directories in %.3fs using %u threads\n",
+			  builder.read, builder.reused,
+			  ( ( end_time.tv_sec - start.tv_sec ) +
+			    ( ( end_time.tv_nsec - start.tv_nsec ) / 1e9 ) ),
+			  walker.threads );
+	}
+
+	/* Construct and write index file */
+	if ( ( builder_finish ( &builder, root, bits, tree ) != 0 ) ||
+	     ( builder_write ( &builder, argv[ optind + 1 ] ) != 0 ) ) {
+		perror ( argv[ optind + 1 ] );
+		exit ( EXIT_FAILURE );
+	}
+
+	if ( builder.previous )
+		index_unmap ( builder.previous );
+	node_free_children ( &builder.root );
+	free ( builder.names );
+	free ( builder.data );
+	free ( root );
+	return 0;
+}
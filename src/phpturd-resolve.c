@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "explain.h"
+
+/**
+ * Print usage information
+ *
+ * @v argv0		Program name
+ */
+static void usage ( const char *argv0 ) {
+
+	fprintf ( stderr, "Usage: %s [-c] [<path>...]\n"
+		  "\n"
+		  "Explain resolution of paths using the PHPTURD "
+		  "environment variables\n"
+		  "\n"
+		  "  -c          Resolve as for file creation (creating "
+		  "any\n"
+		  "              intermediate writable directories)\n"
+		  "\n"
+		  "If no paths are given, paths are read from standard "
+		  "input (one per line).\n"
+		  "Caches persist across paths within a single "
+		  "invocation.\n", argv0 );
+}
+
+int main ( int argc, char **argv ) {
+	char *line = NULL;
+	size_t max = 0;
+	ssize_t len;
+	int create = 0;
+	int rc = 0;
+	int c;
+
+	/* Parse command line */
+	while ( ( c = getopt ( argc, argv, "ch" ) ) != -1 ) {
+		switch ( c ) {
+		case 'c':
+			create = 1;
+			break;
+		case 'h':
+			usage ( argv[0] );
+			exit ( EXIT_SUCCESS );
+		default:
+			usage ( argv[0] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+
+	/* Explain paths from command line, if any */
+	if ( optind < argc ) {
+		for ( ; optind < argc ; optind++ ) {
+			if ( phpturd_explain ( argv[optind], create,
+					       stdout ) != 0 )
+				rc = 1;
+			printf ( "\n" );
+		}
+		return rc;
+	}
+
+	/* Otherwise, explain paths from standard input */
+	while ( ( len = getline ( &line, &max, stdin ) ) >= 0 ) {
+		if ( len && ( line[ len - 1 ] == '\n' ) )
+			line[ --len ] = '\0';
+		if ( ! len )
+			continue;
+		if ( phpturd_explain ( line, create, stdout ) != 0 )
+			rc = 1;
+		printf ( "\n" );
+	}
+	free ( line );
+
+	return rc;
+}
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include "trace.h"
+
+/** Trace event names */
+static const char *events[TRACE_EVENTS] = {
+	[TRACE_RESOLVE] = "resolve",
+	[TRACE_PROBE] = "probe",
+	[TRACE_MKDIR] = "mkdir",
+};
+
+/** Trace decision names */
+static const char *decisions[TRACE_DECISIONS] = {
+	[TRACE_NOPREFIX] = "noprefix",
+	[TRACE_DIST] = "dist",
+	[TRACE_SCRATCH] = "scratch",
+	[TRACE_OK] = "ok",
+	[TRACE_FAILED] = "failed",
+};
+
+/** A decoded trace record */
+struct entry {
+	/** Trace record */
+	struct trace_record record;
+	/** Trace file header */
+	const struct trace_header *hdr;
+	/** Thread identifier */
+	unsigned int tid;
+	/** Path (or empty if overwritten) */
+	char *path;
+};
+
+/** Decoded trace records */
+static struct entry *entries;
+
+/** Number of decoded trace records */
+static size_t count;
+
+/** Number of allocated decoded trace records */
+static size_t max;
+
+/**
+ * Look up name within table
+ *
+ * @v names		Name table
+ * @v len		Length of name table
+ * @v index		Index
+ * @ret name		Name
+ */
+static const char * lookup ( const char **names, unsigned int len,
+			     unsigned int index ) {
+
+	return ( ( ( index < len ) && names[index] ) ? names[index] : "?" );
+}
+
+/**
+ * Decode all records within a trace file
+ *
+ * @v trace		Trace file
+ * @ret rc		Return status code
+ */
+static int decode ( struct trace *trace ) {
+	const struct trace_header *hdr = trace->hdr;
+	struct trace_ring *ring;
+	struct entry *entry;
+	char path[ TRACE_PATH_LEN + 1 ];
+	uint64_t head;
+	uint64_t seq;
+	unsigned int used;
+	unsigned int i;
+
+	/* Decode each claimed ring */
+	used = __atomic_load_n ( &hdr->used, __ATOMIC_RELAXED );
+	if ( used > hdr->rings )
+		used = hdr->rings;
+	for ( i = 0 ; i < used ; i++ ) {
+		ring = &trace->rings[i];
+		head = __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE );
+		seq = ( ( head > TRACE_RECORDS ) ?
+			( head - TRACE_RECORDS ) : 0 );
+		for ( ; seq < head ; seq++ ) {
+
+			/* Grow record list if necessary */
+			if ( count == max ) {
+				max = ( max ? ( max * 2 ) : 1024 );
+				entry = realloc ( entries, ( max *
+						sizeof ( entries[0] ) ) );
+				if ( ! entry )
+					return -1;
+				entries = entry;
+			}
+
+			/* Decode record, skipping overwritten records */
+			entry = &entries[count];
+			if ( trace_read ( ring, seq, &entry->record,
+					  path ) != 0 )
+				continue;
+			entry->hdr = hdr;
+			entry->tid = ring->tid;
+			entry->path = strdup ( path );
+			if ( ! entry->path )
+				return -1;
+			count++;
+		}
+	}
+
+	/* Report lost records */
+	if ( hdr->lost ) {
+		fprintf ( stderr, "Process %u lost %u records (too many "
+			  "threads)\n", hdr->pid, hdr->lost );
+	}
+
+	return 0;
+}
+
+/**
+ * Compare decoded trace records by time
+ *
+ * @v first		First decoded trace record
+ * @v second		Second decoded trace record
+ * @ret diff		Difference
+ */
+static int compare ( const void *first, const void *second ) {
+	const struct entry *a = first;
+	const struct entry *b = second;
+	uint64_t atime = ( a->hdr->epoch + a->record.time );
+	uint64_t btime = ( b->hdr->epoch + b->record.time );
+
+	return ( ( atime > btime ) - ( atime < btime ) );
+}
+
+/**
+ * Format time
+ *
+ * @v entry		Decoded trace record
+ * @v buf		Buffer to fill in
+ * @v len		Length of buffer
+ */
+static void format_time ( const struct entry *entry, char *buf,
+			  size_t len ) {
+	uint64_t time = ( entry->hdr->epoch + entry->record.time );
+	time_t secs = ( time / 1000000000ULL );
+	unsigned long nsecs = ( time % 1000000000ULL );
+	struct tm tm;
+	size_t used;
+
+	localtime_r ( &secs, &tm );
+	used = strftime ( buf, len, "%Y-%m-%dT%H:%M:%S", &tm );
+	snprintf ( ( buf + used ), ( len - used ), ".%09lu", nsecs );
+}
+
+/**
+ * Print path as JSON string
+ *
+ * @v path		Path
+ */
+static void print_json_string ( const char *path ) {
+	unsigned char c;
+
+	putchar ( '"' );
+	while ( ( c = *(path++) ) ) {
+		if ( ( c == '"' ) || ( c == '\\' ) ) {
+			printf ( "\\%c", c );
+		} else if ( c < 0x20 ) {
+			printf ( "\\u%04x", c );
+		} else {
+			putchar ( c );
+		}
+	}
+	putchar ( '"' );
+}
+
+/**
+ * Print decoded trace record
+ *
+ * @v entry		Decoded trace record
+ * @v json		Print as JSON
+ */
+static void print ( const struct entry *entry, int json ) {
+	const struct trace_record *record = &entry->record;
+	const struct trace_header *hdr = entry->hdr;
+	char time[64];
+	const char *func;
+	const char *event;
+	const char *decision;
+
+	/* Look up names */
+	format_time ( entry, time, sizeof ( time ) );
+	func = ( ( record->func < hdr->funcs ) ?
+		 hdr->names[record->func] : "?" );
+	event = lookup ( events, TRACE_EVENTS, record->event );
+	decision = lookup ( decisions, TRACE_DECISIONS, record->decision );
+
+	/* Print record */
+	if ( json ) {
+		printf ( "{\"time\":\"%s\",\"pid\":%u,\"tid\":%u,"
+			 "\"func\":\"%s\",\"event\":\"%s\","
+			 "\"decision\":\"%s\",\"layer\":%u,\"duration\":%u,"
+			 "\"hash\":\"%08x\",\"path\":", time, hdr->pid,
+			 entry->tid, func, event, decision, record->layer,
+			 record->duration, record->hash );
+		print_json_string ( entry->path );
+		printf ( "}\n" );
+	} else {
+		printf ( "%s %u/%u %s %s %s", time, hdr->pid, entry->tid,
+			 func, event, decision );
+		if ( record->layer )
+			printf ( ":%u", record->layer );
+		printf ( " %uns %08x %s\n", record->duration, record->hash,
+			 ( entry->path[0] ? entry->path : "-" ) );
+	}
+}
+
+/**
+ * Print usage information
+ *
+ * @v argv0		Program name
+ */
+static void usage ( const char *argv0 ) {
+
+	fprintf ( stderr, "Usage: %s [-j] <trace file>...\n"
+		  "\n"
+		  "Decode binary trace files\n"
+		  "\n"
+		  "  -j          Print records as JSON (one per line)\n",
+		  argv0 );
+}
+
+int main ( int argc, char **argv ) {
+	struct trace *traces;
+	unsigned int files;
+	unsigned int i;
+	size_t j;
+	int json = 0;
+	int c;
+
+	/* Parse command line */
+	while ( ( c = getopt ( argc, argv, "jh" ) ) != -1 ) {
+		switch ( c ) {
+		case 'j':
+			json = 1;
+			break;
+		case 'h':
+			usage ( argv[0] );
+			exit ( EXIT_SUCCESS );
+		default:
+			usage ( argv[0] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	if ( optind == argc ) {
+		usage ( argv[0] );
+		exit ( EXIT_FAILURE );
+	}
+	files = ( argc - optind );
+
+	/* Open and decode trace files */
+	traces = calloc ( files, sizeof ( traces[0] ) );
+	if ( ! traces ) {
+		perror ( "calloc" );
+		exit ( EXIT_FAILURE );
+	}
+	for ( i = 0 ; i < files ; i++ ) {
+		if ( trace_open ( &traces[i], argv[ optind + i ] ) != 0 ) {
+			perror ( argv[ optind + i ] );
+			exit ( EXIT_FAILURE );
+		}
+		if ( decode ( &traces[i] ) != 0 ) {
+			perror ( argv[ optind + i ] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+
+	/* Print records in time order */
+	qsort ( entries, count, sizeof ( entries[0] ), compare );
+	for ( j = 0 ; j < count ; j++ )
+		print ( &entries[j], json );
+
+	return 0;
+}
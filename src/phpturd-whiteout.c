@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include "index.h"
+#include "whiteout.h"
+
+/** Turd directory environment variable */
+#define PHPTURD "PHPTURD"
+
+/** Whiteout file environment variable */
+#define PHPTURD_WHITEOUT "PHPTURD_WHITEOUT"
+
+/** Namespace selection */
+struct namespace {
+	/** Namespace */
+	uint64_t ns;
+	/** Namespace is selected */
+	int selected;
+};
+
+/**
+ * Print usage information
+ *
+ * @v argv0		Program name
+ */
+static void usage ( const char *argv0 ) {
+
+	fprintf ( stderr, "Usage: %s [-c] [-r] [-f <file>] [-w <dir>] "
+		  "[<path>...]\n"
+		  "\n"
+		  "List or manage phpturd whiteouts\n"
+		  "\n"
+		  "  -f <file>   Whiteout file (default: $PHPTURD_WHITEOUT)\n"
+		  "  -w <dir>    Writable directory identifying the mapping\n"
+		  "              (default: last directory in $PHPTURD)\n"
+		  "  -r          Remove whiteouts for the given paths\n"
+		  "  -c          Compact the whiteout file\n"
+		  "\n"
+		  "Paths are relative to the readonly directories, as "
+		  "listed.  If no mapping\n"
+		  "is identified, whiteouts for all mappings are listed "
+		  "with their namespace.\n", argv0 );
+}
+
+/**
+ * Print whiteout
+ *
+ * @v ns		Namespace
+ * @v path		Path relative to readonly directory
+ * @v len		Length of path
+ * @v arg		Namespace selection
+ * @ret rc		Return status code
+ */
+static int print ( uint64_t ns, const char *path, size_t len, void *arg ) {
+	struct namespace *namespace = arg;
+
+	if ( ! namespace->selected ) {
+		printf ( "%016llx ", ( ( unsigned long long ) ns ) );
+	} else if ( ns != namespace->ns ) {
+		return 0;
+	}
+	printf ( "%.*s\n", ( ( int ) len ), path );
+	return 0;
+}
+
+int main ( int argc, char **argv ) {
+	struct namespace namespace = { 0, 0 };
+	struct whiteouts whiteouts;
+	const char *filename;
+	const char *path;
+	const char *dir;
+	int compact = 0;
+	int remove = 0;
+	int rc = 0;
+	int c;
+
+	/* Parse command line */
+	filename = getenv ( PHPTURD_WHITEOUT );
+	dir = getenv ( PHPTURD );
+	if ( dir && strrchr ( dir, ':' ) )
+		dir = ( strrchr ( dir, ':' ) + 1 );
+	while ( ( c = getopt ( argc, argv, "crf:w:h" ) ) != -1 ) {
+		switch ( c ) {
+		case 'c':
+			compact = 1;
+			break;
+		case 'r':
+			remove = 1;
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		case 'w':
+			dir = optarg;
+			break;
+		case 'h':
+			usage ( argv[0] );
+			exit ( EXIT_SUCCESS );
+		default:
+			usage ( argv[0] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	if ( ( ! filename ) || ( ( optind < argc ) && ! remove ) ||
+	     ( remove && ( ( optind == argc ) || ( ! dir ) ) ) ) {
+		usage ( argv[0] );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* Identify namespace, if applicable (as for the interception
+	 * library, this is the hash of the writable directory).
+	 */
+	if ( dir ) {
+		namespace.ns = index_hash ( dir, strlen ( dir ) );
+		namespace.selected = 1;
+	}
+
+	/* Open whiteout file */
+	if ( whiteout_open ( &whiteouts, filename ) != 0 ) {
+		perror ( filename );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* Remove whiteouts, if applicable */
+	if ( remove ) {
+		for ( ; optind < argc ; optind++ ) {
+			path = argv[optind];
+			if ( whiteout_remove ( &whiteouts, namespace.ns, path,
+					       strlen ( path ) ) != 0 ) {
+				perror ( path );
+				rc = 1;
+			}
+		}
+	}
+
+	/* Compact whiteout file, if applicable */
+	if ( compact && ( whiteout_compact ( &whiteouts ) != 0 ) ) {
+		perror ( filename );
+		exit ( EXIT_FAILURE );
+	}
+
+	/* List whiteouts, if no other action was requested */
+	if ( ! ( remove || compact ) )
+		whiteout_list ( &whiteouts, print, &namespace );
+
+	return rc;
+}
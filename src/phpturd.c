@@ -18,26 +18,103 @@
  */
 
 #define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
 #include <utime.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <glob.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/xattr.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <selinux/selinux.h>
 #include <dlfcn.h>
+#include <execinfo.h>
+#include "index.h"
+#include "cache.h"
+#include "walk.h"
+#include "dirlist.h"
+#include "whiteout.h"
+#include "prefix.h"
+#include "route.h"
+#include "fold.h"
+#include "stats.h"
+#include "trace.h"
+#include "probe.h"
+#include "explain.h"
 
 /** Environment variable name */
 #define PHPTURD "PHPTURD"
 
+/** Index environment variable name */
+#define PHPTURD_INDEX PHPTURD "_INDEX"
+
+/** Index check interval environment variable name */
+#define PHPTURD_INDEX_INTERVAL PHPTURD_INDEX "_INTERVAL"
+
+/** Cache size environment variable name */
+#define PHPTURD_CACHE PHPTURD "_CACHE"
+
+/** Warm-up thread count environment variable name */
+#define PHPTURD_WARMUP PHPTURD "_WARMUP"
+
+/** Whiteout file environment variable name */
+#define PHPTURD_WHITEOUT PHPTURD "_WHITEOUT"
+
+/** Configuration file environment variable name */
+#define PHPTURD_CONF PHPTURD "_CONF"
+
+/** Routing rules environment variable name */
+#define PHPTURD_ROUTES PHPTURD "_ROUTES"
+
+/** Case-insensitive mode environment variable name */
+#define PHPTURD_NOCASE PHPTURD "_NOCASE"
+
+/** Symlink-aware mode environment variable name */
+#define PHPTURD_SYMLINKS PHPTURD "_SYMLINKS"
+
+/** Latency sampling rate environment variable name */
+#define PHPTURD_SAMPLE PHPTURD "_SAMPLE"
+
+/** Trace level environment variable name */
+#define PHPTURD_TRACE PHPTURD "_TRACE"
+
+/** Trace file environment variable name */
+#define PHPTURD_TRACE_FILE PHPTURD_TRACE "_FILE"
+
+/** Request slow log environment variable name */
+#define PHPTURD_SLOWLOG PHPTURD "_SLOWLOG"
+
+/** Request slow log call threshold environment variable name */
+#define PHPTURD_SLOWLOG_CALLS PHPTURD_SLOWLOG "_CALLS"
+
+/** Request slow log time threshold environment variable name */
+#define PHPTURD_SLOWLOG_TIME PHPTURD_SLOWLOG "_TIME"
+
+/** Backtrace file environment variable name */
+#define PHPTURD_BACKTRACE PHPTURD "_BACKTRACE"
+
+/** Backtrace sampling rate environment variable name */
+#define PHPTURD_BACKTRACE_RATE PHPTURD_BACKTRACE "_RATE"
+
+/** Backtrace dump signal environment variable name */
+#define PHPTURD_BACKTRACE_SIGNAL PHPTURD_BACKTRACE "_SIGNAL"
+
 /** Enable debugging */
 #ifndef DEBUG
 #define DEBUG 0
@@ -59,6 +136,42 @@
  */
 #define MKDIR_MODE ( S_IRWXU | S_IRGRP | S_IXGRP )
 
+/** Create intermediate directories if needed */
+#define TURD_MKDIRS 0x0001
+
+/** Library call does not follow a symbolic link as the final component */
+#define TURD_NOFOLLOW 0x0004
+
+/** Maximum number of symbolic links followed in resolving a path */
+#define MAX_SYMLINKS 40
+
+/** Default symlink map memory budget (if no cache budget is specified) */
+#define SYMLINK_BUDGET ( 256 * 1024 )
+
+/** Default latency sampling rate (one in every N library calls) */
+#define SAMPLE_RATE 64
+
+/** Default trace file name prefix */
+#define TRACE_FILE "/tmp/phpturd-trace"
+
+/** Default request slow log call threshold */
+#define SLOWLOG_CALLS 10000
+
+/** Default request slow log time threshold (in milliseconds) */
+#define SLOWLOG_TIME 100
+
+/** Default backtrace sampling rate (one in every N library calls) */
+#define BACKTRACE_RATE 1000
+
+/** Maximum number of frames in a sampled backtrace */
+#define BACKTRACE_DEPTH 32
+
+/** Maximum number of frames within this library atop a backtrace */
+#define BACKTRACE_OWN 4
+
+/** Maximum number of distinct sampled backtraces (a power of two) */
+#define BACKTRACE_STACKS 4096
+
 /* Error return values */
 typedef char * char_ptr;
 typedef DIR * DIR_ptr;
@@ -73,6 +186,279 @@ typedef FILE * FILE_ptr;
 static int ( * orig_access ) ( const char *path, int mode );
 static int ( * orig_mkdir ) ( const char *path, mode_t mode );
 
+/* Fortified realpath() (declared only if _FORTIFY_SOURCE is defined) */
+extern char * __realpath_chk ( const char *path, char *resolved,
+			       size_t resolvedlen );
+
+/** A turd directory */
+struct layer {
+	/** Mapping containing this directory */
+	struct mapping *mapping;
+	/** Directory */
+	const char *path;
+	/** Length of directory */
+	size_t len;
+	/** Readonly directory index (if any) */
+	struct index_handle index;
+	/** Number of readonly directory index replacements seen */
+	unsigned long swaps;
+	/** Number of index replacements seen by case-folded name map */
+	unsigned long folded;
+};
+
+/** A turd mapping */
+struct mapping {
+	/** Readonly layers (in order of precedence) */
+	struct layer *layers;
+	/** Number of readonly layers */
+	unsigned int count;
+	/** Writable directory */
+	struct layer writable;
+	/** Whiteout namespace */
+	uint64_t ns;
+	/** Readonly directory existence cache */
+	struct cache cache;
+	/** Readonly directory listing cache */
+	struct cache listings;
+	/** Case-folded name map (if enabled) */
+	struct fold_map names;
+	/** Readonly directory symlink map */
+	struct cache links;
+	/** Readonly directory canonical path cache */
+	struct cache realpaths;
+	/** Shared statistics */
+	struct stats stats;
+};
+
+/** Turd mappings */
+static struct mapping **mappings;
+
+/** Number of turd mappings */
+static unsigned int mapping_count;
+
+/** All turd directories */
+static struct prefix_trie turd_dirs;
+
+/** Maximum length of any turd directory */
+static size_t max_prefix_len;
+
+/** Readonly directory whiteouts (if enabled) */
+static struct whiteouts readonly_whiteouts;
+
+/** Path routing rules */
+static struct routes routes;
+
+/** Case-insensitive mode flags */
+static unsigned int nocase;
+
+/** Case-insensitive mode includes readonly directories */
+#define NOCASE_READONLY 0x0001
+
+/** Case-insensitive mode includes writable directories */
+#define NOCASE_WRITABLE 0x0002
+
+/** Symlink-aware resolution is enabled */
+static int symlinks;
+
+/** Wrapped function names (for statistics) */
+static const char * const stats_funcs[] = {
+	"other", "__lxstat", "__realpath_chk", "__xstat", "access",
+	"canonicalize_file_name", "chdir", "chmod", "chown", "creat",
+	"fopen", "getfilecon", "getxattr", "glob", "glob64", "lchown",
+	"lgetfilecon", "lgetxattr", "link", "listxattr", "llistxattr",
+	"lremovexattr", "lsetxattr", "lstat", "mkdir", "mkostemp",
+	"mkostemps", "mkstemp", "mkstemps", "mktemp", "open", "opendir",
+	"phpturd_explain", "readlink", "realpath", "removexattr", "rename",
+	"rmdir", "scandir", "scandir64", "setxattr", "stat", "symlink",
+	"truncate", "unlink", "utime", "utimes",
+};
+
+/** Number of wrapped functions (for statistics) */
+#define STATS_FUNCS ( sizeof ( stats_funcs ) / sizeof ( stats_funcs[0] ) )
+
+/** Statistics for the current library call */
+struct turd_call {
+	/** Wrapped function index */
+	unsigned int func;
+	/** Thread identifier (or zero if not yet known) */
+	unsigned int tid;
+	/** Number of library calls until next sampled call */
+	unsigned int countdown;
+	/** Number of library calls until next sampled backtrace */
+	unsigned int btcountdown;
+	/** Latencies are being sampled for this call */
+	int sampled;
+	/** Mapping containing path (if known) */
+	struct mapping *mapping;
+	/** Trace ring (if claimed) */
+	struct trace_ring *ring;
+	/** Explanation output stream (if explaining resolution) */
+	FILE *explain;
+	/** Explanation start time (in nanoseconds) */
+	uint64_t explained;
+	/** Time spent writing explanation (in nanoseconds) */
+	uint64_t overhead;
+	/** Number of system calls issued while explaining */
+	unsigned int syscalls;
+};
+
+/** Latency sampling rate (or zero if sampling is disabled) */
+static unsigned int sample_rate;
+
+/** Statistics for the current library call within this thread */
+static __thread struct turd_call turd_call
+	__attribute__ (( tls_model ( "initial-exec" ) ));
+
+/** First-use initialisation */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/** Caller of first-use initialisation within this thread
+ *
+ * This is non-NULL only while the thread is performing (or waiting
+ * for) first-use initialisation.
+ */
+static __thread const char *init_func
+	__attribute__ (( tls_model ( "initial-exec" ) ));
+
+/** Trace level (or zero if tracing is disabled) */
+static unsigned int trace_level;
+
+/** Trace file name prefix */
+static const char *trace_prefix;
+
+/** Trace file for this process (if created) */
+static struct trace trace;
+
+/** Trace file creation lock */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Accounting for the current request */
+struct turd_request {
+	/** Connection file descriptor (or negative if not within a request) */
+	int fd;
+	/** Start time (in nanoseconds) */
+	uint64_t started;
+	/** Statistics events */
+	uint64_t counters[STATS_COUNTERS];
+	/** Readonly directory probes */
+	uint64_t probes;
+	/** Readonly directory probes answered by an index */
+	uint64_t indexed;
+	/** Time spent mapping paths (in nanoseconds) */
+	uint64_t time;
+};
+
+/** Accounting for the current request within this thread
+ *
+ * A request is accounted within the thread that accepted its
+ * connection (which is the only thread in a php-fpm worker), so that
+ * threads handling separate connections do not share accounting.
+ */
+static __thread struct turd_request request
+	__attribute__ (( tls_model ( "initial-exec" ) )) = { .fd = -1 };
+
+/** Request slow log file (or NULL if request accounting is disabled) */
+static const char *slowlog;
+
+/** Request slow log call threshold */
+static unsigned long slowlog_calls;
+
+/** Request slow log time threshold (in nanoseconds) */
+static uint64_t slowlog_time;
+
+/** A sampled backtrace */
+struct turd_stack {
+	/** Number of samples (or zero if unused) */
+	unsigned long count;
+	/** Wrapped function index */
+	unsigned int func;
+	/** Number of frames */
+	unsigned int depth;
+	/** Return addresses (innermost first) */
+	void *frames[BACKTRACE_DEPTH];
+};
+
+/** Backtrace file name prefix (or NULL if backtraces are disabled) */
+static const char *backtrace_prefix;
+
+/** Backtrace sampling rate */
+static unsigned int backtrace_rate;
+
+/** Base address of this library */
+static void *backtrace_base;
+
+/** Sampled backtraces (hash table) */
+static struct turd_stack *backtrace_stacks;
+
+/** Snapshot of sampled backtraces being written */
+static struct turd_stack *backtrace_snapshot;
+
+/** Number of samples */
+static unsigned long backtrace_samples;
+
+/** Number of samples discarded for lack of space */
+static unsigned long backtrace_dropped;
+
+/** Backtrace dump has been requested via a signal */
+static volatile sig_atomic_t backtrace_pending;
+
+/** Sampled backtrace lock */
+static pthread_mutex_t backtrace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Backtrace file writing lock (held while using the snapshot) */
+static pthread_mutex_t backtrace_dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** A union directory stream */
+struct union_dir {
+	/** Underlying directory stream */
+	DIR *dirp;
+	/** Merged directory listing */
+	struct dirlist list;
+	/** Offset of next entry within merged directory listing */
+	size_t offset;
+	/** Directory entry returned by readdir() */
+	struct dirent dirent;
+	/** Directory entry returned by readdir64() */
+	struct dirent64 dirent64;
+	/** Next union directory stream */
+	struct union_dir *next;
+};
+
+/** A union directory stream lookup slot */
+struct union_slot {
+	/** Underlying directory stream (or NULL if never used) */
+	DIR *dirp;
+	/** Union directory stream */
+	struct union_dir *udir;
+};
+
+/** Number of union directory stream lookup slots */
+#define UNION_SLOTS 64
+
+/** Underlying directory stream marking a lookup slot no longer in use */
+#define UNION_REMOVED ( ( DIR * ) 1 )
+
+/** Union directory stream lookup slots (open-addressed hash table)
+ *
+ * Lookups probe the slots without taking the lock.  A slot's stream
+ * is recorded only after its union directory stream, and a slot
+ * never reverts to being unused while streams remain open, so a probe
+ * may stop at the first unused slot.
+ */
+static struct union_slot union_slots[UNION_SLOTS];
+
+/** Open union directory streams not held in a lookup slot */
+static struct union_dir *union_dirs;
+
+/** Number of open union directory streams */
+static unsigned int union_count;
+
+/** Number of open union directory streams not held in a lookup slot */
+static unsigned int union_overflow;
+
+/** Union directory stream list lock */
+static pthread_mutex_t union_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Check if canonicalised path starts with a given prefix directory
  *
@@ -90,441 +476,3896 @@ static inline int path_starts_with ( const char *path, const char *prefix,
 }
 
 /**
- * Convert to a canonical absolute path (ignoring symlinks)
+ * Find turd directory containing path
  *
- * @v path		Path
- * @v func		Wrapped function name (for debugging)
- * @ret canonical	Canonical path, or NULL on error
+ * @v path		Canonicalised absolute path
+ * @ret layer		Turd directory, or NULL if not within a turd directory
  *
- * The caller is repsonsible for calling free() on the returned path.
+ * All turd directories are compiled into a single prefix trie, so
+ * the cost of finding the turd directory does not depend upon the
+ * number of turd mappings.
  */
-static char * canonical_path ( const char *path, const char *func ) {
-	size_t cwd_len;
-	size_t path_len;
-	char *cwd;
-	char *result;
-	const char *in;
-	char *out;
-	char c;
-
-	/* Get current working directory */
-	if ( path[0] != '/' ) {
-		cwd = getcwd ( NULL, 0 );
-		if ( ! cwd )
-			goto err_getcwd;
-		cwd_len = strlen ( cwd );
-	} else {
-		cwd = NULL;
-		cwd_len = 0;
-	}
-
-	/* Allocate result path */
-	path_len = strlen ( path );
-	result = malloc ( cwd_len + 1 /* '/' */ + path_len + 1 /* NUL */ );
-	if ( ! result )
-		goto err_result;
+static inline struct layer * turd_find ( const char *path ) {
+	size_t len;
 
-	/* Construct result path */
-	if ( cwd ) {
-		memcpy ( result, cwd, cwd_len );
-		result[cwd_len] = '/';
-		memcpy ( ( result + cwd_len + 1 ), path,
-			 ( path_len + 1 /* NUL */ ) );
-	} else {
-		memcpy ( result, path, ( path_len + 1 ) );
-	}
+	return prefix_match ( &turd_dirs, path, &len );
+}
 
-	/* Canonicalise result */
-	in = out = result;
-	while ( 1 ) {
+/**
+ * Find readonly layer containing path
+ *
+ * @v path		Canonicalised absolute path
+ * @ret layer		Readonly layer, or NULL if not within a readonly layer
+ */
+static struct layer * layer_find ( const char *path ) {
+	struct layer *layer;
 
-		/* Dump debug information */
-		if ( DEBUG >= 2 ) {
-			c = *out;
-			*out = '\0';
-			fprintf ( stderr, PHPTURD " [%s] %s -> %s ",
-				  func, path, result );
-			*out = c;
-			fprintf ( stderr, "%s\n", in );
-		}
+	layer = turd_find ( path );
+	if ( layer && ( layer == &layer->mapping->writable ) )
+		return NULL;
+	return layer;
+}
 
-		/* Copy path (in place) */
-		c = *out++ = *in++;
-		if ( c == '\0' )
-			break;
-		if ( c != '/' )
-			continue;
+/**
+ * Construct path within readonly layer
+ *
+ * @v layer		Readonly layer
+ * @v path		Path buffer to fill in
+ * @v suffix		Path relative to readonly directory
+ * @v suffix_len	Length of relative path
+ */
+static inline void layer_path ( struct layer *layer, char *path,
+				const char *suffix, size_t suffix_len ) {
 
-		/* We have a "/".  Remove all consecutive "/" */
-		while ( *in == '/' )
-			in++;
-		if ( *in != '.' )
-			continue;
-		in++;
+	memcpy ( path, layer->path, layer->len );
+	memcpy ( ( path + layer->len ), suffix, ( suffix_len + 1 /* NUL */ ) );
+}
 
-		/* We have a "/." */
-		if ( ( *in == '/' ) || ( *in == '\0' ) ) {
-			/* "/./" or "/.\0" - strip it out */
-			out--;
-			continue;
-		}
-		if ( *in != '.' ) {
-			/* Filename starting with a dot - continue */
-			in--;
-			continue;
-		}
-		in++;
+/**
+ * Record statistics event
+ *
+ * @v mapping		Turd mapping (or NULL if not within any mapping)
+ * @v counter		Counter
+ *
+ * Events for paths not within any mapping are recorded against the
+ * first mapping.  Counters are sharded by thread identifier.
+ */
+static inline void turd_count ( struct mapping *mapping,
+				enum stats_counter counter ) {
 
-		/* We have a "/.." */
-		if ( ( *in == '/') || ( *in == '\0' ) ) {
-			/* "/../" or "/..\0" - go up a level */
-			out--;
-			while ( out > result ) {
-				out--;
-				if ( *out == '/' )
-					break;
-			}
-		}
+	if ( ! mapping ) {
+		if ( ! mapping_count )
+			return;
+		mapping = mappings[0];
 	}
+	if ( ! turd_call.tid )
+		turd_call.tid = syscall ( SYS_gettid );
+	stats_inc ( &mapping->stats, turd_call.tid, turd_call.func, counter );
+	if ( request.fd >= 0 )
+		request.counters[counter]++;
+}
 
-	/* Free current working directory */
-	free ( cwd );
+/**
+ * Record resolution cache evictions
+ *
+ * @v mapping		Turd mapping
+ * @v evicted		Number of entries evicted
+ */
+static inline void turd_evicted ( struct mapping *mapping,
+				  unsigned int evicted ) {
 
-	return result;
+	while ( evicted-- )
+		turd_count ( mapping, STATS_EVICTIONS );
+}
 
- err_result:
-	free ( cwd );
- err_getcwd:
-	return NULL;
+/**
+ * Record per-request accounting value
+ *
+ * @v value		Accounting value
+ * @v delta		Amount to add
+ */
+static inline void turd_account ( uint64_t *value, uint64_t delta ) {
+
+	if ( request.fd >= 0 )
+		*value += delta;
 }
 
 /**
- * Attempt to create intermediate directories, ignoring failures
+ * Write folded sampled backtraces
  *
- * @v path		Canonicalised absolute path
- * @v top		Top directory (known to already exist)
- * @v end		End of path
+ * The backtrace file is rewritten in the folded stack format used by
+ * flame graph tools, with one line per distinct backtrace (outermost
+ * frame first, ending with the wrapped function) followed by the
+ * number of samples.  Frames are identified by the nearest dynamic
+ * symbol, or by the containing module if no symbol is known.
  *
- * Allow for attempts to create files within the writable directory in
- * subdirectories that currently exist only in the readonly directory,
- * by transparently creating the corresponding subdirectories as
- * needed.  Optimise for the common case that the subdirectories
- * already exist and no action is required.
+ * The sampled backtraces are copied to a preallocated snapshot, so
+ * that the sampled backtrace lock is not held while writing the file
+ * (which would block sampling in all other threads).  No file is
+ * written if no samples have been recorded.
  */
-static void create_intermediate_dirs ( const char *path, const char *top,
-				       char *end ) {
-	char tmp;
+static void backtrace_dump ( void ) {
+	struct turd_stack *stack;
+	unsigned long samples;
+	unsigned long dropped;
+	unsigned int count;
+	const char *name;
+	char *filename;
+	Dl_info info;
+	FILE *file;
+	unsigned int i;
+	unsigned int j;
+	int fd;
 
-	/* Find parent directory separator, allowing for the fact that
-	 * the initial path may end with a '/'.
-	 */
-	end--;
-	while ( 1 ) {
-		end--;
-		if ( end <= top )
-			goto finished;
-		if ( *end == '/' )
-			break;
+	/* Take snapshot of sampled backtraces */
+	pthread_mutex_lock ( &backtrace_dump_lock );
+	pthread_mutex_lock ( &backtrace_lock );
+	for ( i = 0, count = 0 ; i < BACKTRACE_STACKS ; i++ ) {
+		stack = &backtrace_stacks[i];
+		if ( stack->count ) {
+			memcpy ( &backtrace_snapshot[count++], stack,
+				 sizeof ( *stack ) );
+		}
 	}
+	samples = backtrace_samples;
+	dropped = backtrace_dropped;
+	pthread_mutex_unlock ( &backtrace_lock );
+	if ( ! samples )
+		goto no_samples;
 
-	/* Temporarily truncate path */
-	tmp = *end;
-	*end = '\0';
-
-	/* Do nothing if parent directory already exists */
-	if ( orig_access ( path, F_OK ) == 0 )
-		goto exists;
-
-	/* Recursively ensure that parent directories exist */
-	create_intermediate_dirs ( path, top, end );
+	/* Open backtrace file */
+	if ( asprintf ( &filename, "%s.%d", backtrace_prefix,
+			getpid() ) < 0 )
+		goto err_alloc;
+	fd = openat ( AT_FDCWD, filename,
+		      ( O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC ), 0644 );
+	if ( fd < 0 )
+		goto err_open;
+	file = fdopen ( fd, "w" );
+	if ( ! file ) {
+		close ( fd );
+		goto err_fdopen;
+	}
 
-	/* Create this directory */
-	if ( orig_mkdir ( path, MKDIR_MODE ) != 0 ) {
-		if ( DEBUG >= 1 ) {
-			fprintf ( stderr, PHPTURD " could not create %s: %s\n",
-				  path, strerror ( errno ) );
+	/* Write each distinct backtrace */
+	for ( i = 0 ; i < count ; i++ ) {
+		stack = &backtrace_snapshot[i];
+		for ( j = stack->depth ; j-- ; ) {
+			if ( ! dladdr ( stack->frames[j], &info ) ) {
+				fprintf ( file, "[unknown];" );
+			} else if ( info.dli_sname ) {
+				fprintf ( file, "%s;", info.dli_sname );
+			} else {
+				name = strrchr ( info.dli_fname, '/' );
+				fprintf ( file, "[%s];", ( name ? ( name + 1 ) :
+							  info.dli_fname ) );
+			}
 		}
-		/* Ignore failure; minimise surprise by letting errors
-		 * be reported by the original library call that
-		 * subsequently tries to access the file within the
-		 * nonexistent directory.
-		 */
+		fprintf ( file, "%s %lu\n", stats_funcs[stack->func],
+			  stack->count );
 	}
+	if ( dropped )
+		fprintf ( file, "[dropped] %lu\n", dropped );
 
- exists:
-	/* Restore truncated path */
-	*end = tmp;
- finished:
-	return;
+	fclose ( file );
+ err_fdopen:
+ err_open:
+	free ( filename );
+ err_alloc:
+ no_samples:
+	pthread_mutex_unlock ( &backtrace_dump_lock );
 }
 
 /**
- * Convert to a turdified path
- *
- * @v path		Path
- * @v mkdirs		Create intermediate directories if needed
- * @v func		Wrapped function name (for debugging)
- * @ret turdpath	Turdified path
+ * Record sampled backtrace for the current library call
  *
- * The caller is repsonsible for calling free() on the returned path
- * if and only if the pointer value differs from the original path.
+ * Identical backtraces are aggregated.  Samples for new backtraces
+ * are discarded once the table is full.
  */
-static char * turdify_path ( const char *path, int mkdirs, const char *func ) {
-	static int used;
-	static const char *readonly;
-	static const char *writable;
-	static size_t readonly_len;
-	static size_t writable_len;
-	static size_t max_prefix_len;
-	const char *turd;
-	const char *suffix;
-	char *abspath;
+static void __attribute__ (( noinline )) turd_backtrace ( void ) {
+	void *frames[ BACKTRACE_OWN + BACKTRACE_DEPTH ];
+	struct turd_stack *stack;
+	Dl_info info;
+	void **caller;
+	size_t len;
+	uint64_t hash;
+	unsigned int i;
+	int depth;
+	int own;
+
+	/* Capture backtrace, omitting the frames within this library */
+	depth = backtrace ( frames, ( sizeof ( frames ) /
+				      sizeof ( frames[0] ) ) );
+	for ( own = 0 ; ( ( own < depth ) && ( own < BACKTRACE_OWN ) ) ;
+	      own++ ) {
+		if ( ! ( dladdr ( frames[own], &info ) &&
+			 ( info.dli_fbase == backtrace_base ) ) )
+			break;
+	}
+	caller = &frames[own];
+	depth -= own;
+	if ( depth > BACKTRACE_DEPTH )
+		depth = BACKTRACE_DEPTH;
+	len = ( depth * sizeof ( frames[0] ) );
+	hash = ( index_hash ( ( ( void * ) caller ), len ) + turd_call.func );
+
+	/* Find or add entry */
+	pthread_mutex_lock ( &backtrace_lock );
+	for ( i = 0 ; i < BACKTRACE_STACKS ; i++ ) {
+		stack = &backtrace_stacks[ ( hash + i ) %
+					   BACKTRACE_STACKS ];
+		if ( ! stack->count ) {
+			stack->func = turd_call.func;
+			stack->depth = depth;
+			memcpy ( stack->frames, caller, len );
+			break;
+		}
+		if ( ( stack->func == turd_call.func ) &&
+		     ( stack->depth == ( ( unsigned int ) depth ) ) &&
+		     ( memcmp ( stack->frames, caller, len ) == 0 ) )
+			break;
+	}
+	if ( i < BACKTRACE_STACKS ) {
+		stack->count++;
+	} else {
+		backtrace_dropped++;
+	}
+	backtrace_samples++;
+	pthread_mutex_unlock ( &backtrace_lock );
+
+	/* Write backtrace file, if requested via a signal */
+	if ( backtrace_pending &&
+	     __atomic_exchange_n ( &backtrace_pending, 0, __ATOMIC_RELAXED ) )
+		backtrace_dump();
+}
+
+/**
+ * Start recording statistics for a library call
+ *
+ * @v func		Wrapped function index (plus one, or zero if unknown)
+ * @v name		Wrapped function name
+ */
+static inline void turd_begin ( unsigned int *func, const char *name ) {
+	unsigned int i;
+
+	/* Look up function index on first use */
+	if ( ! *func ) {
+		for ( i = ( STATS_FUNCS - 1 ) ; i ; i-- ) {
+			if ( strcmp ( stats_funcs[i], name ) == 0 )
+				break;
+		}
+		*func = ( i + 1 );
+	}
+
+	turd_call.func = ( *func - 1 );
+	turd_call.mapping = NULL;
+
+	/* Sample one in every sample_rate calls */
+	turd_call.sampled = 0;
+	if ( sample_rate ) {
+		if ( turd_call.countdown ) {
+			turd_call.countdown--;
+		} else {
+			turd_call.countdown = ( sample_rate - 1 );
+			turd_call.sampled = 1;
+		}
+	}
+
+	/* Sample backtrace one in every backtrace_rate calls */
+	if ( backtrace_rate ) {
+		if ( turd_call.btcountdown ) {
+			turd_call.btcountdown--;
+		} else {
+			turd_call.btcountdown = ( backtrace_rate - 1 );
+			turd_backtrace();
+		}
+	}
+}
+
+/**
+ * Resume recording statistics for a library call
+ *
+ * @v func		Wrapped function index (plus one)
+ *
+ * Any wrapped functions called by the original library function will
+ * have recorded their own statistics, overwriting the state for the
+ * current call.
+ */
+static inline void turd_resume ( unsigned int func ) {
+
+	turd_call.func = ( func - 1 );
+	turd_call.mapping = NULL;
+}
+
+/**
+ * Read monotonic clock
+ *
+ * @ret now		Current time (in nanoseconds)
+ *
+ * The monotonic clock is read via the vDSO, without a system call.
+ */
+static inline uint64_t turd_now ( void ) {
+	struct timespec ts;
+
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ( ( ts.tv_sec * 1000000000ULL ) + ts.tv_nsec );
+}
+
+/**
+ * Explain a step of path resolution
+ *
+ * @v fmt		Format string
+ * @v ...		Arguments
+ *
+ * Each step is prefixed with the elapsed time, excluding the time
+ * spent writing the explanation itself.
+ */
+static void __attribute__ (( noinline, format ( printf, 1, 2 ) ))
+turd_explain_step ( const char *fmt, ... ) {
+	FILE *out = turd_call.explain;
+	uint64_t now = turd_now();
+	int saved_errno = errno;
+	va_list args;
+
+	fprintf ( out, "%9lluns  ", ( ( unsigned long long )
+				      ( now - turd_call.explained -
+					turd_call.overhead ) ) );
+	va_start ( args, fmt );
+	vfprintf ( out, fmt, args );
+	va_end ( args );
+	fprintf ( out, "\n" );
+	turd_call.overhead += ( turd_now() - now );
+	errno = saved_errno;
+}
+
+/**
+ * Explain a step of path resolution, if applicable
+ *
+ * @v fmt		Format string
+ * @v ...		Arguments
+ */
+#define turd_explain( fmt, ... ) do {					\
+	if ( turd_call.explain )					\
+		turd_explain_step ( fmt, ##__VA_ARGS__ );		\
+	} while ( 0 )
+
+/**
+ * Explain a system call issued during path resolution, if applicable
+ *
+ * @v fmt		Format string
+ * @v ...		Arguments
+ */
+#define turd_syscall( fmt, ... ) do {					\
+	if ( turd_call.explain ) {					\
+		turd_call.syscalls++;					\
+		turd_explain_step ( "syscall " fmt, ##__VA_ARGS__ );	\
+	}								\
+	} while ( 0 )
+
+/**
+ * Start timing a phase of a library call
+ *
+ * @ret start		Start time (in nanoseconds), or zero if not sampled
+ */
+static inline uint64_t turd_clock ( void ) {
+
+	if ( ! turd_call.sampled )
+		return 0;
+	return turd_now();
+}
+
+/**
+ * Finish timing a phase of a library call
+ *
+ * @v phase		Latency phase
+ * @v start		Start time (in nanoseconds), or zero if not sampled
+ */
+static inline void turd_time ( enum stats_phase phase, uint64_t start ) {
+	struct mapping *mapping = turd_call.mapping;
+
+	if ( ! start )
+		return;
+	if ( ! mapping ) {
+		if ( ! mapping_count )
+			return;
+		mapping = mappings[0];
+	}
+	stats_record ( &mapping->stats, turd_call.func, phase,
+		       ( turd_clock() - start ) );
+}
+
+/**
+ * Create trace file for this process, if not already created
+ *
+ * @ret rc		Return status code
+ *
+ * Tracing is disabled if the trace file cannot be created.
+ */
+static int turd_trace_file ( void ) {
+	char *filename;
+	int rc = 0;
+
+	pthread_mutex_lock ( &trace_lock );
+	if ( trace.hdr || ( ! trace_level ) )
+		goto done;
+	if ( asprintf ( &filename, "%s.%d", trace_prefix, getpid() ) < 0 ) {
+		rc = -1;
+		goto err_alloc;
+	}
+	rc = trace_create ( &trace, filename, stats_funcs, STATS_FUNCS );
+	if ( ( rc != 0 ) && ( DEBUG >= 1 ) ) {
+		fprintf ( stderr, PHPTURD " could not create %s: %s\n",
+			  filename, strerror ( errno ) );
+	}
+	free ( filename );
+ err_alloc:
+	if ( rc != 0 )
+		trace_level = 0;
+ done:
+	pthread_mutex_unlock ( &trace_lock );
+	return rc;
+}
+
+/**
+ * Write trace record
+ *
+ * @v start		Start time (in nanoseconds)
+ * @v event		Trace event
+ * @v decision		Trace decision
+ * @v layer		Readonly layer number (or zero if not applicable)
+ * @v path		Path
+ */
+static void __attribute__ (( noinline ))
+turd_trace_write ( uint64_t start, enum trace_event event,
+	      enum trace_decision decision, unsigned int layer,
+	      const char *path ) {
+	struct trace_record record;
+	uint64_t duration;
+	int saved_errno = errno;
+
+	/* Create trace file and claim ring, if not already done */
+	if ( ! turd_call.ring ) {
+		if ( ( ! trace.hdr ) && ( turd_trace_file() != 0 ) )
+			goto err_file;
+		if ( ! turd_call.tid )
+			turd_call.tid = syscall ( SYS_gettid );
+		turd_call.ring = trace_claim ( &trace, turd_call.tid );
+		if ( ! turd_call.ring )
+			goto err_claim;
+	}
+
+	/* Write record */
+	duration = ( turd_now() - start );
+	memset ( &record, 0, sizeof ( record ) );
+	record.time = start;
+	record.duration = ( ( duration < UINT32_MAX ) ? duration : UINT32_MAX );
+	record.func = turd_call.func;
+	record.event = event;
+	record.decision = decision;
+	record.layer = layer;
+	trace_write ( turd_call.ring, &record, path );
+
+ err_claim:
+ err_file:
+	errno = saved_errno;
+}
+
+/**
+ * Start tracing an event
+ *
+ * @v level		Minimum trace level
+ * @ret start		Start time (in nanoseconds), or zero if not traced
+ */
+static inline uint64_t turd_trace_begin ( unsigned int level ) {
+
+	if ( trace_level < level )
+		return 0;
+	return turd_now();
+}
+
+/**
+ * Finish tracing an event
+ *
+ * @v start		Start time (in nanoseconds), or zero if not traced
+ * @v event		Trace event
+ * @v decision		Trace decision
+ * @v layer		Readonly layer number (or zero if not applicable)
+ * @v path		Path
+ */
+static inline void turd_trace ( uint64_t start, enum trace_event event,
+				enum trace_decision decision,
+				unsigned int layer, const char *path ) {
+
+	if ( start )
+		turd_trace_write ( start, event, decision, layer, path );
+}
+
+/**
+ * Record path in heavy-hitter sketch
+ *
+ * @v mapping		Turd mapping
+ * @v sketch		Heavy-hitter sketch
+ * @v suffix		Path relative to turd directory
+ * @v suffix_len	Length of relative path
+ *
+ * Only sampled library calls are recorded, with each recorded path
+ * weighted by the sampling rate.
+ */
+static inline void turd_hot ( struct mapping *mapping,
+			      enum stats_sketch sketch, const char *suffix,
+			      size_t suffix_len ) {
+
+	if ( ! turd_call.sampled )
+		return;
+	if ( ! turd_call.tid )
+		turd_call.tid = syscall ( SYS_gettid );
+	stats_hot ( &mapping->stats, turd_call.tid, sketch, suffix,
+		    suffix_len, sample_rate );
+}
+
+/**
+ * Finish recording statistics for a library call
+ *
+ * @v error		Library call returned an error
+ */
+static inline void turd_end ( int error ) {
+
+	turd_count ( turd_call.mapping, STATS_CALLS );
+	if ( error )
+		turd_count ( turd_call.mapping, STATS_ERRORS );
+}
+
+/**
+ * Look up path within readonly layer index
+ *
+ * @v layer		Readonly layer
+ * @v suffix		Path relative to readonly directory
+ * @v suffix_len	Length of relative path
+ * @ret result		Lookup result
+ */
+static enum index_result layer_lookup ( struct layer *layer,
+					const char *suffix,
+					size_t suffix_len ) {
+	enum index_result result;
+	struct index *index;
+
+	/* Path may exist if there is no index */
+	index = index_get ( &layer->index );
+	if ( ! index )
+		return INDEX_MAYBE;
+
+	/* Check index */
+	result = index_lookup ( index, suffix, suffix_len );
+	index_put ( index );
+	return result;
+}
+
+/**
+ * Convert to a canonical absolute path (ignoring symlinks)
+ *
+ * @v path		Path
+ * @v func		Wrapped function name (for debugging)
+ * @ret canonical	Canonical path, or NULL on error
+ *
+ * The caller is repsonsible for calling free() on the returned path.
+ */
+static char * canonical_path ( const char *path, const char *func ) {
+	size_t cwd_len;
+	size_t path_len;
+	char *cwd;
 	char *result;
-	size_t suffix_len;
-	size_t max_len;
+	const char *in;
+	char *out;
+	char c;
 
-	/* Perform initialisation on first use */
-	if ( ! used ) {
+	/* Get current working directory */
+	if ( path[0] != '/' ) {
+		cwd = getcwd ( NULL, 0 );
+		turd_syscall ( "getcwd() = %s",
+			       ( cwd ? cwd : strerror ( errno ) ) );
+		if ( ! cwd )
+			goto err_getcwd;
+		cwd_len = strlen ( cwd );
+	} else {
+		cwd = NULL;
+		cwd_len = 0;
+	}
+
+	/* Allocate result path */
+	path_len = strlen ( path );
+	result = malloc ( cwd_len + 1 /* '/' */ + path_len + 1 /* NUL */ );
+	if ( ! result )
+		goto err_result;
+
+	/* Construct result path */
+	if ( cwd ) {
+		memcpy ( result, cwd, cwd_len );
+		result[cwd_len] = '/';
+		memcpy ( ( result + cwd_len + 1 ), path,
+			 ( path_len + 1 /* NUL */ ) );
+	} else {
+		memcpy ( result, path, ( path_len + 1 ) );
+	}
 
-		/* Record that initialisation has been attempted */
-		used = 1;
+	/* Canonicalise result */
+	in = out = result;
+	while ( 1 ) {
 
-		/* Get original access() function */
-		orig_access = dlsym ( RTLD_NEXT, "access" );
-		if ( ! orig_access ) {
-			result = NULL;
-			errno = ENOSYS;
-			goto err_dlsym;
+		/* Dump debug information */
+		if ( DEBUG >= 2 ) {
+			c = *out;
+			*out = '\0';
+			fprintf ( stderr, PHPTURD " [%s] %s -> %s ",
+				  func, path, result );
+			*out = c;
+			fprintf ( stderr, "%s\n", in );
 		}
 
-		/* Get original mkdir() function */
-		orig_mkdir = dlsym ( RTLD_NEXT, "mkdir" );
-		if ( ! orig_mkdir ) {
-			result = NULL;
-			errno = ENOSYS;
-			goto err_dlsym;
+		/* Copy path (in place) */
+		c = *out++ = *in++;
+		if ( c == '\0' )
+			break;
+		if ( c != '/' )
+			continue;
+
+		/* We have a "/".  Remove all consecutive "/" */
+		while ( *in == '/' )
+			in++;
+		if ( *in != '.' )
+			continue;
+		in++;
+
+		/* We have a "/." */
+		if ( ( *in == '/' ) || ( *in == '\0' ) ) {
+			/* "/./" or "/.\0" - strip it out */
+			out--;
+			continue;
+		}
+		if ( *in != '.' ) {
+			/* Filename starting with a dot - continue */
+			in--;
+			continue;
 		}
+		in++;
 
-		/* Check for and parse PHPTURD environment variable */
-		turd = getenv ( PHPTURD );
-		if ( ! turd ) {
-			if ( DEBUG >= 1 ) {
-				fprintf ( stderr, PHPTURD " [%s] no turd "
-					  "found\n", func );
+		/* We have a "/.." */
+		if ( ( *in == '/') || ( *in == '\0' ) ) {
+			/* "/../" or "/..\0" - go up a level */
+			out--;
+			while ( out > result ) {
+				out--;
+				if ( *out == '/' )
+					break;
 			}
-			result = ( ( char * ) path );
-			goto no_turd;
 		}
-		readonly = strdup ( turd );
-		if ( ! readonly ) {
-			result = NULL;
-			goto err_strdup;
-		}
-		writable = strchr ( readonly, ':' );
-		if ( ! writable ) {
+	}
+
+	/* Free current working directory */
+	free ( cwd );
+
+	return result;
+
+ err_result:
+	free ( cwd );
+ err_getcwd:
+	return NULL;
+}
+
+/**
+ * Load readonly layer index, if any
+ *
+ * @v layer		Readonly layer
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_INDEX environment variable may specify a
+ * colon-separated list of index files.  The first index file that
+ * was built for the layer's readonly directory will be used.
+ *
+ * The index file will be checked for replacement at intervals
+ * specified (in seconds) by the PHPTURD_INDEX_INTERVAL environment
+ * variable.  An interval of zero disables checking.
+ *
+ * If no index file is currently usable, then the first index file
+ * that was not built for a different directory (e.g. one that has not
+ * yet been built) will be retried at the same intervals.
+ */
+static void load_index ( struct layer *layer, const char *func ) {
+	unsigned int interval = INDEX_INTERVAL;
+	struct index_handle retry;
+	const char *indexes;
+	const char *text;
+	char *filenames;
+	char *filename;
+	char *next;
+	int pending = 0;
+	int found = 0;
+
+	/* Check for PHPTURD_INDEX environment variable */
+	indexes = getenv ( PHPTURD_INDEX );
+	if ( ! indexes )
+		return;
+	filenames = strdup ( indexes );
+	if ( ! filenames )
+		return;
+
+	/* Check for PHPTURD_INDEX_INTERVAL environment variable */
+	text = getenv ( PHPTURD_INDEX_INTERVAL );
+	if ( text )
+		interval = strtoul ( text, NULL, 0 );
+
+	/* Try each index file in turn */
+	for ( filename = filenames ; filename ; filename = next ) {
+
+		/* Terminate file name */
+		next = strchr ( filename, ':' );
+		if ( next )
+			*(next++) = '\0';
+		if ( ! *filename )
+			continue;
+
+		/* Use index if it was built for this readonly directory */
+		if ( index_open ( &layer->index, filename, layer->path,
+				  layer->len, interval ) == 0 ) {
 			if ( DEBUG >= 1 ) {
-				fprintf ( stderr, PHPTURD " [%s] malformed: "
-					  "%s\n", func, readonly );
+				fprintf ( stderr, PHPTURD " [%s] using index "
+					  "%s\n", func, filename );
 			}
-			result = ( ( char * ) path );
-			goto err_malformed;
+			found = 1;
+			break;
+		}
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] could not use %s: "
+				  "%s\n", func, filename, strerror ( errno ) );
 		}
-		readonly_len = ( writable - readonly );
-		writable++;
-		writable_len = strlen ( writable );
-		max_prefix_len = readonly_len;
-		if ( max_prefix_len < writable_len )
-			max_prefix_len = writable_len;
-	}
 
-	/* Bypass everything if initialisation did not find a valid PHPTURD */
-	if ( ! max_prefix_len ) {
-		result = ( ( char * ) path );
-		goto bypass;
+		/* Retain first index that may later become usable */
+		if ( ( ! pending ) && ( errno != EXDEV ) &&
+		     layer->index.filename ) {
+			retry = layer->index;
+			pending = 1;
+		} else {
+			index_close ( &layer->index );
+		}
 	}
 
-	/* Convert to an absolute path */
-	abspath = canonical_path ( path, func );
-	if ( ! abspath ) {
+	/* Retry retained index if no index was usable */
+	if ( found ) {
+		if ( pending )
+			index_close ( &retry );
+	} else if ( pending ) {
+		layer->index = retry;
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] will retry index "
+				  "%s\n", func, retry.filename );
+		}
+	}
+
+	free ( filenames );
+}
+
+/**
+ * Initialise readonly directory caches, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_CACHE environment variable may specify a memory budget
+ * (e.g. "4M") for caching the results of probing the readonly
+ * directories.  The same budget applies separately to caching readonly
+ * directory listings, separately to caching canonical paths returned
+ * by realpath(), and separately to each turd mapping.
+ */
+static void init_cache ( const char *func ) {
+	struct mapping *mapping;
+	const char *budget;
+	size_t size = 0;
+	unsigned int i;
+
+	/* Check for PHPTURD_CACHE environment variable */
+	budget = getenv ( PHPTURD_CACHE );
+	if ( budget ) {
+		size = cache_parse_size ( budget );
+		if ( ( ! size ) && ( DEBUG >= 1 ) ) {
+			fprintf ( stderr, PHPTURD " [%s] invalid cache size "
+				  "\"%s\"\n", func, budget );
+		}
+	}
+
+	/* Initialise caches (disabled if size is zero) */
+	for ( i = 0 ; i < mapping_count ; i++ ) {
+		mapping = mappings[i];
+		if ( ( cache_init ( &mapping->cache, size ) != 0 ) ||
+		     ( cache_init ( &mapping->listings, size ) != 0 ) ||
+		     ( cache_init ( &mapping->realpaths, size ) != 0 ) ) {
+			if ( DEBUG >= 1 ) {
+				fprintf ( stderr, PHPTURD " [%s] could not "
+					  "create cache: %s\n", func,
+					  strerror ( errno ) );
+			}
+			cache_init ( &mapping->cache, 0 );
+			cache_init ( &mapping->listings, 0 );
+			cache_init ( &mapping->realpaths, 0 );
+		}
+	}
+}
+
+/**
+ * Initialise symlink-aware resolution, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_SYMLINKS environment variable may be set to a non-zero
+ * value to enable resolution of symbolic links within the readonly
+ * directories via the turd mappings.  Symbolic link targets are
+ * cached within the cache memory budget (or a small default budget
+ * if caching is not enabled).
+ */
+static void init_symlinks ( const char *func ) {
+	struct mapping *mapping;
+	const char *text;
+	size_t size;
+	unsigned int i;
+
+	/* Check for PHPTURD_SYMLINKS environment variable */
+	text = getenv ( PHPTURD_SYMLINKS );
+	symlinks = ( text && strtoul ( text, NULL, 0 ) );
+
+	/* Initialise symlink maps (disabled unless applicable) */
+	for ( i = 0 ; i < mapping_count ; i++ ) {
+		mapping = mappings[i];
+		size = ( mapping->cache.budget ?
+			 mapping->cache.budget : SYMLINK_BUDGET );
+		if ( cache_init ( &mapping->links,
+				  ( symlinks ? size : 0 ) ) != 0 ) {
+			if ( DEBUG >= 1 ) {
+				fprintf ( stderr, PHPTURD " [%s] could not "
+					  "create symlink map: %s\n", func,
+					  strerror ( errno ) );
+			}
+			cache_init ( &mapping->links, 0 );
+		}
+	}
+}
+
+/**
+ * Forget thread identifier and current request in child process
+ *
+ * The thread identifier used to select a counter shard is inherited
+ * across fork(), and so must be looked up again by the child process.
+ * The current request (if any) of the forking thread belongs to the
+ * parent process.
+ */
+static void turd_forked ( void ) {
+
+	turd_call.tid = 0;
+	request.fd = -1;
+}
+
+/**
+ * Initialise shared statistics
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * Each turd mapping has a shared memory segment (named using the
+ * format version, the user ID, and a hash of the mapping's
+ * directories), which is shared by all processes running as the same
+ * user with the same mapping.  Statistics are not recorded for a
+ * mapping whose segment cannot be used.
+ *
+ * The PHPTURD_SAMPLE environment variable may specify the rate at
+ * which library call latencies are sampled (as one in every N calls),
+ * with zero disabling latency sampling.
+ */
+static void init_stats ( const char *func ) {
+	struct mapping *mapping;
+	char name[ sizeof ( "/" STATS_PREFIX ) + 48 ];
+	const char *rate;
+	uint64_t hash;
+	char *desc;
+	size_t len;
+	unsigned int i;
+	unsigned int j;
+
+	for ( i = 0 ; i < mapping_count ; i++ ) {
+		mapping = mappings[i];
+
+		/* Construct mapping description */
+		len = mapping->writable.len;
+		for ( j = 0 ; j < mapping->count ; j++ )
+			len += ( mapping->layers[j].len + 1 /* ":" */ );
+		desc = malloc ( len + 1 /* NUL */ );
+		if ( ! desc )
+			continue;
+		desc[0] = '\0';
+		for ( j = 0 ; j < mapping->count ; j++ ) {
+			strncat ( desc, mapping->layers[j].path,
+				  mapping->layers[j].len );
+			strcat ( desc, ":" );
+		}
+		strncat ( desc, mapping->writable.path, mapping->writable.len );
+
+		/* Open statistics segment */
+		hash = index_hash ( desc, len );
+		snprintf ( name, sizeof ( name ),
+			   "/" STATS_PREFIX "%u.%u.%016llx", STATS_VERSION,
+			   ( ( unsigned int ) getuid() ),
+			   ( ( unsigned long long ) hash ) );
+		if ( ( stats_open ( &mapping->stats, name, desc, stats_funcs,
+				    STATS_FUNCS ) != 0 ) && ( DEBUG >= 1 ) ) {
+			fprintf ( stderr, PHPTURD " [%s] could not use "
+				  "statistics %s: %s\n", func, name,
+				  strerror ( errno ) );
+		}
+		free ( desc );
+	}
+
+	/* Check for PHPTURD_SAMPLE environment variable */
+	rate = getenv ( PHPTURD_SAMPLE );
+	sample_rate = ( rate ? strtoul ( rate, NULL, 0 ) : SAMPLE_RATE );
+
+	/* Reselect counter shards after fork() */
+	pthread_atfork ( NULL, NULL, turd_forked );
+}
+
+/**
+ * Discard parent's trace file in child process
+ *
+ * The child process will create its own trace file when it first
+ * writes a trace record.
+ */
+static void turd_trace_forked ( void ) {
+
+	trace_close ( &trace );
+	turd_call.ring = NULL;
+}
+
+/**
+ * Initialise tracing, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_TRACE environment variable may specify a trace level:
+ * level 1 traces each path mapping, and level 2 additionally traces
+ * each probe of a readonly directory and each implicitly created
+ * directory.  The PHPTURD_TRACE_FILE environment variable may specify
+ * the trace file name prefix, to which the process ID is appended.
+ */
+static void init_trace ( const char *func ) {
+	const char *level;
+
+	/* Check for PHPTURD_TRACE environment variable */
+	level = getenv ( PHPTURD_TRACE );
+	if ( level )
+		trace_level = strtoul ( level, NULL, 0 );
+	if ( ! trace_level )
+		return;
+
+	/* Check for PHPTURD_TRACE_FILE environment variable */
+	trace_prefix = getenv ( PHPTURD_TRACE_FILE );
+	if ( ! trace_prefix )
+		trace_prefix = TRACE_FILE;
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " [%s] tracing to %s.<pid>\n",
+			  func, trace_prefix );
+	}
+
+	/* Create a separate trace file in each child process */
+	pthread_atfork ( NULL, NULL, turd_trace_forked );
+}
+
+/**
+ * Finish accounting for the current request, if any
+ *
+ * A summary line is appended to the slow log if the request reached
+ * either the call threshold or the time threshold.
+ */
+static void request_finish ( void ) {
+	const uint64_t *counters = request.counters;
+	unsigned long long duration;
+	unsigned long long avoided;
+	unsigned long long time_ns;
+	char stamp[32];
+	char buf[512];
+	struct tm tm;
+	time_t now;
+	int len;
+	int fd;
+
+	/* Do nothing unless request exceeded a threshold */
+	if ( request.fd < 0 )
+		return;
+	request.fd = -1;
+	if ( ( counters[STATS_CALLS] < slowlog_calls ) &&
+	     ( request.time < slowlog_time ) )
+		return;
+
+	/* Construct summary line */
+	now = time ( NULL );
+	localtime_r ( &now, &tm );
+	strftime ( stamp, sizeof ( stamp ), "%Y-%m-%dT%H:%M:%S", &tm );
+	duration = ( ( turd_now() - request.started ) / 1000 );
+	time_ns = request.time;
+	avoided = ( counters[STATS_BYPASS] + counters[STATS_HITS] +
+		    request.indexed );
+	len = snprintf ( buf, sizeof ( buf ), "%s pid=%d "
+			 "duration=%llu.%03llums calls=%llu errors=%llu "
+			 "dist=%llu scratch=%llu noprefix=%llu probes=%llu "
+			 "avoided=%llu mkdirs=%llu time=%llu.%03llums\n",
+			 stamp, getpid(),
+			 ( duration / 1000 ), ( duration % 1000 ),
+			 ( ( unsigned long long ) counters[STATS_CALLS] ),
+			 ( ( unsigned long long ) counters[STATS_ERRORS] ),
+			 ( ( unsigned long long ) counters[STATS_DIST] ),
+			 ( ( unsigned long long ) counters[STATS_SCRATCH] ),
+			 ( ( unsigned long long ) counters[STATS_NOPREFIX] ),
+			 ( ( unsigned long long ) request.probes ), avoided,
+			 ( ( unsigned long long ) counters[STATS_MKDIRS] ),
+			 ( time_ns / 1000000 ), ( ( time_ns / 1000 ) % 1000 ) );
+
+	/* Append to slow log */
+	fd = openat ( AT_FDCWD, slowlog,
+		      ( O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC ), 0644 );
+	if ( fd < 0 )
+		goto err_open;
+	if ( ( write ( fd, buf, len ) != len ) && ( DEBUG >= 1 ) ) {
+		fprintf ( stderr, PHPTURD " could not write %s: %s\n",
+			  slowlog, strerror ( errno ) );
+	}
+	close ( fd );
+ err_open:
+	return;
+}
+
+/**
+ * Start accounting for a new request
+ *
+ * @v fd		Connection file descriptor
+ *
+ * Any current request is finished first, since a persistent
+ * connection may be closed only after several requests.
+ */
+static void request_start ( int fd ) {
+
+	request_finish();
+	memset ( request.counters, 0, sizeof ( request.counters ) );
+	request.probes = 0;
+	request.indexed = 0;
+	request.time = 0;
+	request.started = turd_now();
+	request.fd = fd;
+}
+
+/**
+ * Initialise per-request accounting, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_SLOWLOG environment variable may specify a slow log
+ * file.  If present, then each request (i.e. each connection accepted
+ * via accept() or accept4(), until the connection is closed or the
+ * next connection is accepted by the same thread) is accounted
+ * separately within the accepting thread, and a summary line is
+ * appended to the slow log for each request that made at least
+ * PHPTURD_SLOWLOG_CALLS wrapped library calls or that spent at least
+ * PHPTURD_SLOWLOG_TIME milliseconds mapping paths.
+ */
+static void init_requests ( const char *func ) {
+	const char *calls;
+	const char *ms;
+
+	/* Check for PHPTURD_SLOWLOG environment variable */
+	slowlog = getenv ( PHPTURD_SLOWLOG );
+	if ( ! slowlog )
+		return;
+
+	/* Check for threshold environment variables */
+	calls = getenv ( PHPTURD_SLOWLOG_CALLS );
+	slowlog_calls = ( calls ? strtoul ( calls, NULL, 0 ) : SLOWLOG_CALLS );
+	ms = getenv ( PHPTURD_SLOWLOG_TIME );
+	slowlog_time = ( ( ms ? strtoul ( ms, NULL, 0 ) : SLOWLOG_TIME ) *
+			 1000000ULL );
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " [%s] logging requests to %s\n",
+			  func, slowlog );
+	}
+}
+
+/**
+ * Request writing of sampled backtraces
+ *
+ * @v signum		Signal number
+ *
+ * The backtrace file is written by the next sampled library call,
+ * since writing it is not async-signal-safe.
+ */
+static void backtrace_signal ( int signum __attribute__ (( unused )) ) {
+
+	backtrace_pending = 1;
+}
+
+/**
+ * Install handler for backtrace signal
+ *
+ * @v sig		Signal number
+ * @ret rc		Return status code
+ *
+ * The handler is not installed if the application has already
+ * installed a handler for the signal (or chosen to ignore it).
+ */
+static int backtrace_handle ( int sig ) {
+	struct sigaction old;
+	struct sigaction sa;
+
+	/* Refuse to replace any existing disposition */
+	if ( sigaction ( sig, NULL, &old ) != 0 )
+		return -1;
+	if ( ( old.sa_flags & SA_SIGINFO ) || ( old.sa_handler != SIG_DFL ) ) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* Install handler */
+	memset ( &sa, 0, sizeof ( sa ) );
+	sa.sa_handler = backtrace_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset ( &sa.sa_mask );
+	return sigaction ( sig, &sa, NULL );
+}
+
+/**
+ * Discard parent's sampled backtraces in child process
+ */
+static void backtrace_forked ( void ) {
+
+	pthread_mutex_init ( &backtrace_lock, NULL );
+	pthread_mutex_init ( &backtrace_dump_lock, NULL );
+	memset ( backtrace_stacks, 0,
+		 ( BACKTRACE_STACKS * sizeof ( backtrace_stacks[0] ) ) );
+	backtrace_samples = 0;
+	backtrace_dropped = 0;
+}
+
+/**
+ * Write sampled backtraces on exit
+ *
+ * No backtrace file is written by a process that recorded no samples.
+ */
+static void __attribute__ (( destructor )) report_backtraces ( void ) {
+
+	if ( ! backtrace_stacks )
+		return;
+	backtrace_dump();
+}
+
+/**
+ * Initialise backtrace sampling, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_BACKTRACE environment variable may specify a backtrace
+ * file name prefix, to which the process ID is appended.  If present,
+ * then the caller's backtrace is captured for one in every 1000
+ * library calls (or one in every N calls, as specified by the
+ * PHPTURD_BACKTRACE_RATE environment variable), and the aggregated
+ * backtraces are written to the backtrace file on exit.  The
+ * PHPTURD_BACKTRACE_SIGNAL environment variable may specify a signal
+ * number that requests the backtrace file to be written immediately,
+ * unless the application already handles that signal.
+ */
+static void init_backtrace ( const char *func ) {
+	const char *rate;
+	const char *signum;
+	Dl_info info;
+	void *frame;
+
+	/* Check for PHPTURD_BACKTRACE environment variable */
+	backtrace_prefix = getenv ( PHPTURD_BACKTRACE );
+	if ( ! backtrace_prefix )
+		return;
+
+	/* Allocate table and snapshot */
+	backtrace_stacks = calloc ( ( 2 * BACKTRACE_STACKS ),
+				    sizeof ( backtrace_stacks[0] ) );
+	if ( ! backtrace_stacks ) {
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] could not allocate "
+				  "backtraces\n", func );
+		}
+		return;
+	}
+	backtrace_snapshot = &backtrace_stacks[BACKTRACE_STACKS];
+
+	/* Load unwinder before first use, since backtrace() may
+	 * otherwise need to load it while handling a library call.
+	 */
+	backtrace ( &frame, 1 );
+
+	/* Identify this library, so that its frames may be omitted */
+	if ( dladdr ( turd_backtrace, &info ) )
+		backtrace_base = info.dli_fbase;
+
+	/* Check for PHPTURD_BACKTRACE_SIGNAL environment variable */
+	signum = getenv ( PHPTURD_BACKTRACE_SIGNAL );
+	if ( signum &&
+	     ( backtrace_handle ( strtoul ( signum, NULL, 0 ) ) != 0 ) &&
+	     ( DEBUG >= 1 ) ) {
+		fprintf ( stderr, PHPTURD " [%s] could not use signal %s: "
+			  "%s\n", func, signum, strerror ( errno ) );
+	}
+
+	/* Discard parent's backtraces in child processes */
+	pthread_atfork ( NULL, NULL, backtrace_forked );
+
+	/* Check for PHPTURD_BACKTRACE_RATE environment variable */
+	rate = getenv ( PHPTURD_BACKTRACE_RATE );
+	backtrace_rate = ( rate ? strtoul ( rate, NULL, 0 ) : BACKTRACE_RATE );
+}
+
+/**
+ * Initialise readonly directory whiteouts, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_WHITEOUT environment variable may specify a whiteout
+ * file (which will be created if it does not already exist).  If
+ * present, then removing a path within the readonly directory will
+ * record a whiteout instead of modifying the readonly directory.
+ */
+static void init_whiteouts ( const char *func ) {
+	const char *filename;
+
+	/* Check for PHPTURD_WHITEOUT environment variable */
+	filename = getenv ( PHPTURD_WHITEOUT );
+	if ( ! filename )
+		return;
+
+	/* Open whiteout file */
+	if ( whiteout_open ( &readonly_whiteouts, filename ) != 0 ) {
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] could not use %s: "
+				  "%s\n", func, filename, strerror ( errno ) );
+		}
+		return;
+	}
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " [%s] using %s (%lu whiteouts)\n",
+			  func, filename,
+			  ( ( unsigned long )
+			    whiteout_count ( &readonly_whiteouts ) ) );
+	}
+}
+
+/**
+ * Add names within turd directory to case-folded name map
+ *
+ * @v layer		Turd directory
+ * @ret rc		Return status code
+ *
+ * Names are taken from the readonly directory index, if available,
+ * since this requires no system calls.  Otherwise, the directory is
+ * walked.  The caller must already have recorded the number of index
+ * replacements seen.
+ */
+static int nocase_add ( struct layer *layer ) {
+	struct mapping *mapping = layer->mapping;
+	struct index *index;
+	int fd;
+	int rc;
+
+	/* Use index, if available */
+	index = index_get ( &layer->index );
+	if ( index && index->nodes ) {
+		rc = fold_add_index ( &mapping->names, index );
+		index_put ( index );
+		return rc;
+	}
+	if ( index )
+		index_put ( index );
+
+	/* Otherwise, walk directory */
+	fd = openat ( AT_FDCWD, layer->path,
+		      ( O_PATH | O_DIRECTORY | O_CLOEXEC ) );
+	if ( fd < 0 )
+		return -1;
+	rc = fold_add_tree ( &mapping->names, fd, walk_default_threads() );
+	close ( fd );
+	return rc;
+}
+
+/**
+ * Add names within turd directory for the first time
+ *
+ * @v layer		Turd directory
+ * @v func		Wrapped function name (for debugging)
+ */
+static void nocase_init_layer ( struct layer *layer, const char *func ) {
+
+	layer->folded = __atomic_load_n ( &layer->index.swaps,
+					  __ATOMIC_RELAXED );
+	if ( ( nocase_add ( layer ) != 0 ) && ( DEBUG >= 1 ) ) {
+		fprintf ( stderr, PHPTURD " [%s] could not fold %s: %s\n",
+			  func, layer->path, strerror ( errno ) );
+	}
+}
+
+/**
+ * Initialise case-insensitive mode, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_NOCASE environment variable may be set to "dist" to
+ * allow paths within the readonly directories to be accessed using
+ * the wrong case, or to "all" to include paths within the writable
+ * directories.
+ */
+static void init_nocase ( const char *func ) {
+	struct mapping *mapping;
+	const char *mode;
+	unsigned int i;
+	unsigned int j;
+
+	/* Check for PHPTURD_NOCASE environment variable */
+	mode = getenv ( PHPTURD_NOCASE );
+	if ( ! mode )
+		return;
+	if ( strcmp ( mode, "dist" ) == 0 ) {
+		nocase = NOCASE_READONLY;
+	} else if ( strcmp ( mode, "all" ) == 0 ) {
+		nocase = ( NOCASE_READONLY | NOCASE_WRITABLE );
+	} else {
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] unknown case mode "
+				  "\"%s\"\n", func, mode );
+		}
+		return;
+	}
+
+	/* Construct case-folded name map for each mapping */
+	for ( i = 0 ; i < mapping_count ; i++ ) {
+		mapping = mappings[i];
+		if ( fold_init ( &mapping->names ) != 0 )
+			goto err_init;
+		for ( j = 0 ; j < mapping->count ; j++ )
+			nocase_init_layer ( &mapping->layers[j], func );
+		if ( nocase & NOCASE_WRITABLE )
+			nocase_init_layer ( &mapping->writable, func );
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] %s has %zd "
+				  "case-folded names\n", func,
+				  mapping->writable.path,
+				  mapping->names.count );
+		}
+	}
+
+	return;
+
+ err_init:
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " [%s] could not initialise case "
+			  "mode: %s\n", func, strerror ( errno ) );
+	}
+	while ( i-- )
+		fold_free ( &mappings[i]->names );
+	nocase = 0;
+}
+
+/**
+ * Report readonly directory existence cache statistics
+ *
+ * Statistics are reported on exit, if debugging is enabled.
+ */
+static void __attribute__ (( destructor )) report_cache ( void ) {
+	struct cache_stats stats;
+	struct mapping *mapping;
+	unsigned int i;
+
+	for ( i = 0 ; i < mapping_count ; i++ ) {
+		mapping = mappings[i];
+		if ( ( DEBUG >= 1 ) && mapping->links.budget ) {
+			cache_get_stats ( &mapping->links, &stats );
+			fprintf ( stderr, PHPTURD " %s symlink map: %lu "
+				  "hits, %lu misses, %lu inserts, %lu "
+				  "evictions, %lu flushes, %lu entries, %zd "
+				  "bytes\n",
+				  mapping->writable.path, stats.hits,
+				  stats.misses, stats.inserts, stats.evictions,
+				  stats.flushes, stats.entries, stats.bytes );
+		}
+		if ( ! ( ( DEBUG >= 1 ) && mapping->cache.budget ) )
+			continue;
+		cache_get_stats ( &mapping->cache, &stats );
+		fprintf ( stderr, PHPTURD " %s cache: %lu hits, %lu misses, "
+			  "%lu inserts, %lu evictions, %lu flushes, %lu "
+			  "entries, %zd bytes\n", mapping->writable.path,
+			  stats.hits, stats.misses, stats.inserts,
+			  stats.evictions, stats.flushes, stats.entries,
+			  stats.bytes );
+		cache_get_stats ( &mapping->listings, &stats );
+		fprintf ( stderr, PHPTURD " %s listing cache: %lu hits, %lu "
+			  "misses, %lu inserts, %lu evictions, %lu flushes, "
+			  "%lu entries, %zd bytes\n", mapping->writable.path,
+			  stats.hits, stats.misses, stats.inserts,
+			  stats.evictions, stats.flushes, stats.entries,
+			  stats.bytes );
+		cache_get_stats ( &mapping->realpaths, &stats );
+		fprintf ( stderr, PHPTURD " %s realpath cache: %lu hits, %lu "
+			  "misses, %lu inserts, %lu evictions, %lu flushes, "
+			  "%lu entries, %zd bytes\n", mapping->writable.path,
+			  stats.hits, stats.misses, stats.inserts,
+			  stats.evictions, stats.flushes, stats.entries,
+			  stats.bytes );
+	}
+}
+
+/** A readonly directory being warmed up */
+struct warmup_dir {
+	/** Walker */
+	struct walker *walker;
+	/** Worker thread index */
+	unsigned int thread;
+};
+
+/**
+ * Handle readonly directory entry during warm-up
+ *
+ * @v job		Directory walk job
+ * @v name		Name
+ * @v len		Length of name
+ * @v type		Entry type
+ * @v arg		Directory being warmed up
+ * @ret rc		Return status code
+ *
+ * Subdirectories are walked.  Other entries are examined, so that the
+ * kernel will cache their attributes.  Symbolic links to directories
+ * are not walked, to avoid loops.
+ */
+static int warmup_entry ( struct walk_job *job, const char *name, size_t len,
+			  unsigned int type, void *arg ) {
+	struct warmup_dir *dir = arg;
+
+	if ( type == WALK_DIR ) {
+		walk_push ( dir->walker, dir->thread, job, name, len, NULL );
+	} else {
+		walk_type ( job->fd, name, &type );
+	}
+	return 0;
+}
+
+/**
+ * Visit readonly directory during warm-up
+ *
+ * @v walker		Walker
+ * @v thread		Worker thread index
+ * @v job		Directory walk job
+ * @ret rc		Return status code
+ */
+static int warmup_visit ( struct walker *walker, unsigned int thread,
+			  struct walk_job *job ) {
+	unsigned long *dirs = walker->priv;
+	struct warmup_dir dir;
+
+	/* Ignore directories that cannot be opened or read */
+	if ( job->fd < 0 )
+		return 0;
+	dir.walker = walker;
+	dir.thread = thread;
+	walk_read ( job, warmup_entry, &dir );
+	__atomic_add_fetch ( dirs, 1, __ATOMIC_RELAXED );
+	return 0;
+}
+
+/**
+ * Warm up readonly directories
+ *
+ * @v arg		Walker
+ * @ret ret		Return value
+ */
+static void * warmup_thread ( void *arg ) {
+	struct walker *walker = arg;
+	struct timespec start;
+	struct timespec end;
+	struct mapping *mapping;
+	unsigned long dirs = 0;
+	sigset_t sigset;
+	unsigned int i;
+	unsigned int j;
+	int fd;
+
+	/* Leave all signal handling to the application's own threads */
+	sigfillset ( &sigset );
+	pthread_sigmask ( SIG_BLOCK, &sigset, NULL );
+
+	/* Walk each readonly directory in turn */
+	clock_gettime ( CLOCK_MONOTONIC, &start );
+	walker->visit = warmup_visit;
+	walker->priv = &dirs;
+	for ( i = 0 ; i < mapping_count ; i++ ) {
+		mapping = mappings[i];
+		for ( j = 0 ; j < mapping->count ; j++ ) {
+			fd = openat ( AT_FDCWD, mapping->layers[j].path,
+				      ( O_PATH | O_DIRECTORY | O_CLOEXEC ) );
+			if ( fd < 0 )
+				continue;
+			walk_tree ( walker, fd, NULL );
+			close ( fd );
+		}
+	}
+	clock_gettime ( CLOCK_MONOTONIC, &end );
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " warmed up %lu directories in "
+			  "%.3fs\n", dirs, ( ( end.tv_sec - start.tv_sec ) +
+					    ( ( end.tv_nsec - start.tv_nsec ) /
+					      1e9 ) ) );
+	}
+
+	free ( walker );
+	return NULL;
+}
+
+/**
+ * Start warming up readonly directories, if enabled
+ *
+ * @v func		Wrapped function name (for debugging)
+ *
+ * The PHPTURD_WARMUP environment variable may specify a number of
+ * threads to be used to walk the readonly directory in the
+ * background, so that the kernel's directory entry and attribute
+ * caches are already populated by the time that the application
+ * probes the readonly directory.  This is mainly of use when the
+ * readonly directory is on a network filesystem.
+ */
+static void init_warmup ( const char *func ) {
+	struct walker *walker;
+	pthread_attr_t attr;
+	pthread_t thread;
+	const char *text;
+	unsigned long threads;
+
+	/* Check for PHPTURD_WARMUP environment variable */
+	text = getenv ( PHPTURD_WARMUP );
+	if ( ! text )
+		return;
+	threads = strtoul ( text, NULL, 0 );
+	if ( ! threads )
+		return;
+
+	/* Start warm-up thread */
+	walker = calloc ( 1, sizeof ( *walker ) );
+	if ( ! walker )
+		return;
+	walker->threads = threads;
+	pthread_attr_init ( &attr );
+	pthread_attr_setdetachstate ( &attr, PTHREAD_CREATE_DETACHED );
+	if ( pthread_create ( &thread, &attr, warmup_thread, walker ) != 0 ) {
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] could not start "
+				  "warm-up\n", func );
+		}
+		free ( walker );
+	}
+	pthread_attr_destroy ( &attr );
+}
+
+/**
+ * Find readonly layer containing path
+ *
+ * @v mapping		Turd mapping
+ * @v path		Path buffer to fill in with readonly path
+ * @v suffix		Path relative to readonly directory
+ * @v suffix_len	Length of relative path
+ * @ret layer		Topmost readonly layer containing path, or NULL
+ *
+ * Use the readonly directory indexes (if any) to rule out nonexistent
+ * paths without a system call.  Since the vast majority of probes for
+ * paths within the readonly directories are misses (e.g. autoloader
+ * fallback directories), this avoids most of the probing overhead.
+ * If an index includes a path component tree, then existing paths
+ * may also be confirmed without a system call.  A lookup therefore
+ * costs one memory probe per indexed layer, rather than one system
+ * call per layer.
+ *
+ * Results of probing the readonly directories are cached, if
+ * enabled.  The cache records the topmost layer containing the path
+ * (if any), and so is consulted only once per lookup.
+ *
+ * Whited-out paths are treated as nonexistent in all layers, without
+ * consulting the indexes, the cache, or the readonly directories.
+ */
+static struct layer * readonly_resolve ( struct mapping *mapping, char *path,
+					 const char *suffix,
+					 size_t suffix_len ) {
+	struct layer *layers = mapping->layers;
+	enum index_result result;
+	struct layer *layer;
+	unsigned long swaps;
+	unsigned int found;
+	unsigned int i;
+	uint64_t traced;
+	int cacheable = 1;
+	int checked = 0;
+	int flush = 0;
+	int rc;
+
+	/* Check whiteouts, if applicable */
+	if ( whiteout_contains ( &readonly_whiteouts, mapping->ns, suffix,
+				 suffix_len ) ) {
+		turd_explain ( "whiteout: %s is hidden in all layers",
+			       suffix );
+		return NULL;
+	}
+
+	/* Flush caches if any index has been replaced, since the
+	 * readonly directory contents have presumably changed.
+	 */
+	for ( i = 0 ; i < mapping->count ; i++ ) {
+		layer = &layers[i];
+		swaps = __atomic_load_n ( &layer->index.swaps,
+					  __ATOMIC_RELAXED );
+		if ( swaps != layer->swaps ) {
+			layer->swaps = swaps;
+			flush = 1;
+		}
+	}
+	if ( flush ) {
+		turd_explain ( "caches flushed: index replaced" );
+		cache_flush ( &mapping->cache );
+		cache_flush ( &mapping->listings );
+		cache_flush ( &mapping->links );
+		cache_flush ( &mapping->realpaths );
+	}
+
+	/* Check each layer in turn */
+	for ( i = 0 ; i < mapping->count ; i++ ) {
+		layer = &layers[i];
+
+		/* Check index, if applicable */
+		result = layer_lookup ( layer, suffix, suffix_len );
+		turd_explain ( "index layer %u: %s", ( i + 1 ),
+			       ( ( result == INDEX_ABSENT ) ? "absent" :
+				 ( ( result == INDEX_PRESENT ) ? "present" :
+				   "maybe" ) ) );
+		if ( result != INDEX_MAYBE )
+			turd_account ( &request.indexed, 1 );
+		if ( result == INDEX_ABSENT )
+			continue;
+		if ( result == INDEX_PRESENT )
+			goto found;
+
+		/* Check cache (once), if applicable */
+		if ( ! checked ) {
+			checked = 1;
+			if ( cache_lookup ( &mapping->cache, suffix,
+					    suffix_len, &found ) ) {
+				turd_count ( mapping, STATS_HITS );
+				turd_probe3 ( cache__hit,
+					      mapping->writable.path, suffix,
+					      found );
+				turd_explain ( "cache hit: %s%.0d",
+					       ( found ? "layer " : "absent" ),
+					       found );
+				if ( ! found )
+					return NULL;
+				layer = &layers[ found - 1 ];
+				layer_path ( layer, path, suffix, suffix_len );
+				return layer;
+			}
+			if ( mapping->cache.budget ) {
+				turd_count ( mapping, STATS_MISSES );
+				turd_probe2 ( cache__miss,
+					      mapping->writable.path, suffix );
+				turd_explain ( "cache miss" );
+			}
+		}
+
+		/* Probe readonly directory */
+		layer_path ( layer, path, suffix, suffix_len );
+		traced = turd_trace_begin ( 2 );
+		turd_account ( &request.probes, 1 );
+		rc = orig_access ( path, F_OK );
+		turd_probe2 ( probe, path, rc );
+		turd_syscall ( "access(\"%s\") = %d%s%s", path, rc,
+			       ( rc ? " " : "" ),
+			       ( rc ? strerror ( errno ) : "" ) );
+		turd_trace ( traced, TRACE_PROBE,
+			     ( ( rc == 0 ) ? TRACE_OK : TRACE_FAILED ),
+			     ( i + 1 ), path );
+		if ( rc == 0 )
+			goto found;
+
+		/* Do not cache probes that failed for a reason (such as
+		 * lack of memory) that does not imply nonexistence.
+		 */
+		if ( ( errno != ENOENT ) && ( errno != ENOTDIR ) )
+			cacheable = 0;
+	}
+	layer = NULL;
+
+ found:
+	/* Cache result of probing, if applicable */
+	if ( checked && ( layer || cacheable ) ) {
+		turd_evicted ( mapping,
+			       cache_insert ( &mapping->cache, suffix,
+					      suffix_len,
+					      ( layer ?
+						( layer - layers + 1 ) :
+						0 ) ) );
+		if ( mapping->cache.budget )
+			turd_explain ( "cache insert" );
+	}
+
+	/* Construct readonly path, if applicable */
+	if ( layer )
+		layer_path ( layer, path, suffix, suffix_len );
+
+	return layer;
+}
+
+/**
+ * Read symbolic link within readonly directories
+ *
+ * @v mapping		Turd mapping
+ * @v suffix		Path relative to turd directory
+ * @v suffix_len	Length of relative path
+ * @v target		Buffer (of size PATH_MAX) to fill in with link target
+ * @ret len		Length of link target, zero if path is not a link,
+ *			or negative if path is not within a readonly layer
+ *
+ * The result for any path within the readonly directories is recorded
+ * in the symlink map, so that each link is read only once.  Paths
+ * within the writable directory are not examined, and symbolic links
+ * within the writable directory are left to be followed by the kernel
+ * as usual.
+ *
+ * Whited-out paths are treated as not within a readonly layer, before
+ * consulting the symlink map (which may have recorded the link before
+ * it was whited out, possibly by another process).
+ */
+static ssize_t readonly_readlink ( struct mapping *mapping,
+				   const char *suffix, size_t suffix_len,
+				   char *target ) {
+	void *data;
+	size_t len;
+	ssize_t rc;
+	char *path;
+
+	/* Check whiteouts, if applicable */
+	if ( whiteout_contains ( &readonly_whiteouts, mapping->ns, suffix,
+				 suffix_len ) ) {
+		turd_explain ( "whiteout: %s is hidden in all layers",
+			       suffix );
+		return -1;
+	}
+
+	/* Use symlink map, if possible */
+	if ( cache_lookup_data ( &mapping->links, suffix, suffix_len,
+				 &data, &len ) ) {
+		memcpy ( target, data, len );
+		target[len] = '\0';
+		free ( data );
+		turd_explain ( "symlink map hit: %s -> \"%s\"", suffix,
+			       target );
+		return len;
+	}
+
+	/* Find readonly layer containing path */
+	path = malloc ( max_prefix_len + suffix_len + 1 /* NUL */ );
+	if ( ! path ) {
+		rc = -1;
+		goto err_alloc;
+	}
+	if ( ! readonly_resolve ( mapping, path, suffix, suffix_len ) ) {
+		rc = -1;
+		goto not_readonly;
+	}
+
+	/* Read link (treating any unreadable link as not a link) */
+	rc = readlinkat ( AT_FDCWD, path, target, ( PATH_MAX - 1 ) );
+	turd_syscall ( "readlink(\"%s\") = %zd%s%s", path, rc,
+		       ( ( rc < 0 ) ? " " : "" ),
+		       ( ( rc < 0 ) ? strerror ( errno ) : "" ) );
+	if ( rc < 0 ) {
+		if ( errno != EINVAL )
+			goto err_readlink;
+		rc = 0;
+	}
+	target[rc] = '\0';
+
+	/* Record in symlink map */
+	turd_evicted ( mapping,
+		       cache_insert_data ( &mapping->links, suffix,
+					   suffix_len, target, rc ) );
+
+ err_readlink:
+ not_readonly:
+	free ( path );
+ err_alloc:
+	return rc;
+}
+
+/**
+ * Convert to a canonical absolute path (following symlinks)
+ *
+ * @v path		Path
+ * @v flags		Turdification flags
+ * @v func		Wrapped function name (for debugging)
+ * @ret canonical	Canonical path, or NULL on error
+ *
+ * Symbolic links within the readonly directories are followed, with
+ * the target path being resolved via the turd mappings.  An absolute
+ * link pointing to any turd directory (or a relative link pointing
+ * outside its own turd directory) therefore resolves correctly, and
+ * ".." following a link refers to the parent of the link target.
+ *
+ * The caller is repsonsible for calling free() on the returned path.
+ */
+static char * physical_path ( const char *path, unsigned int flags,
+			      const char *func ) {
+	struct layer *layer;
+	unsigned int links = 0;
+	const char *comp;
+	const char *next;
+	size_t comp_len;
+	size_t rest_len;
+	size_t len = 0;
+	ssize_t target_len;
+	int examine = 1;
+	char *result;
+	char *target;
+	char *rest;
+	char *cwd;
+	char *tmp;
+
+	/* Construct path to be resolved */
+	if ( path[0] != '/' ) {
+		cwd = getcwd ( NULL, 0 );
+		turd_syscall ( "getcwd() = %s",
+			       ( cwd ? cwd : strerror ( errno ) ) );
+		if ( ! cwd )
+			goto err_getcwd;
+		if ( asprintf ( &rest, "%s/%s", cwd, path ) < 0 )
+			goto err_rest;
+	} else {
+		cwd = NULL;
+		rest = strdup ( path );
+		if ( ! rest )
+			goto err_rest;
+	}
+
+	/* Allocate buffers */
+	result = malloc ( PATH_MAX );
+	if ( ! result )
+		goto err_result;
+	target = malloc ( PATH_MAX );
+	if ( ! target )
+		goto err_target;
+	result[0] = '\0';
+
+	/* Resolve each path component in turn */
+	for ( comp = rest ; ; comp = next ) {
+
+		/* Find next component */
+		comp += strspn ( comp, "/" );
+		if ( ! *comp )
+			break;
+		comp_len = strcspn ( comp, "/" );
+		next = ( comp + comp_len );
+
+		/* Ignore "." and go up a level for ".." */
+		if ( ( comp_len == 1 ) && ( comp[0] == '.' ) )
+			continue;
+		if ( ( comp_len == 2 ) && ( comp[0] == '.' ) &&
+		     ( comp[1] == '.' ) ) {
+			while ( len && ( result[--len] != '/' ) ) {}
+			result[len] = '\0';
+			examine = 1;
+			continue;
+		}
+
+		/* Append component */
+		if ( ( len + 1 /* '/' */ + comp_len ) >= PATH_MAX ) {
+			errno = ENAMETOOLONG;
+			goto err_toolong;
+		}
+		result[len++] = '/';
+		memcpy ( &result[len], comp, comp_len );
+		len += comp_len;
+		result[len] = '\0';
+
+		/* Examine component within readonly directories, if
+		 * applicable.  There is no need to examine any further
+		 * components once a component is found to lie outside
+		 * the readonly directories.
+		 */
+		if ( ! examine )
+			continue;
+		if ( ( flags & TURD_NOFOLLOW ) &&
+		     ( ! next[ strspn ( next, "/" ) ] ) )
+			continue;
+		layer = turd_find ( result );
+		if ( ( ! layer ) || ( ! result[layer->len] ) )
+			continue;
+		target_len = readonly_readlink ( layer->mapping,
+						 &result[layer->len],
+						 ( len - layer->len ),
+						 target );
+		if ( target_len < 0 ) {
+			examine = 0;
+			continue;
+		}
+		if ( ! target_len )
+			continue;
+
+		/* Follow link */
+		if ( ++links > MAX_SYMLINKS ) {
+			errno = ELOOP;
+			goto err_loop;
+		}
+		if ( DEBUG >= 2 ) {
+			fprintf ( stderr, PHPTURD " [%s] %s -> %s\n",
+				  func, result, target );
+		}
+		if ( target[0] == '/' ) {
+			len = 0;
+		} else {
+			while ( len && ( result[--len] != '/' ) ) {}
+		}
+		result[len] = '\0';
+		rest_len = strlen ( next );
+		tmp = malloc ( target_len + rest_len + 1 /* NUL */ );
+		if ( ! tmp )
+			goto err_follow;
+		memcpy ( tmp, target, target_len );
+		memcpy ( ( tmp + target_len ), next, ( rest_len + 1 ) );
+		free ( rest );
+		rest = tmp;
+		next = rest;
+	}
+
+	/* Represent root directory as "/" */
+	if ( ! len )
+		strcpy ( result, "/" );
+
+	free ( target );
+	free ( rest );
+	free ( cwd );
+	return result;
+
+ err_follow:
+ err_loop:
+ err_toolong:
+	free ( target );
+ err_target:
+	free ( result );
+ err_result:
+	free ( rest );
+ err_rest:
+	free ( cwd );
+ err_getcwd:
+	return NULL;
+}
+
+/**
+ * Convert path to the case that exists on disk
+ *
+ * @v mapping		Turd mapping
+ * @v suffix		Path relative to turd directory (modified in place)
+ * @v flags		Turdification flags
+ *
+ * Names from any replaced readonly directory indexes are added to the
+ * case-folded name map before it is used.  Names that are no longer
+ * present are left in place, since they affect only the case used
+ * for a nonexistent path.
+ *
+ * Only the thread that records a replacement adds the names from
+ * the replacement index; other threads continue to use the map
+ * (which already holds the names from the previous index).
+ */
+static void nocase_resolve ( struct mapping *mapping, char *suffix,
+			     unsigned int flags ) {
+	struct layer *layer;
+	unsigned long folded;
+	unsigned long swaps;
+	unsigned int i;
+	size_t len;
+
+	/* Add names from any replaced indexes */
+	for ( i = 0 ; i < mapping->count ; i++ ) {
+		layer = &mapping->layers[i];
+		swaps = __atomic_load_n ( &layer->index.swaps,
+					  __ATOMIC_RELAXED );
+		folded = __atomic_load_n ( &layer->folded, __ATOMIC_RELAXED );
+		if ( ( swaps != folded ) &&
+		     __atomic_compare_exchange_n ( &layer->folded, &folded,
+						   swaps, 0, __ATOMIC_RELAXED,
+						   __ATOMIC_RELAXED ) ) {
+			nocase_add ( layer );
+		}
+	}
+
+	/* Convert path (or its parent directories, if creating) */
+	while ( *suffix == '/' )
+		suffix++;
+	len = strlen ( suffix );
+	while ( len && ( suffix[ len - 1 ] == '/' ) )
+		len--;
+	fold_resolve ( &mapping->names, suffix, len,
+		       ( flags & TURD_MKDIRS ) );
+}
+
+/**
+ * Update case-folded name map for a possibly created or removed path
+ *
+ * @v turdpath		Turdified path
+ */
+static void nocase_update ( const char *turdpath ) {
+	struct mapping *mapping;
+	struct layer *layer;
+	const char *suffix;
+	size_t suffix_len;
+	char *path;
+	int exists;
+
+	/* Ignore paths outside the turd directories */
+	layer = turd_find ( turdpath );
+	if ( ! layer )
+		return;
+	mapping = layer->mapping;
+	suffix = &turdpath[layer->len];
+	suffix_len = strlen ( suffix );
+
+	/* Check whether path is now visible within any mapped directory */
+	path = malloc ( max_prefix_len + suffix_len + 1 /* NUL */ );
+	if ( ! path )
+		return;
+	exists = ( readonly_resolve ( mapping, path, suffix,
+				      suffix_len ) != NULL );
+	if ( ( ! exists ) && ( nocase & NOCASE_WRITABLE ) ) {
+		layer_path ( &mapping->writable, path, suffix, suffix_len );
+		exists = ( orig_access ( path, F_OK ) == 0 );
+	}
+	free ( path );
+
+	/* Add or remove name */
+	while ( *suffix == '/' ) {
+		suffix++;
+		suffix_len--;
+	}
+	while ( suffix_len && ( suffix[ suffix_len - 1 ] == '/' ) )
+		suffix_len--;
+	if ( ! suffix_len )
+		return;
+	if ( exists ) {
+		fold_add ( &mapping->names, suffix, suffix_len );
+	} else {
+		fold_remove ( &mapping->names, suffix, suffix_len );
+	}
+}
+
+/**
+ * Handle possible removal of a turdified path
+ *
+ * @v turdpath		Turdified path
+ *
+ * Flush the readonly directory caches if a library call may have
+ * removed (or renamed) a path within a readonly directory.  This
+ * should happen only rarely, since the readonly directories should
+ * not be writable.
+ */
+static void turdify_removed ( const char *turdpath ) {
+	struct layer *layer;
+
+	layer = layer_find ( turdpath );
+	if ( layer ) {
+		cache_flush ( &layer->mapping->cache );
+		cache_flush ( &layer->mapping->listings );
+		cache_flush ( &layer->mapping->links );
+		cache_flush ( &layer->mapping->realpaths );
+	}
+	if ( nocase )
+		nocase_update ( turdpath );
+}
+
+/**
+ * Handle possible creation of a turdified path
+ *
+ * @v turdpath		Turdified path
+ */
+static void turdify_created ( const char *turdpath ) {
+
+	if ( nocase )
+		nocase_update ( turdpath );
+}
+
+/**
+ * Attempt to create intermediate directories, ignoring failures
+ *
+ * @v path		Canonicalised absolute path
+ * @v top		Top directory (known to already exist)
+ * @v end		End of path
+ *
+ * Allow for attempts to create files within the writable directory in
+ * subdirectories that currently exist only in the readonly directory,
+ * by transparently creating the corresponding subdirectories as
+ * needed.  Optimise for the common case that the subdirectories
+ * already exist and no action is required.
+ */
+static void create_intermediate_dirs ( const char *path, const char *top,
+				       char *end ) {
+	uint64_t traced;
+	char tmp;
+	int rc;
+
+	/* Find parent directory separator, allowing for the fact that
+	 * the initial path may end with a '/'.
+	 */
+	end--;
+	while ( 1 ) {
+		end--;
+		if ( end <= top )
+			goto finished;
+		if ( *end == '/' )
+			break;
+	}
+
+	/* Temporarily truncate path */
+	tmp = *end;
+	*end = '\0';
+
+	/* Do nothing if parent directory already exists */
+	rc = orig_access ( path, F_OK );
+	turd_syscall ( "access(\"%s\") = %d%s%s", path, rc,
+		       ( rc ? " " : "" ), ( rc ? strerror ( errno ) : "" ) );
+	if ( rc == 0 )
+		goto exists;
+
+	/* Recursively ensure that parent directories exist */
+	create_intermediate_dirs ( path, top, end );
+
+	/* Create this directory */
+	traced = turd_trace_begin ( 2 );
+	rc = orig_mkdir ( path, MKDIR_MODE );
+	turd_probe2 ( mkdir, path, rc );
+	turd_syscall ( "mkdir(\"%s\") = %d%s%s", path, rc,
+		       ( rc ? " " : "" ), ( rc ? strerror ( errno ) : "" ) );
+	turd_trace ( traced, TRACE_MKDIR,
+		     ( ( rc == 0 ) ? TRACE_OK : TRACE_FAILED ), 0, path );
+	if ( rc == 0 ) {
+		turd_count ( turd_call.mapping, STATS_MKDIRS );
+	} else {
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " could not create %s: %s\n",
+				  path, strerror ( errno ) );
+		}
+		/* Ignore failure; minimise surprise by letting errors
+		 * be reported by the original library call that
+		 * subsequently tries to access the file within the
+		 * nonexistent directory.
+		 */
+	}
+
+ exists:
+	/* Restore truncated path */
+	*end = tmp;
+ finished:
+	return;
+}
+
+/**
+ * Add turd directory
+ *
+ * @v layer		Turd directory
+ * @v mapping		Turd mapping
+ * @v path		Directory
+ * @v len		Length of directory
+ * @ret rc		Return status code
+ */
+static int add_turd_dir ( struct layer *layer, struct mapping *mapping,
+			  const char *path, size_t len ) {
+
+	/* Reject empty directories, which would match every path */
+	if ( ! len ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Add to set of all turd directories (rejecting duplicates) */
+	layer->mapping = mapping;
+	layer->path = path;
+	layer->len = len;
+	if ( prefix_add ( &turd_dirs, path, len, layer ) != 0 )
+		return -1;
+	if ( max_prefix_len < len )
+		max_prefix_len = len;
+
+	return 0;
+}
+
+/**
+ * Add turd mapping
+ *
+ * @v turd		Turd directories
+ * @v len		Length of turd directories
+ * @ret rc		Return status code
+ *
+ * A turd mapping is a colon-separated list of one or more readonly
+ * directories (in order of precedence) followed by the writable
+ * directory, as found in the PHPTURD environment variable.  A mapping
+ * that reuses any directory from an existing mapping is rejected.
+ */
+static int add_mapping ( const char *turd, size_t len ) {
+	struct mapping **tmp;
+	struct mapping *mapping;
+	struct layer *layer;
+	unsigned int count;
+	char *copy;
+	char *dir;
+	char *sep;
+	size_t i;
+
+	/* Count readonly layers */
+	count = 0;
+	for ( i = 0 ; i < len ; i++ ) {
+		if ( turd[i] == ':' )
+			count++;
+	}
+	if ( ! count ) {
+		errno = EINVAL;
+		goto err_malformed;
+	}
+
+	/* Allocate mapping */
+	tmp = realloc ( mappings, ( ( mapping_count + 1 ) *
+				    sizeof ( mappings[0] ) ) );
+	if ( ! tmp )
+		goto err_grow;
+	mappings = tmp;
+	mapping = calloc ( 1, sizeof ( *mapping ) );
+	if ( ! mapping )
+		goto err_mapping;
+	mapping->layers = calloc ( count, sizeof ( mapping->layers[0] ) );
+	if ( ! mapping->layers )
+		goto err_layers;
+	mapping->count = count;
+	copy = strndup ( turd, len );
+	if ( ! copy )
+		goto err_strdup;
+
+	/* Split into directories */
+	dir = copy;
+	for ( layer = mapping->layers ; layer < &mapping->layers[count] ;
+	      layer++ ) {
+		sep = strchr ( dir, ':' );
+		*sep = '\0';
+		if ( add_turd_dir ( layer, mapping, dir, ( sep - dir ) ) != 0 )
+			goto err_add;
+		dir = ( sep + 1 );
+	}
+	if ( add_turd_dir ( &mapping->writable, mapping, dir,
+			    strlen ( dir ) ) != 0 )
+		goto err_add;
+	mapping->ns = index_hash ( dir, strlen ( dir ) );
+
+	/* Record mapping */
+	mappings[mapping_count++] = mapping;
+
+	return 0;
+
+ err_add:
+	/* Remove any readonly directories already added */
+	while ( layer-- != mapping->layers ) {
+		prefix_remove ( &turd_dirs, layer->path, layer->len,
+				layer );
+	}
+	free ( copy );
+ err_strdup:
+	free ( mapping->layers );
+ err_layers:
+	free ( mapping );
+ err_mapping:
+ err_grow:
+ err_malformed:
+	return -1;
+}
+
+/**
+ * Add routing rule
+ *
+ * @v rule		Routing rule
+ * @v len		Length of routing rule
+ * @ret rc		Return status code
+ *
+ * A routing rule is an action ("scratch", "dist" or "probe") followed
+ * by whitespace and a glob pattern.
+ */
+static int add_route ( const char *rule, size_t len ) {
+	enum route_action action;
+	size_t name_len;
+
+	/* Parse action */
+	for ( name_len = 0 ; ( ( name_len < len ) &&
+			       ! strchr ( " \t", rule[name_len] ) ) ;
+	      name_len++ ) {}
+	if ( route_parse_action ( rule, name_len, &action ) != 0 )
+		return -1;
+
+	/* Parse pattern */
+	for ( ; ( ( name_len < len ) && strchr ( " \t", rule[name_len] ) ) ;
+	      name_len++ ) {}
+	return route_add ( &routes, ( rule + name_len ), ( len - name_len ),
+			   action );
+}
+
+/**
+ * Load configuration file
+ *
+ * @v filename		Configuration file name
+ * @v parse		Line parser
+ * @v func		Wrapped function name (for debugging)
+ * @ret rc		Return status code
+ *
+ * Leading and trailing whitespace is ignored, as are blank lines and
+ * lines starting with '#'.  Invalid lines are skipped.
+ */
+static int load_lines ( const char *filename,
+			int ( * parse ) ( const char *line, size_t len ),
+			const char *func ) {
+	struct stat st;
+	char *data;
+	char *line;
+	char *end;
+	size_t len;
+	ssize_t got;
+	int fd;
+	int rc;
+
+	/* Read file (without using any wrapped library calls) */
+	fd = openat ( AT_FDCWD, filename, ( O_RDONLY | O_CLOEXEC ) );
+	if ( fd < 0 ) {
+		rc = -1;
+		goto err_open;
+	}
+	if ( ( rc = fstat ( fd, &st ) ) != 0 )
+		goto err_stat;
+	data = malloc ( st.st_size + 1 /* NUL */ );
+	if ( ! data ) {
+		rc = -1;
+		goto err_alloc;
+	}
+	for ( len = 0 ; len < ( ( size_t ) st.st_size ) ; len += got ) {
+		got = read ( fd, ( data + len ), ( st.st_size - len ) );
+		if ( got < 0 ) {
+			rc = -1;
+			goto err_read;
+		}
+		if ( ! got )
+			break;
+	}
+	data[len] = '\0';
+
+	/* Parse each line */
+	for ( line = data ; *line ; line = end ) {
+		end = strchrnul ( line, '\n' );
+		len = ( end - line );
+		if ( *end )
+			end++;
+		while ( len && strchr ( " \t\r", line[ len - 1 ] ) )
+			len--;
+		while ( len && strchr ( " \t", *line ) ) {
+			line++;
+			len--;
+		}
+		if ( ( ! len ) || ( *line == '#' ) )
+			continue;
+		if ( ( parse ( line, len ) != 0 ) && ( DEBUG >= 1 ) ) {
+			fprintf ( stderr, PHPTURD " [%s] %s: invalid line "
+				  "\"%.*s\": %s\n", func, filename,
+				  ( ( int ) len ), line, strerror ( errno ) );
+		}
+	}
+	rc = 0;
+
+ err_read:
+	free ( data );
+ err_alloc:
+ err_stat:
+	close ( fd );
+ err_open:
+	return rc;
+}
+
+/**
+ * Perform initialisation on first use
+ *
+ * This is called exactly once (via pthread_once()), so that no thread
+ * can observe a partially initialised set of mappings.
+ */
+static void turdify_init ( void ) {
+	const char *func = init_func;
+	struct mapping *mapping;
+	const char *turd;
+	const char *conf;
+	const char *rules;
+	unsigned int i;
+	unsigned int j;
+
+	/* Get original access() function */
+	orig_access = dlsym ( RTLD_NEXT, "access" );
+	if ( ! orig_access )
+		return;
+
+	/* Get original mkdir() function */
+	orig_mkdir = dlsym ( RTLD_NEXT, "mkdir" );
+	if ( ! orig_mkdir )
+		return;
+
+	/* Check for and parse PHPTURD environment variable */
+	turd = getenv ( PHPTURD );
+	if ( turd && ( add_mapping ( turd, strlen ( turd ) ) != 0 ) &&
+	     ( DEBUG >= 1 ) ) {
+		fprintf ( stderr, PHPTURD " [%s] malformed: %s\n", func, turd );
+	}
+
+	/* Check for and load PHPTURD_CONF configuration file */
+	conf = getenv ( PHPTURD_CONF );
+	if ( conf && ( load_lines ( conf, add_mapping, func ) != 0 ) &&
+	     ( DEBUG >= 1 ) ) {
+		fprintf ( stderr, PHPTURD " [%s] could not use %s: %s\n",
+			  func, conf, strerror ( errno ) );
+	}
+
+	/* Bypass everything if there are no mappings */
+	if ( ! mapping_count ) {
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] no turd found\n",
+				  func );
+		}
+		return;
+	}
+
+	/* Check for, load, and compile PHPTURD_ROUTES rules */
+	rules = getenv ( PHPTURD_ROUTES );
+	if ( rules &&
+	     ( ( load_lines ( rules, add_route, func ) != 0 ) ||
+	       ( route_compile ( &routes ) != 0 ) ) ) {
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] could not use %s: "
+				  "%s\n", func, rules, strerror ( errno ) );
+		}
+		route_free ( &routes );
+	}
+
+	/* Load readonly directory indexes, if any */
+	for ( i = 0 ; i < mapping_count ; i++ ) {
+		mapping = mappings[i];
+		for ( j = 0 ; j < mapping->count ; j++ )
+			load_index ( &mapping->layers[j], func );
+	}
+
+	/* Initialise readonly directory caches */
+	init_cache ( func );
+
+	/* Initialise symlink-aware resolution, if enabled */
+	init_symlinks ( func );
+
+	/* Initialise shared statistics */
+	init_stats ( func );
+
+	/* Initialise tracing, if enabled */
+	init_trace ( func );
+
+	/* Initialise per-request accounting, if enabled */
+	init_requests ( func );
+
+	/* Initialise backtrace sampling, if enabled */
+	init_backtrace ( func );
+
+	/* Load readonly directory whiteouts, if enabled */
+	init_whiteouts ( func );
+
+	/* Construct case-folded name maps, if enabled */
+	init_nocase ( func );
+
+	/* Start warming up readonly directories, if enabled */
+	init_warmup ( func );
+
+	/* Report initialisation */
+	turd_explain ( "initialised: %u mapping%s", mapping_count,
+		       ( ( mapping_count == 1 ) ? "" : "s" ) );
+}
+
+/**
+ * Convert to a turdified path
+ *
+ * @v path		Path
+ * @v flags		Turdification flags
+ * @v func		Wrapped function name (for debugging)
+ * @ret turdpath	Turdified path
+ *
+ * The caller is repsonsible for calling free() on the returned path
+ * if and only if the pointer value differs from the original path.
+ */
+static char * turdify_path ( const char *path, unsigned int flags,
+			     const char *func ) {
+	struct mapping *mapping;
+	struct layer *layer;
+	const char *suffix;
+	enum route_action action;
+	char *abspath;
+	char *result;
+	size_t suffix_len;
+	size_t max_len;
+	enum trace_decision decision = TRACE_FAILED;
+	unsigned int number = 0;
+	uint64_t start = 0;
+	uint64_t traced = 0;
+	uint64_t accounted = 0;
+	uint64_t phase;
+
+	/* Perform initialisation on first use */
+	if ( init_func ) {
+		/* Bypass calls made from within initialisation itself */
+		result = ( ( char * ) path );
+		goto bypass;
+	}
+	init_func = func;
+	pthread_once ( &init_once, turdify_init );
+	init_func = NULL;
+	if ( ! ( orig_access && orig_mkdir ) ) {
+		result = NULL;
+		errno = ENOSYS;
+		goto err_init;
+	}
+
+	/* Bypass everything if initialisation did not find any mappings */
+	if ( ! mapping_count ) {
+		result = ( ( char * ) path );
+		goto bypass;
+	}
+	turd_probe3 ( resolve__entry, func, path, flags );
+
+	/* Start timing and tracing, if applicable */
+	start = turd_clock();
+	traced = turd_trace_begin ( 1 );
+	if ( request.fd >= 0 )
+		accounted = turd_now();
+
+	/* Convert to an absolute path */
+	abspath = ( symlinks ? physical_path ( path, flags, func ) :
+		    canonical_path ( path, func ) );
+	turd_time ( STATS_CANONICAL, start );
+	if ( ! abspath ) {
 		if ( DEBUG >= 1 ) {
 			fprintf ( stderr, PHPTURD " [%s] could not "
 				  "canonicalise \"%s\"\n", func, path );
 		}
+		turd_explain ( "canonical: failed: %s", strerror ( errno ) );
+		result = NULL;
+		goto err_canonical;
+	}
+	turd_explain ( "canonical: %s", abspath );
+
+	/* Check if path lies within a turd directory */
+	layer = turd_find ( abspath );
+	if ( layer ) {
+		mapping = layer->mapping;
+		suffix = &abspath[layer->len];
+		turd_call.mapping = mapping;
+		if ( layer == &mapping->writable ) {
+			turd_explain ( "prefix: %s (writable), suffix %s",
+				       layer->path, suffix );
+		} else {
+			turd_explain ( "prefix: %s (readonly layer %td), "
+				       "suffix %s", layer->path,
+				       ( layer - mapping->layers + 1 ),
+				       suffix );
+		}
+	} else {
+		turd_explain ( "prefix: none (path unmodified)" );
+		result = ( ( char * ) path );
+		decision = TRACE_NOPREFIX;
+		turd_count ( NULL, STATS_NOPREFIX );
+		if ( DEBUG >= 1 ) {
+			fprintf ( stderr, PHPTURD " [%s] %s [unmodified]\n",
+				  func, path );
+		}
+		goto no_prefix;
+	}
+
+	/* Calculate maximum result path length */
+	suffix_len = strlen ( suffix );
+	max_len = ( max_prefix_len + suffix_len );
+
+	/* Allocate result path */
+	result = malloc ( max_len + 1 /* NUL */ );
+	if ( ! result )
+		goto err_result;
+
+	/* Convert to case that exists on disk, if applicable */
+	if ( nocase ) {
+		nocase_resolve ( mapping, &abspath[layer->len], flags );
+		turd_explain ( "case folded: %s", suffix );
+	}
+
+	/* Apply routing rules */
+	action = route_match ( &routes, suffix, suffix_len );
+	turd_explain ( "route: %s", ( ( action == ROUTE_SCRATCH ) ?
+				      "scratch (writable only)" :
+				      ( ( action == ROUTE_DIST ) ?
+					"dist (readonly only)" :
+					"probe (default)" ) ) );
+
+	/* Paths routed to the readonly directories remain subject to
+	 * whiteouts (which would otherwise be checked only when probing
+	 * the readonly directories), and any whited-out path is instead
+	 * routed to the writable directory.
+	 */
+	if ( ( action == ROUTE_DIST ) &&
+	     whiteout_contains ( &readonly_whiteouts, mapping->ns, suffix,
+				 suffix_len ) ) {
+		turd_explain ( "whiteout: %s is hidden in all layers",
+			       suffix );
+		action = ROUTE_SCRATCH;
+	}
+
+	/* Construct readonly path from topmost layer containing path,
+	 * or writable path if no readonly layer contains the path.
+	 * Paths routed to the writable directory are never probed.
+	 * Paths routed to the readonly directories are probed only to
+	 * choose between multiple layers, and otherwise resolve to the
+	 * lowest layer.
+	 */
+	layer = NULL;
+	if ( ( action == ROUTE_PROBE ) ||
+	     ( ( action == ROUTE_DIST ) && ( mapping->count > 1 ) ) ) {
+		phase = turd_clock();
+		layer = readonly_resolve ( mapping, result, suffix,
+					   suffix_len );
+		turd_time ( STATS_PROBE, phase );
+		turd_hot ( mapping, ( layer ? STATS_FOUND : STATS_MISSING ),
+			   suffix, suffix_len );
+	} else {
+		turd_count ( mapping, STATS_BYPASS );
+	}
+	if ( ( ! layer ) && ( action == ROUTE_DIST ) ) {
+		layer = &mapping->layers[ mapping->count - 1 ];
+		layer_path ( layer, result, suffix, suffix_len );
+		turd_explain ( "routed to lowest readonly layer" );
+	}
+	if ( ! layer ) {
+
+		/* Construct writable path */
+		layer = &mapping->writable;
+		layer_path ( layer, result, suffix, suffix_len );
+		decision = TRACE_SCRATCH;
+		turd_count ( mapping, STATS_SCRATCH );
+		turd_explain ( "final: %s (writable)", result );
+
+		/* Ensure that path components exist, if applicable */
+		if ( flags & TURD_MKDIRS ) {
+			phase = turd_clock();
+			create_intermediate_dirs ( result,
+						   ( result + layer->len ),
+						   ( result + layer->len +
+						     suffix_len ) );
+			turd_time ( STATS_MKDIR, phase );
+		}
+	} else {
+		decision = TRACE_DIST;
+		number = ( layer - mapping->layers + 1 );
+		turd_count ( mapping, STATS_DIST );
+		turd_explain ( "final: %s (readonly layer %u)", result,
+			       number );
+	}
+
+	/* Dump debug information */
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " [%s] %s => %s => %s\n",
+			  func, path, abspath, result );
+	}
+
+ err_result:
+ no_prefix:
+	free ( abspath );
+ err_canonical:
+	turd_time ( STATS_TURDIFY, start );
+	turd_trace ( traced, TRACE_RESOLVE, decision, number, path );
+	if ( accounted )
+		turd_account ( &request.time, ( turd_now() - accounted ) );
+	turd_probe3 ( resolve__return, func, path, result );
+ bypass:
+ err_init:
+	return result;
+}
+
+/**
+ * Explain resolution of a path
+ *
+ * @v path		Path
+ * @v create		Create intermediate directories, as for a new file
+ * @v out		Output stream
+ * @ret rc		Return status code
+ *
+ * The path is resolved exactly as for a wrapped library call, with
+ * each step of resolution (and each system call issued) described
+ * on the output stream.  Caches persist between calls, so that a
+ * sequence of paths may be used to examine the effect of caching.
+ */
+int phpturd_explain ( const char *path, int create, FILE *out ) {
+	static unsigned int stats_phpturd_explain = 0;
+	unsigned long long elapsed;
+	char *turdpath;
+	int rc;
+
+	/* Resolve path, explaining each step */
+	turd_begin ( &stats_phpturd_explain, "phpturd_explain" );
+	turd_call.explain = out;
+	turd_call.explained = turd_now();
+	turd_call.overhead = 0;
+	turd_call.syscalls = 0;
+	turd_explain ( "path: %s", path );
+	turdpath = turdify_path ( path, ( create ? TURD_MKDIRS : 0 ),
+				  "phpturd_explain" );
+	elapsed = ( turd_now() - turd_call.explained - turd_call.overhead );
+	turd_call.explain = NULL;
+
+	/* Report result */
+	if ( turdpath ) {
+		fprintf ( out, "%s => %s\n", path, turdpath );
+		rc = 0;
+	} else {
+		fprintf ( out, "%s => error: %s\n", path, strerror ( errno ) );
+		rc = -1;
+	}
+	fprintf ( out, "%u system call%s in %lluns\n", turd_call.syscalls,
+		  ( ( turd_call.syscalls == 1 ) ? "" : "s" ), elapsed );
+	turd_end ( rc != 0 );
+
+	if ( turdpath && ( turdpath != path ) )
+		free ( turdpath );
+	return rc;
+}
+
+/**
+ * Turdify a library call taking a single path parameter
+ *
+ * @v rtype		Return type
+ * @v func		Library function
+ * @v path		Path
+ * @v flags		Turdification flags
+ * @v ...		Turdified call arguments
+ */
+#define turdwrap1( rtype, func, path, flags, ... ) do {		\
+	static typeof ( func ) * orig_ ## func = NULL;			\
+	static unsigned int stats_ ## func = 0;				\
+	uint64_t start;							\
+	char *turdpath;							\
+	rtype ret;							\
+									\
+	/* Get original library function */				\
+	if ( ! orig_ ## func ) {					\
+		orig_ ## func = dlsym ( RTLD_NEXT, #func );		\
+		if ( ! orig_ ## func ) {				\
+			ret = rtype ## _error_return;			\
+			errno = ENOSYS;					\
+			goto err_dlsym;					\
+		}							\
+	}								\
+									\
+	/* Start recording statistics */				\
+	turd_begin ( &stats_ ## func, #func );				\
+									\
+	/* Turdify path */						\
+	turdpath = turdify_path ( path, flags, #func );		\
+	if ( ! turdpath ) {						\
+		ret = rtype ## _error_return;				\
+		goto err_turdpath;					\
+	}								\
+									\
+	/* Call original library function */				\
+	start = turd_clock();						\
+	ret = orig_ ## func ( __VA_ARGS__ );				\
+	turd_time ( STATS_CALL, start );				\
+									\
+	/* Handle possible path creation, if applicable */		\
+	if ( (flags) & TURD_MKDIRS )					\
+		turdify_created ( turdpath );				\
+									\
+	err_turdpath:							\
+									\
+	/* Finish recording statistics */				\
+	turd_end ( ret == rtype ## _error_return );			\
+									\
+	/* Free turdified path, if applicable */			\
+	if ( turdpath != path )						\
+		free ( turdpath );					\
+									\
+	err_dlsym:							\
+									\
+	/* Return value from original library function */		\
+	return ret;							\
+									\
+	} while ( 0 )
+
+/**
+ * Turdify a library call taking two path parameters
+ *
+ * @v rtype		Return type
+ * @v func		Library function
+ * @v path1		Path one
+ * @v flags1		Path one turdification flags
+ * @v path2		Path two
+ * @v flags2		Path two turdification flags
+ * @v ...		Turdified call arguments
+ */
+#define turdwrap2( rtype, func, path1, flags1, path2, flags2,		\
+		   ... ) do {						\
+	static typeof ( func ) * orig_ ## func = NULL;			\
+	static unsigned int stats_ ## func = 0;				\
+	uint64_t start;							\
+	char *turdpath1;						\
+	char *turdpath2;						\
+	rtype ret;							\
+									\
+	/* Get original library function */				\
+	if ( ! orig_ ## func ) {					\
+		orig_ ## func = dlsym ( RTLD_NEXT, #func );		\
+		if ( ! orig_ ## func ) {				\
+			ret = rtype ## _error_return;			\
+			errno = ENOSYS;					\
+			goto err_dlsym;					\
+		}							\
+	}								\
+									\
+	/* Start recording statistics */				\
+	turd_begin ( &stats_ ## func, #func );				\
+									\
+	/* Turdify path one */						\
+	turdpath1 = turdify_path ( path1, flags1, #func );		\
+	if ( ! turdpath1 ) {						\
+		ret = rtype ## _error_return;				\
+		goto err_turdpath1;					\
+	}								\
+									\
+	/* Turdify path two */						\
+	turdpath2 = turdify_path ( path2, flags2, #func );		\
+	if ( ! turdpath2 ) {						\
+		ret = rtype ## _error_return;				\
+		goto err_turdpath2;					\
+	}								\
+									\
+	/* Call original library function */				\
+	start = turd_clock();						\
+	ret = orig_ ## func ( __VA_ARGS__ );				\
+	turd_time ( STATS_CALL, start );				\
+									\
+	/* Handle possible path creation, if applicable */		\
+	if ( (flags1) & TURD_MKDIRS )					\
+		turdify_created ( turdpath1 );				\
+	if ( (flags2) & TURD_MKDIRS )					\
+		turdify_created ( turdpath2 );				\
+									\
+	err_turdpath2:							\
+									\
+	/* Free turdified path two, if applicable */			\
+	if ( turdpath2 != path2 )					\
+		free ( turdpath2 );					\
+									\
+	err_turdpath1:							\
+									\
+	/* Finish recording statistics */				\
+	turd_end ( ret == rtype ## _error_return );			\
+									\
+	/* Free turdified path one, if applicable */			\
+	if ( turdpath1 != path1 )					\
+		free ( turdpath1 );					\
+									\
+	err_dlsym:							\
+									\
+	/* Return value from original library function */		\
+	return ret;							\
+									\
+	} while ( 0 )
+
+/**
+ * Get original library function
+ *
+ * @v func		Library function
+ * @v error		Value to return on error
+ */
+#define origfunc( func, error ) do {					\
+	if ( ! orig_ ## func ) {					\
+		orig_ ## func = dlsym ( RTLD_NEXT, #func );		\
+		if ( ! orig_ ## func ) {				\
+			errno = ENOSYS;					\
+			return error;					\
+		}							\
+	}								\
+	} while ( 0 )
+
+/**
+ * Read readonly directory listing
+ *
+ * @v list		Directory listing
+ * @v layer		Topmost readonly layer containing directory
+ * @v suffix		Directory path relative to readonly directory
+ * @v suffix_len	Length of relative path
+ * @ret rc		Return status code
+ *
+ * Entries from the same directory within any lower readonly layers
+ * are merged into the listing.  Lower layers whose index shows that
+ * the directory does not exist are skipped without a system call.
+ */
+static int readonly_list ( struct dirlist *list, struct layer *layer,
+			   const char *suffix, size_t suffix_len ) {
+	struct mapping *mapping;
+	struct layer *lower;
+	char *path;
+	int fd;
+	int rc;
+
+	/* Allocate path buffer */
+	path = malloc ( max_prefix_len + suffix_len + 1 /* NUL */ );
+	if ( ! path ) {
+		rc = -1;
+		goto err_alloc;
+	}
+
+	/* Read each layer in turn */
+	mapping = layer->mapping;
+	for ( lower = layer ; lower < &mapping->layers[mapping->count] ;
+	      lower++ ) {
+
+		/* Skip lower layers known not to contain the directory */
+		if ( ( lower != layer ) &&
+		     ( layer_lookup ( lower, suffix, suffix_len ) ==
+		       INDEX_ABSENT ) )
+			continue;
+
+		/* Open directory, ignoring lower layers that lack it */
+		layer_path ( lower, path, suffix, suffix_len );
+		fd = openat ( AT_FDCWD, path,
+			      ( O_RDONLY | O_DIRECTORY | O_CLOEXEC ) );
+		if ( fd < 0 ) {
+			if ( lower == layer ) {
+				rc = -1;
+				goto err_open;
+			}
+			continue;
+		}
+
+		/* Read directory, omitting names from higher layers */
+		rc = dirlist_read ( list, fd, ( lower != layer ) );
+		close ( fd );
+		if ( rc != 0 )
+			goto err_read;
+	}
+	rc = 0;
+
+ err_read:
+ err_open:
+	free ( path );
+ err_alloc:
+	return rc;
+}
+
+/** A readonly directory listing being checked for whiteouts */
+struct whiteout_dir {
+	/** Turd mapping */
+	struct mapping *mapping;
+	/** Path buffer (relative to readonly directory) */
+	char *path;
+	/** Length of directory path */
+	size_t len;
+};
+
+/**
+ * Check for whited-out readonly directory entry
+ *
+ * @v dirent		Raw directory entry
+ * @v arg		Readonly directory listing
+ * @ret whiteout	Entry has been whited out
+ */
+static int whiteout_entry ( struct walk_dirent64 *dirent, void *arg ) {
+	struct whiteout_dir *wdir = arg;
+	size_t len;
+
+	len = strlen ( dirent->d_name );
+	memcpy ( ( wdir->path + wdir->len ), dirent->d_name, len );
+	return whiteout_contains ( &readonly_whiteouts, wdir->mapping->ns,
+				   wdir->path, ( wdir->len + len ) );
+}
+
+/**
+ * Remove whited-out entries from readonly directory listing
+ *
+ * @v mapping		Turd mapping
+ * @v list		Directory listing
+ * @v suffix		Directory path relative to readonly directory
+ * @v suffix_len	Length of relative path
+ * @ret rc		Return status code
+ */
+static int whiteout_filter ( struct mapping *mapping, struct dirlist *list,
+			     const char *suffix, size_t suffix_len ) {
+	struct whiteout_dir wdir;
+
+	/* Do nothing unless whiteouts exist */
+	if ( ! whiteout_count ( &readonly_whiteouts ) )
+		return 0;
+
+	/* Construct path buffer */
+	while ( suffix_len && ( suffix[ suffix_len - 1 ] == '/' ) )
+		suffix_len--;
+	wdir.path = malloc ( suffix_len + 1 /* "/" */ + NAME_MAX );
+	if ( ! wdir.path )
+		return -1;
+	memcpy ( wdir.path, suffix, suffix_len );
+	wdir.path[suffix_len] = '/';
+	wdir.len = ( suffix_len + 1 );
+	wdir.mapping = mapping;
+
+	/* Remove whited-out entries */
+	dirlist_filter ( list, whiteout_entry, &wdir );
+
+	free ( wdir.path );
+	return 0;
+}
+
+/**
+ * Find readonly layer subject to whiteouts
+ *
+ * @v turdpath		Turdified path
+ * @ret layer		Readonly layer containing path, or NULL if whiteouts
+ *			are disabled or path is not within a readonly layer
+ */
+static struct layer * whiteout_layer ( const char *turdpath ) {
+
+	return ( whiteout_enabled ( &readonly_whiteouts ) ?
+		 layer_find ( turdpath ) : NULL );
+}
+
+/**
+ * Check that readonly directory has no visible entries
+ *
+ * @v layer		Topmost readonly layer containing directory
+ * @v suffix		Path relative to readonly directory
+ * @v suffix_len	Length of relative path
+ * @ret rc		Return status code
+ */
+static int whiteout_empty ( struct layer *layer, const char *suffix,
+			    size_t suffix_len ) {
+	struct dirlist list = { NULL, 0, 0 };
+	struct walk_dirent64 *dirent;
+	size_t offset;
+	int rc;
+
+	/* Read directory listing, omitting whited-out entries */
+	if ( ( rc = readonly_list ( &list, layer, suffix, suffix_len ) ) != 0 )
+		goto err_read;
+	if ( ( rc = whiteout_filter ( layer->mapping, &list, suffix,
+				       suffix_len ) ) != 0 )
+		goto err_filter;
+
+	/* Check for any remaining entries other than "." and ".." */
+	for ( offset = 0 ; ( dirent = dirlist_entry ( &list, offset ) ) ;
+	      offset = dirent->d_off ) {
+		if ( ( strcmp ( dirent->d_name, "." ) != 0 ) &&
+		     ( strcmp ( dirent->d_name, ".." ) != 0 ) ) {
+			errno = ENOTEMPTY;
+			rc = -1;
+			goto err_notempty;
+		}
+	}
+
+ err_notempty:
+ err_filter:
+ err_read:
+	dirlist_free ( &list );
+	return rc;
+}
+
+/**
+ * Remove a path
+ *
+ * @v path		Path
+ * @v remove		Original library function
+ * @v dir		Path is expected to be a directory
+ * @v func		Wrapped function name (for debugging)
+ * @ret rc		Return status code
+ *
+ * If whiteouts are enabled, then a path that resolves to a readonly
+ * directory is removed by recording a whiteout, leaving the readonly
+ * directories untouched.  The whiteout hides the path within all
+ * readonly layers.  Any writable counterpart is also removed, since
+ * it would otherwise be uncovered by the whiteout.
+ */
+static int turdify_remove ( const char *path,
+			    int ( * remove ) ( const char *path ), int dir,
+			    const char *func ) {
+	struct layer *layer;
+	const char *suffix;
+	struct stat st;
+	size_t suffix_len;
+	uint64_t start;
+	char *turdpath;
+	char *wpath;
+	int rc;
+
+	/* Turdify path */
+	turdpath = turdify_path ( path, TURD_NOFOLLOW, func );
+	if ( ! turdpath ) {
+		rc = -1;
+		goto err_turdpath;
+	}
+
+	/* Remove path directly unless subject to whiteouts */
+	layer = whiteout_layer ( turdpath );
+	if ( ! layer ) {
+		start = turd_clock();
+		rc = remove ( turdpath );
+		turd_time ( STATS_CALL, start );
+		turdify_removed ( turdpath );
+		goto done;
+	}
+	suffix = &turdpath[layer->len];
+	suffix_len = strlen ( suffix );
+
+	/* Refuse to remove the readonly directory itself */
+	if ( strspn ( suffix, "/" ) == suffix_len ) {
+		errno = EBUSY;
+		rc = -1;
+		goto err_root;
+	}
+
+	/* Check that path may be removed */
+	if ( ( rc = fstatat ( AT_FDCWD, turdpath, &st,
+			      AT_SYMLINK_NOFOLLOW ) ) != 0 )
+		goto err_stat;
+	if ( dir && ! S_ISDIR ( st.st_mode ) ) {
+		errno = ENOTDIR;
+		rc = -1;
+		goto err_type;
+	}
+	if ( ( ! dir ) && S_ISDIR ( st.st_mode ) ) {
+		errno = EISDIR;
+		rc = -1;
+		goto err_type;
+	}
+	if ( dir &&
+	     ( ( rc = whiteout_empty ( layer, suffix, suffix_len ) ) != 0 ) )
+		goto err_empty;
+
+	/* Remove writable counterpart, if any */
+	wpath = malloc ( max_prefix_len + suffix_len + 1 /* NUL */ );
+	if ( ! wpath ) {
+		rc = -1;
+		goto err_wpath;
+	}
+	layer_path ( &layer->mapping->writable, wpath, suffix, suffix_len );
+	if ( ( ( rc = remove ( wpath ) ) != 0 ) && ( errno == ENOENT ) )
+		rc = 0;
+	free ( wpath );
+	if ( rc != 0 )
+		goto err_remove;
+
+	/* Record whiteout */
+	if ( ( rc = whiteout_add ( &readonly_whiteouts, layer->mapping->ns,
+				   suffix, suffix_len,
+				   S_ISLNK ( st.st_mode ) ) ) != 0 )
+		goto err_whiteout;
+
+	/* Discard any symbolic links or canonical paths recorded for
+	 * the whited-out path (or anything beneath it).
+	 */
+	cache_flush ( &layer->mapping->links );
+	cache_flush ( &layer->mapping->realpaths );
+
+	if ( nocase )
+		nocase_update ( turdpath );
+
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " [%s] %s [whiteout]\n",
+			  func, turdpath );
+	}
+
+ err_whiteout:
+ err_remove:
+ err_wpath:
+ err_empty:
+ err_type:
+ err_stat:
+ err_root:
+ done:
+	if ( turdpath != path )
+		free ( turdpath );
+ err_turdpath:
+	return rc;
+}
+
+/**
+ * Rename path
+ *
+ * @v path1		Existing path
+ * @v path2		New path
+ * @v rename		Original library function
+ * @v func		Wrapped function name (for debugging)
+ * @ret rc		Return status code
+ *
+ * If whiteouts are enabled, then renaming a path that resolves to a
+ * readonly directory is refused with EXDEV, so that the caller will
+ * fall back to copying and removing the path (as PHP's rename() does
+ * automatically).
+ */
+static int turdify_rename ( const char *path1, const char *path2,
+			    int ( * rename ) ( const char *path1,
+					       const char *path2 ),
+			    const char *func ) {
+	uint64_t start;
+	char *turdpath1;
+	char *turdpath2;
+	int rc;
+
+	/* Turdify existing path */
+	turdpath1 = turdify_path ( path1, TURD_NOFOLLOW, func );
+	if ( ! turdpath1 ) {
+		rc = -1;
+		goto err_turdpath1;
+	}
+
+	/* Refuse to rename paths subject to whiteouts */
+	if ( whiteout_layer ( turdpath1 ) ) {
+		errno = EXDEV;
+		rc = -1;
+		goto err_whiteout;
+	}
+
+	/* Turdify new path */
+	turdpath2 = turdify_path ( path2, ( TURD_MKDIRS | TURD_NOFOLLOW ),
+				   func );
+	if ( ! turdpath2 ) {
+		rc = -1;
+		goto err_turdpath2;
+	}
+
+	/* Rename path */
+	start = turd_clock();
+	rc = rename ( turdpath1, turdpath2 );
+	turd_time ( STATS_CALL, start );
+	turdify_removed ( turdpath1 );
+	turdify_created ( turdpath2 );
+
+	if ( turdpath2 != path2 )
+		free ( turdpath2 );
+ err_turdpath2:
+ err_whiteout:
+	if ( turdpath1 != path1 )
+		free ( turdpath1 );
+ err_turdpath1:
+	return rc;
+}
+
+/**
+ * Resolve canonical absolute path via turd mappings
+ *
+ * @v path		Path
+ * @v resolved		Buffer (of size PATH_MAX) to fill in, or NULL
+ * @v func		Wrapped function name (for debugging)
+ * @ret resolved	Canonical absolute path, or NULL on error
+ *
+ * The path is turdified before being passed to the original
+ * realpath(), so that the result identifies the file that would be
+ * accessed via any other wrapped function.  If the resolved buffer is
+ * NULL, then the result is allocated using malloc().
+ *
+ * The results for paths within the readonly directories are cached
+ * (if enabled), since resolving each path would otherwise require a
+ * system call for every path component.
+ */
+static char * turdify_realpath ( const char *path, char *resolved,
+				 const char *func ) {
+	static typeof ( realpath ) * orig_realpath = NULL;
+	struct layer *layer;
+	uint64_t start;
+	char *turdpath;
+	char *result;
+	void *data;
+	size_t len;
+
+	/* Get original library function */
+	origfunc ( realpath, NULL );
+
+	/* Turdify path */
+	turdpath = turdify_path ( path, 0, func );
+	if ( ! turdpath ) {
 		result = NULL;
-		goto err_canonical;
+		goto err_turdpath;
+	}
+
+	/* Use cached result, if possible */
+	layer = ( ( turdpath == path ) ? NULL : layer_find ( turdpath ) );
+	if ( layer &&
+	     cache_lookup_data ( &layer->mapping->realpaths, turdpath,
+				 strlen ( turdpath ), &data, &len ) ) {
+		if ( resolved ) {
+			memcpy ( resolved, data, len );
+			free ( data );
+			result = resolved;
+		} else {
+			result = data;
+		}
+		goto cached;
+	}
+
+	/* Call original library function */
+	start = turd_clock();
+	result = orig_realpath ( turdpath, resolved );
+	turd_time ( STATS_CALL, start );
+
+	/* Record result (including terminating NUL), if applicable */
+	if ( layer && result ) {
+		turd_evicted ( layer->mapping,
+			       cache_insert_data ( &layer->mapping->realpaths,
+						   turdpath,
+						   strlen ( turdpath ), result,
+						   ( strlen ( result ) +
+						     1 /* NUL */ ) ) );
+	}
+
+ cached:
+	if ( turdpath != path )
+		free ( turdpath );
+ err_turdpath:
+	return result;
+}
+
+/**
+ * Find union directory stream lookup slot
+ *
+ * @v dirp		Directory stream
+ * @ret slot		Lookup slot, or NULL if not found
+ */
+static struct union_slot * union_slot ( DIR *dirp ) {
+	struct union_slot *slot;
+	unsigned int i;
+	unsigned int n;
+	DIR *key;
+
+	i = ( ( ( ( uintptr_t ) dirp ) >> 4 ) % UNION_SLOTS );
+	for ( n = 0 ; n < UNION_SLOTS ; n++ ) {
+		slot = &union_slots[i];
+		key = __atomic_load_n ( &slot->dirp, __ATOMIC_ACQUIRE );
+		if ( key == dirp )
+			return slot;
+		if ( ! key )
+			break;
+		i = ( ( i + 1 ) % UNION_SLOTS );
+	}
+	return NULL;
+}
+
+/**
+ * Add union directory stream (with lock held)
+ *
+ * @v udir		Union directory stream
+ */
+static void union_add ( struct union_dir *udir ) {
+	struct union_slot *slot;
+	unsigned int i;
+	unsigned int n;
+
+	/* Use the first unused or no longer used slot, if any */
+	i = ( ( ( ( uintptr_t ) udir->dirp ) >> 4 ) % UNION_SLOTS );
+	for ( n = 0 ; n < UNION_SLOTS ; n++ ) {
+		slot = &union_slots[i];
+		if ( ( ! slot->dirp ) || ( slot->dirp == UNION_REMOVED ) ) {
+			slot->udir = udir;
+			__atomic_store_n ( &slot->dirp, udir->dirp,
+					   __ATOMIC_RELEASE );
+			goto added;
+		}
+		i = ( ( i + 1 ) % UNION_SLOTS );
+	}
+
+	/* Otherwise, add to list */
+	udir->next = union_dirs;
+	union_dirs = udir;
+	__atomic_add_fetch ( &union_overflow, 1, __ATOMIC_SEQ_CST );
+
+ added:
+	__atomic_add_fetch ( &union_count, 1, __ATOMIC_SEQ_CST );
+}
+
+/**
+ * Open union directory stream, if applicable
+ *
+ * @v dirp		Directory stream
+ * @v turdpath		Turdified path
+ *
+ * A directory within a readonly directory may have counterparts within
+ * lower readonly layers and within the writable directory (e.g.
+ * "custom/modules"), in which case the directory stream will return
+ * the entries from all of these directories.  Entries present in more
+ * than one directory are returned only once, with the file type of
+ * the topmost entry (since the turdified path will resolve to the
+ * topmost entry).
+ *
+ * Readonly directory listings are cached, if enabled.  Without any
+ * lower layers, a writable counterpart, a cache, or any whiteouts,
+ * the directory stream is left unmodified.  Whited-out readonly
+ * entries are omitted (and do not hide writable entries of the same
+ * name).
+ */
+static void union_open ( DIR *dirp, const char *turdpath ) {
+	struct union_dir *udir;
+	struct mapping *mapping;
+	struct layer *layer;
+	const char *suffix;
+	size_t suffix_len;
+	char *wpath;
+	void *data;
+	size_t len;
+	int wfd;
+
+	/* Only directories within a readonly directory need merging */
+	layer = layer_find ( turdpath );
+	if ( ! layer )
+		goto not_readonly;
+	mapping = layer->mapping;
+	suffix = &turdpath[layer->len];
+	suffix_len = strlen ( suffix );
+
+	/* Open writable counterpart directory, if any */
+	wpath = malloc ( max_prefix_len + suffix_len + 1 /* NUL */ );
+	if ( ! wpath )
+		goto err_wpath;
+	layer_path ( &mapping->writable, wpath, suffix, suffix_len );
+	wfd = openat ( AT_FDCWD, wpath,
+		       ( O_RDONLY | O_DIRECTORY | O_CLOEXEC ) );
+	if ( ( wfd < 0 ) && ( ! mapping->listings.budget ) &&
+	     ( layer == &mapping->layers[ mapping->count - 1 ] ) &&
+	     ( ! whiteout_count ( &readonly_whiteouts ) ) )
+		goto no_union;
+
+	/* Allocate union directory stream */
+	udir = calloc ( 1, sizeof ( *udir ) );
+	if ( ! udir )
+		goto err_alloc;
+	udir->dirp = dirp;
+
+	/* Get readonly directory listing (merged across all layers
+	 * containing the directory) from cache, or read it.
+	 */
+	if ( cache_lookup_data ( &mapping->listings, suffix, suffix_len,
+				 &data, &len ) ) {
+		udir->list.data = data;
+		udir->list.len = udir->list.max = len;
+	} else {
+		if ( readonly_list ( &udir->list, layer, suffix,
+				     suffix_len ) != 0 )
+			goto err_read;
+		turd_evicted ( mapping,
+			       cache_insert_data ( &mapping->listings, suffix,
+						   suffix_len,
+						   udir->list.data,
+						   udir->list.len ) );
+	}
+
+	/* Omit whited-out entries */
+	if ( whiteout_filter ( mapping, &udir->list, suffix,
+			      suffix_len ) != 0 )
+		goto err_filter;
+
+	/* Merge writable directory listing, if applicable */
+	if ( ( wfd >= 0 ) && ( dirlist_read ( &udir->list, wfd, 1 ) != 0 ) )
+		goto err_merge;
+
+	/* Add to lookup slots or list of union directory streams */
+	pthread_mutex_lock ( &union_lock );
+	union_add ( udir );
+	pthread_mutex_unlock ( &union_lock );
+
+	if ( DEBUG >= 1 ) {
+		fprintf ( stderr, PHPTURD " [opendir] %s [union%s]\n",
+			  turdpath, ( ( wfd >= 0 ) ? " merged" : "" ) );
 	}
+	if ( wfd >= 0 )
+		close ( wfd );
+	free ( wpath );
+	return;
 
-	/* Check if path lies within a turd directory */
-	if ( path_starts_with ( abspath, readonly, readonly_len ) ) {
-		suffix = &abspath[readonly_len];
-	} else if ( path_starts_with ( abspath, writable, writable_len ) ) {
-		suffix = &abspath[writable_len];
+ err_merge:
+ err_filter:
+ err_read:
+	dirlist_free ( &udir->list );
+	free ( udir );
+ err_alloc:
+	if ( wfd >= 0 )
+		close ( wfd );
+ no_union:
+	free ( wpath );
+ err_wpath:
+ not_readonly:
+	return;
+}
+
+/**
+ * Remove union directory stream
+ *
+ * @v dirp		Directory stream
+ * @ret udir		Union directory stream, or NULL if not a union
+ */
+static struct union_dir * union_remove ( DIR *dirp ) {
+	struct union_dir **prev;
+	struct union_dir *udir = NULL;
+	struct union_slot *slot;
+	unsigned int i;
+
+	/* Avoid taking the lock if there are no union streams */
+	if ( ! __atomic_load_n ( &union_count, __ATOMIC_SEQ_CST ) )
+		return NULL;
+
+	pthread_mutex_lock ( &union_lock );
+
+	/* Remove from lookup slots or list */
+	if ( ( slot = union_slot ( dirp ) ) ) {
+		udir = slot->udir;
+		__atomic_store_n ( &slot->dirp, UNION_REMOVED,
+				   __ATOMIC_RELEASE );
 	} else {
-		result = ( ( char * ) path );
-		if ( DEBUG >= 1 ) {
-			fprintf ( stderr, PHPTURD " [%s] %s [unmodified]\n",
-				  func, path );
+		for ( prev = &union_dirs ; ( udir = *prev ) ;
+		      prev = &udir->next ) {
+			if ( udir->dirp == dirp ) {
+				*prev = udir->next;
+				__atomic_sub_fetch ( &union_overflow, 1,
+						     __ATOMIC_SEQ_CST );
+				break;
+			}
 		}
-		goto no_prefix;
 	}
 
-	/* Calculate maximum result path length */
-	suffix_len = strlen ( suffix );
-	max_len = ( max_prefix_len + suffix_len );
+	/* Mark all slots as unused once no streams remain open, so
+	 * that probes remain short.
+	 */
+	if ( udir &&
+	     ( ! __atomic_sub_fetch ( &union_count, 1, __ATOMIC_SEQ_CST ) ) ) {
+		for ( i = 0 ; i < UNION_SLOTS ; i++ ) {
+			__atomic_store_n ( &union_slots[i].dirp, NULL,
+					   __ATOMIC_RELEASE );
+		}
+	}
 
-	/* Allocate result path */
-	result = malloc ( max_len + 1 /* NUL */ );
-	if ( ! result )
-		goto err_result;
+	pthread_mutex_unlock ( &union_lock );
 
-	/* Construct readonly path variant */
-	memcpy ( result, readonly, readonly_len );
-	memcpy ( ( result + readonly_len ), suffix,
-		 ( suffix_len + 1 /* NUL */ ) );
+	return udir;
+}
 
-	/* Construct writable path if readonly path does not exist */
-	if ( orig_access ( result, F_OK ) != 0 ) {
+/**
+ * Find union directory stream
+ *
+ * @v dirp		Directory stream
+ * @ret udir		Union directory stream, or NULL if not a union
+ *
+ * Streams held in a lookup slot are found without taking the lock.
+ * The lock is taken only if some streams are held in the list.
+ */
+static struct union_dir * union_find ( DIR *dirp ) {
+	struct union_slot *slot;
+	struct union_dir *udir;
 
-		/* Construct writable path */
-		memcpy ( result, writable, writable_len );
-		memcpy ( ( result + writable_len ), suffix,
-			 ( suffix_len + 1 /* NUL */ ) );
+	/* Check lookup slots, if there are any union streams */
+	if ( ! __atomic_load_n ( &union_count, __ATOMIC_SEQ_CST ) )
+		return NULL;
+	if ( ( slot = union_slot ( dirp ) ) )
+		return slot->udir;
 
-		/* Ensure that path components exist, if applicable */
-		if ( mkdirs ) {
-			create_intermediate_dirs ( result,
-						   ( result + writable_len ),
-						   ( result + writable_len +
-						     suffix_len ) );
-		}
+	/* Check list, if there are any streams in the list */
+	if ( ! __atomic_load_n ( &union_overflow, __ATOMIC_SEQ_CST ) )
+		return NULL;
+	pthread_mutex_lock ( &union_lock );
+	for ( udir = union_dirs ; udir ; udir = udir->next ) {
+		if ( udir->dirp == dirp )
+			break;
 	}
+	pthread_mutex_unlock ( &union_lock );
 
-	/* Dump debug information */
-	if ( DEBUG >= 1 ) {
-		fprintf ( stderr, PHPTURD " [%s] %s => %s => %s\n",
-			  func, path, abspath, result );
-	}
+	return udir;
+}
 
- err_result:
- no_prefix:
-	free ( abspath );
- err_canonical:
- bypass:
- err_malformed:
- err_strdup:
- no_turd:
- err_dlsym:
-	return result;
+/**
+ * Read next entry from union directory stream
+ *
+ * @v udir		Union directory stream
+ * @ret dirent		Raw directory entry, or NULL at end of directory
+ */
+static struct walk_dirent64 * union_next ( struct union_dir *udir ) {
+	struct walk_dirent64 *dirent;
+
+	dirent = dirlist_entry ( &udir->list, udir->offset );
+	if ( dirent )
+		udir->offset = dirent->d_off;
+	return dirent;
 }
 
 /**
- * Turdify a library call taking a single path parameter
+ * Fill in directory entry from union directory stream
+ *
+ * @v udir		Union directory stream
+ * @v entry		Directory entry to fill in
+ * @ret entry		Directory entry, or NULL at end of directory
+ */
+#define union_fill( udir, entry ) ( {					\
+	struct walk_dirent64 *raw = union_next ( udir );		\
+	if ( raw ) {							\
+		(entry)->d_ino = raw->d_ino;				\
+		(entry)->d_off = raw->d_off;				\
+		(entry)->d_reclen = sizeof ( *(entry) );		\
+		(entry)->d_type = raw->d_type;				\
+		memcpy ( (entry)->d_name, raw->d_name,			\
+			 ( strlen ( raw->d_name ) + 1 /* NUL */ ) );	\
+	}								\
+	( raw ? (entry) : NULL ); } )
+
+/**
+ * Scan directory via union directory stream
  *
- * @v rtype		Return type
  * @v func		Library function
+ * @v dirent_t		Directory entry type
+ * @v readdir		Directory entry reading function
  * @v path		Path
- * @v mkdirs		Create intermediate directories if needed
- * @v ...		Turdified call arguments
+ * @v namelist		List of directory entries to fill in
+ * @v filter		Directory entry filter (or NULL)
+ * @v compar		Directory entry comparator (or NULL)
+ *
+ * The C library's own scandir() uses internal directory stream
+ * functions that bypass the wrapped opendir() and readdir(), and so
+ * would see neither turdified paths nor merged listings.
  */
-#define turdwrap1( rtype, func, path, mkdirs, ... ) do {		\
-	static typeof ( func ) * orig_ ## func = NULL;			\
-	char *turdpath;							\
-	rtype ret;							\
+#define turdscandir( func, dirent_t, readdir, path, namelist, filter,	\
+		     compar ) do {					\
+	static unsigned int stats_ ## func = 0;				\
+	struct dirent_t **list = NULL;					\
+	struct dirent_t **tmp;						\
+	struct dirent_t *entry;						\
+	struct dirent_t *copy;						\
+	size_t count = 0;						\
+	size_t max = 0;							\
+	size_t len;							\
+	DIR *dirp;							\
+	int err;							\
+	int rc;								\
 									\
-	/* Get original library function */				\
-	if ( ! orig_ ## func ) {					\
-		orig_ ## func = dlsym ( RTLD_NEXT, #func );		\
-		if ( ! orig_ ## func ) {				\
-			ret = rtype ## _error_return;			\
-			errno = ENOSYS;					\
-			goto err_dlsym;					\
+	/* Start recording statistics */				\
+	turd_begin ( &stats_ ## func, #func );				\
+									\
+	/* Open (turdified and merged) directory stream */		\
+	dirp = opendir ( path );					\
+	if ( ! dirp )							\
+		goto err_opendir;					\
+									\
+	/* Read and filter directory entries */				\
+	while ( ( errno = 0, entry = readdir ( dirp ) ) ) {		\
+		if ( (filter) && ! (filter) ( entry ) )			\
+			continue;					\
+		if ( count == max ) {					\
+			max = ( max ? ( max * 2 ) : 16 );		\
+			tmp = realloc ( list, ( max *			\
+						sizeof ( list[0] ) ) );	\
+			if ( ! tmp )					\
+				goto err_alloc;				\
+			list = tmp;					\
 		}							\
+		len = ( offsetof ( struct dirent_t, d_name ) +		\
+			strlen ( entry->d_name ) + 1 /* NUL */ );	\
+		copy = malloc ( len );					\
+		if ( ! copy )						\
+			goto err_alloc;					\
+		memcpy ( copy, entry, len );				\
+		list[count++] = copy;					\
 	}								\
+	if ( errno )							\
+		goto err_readdir;					\
+	closedir ( dirp );						\
 									\
-	/* Turdify path */						\
-	turdpath = turdify_path ( path, mkdirs, #func );		\
-	if ( ! turdpath ) {						\
-		ret = rtype ## _error_return;				\
-		goto err_turdpath;					\
+	/* Sort directory entries, if applicable */			\
+	if ( compar ) {							\
+		qsort ( list, count, sizeof ( list[0] ),		\
+			( ( int ( * ) ( const void *, const void * ) )	\
+			  (compar) ) );					\
 	}								\
 									\
-	/* Call original library function */				\
-	ret = orig_ ## func ( __VA_ARGS__ );				\
-									\
-	err_turdpath:							\
-									\
-	/* Free turdified path, if applicable */			\
-	if ( turdpath != path )						\
-		free ( turdpath );					\
-									\
-	err_dlsym:							\
+	*(namelist) = list;						\
+	rc = count;							\
+	goto done;							\
 									\
-	/* Return value from original library function */		\
-	return ret;							\
+ err_readdir:								\
+ err_alloc:								\
+	err = errno;							\
+	while ( count )							\
+		free ( list[--count] );					\
+	free ( list );							\
+	closedir ( dirp );						\
+	errno = err;							\
+ err_opendir:								\
+	rc = -1;							\
+ done:									\
+	/* Finish recording statistics */				\
+	turd_resume ( stats_ ## func );					\
+	turd_end ( rc < 0 );						\
+	return rc;							\
 									\
 	} while ( 0 )
 
 /**
- * Turdify a library call taking two path parameters
+ * Open directory stream for glob()
+ *
+ * @v path		Path
+ * @ret dirp		Directory stream, or NULL on error
+ */
+static void * glob_opendir ( const char *path ) {
+
+	return opendir ( path );
+}
+
+/**
+ * Read directory entry for glob()
+ *
+ * @v dirp		Directory stream
+ * @ret dirent		Directory entry, or NULL at end of directory
+ */
+static struct dirent * glob_readdir ( void *dirp ) {
+
+	return readdir ( dirp );
+}
+
+/**
+ * Read directory entry for glob64()
+ *
+ * @v dirp		Directory stream
+ * @ret dirent		Directory entry, or NULL at end of directory
+ */
+static struct dirent64 * glob_readdir64 ( void *dirp ) {
+
+	return readdir64 ( dirp );
+}
+
+/**
+ * Close directory stream for glob()
+ *
+ * @v dirp		Directory stream
+ */
+static void glob_closedir ( void *dirp ) {
+
+	closedir ( dirp );
+}
+
+/**
+ * Get file status for glob64()
+ *
+ * @v path		Path
+ * @v buf		File status to fill in
+ * @v flags		Flags for fstatat64()
+ * @v stats		Wrapped function index (for statistics)
+ * @v func		Wrapped function name (for statistics and debugging)
+ * @ret rc		Return status code
+ *
+ * The status calls are counted as the equivalent wrapped functions,
+ * as for the status calls made via glob().
+ */
+static int glob_fstatat64 ( const char *path, struct stat64 *buf,
+			    int flags, unsigned int *stats,
+			    const char *func ) {
+	uint64_t start;
+	char *turdpath;
+	int rc;
+
+	turd_begin ( stats, func );
+	turdpath = turdify_path ( path, ( ( flags & AT_SYMLINK_NOFOLLOW ) ?
+					  TURD_NOFOLLOW : 0 ), func );
+	if ( ! turdpath ) {
+		rc = -1;
+		goto err_turdpath;
+	}
+	start = turd_clock();
+	rc = fstatat64 ( AT_FDCWD, turdpath, buf, flags );
+	turd_time ( STATS_CALL, start );
+	if ( turdpath != path )
+		free ( turdpath );
+ err_turdpath:
+	turd_end ( rc != 0 );
+	return rc;
+}
+
+/**
+ * Get file status (following symbolic links) for glob64()
+ *
+ * @v path		Path
+ * @v buf		File status to fill in
+ * @ret rc		Return status code
+ */
+static int glob_stat64 ( const char *path, struct stat64 *buf ) {
+	static unsigned int stats_stat = 0;
+
+	return glob_fstatat64 ( path, buf, 0, &stats_stat, "stat" );
+}
+
+/**
+ * Get file status (without following symbolic links) for glob64()
+ *
+ * @v path		Path
+ * @v buf		File status to fill in
+ * @ret rc		Return status code
+ */
+static int glob_lstat64 ( const char *path, struct stat64 *buf ) {
+	static unsigned int stats_lstat = 0;
+
+	return glob_fstatat64 ( path, buf, AT_SYMLINK_NOFOLLOW,
+				&stats_lstat, "lstat" );
+}
+
+/**
+ * Turdify a glob() call
  *
- * @v rtype		Return type
  * @v func		Library function
- * @v path1		Path one
- * @v mkdirs1		Create path one intermediate directories if needed
- * @v path2		Path two
- * @v mkdirs2		Create path two intermediate directories if needed
- * @v ...		Turdified call arguments
+ * @v readdir		Directory entry reading function for glob()
+ * @v stat		File status function for glob()
+ * @v lstat		File status function (without following links)
+ * @v pattern		Pattern
+ * @v flags		Flags
+ * @v errfunc		Error function
+ * @v pglob		Glob structure
+ *
+ * The C library's own directory access functions bypass the wrapped
+ * functions.  The C library's pattern matching is used, but with
+ * directory access (unless already overridden by the caller) via the
+ * wrapped functions, and hence via union directory streams.
+ *
+ * The directory access functions record their own statistics
+ * (overwriting the wrapped function recorded for the current call),
+ * so the call itself is recorded as glob() again once it returns.
+ * The caller's flags are left unmodified, and any directory access
+ * functions within the caller's glob structure are restored before
+ * returning.
  */
-#define turdwrap2( rtype, func, path1, mkdirs1, path2, mkdirs2,		\
-		   ... ) do {						\
+#define turdglob( func, readdir, stat, lstat, pattern, flags,		\
+		  errfunc, pglob ) do {					\
 	static typeof ( func ) * orig_ ## func = NULL;			\
-	char *turdpath1;						\
-	char *turdpath2;						\
-	rtype ret;							\
+	static unsigned int stats_ ## func = 0;				\
+	typeof ( *(pglob) ) saved;					\
+	int altflags = (flags);						\
+	int rc;								\
 									\
 	/* Get original library function */				\
-	if ( ! orig_ ## func ) {					\
-		orig_ ## func = dlsym ( RTLD_NEXT, #func );		\
-		if ( ! orig_ ## func ) {				\
-			ret = rtype ## _error_return;			\
-			errno = ENOSYS;					\
-			goto err_dlsym;					\
-		}							\
-	}								\
+	origfunc ( func, GLOB_ABORTED );				\
 									\
-	/* Turdify path one */						\
-	turdpath1 = turdify_path ( path1, mkdirs1, #func );		\
-	if ( ! turdpath1 ) {						\
-		ret = rtype ## _error_return;				\
-		goto err_turdpath1;					\
-	}								\
+	/* Start recording statistics */				\
+	turd_begin ( &stats_ ## func, #func );				\
 									\
-	/* Turdify path two */						\
-	turdpath2 = turdify_path ( path2, mkdirs2, #func );		\
-	if ( ! turdpath2 ) {						\
-		ret = rtype ## _error_return;				\
-		goto err_turdpath2;					\
+	/* Use wrapped directory access functions, if applicable */	\
+	if ( ! ( (flags) & GLOB_ALTDIRFUNC ) ) {			\
+		memcpy ( &saved, (pglob), sizeof ( saved ) );		\
+		(pglob)->gl_opendir = glob_opendir;			\
+		(pglob)->gl_readdir = readdir;				\
+		(pglob)->gl_closedir = glob_closedir;			\
+		(pglob)->gl_stat = stat;				\
+		(pglob)->gl_lstat = lstat;				\
+		altflags |= GLOB_ALTDIRFUNC;				\
 	}								\
 									\
 	/* Call original library function */				\
-	ret = orig_ ## func ( __VA_ARGS__ );				\
-									\
-	err_turdpath2:							\
-									\
-	/* Free turdified path two, if applicable */			\
-	if ( turdpath2 != path2 )					\
-		free ( turdpath2 );					\
+	rc = orig_ ## func ( pattern, altflags, errfunc, pglob );	\
 									\
-	err_turdpath1:							\
-									\
-	/* Free turdified path one, if applicable */			\
-	if ( turdpath1 != path1 )					\
-		free ( turdpath1 );					\
-									\
-	err_dlsym:							\
+	/* Restore caller's directory access functions */		\
+	if ( ! ( (flags) & GLOB_ALTDIRFUNC ) ) {			\
+		(pglob)->gl_opendir = saved.gl_opendir;			\
+		(pglob)->gl_readdir = saved.gl_readdir;			\
+		(pglob)->gl_closedir = saved.gl_closedir;		\
+		(pglob)->gl_stat = saved.gl_stat;			\
+		(pglob)->gl_lstat = saved.gl_lstat;			\
+		(pglob)->gl_flags &= ~GLOB_ALTDIRFUNC;			\
+	}								\
 									\
-	/* Return value from original library function */		\
-	return ret;							\
+	/* Finish recording statistics */				\
+	turd_resume ( stats_ ## func );					\
+	turd_end ( rc != 0 );						\
+	return rc;							\
 									\
 	} while ( 0 )
 
@@ -535,17 +4376,67 @@ static char * turdify_path ( const char *path, int mkdirs, const char *func ) {
  */
 
 int __lxstat ( int ver, const char *path, struct stat *buf ) {
-	turdwrap1 ( int, __lxstat, path, 0, ver, turdpath, buf );
+	turdwrap1 ( int, __lxstat, path, TURD_NOFOLLOW, ver, turdpath, buf );
+}
+
+char * __realpath_chk ( const char *path, char *resolved,
+			size_t resolvedlen ) {
+	static typeof ( __realpath_chk ) * orig___realpath_chk = NULL;
+	static unsigned int stats___realpath_chk = 0;
+	char *result;
+
+	/* Let the original function report an undersized buffer */
+	if ( resolvedlen < PATH_MAX ) {
+		origfunc ( __realpath_chk, NULL );
+		return orig___realpath_chk ( path, resolved, resolvedlen );
+	}
+	turd_begin ( &stats___realpath_chk, "__realpath_chk" );
+	result = turdify_realpath ( path, resolved, "__realpath_chk" );
+	turd_end ( result == NULL );
+	return result;
 }
 
 int __xstat ( int ver, const char *path, struct stat *buf ) {
 	turdwrap1 ( int, __xstat, path, 0, ver, turdpath, buf );
 }
 
+int accept ( int sockfd, __SOCKADDR_ARG addr, socklen_t *addrlen ) {
+	static typeof ( accept ) * orig_accept = NULL;
+	int fd;
+
+	origfunc ( accept, -1 );
+	fd = orig_accept ( sockfd, addr, addrlen );
+	if ( ( fd >= 0 ) && slowlog )
+		request_start ( fd );
+	return fd;
+}
+
+int accept4 ( int sockfd, __SOCKADDR_ARG addr, socklen_t *addrlen,
+	      int flags ) {
+	static typeof ( accept4 ) * orig_accept4 = NULL;
+	int fd;
+
+	origfunc ( accept4, -1 );
+	fd = orig_accept4 ( sockfd, addr, addrlen, flags );
+	if ( ( fd >= 0 ) && slowlog )
+		request_start ( fd );
+	return fd;
+}
+
 int access ( const char *path, int mode ) {
 	turdwrap1 ( int, access, path, 0, turdpath, mode );
 }
 
+char * canonicalize_file_name ( const char *path ) {
+	static unsigned int stats_canonicalize_file_name = 0;
+	char *result;
+
+	turd_begin ( &stats_canonicalize_file_name, "canonicalize_file_name" );
+	result = turdify_realpath ( path, NULL, "canonicalize_file_name" );
+	turd_end ( result == NULL );
+	return result;
+}
+
 int chdir ( const char *path ) {
 	turdwrap1 ( int, chdir, path, 0, turdpath );
 }
@@ -558,14 +4449,40 @@ int chown ( const char *path, uid_t owner, gid_t group ) {
 	turdwrap1 ( int, chown, path, 0, turdpath, owner, group );
 }
 
+int close ( int fd ) {
+	static typeof ( close ) * orig_close = NULL;
+
+	/* Finish the current request only if this is its connection.
+	 * The request is thread-local, so the comparison is the only
+	 * work done when closing any other descriptor (including those
+	 * closed from within the library itself).
+	 */
+	if ( ( fd == request.fd ) && ( fd >= 0 ) )
+		request_finish();
+	origfunc ( close, -1 );
+	return orig_close ( fd );
+}
+
+int closedir ( DIR *dirp ) {
+	static typeof ( closedir ) * orig_closedir = NULL;
+	struct union_dir *udir;
+
+	if ( ( udir = union_remove ( dirp ) ) ) {
+		dirlist_free ( &udir->list );
+		free ( udir );
+	}
+	origfunc ( closedir, -1 );
+	return orig_closedir ( dirp );
+}
+
 int creat ( const char *path, mode_t mode ) {
-	turdwrap1 ( int, creat, path, 1, turdpath, mode );
+	turdwrap1 ( int, creat, path, TURD_MKDIRS, turdpath, mode );
 }
 
 FILE * fopen ( const char *path, const char *mode ) {
 	turdwrap1 ( FILE_ptr, fopen, path,
-		    ( ( mode[0] == 'w' ) | ( mode[0] == 'a' ) ),
-		    turdpath, mode );
+		    ( ( ( mode[0] == 'w' ) | ( mode[0] == 'a' ) ) ?
+		      TURD_MKDIRS : 0 ), turdpath, mode );
 }
 
 int getfilecon ( const char *path, security_context_t *con ) {
@@ -577,21 +4494,38 @@ ssize_t getxattr ( const char *path, const char *name, void *value,
 	turdwrap1 ( ssize_t, getxattr, path, 0, turdpath, name, value, size );
 }
 
+int glob ( const char *pattern, int flags,
+	   int ( * errfunc ) ( const char *epath, int eerrno ),
+	   glob_t *pglob ) {
+	turdglob ( glob, glob_readdir, stat, lstat, pattern, flags,
+		   errfunc, pglob );
+}
+
+int glob64 ( const char *pattern, int flags,
+	     int ( * errfunc ) ( const char *epath, int eerrno ),
+	     glob64_t *pglob ) {
+	turdglob ( glob64, glob_readdir64, glob_stat64, glob_lstat64,
+		   pattern, flags, errfunc, pglob );
+}
+
 int lchown ( const char *path, uid_t owner, gid_t group ) {
-	turdwrap1 ( int, lchown, path, 0, turdpath, owner, group );
+	turdwrap1 ( int, lchown, path, TURD_NOFOLLOW, turdpath, owner, group );
 }
 
 int lgetfilecon ( const char *path, security_context_t *con ) {
-	turdwrap1 ( int, lgetfilecon, path, 0, turdpath, con );
+	turdwrap1 ( int, lgetfilecon, path, TURD_NOFOLLOW, turdpath, con );
 }
 
 ssize_t lgetxattr ( const char *path, const char *name, void *value,
 		    size_t size ) {
-	turdwrap1 ( ssize_t, lgetxattr, path, 0, turdpath, name, value, size );
+	turdwrap1 ( ssize_t, lgetxattr, path, TURD_NOFOLLOW, turdpath, name,
+		    value, size );
 }
 
 int link ( const char *path1, const char *path2 ) {
-	turdwrap2 ( int, link, path1, 0, path2, 1, turdpath1, turdpath2 );
+	turdwrap2 ( int, link, path1, TURD_NOFOLLOW,
+		    path2, ( TURD_MKDIRS | TURD_NOFOLLOW ),
+		    turdpath1, turdpath2 );
 }
 
 ssize_t listxattr ( const char *path, char *list, size_t size ) {
@@ -599,45 +4533,48 @@ ssize_t listxattr ( const char *path, char *list, size_t size ) {
 }
 
 ssize_t llistxattr ( const char *path, char *list, size_t size ) {
-	turdwrap1 ( ssize_t, llistxattr, path, 0, turdpath, list, size );
+	turdwrap1 ( ssize_t, llistxattr, path, TURD_NOFOLLOW, turdpath, list,
+		    size );
 }
 
 int lremovexattr ( const char *path, const char *name ) {
-	turdwrap1 ( int, lremovexattr, path, 0, turdpath, name );
+	turdwrap1 ( int, lremovexattr, path, TURD_NOFOLLOW, turdpath, name );
 }
 
 int lsetxattr ( const char *path, const char *name, const void *value,
 		size_t size, int flags ) {
-	turdwrap1 ( int, lsetxattr, path, 0, turdpath, name, value, size,
-		    flags );
+	turdwrap1 ( int, lsetxattr, path, TURD_NOFOLLOW, turdpath, name,
+		    value, size, flags );
 }
 
 int lstat ( const char *path, struct stat *statbuf ) {
-	turdwrap1 ( int, lstat, path, 0, turdpath, statbuf );
+	turdwrap1 ( int, lstat, path, TURD_NOFOLLOW, turdpath, statbuf );
 }
 
 int mkdir ( const char *path, mode_t mode ) {
-	turdwrap1 ( int, mkdir, path, 1, turdpath, mode );
+	turdwrap1 ( int, mkdir, path, ( TURD_MKDIRS | TURD_NOFOLLOW ),
+		    turdpath, mode );
 }
 
 int mkostemp ( char *path, int flags ) {
-	turdwrap1 ( int, mkostemp, path, 1, turdpath, flags );
+	turdwrap1 ( int, mkostemp, path, TURD_MKDIRS, turdpath, flags );
 }
 
 int mkostemps ( char *path, int suffixlen, int flags ) {
-	turdwrap1 ( int, mkostemps, path, 1, turdpath, suffixlen, flags );
+	turdwrap1 ( int, mkostemps, path, TURD_MKDIRS, turdpath, suffixlen,
+		    flags );
 }
 
 int mkstemp ( char *path ) {
-	turdwrap1 ( int, mkstemp, path, 1, turdpath );
+	turdwrap1 ( int, mkstemp, path, TURD_MKDIRS, turdpath );
 }
 
 int mkstemps ( char *path, int suffixlen ) {
-	turdwrap1 ( int, mkstemps, path, 1, turdpath, suffixlen );
+	turdwrap1 ( int, mkstemps, path, TURD_MKDIRS, turdpath, suffixlen );
 }
 
 char * mktemp ( char *path ) {
-	turdwrap1 ( char_ptr, mktemp, path, 1, turdpath );
+	turdwrap1 ( char_ptr, mktemp, path, TURD_MKDIRS, turdpath );
 }
 
 int open ( const char *path, int flags, ... ) {
@@ -653,15 +4590,83 @@ int open ( const char *path, int flags, ... ) {
 	}
 	va_end ( ap );
 
-	turdwrap1 ( int, open, path, creat, turdpath, flags, mode );
+	turdwrap1 ( int, open, path, ( creat ? TURD_MKDIRS : 0 ),
+		    turdpath, flags, mode );
 }
 
 DIR * opendir ( const char *path ) {
-	turdwrap1 ( DIR_ptr, opendir, path, 0, turdpath );
+	static typeof ( opendir ) * orig_opendir = NULL;
+	static unsigned int stats_opendir = 0;
+	uint64_t start;
+	char *turdpath;
+	DIR *dirp;
+
+	/* Get original library function */
+	origfunc ( opendir, NULL );
+
+	/* Start recording statistics */
+	turd_begin ( &stats_opendir, "opendir" );
+
+	/* Turdify path */
+	turdpath = turdify_path ( path, 0, "opendir" );
+	if ( ! turdpath ) {
+		dirp = NULL;
+		goto err_turdpath;
+	}
+
+	/* Open directory stream, merging with writable counterpart
+	 * directory if applicable.
+	 */
+	start = turd_clock();
+	dirp = orig_opendir ( turdpath );
+	turd_time ( STATS_CALL, start );
+	if ( dirp && ( turdpath != path ) )
+		union_open ( dirp, turdpath );
+
+	/* Free turdified path, if applicable */
+	if ( turdpath != path )
+		free ( turdpath );
+
+ err_turdpath:
+	/* Finish recording statistics */
+	turd_end ( dirp == NULL );
+
+	return dirp;
+}
+
+struct dirent * readdir ( DIR *dirp ) {
+	static typeof ( readdir ) * orig_readdir = NULL;
+	struct union_dir *udir;
+
+	if ( ( udir = union_find ( dirp ) ) )
+		return union_fill ( udir, &udir->dirent );
+	origfunc ( readdir, NULL );
+	return orig_readdir ( dirp );
+}
+
+struct dirent64 * readdir64 ( DIR *dirp ) {
+	static typeof ( readdir64 ) * orig_readdir64 = NULL;
+	struct union_dir *udir;
+
+	if ( ( udir = union_find ( dirp ) ) )
+		return union_fill ( udir, &udir->dirent64 );
+	origfunc ( readdir64, NULL );
+	return orig_readdir64 ( dirp );
 }
 
 ssize_t readlink ( const char *path, char *buf, size_t bufsiz ) {
-	turdwrap1 ( ssize_t, readlink, path, 0, turdpath, buf, bufsiz );
+	turdwrap1 ( ssize_t, readlink, path, TURD_NOFOLLOW, turdpath, buf,
+		    bufsiz );
+}
+
+char * realpath ( const char *path, char *resolved ) {
+	static unsigned int stats_realpath = 0;
+	char *result;
+
+	turd_begin ( &stats_realpath, "realpath" );
+	result = turdify_realpath ( path, resolved, "realpath" );
+	turd_end ( result == NULL );
+	return result;
 }
 
 int removexattr ( const char *path, const char *name ) {
@@ -669,11 +4674,65 @@ int removexattr ( const char *path, const char *name ) {
 }
 
 int rename ( const char *path1, const char *path2 ) {
-	turdwrap2 ( int, rename, path1, 0, path2, 1, turdpath1, turdpath2 );
+	static typeof ( rename ) * orig_rename = NULL;
+	static unsigned int stats_rename = 0;
+	int rc;
+
+	origfunc ( rename, -1 );
+	turd_begin ( &stats_rename, "rename" );
+	rc = turdify_rename ( path1, path2, orig_rename, "rename" );
+	turd_end ( rc != 0 );
+	return rc;
+}
+
+void rewinddir ( DIR *dirp ) {
+	static typeof ( rewinddir ) * orig_rewinddir = NULL;
+	struct union_dir *udir;
+
+	if ( ( udir = union_find ( dirp ) ) )
+		udir->offset = 0;
+	origfunc ( rewinddir, );
+	orig_rewinddir ( dirp );
 }
 
 int rmdir ( const char *path ) {
-	turdwrap1 ( int, rmdir, path, 0, turdpath );
+	static typeof ( rmdir ) * orig_rmdir = NULL;
+	static unsigned int stats_rmdir = 0;
+	int rc;
+
+	origfunc ( rmdir, -1 );
+	turd_begin ( &stats_rmdir, "rmdir" );
+	rc = turdify_remove ( path, orig_rmdir, 1, "rmdir" );
+	turd_end ( rc != 0 );
+	return rc;
+}
+
+int scandir ( const char *path, struct dirent ***namelist,
+	      int ( * filter ) ( const struct dirent * ),
+	      int ( * compar ) ( const struct dirent **,
+				 const struct dirent ** ) ) {
+	turdscandir ( scandir, dirent, readdir, path, namelist, filter,
+		      compar );
+}
+
+int scandir64 ( const char *path, struct dirent64 ***namelist,
+		int ( * filter ) ( const struct dirent64 * ),
+		int ( * compar ) ( const struct dirent64 **,
+				   const struct dirent64 ** ) ) {
+	turdscandir ( scandir64, dirent64, readdir64, path, namelist, filter,
+		      compar );
+}
+
+void seekdir ( DIR *dirp, long loc ) {
+	static typeof ( seekdir ) * orig_seekdir = NULL;
+	struct union_dir *udir;
+
+	if ( ( udir = union_find ( dirp ) ) ) {
+		udir->offset = loc;
+		return;
+	}
+	origfunc ( seekdir, );
+	orig_seekdir ( dirp, loc );
 }
 
 int setxattr ( const char *path, const char *name, const void *value,
@@ -687,7 +4746,19 @@ int stat ( const char *path, struct stat *statbuf ) {
 }
 
 int symlink ( const char *path1, const char *path2 ) {
-	turdwrap2 ( int, symlink, path1, 0, path2, 1, turdpath1, turdpath2 );
+	turdwrap2 ( int, symlink, path1, TURD_NOFOLLOW,
+		    path2, ( TURD_MKDIRS | TURD_NOFOLLOW ),
+		    turdpath1, turdpath2 );
+}
+
+long telldir ( DIR *dirp ) {
+	static typeof ( telldir ) * orig_telldir = NULL;
+	struct union_dir *udir;
+
+	if ( ( udir = union_find ( dirp ) ) )
+		return udir->offset;
+	origfunc ( telldir, -1 );
+	return orig_telldir ( dirp );
 }
 
 int truncate ( const char *path, off_t length ) {
@@ -695,7 +4766,15 @@ int truncate ( const char *path, off_t length ) {
 }
 
 int unlink ( const char * path ) {
-	turdwrap1 ( int, unlink, path, 0, turdpath );
+	static typeof ( unlink ) * orig_unlink = NULL;
+	static unsigned int stats_unlink = 0;
+	int rc;
+
+	origfunc ( unlink, -1 );
+	turd_begin ( &stats_unlink, "unlink" );
+	rc = turdify_remove ( path, orig_unlink, 0, "unlink" );
+	turd_end ( rc != 0 );
+	return rc;
 }
 
 int utime ( const char *path, const struct utimbuf *times ) {
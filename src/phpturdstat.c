@@ -0,0 +1,659 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <dirent.h>
+#include "stats.h"
+
+/** Directory containing shared memory objects */
+#define SHM_DIR "/dev/shm"
+
+/** Counter column headings */
+static const char *columns[STATS_COUNTERS] = {
+	[STATS_CALLS] = "calls",
+	[STATS_BYPASS] = "bypass",
+	[STATS_NOPREFIX] = "noprefix",
+	[STATS_DIST] = "dist",
+	[STATS_SCRATCH] = "scratch",
+	[STATS_MKDIRS] = "mkdirs",
+	[STATS_HITS] = "hits",
+	[STATS_MISSES] = "misses",
+	[STATS_EVICTIONS] = "evictions",
+	[STATS_ERRORS] = "errors",
+};
+
+/** Latency phase names */
+static const char *phases[STATS_PHASES] = {
+	[STATS_TURDIFY] = "turdify",
+	[STATS_CANONICAL] = "canonical",
+	[STATS_PROBE] = "probe",
+	[STATS_MKDIR] = "mkdir",
+	[STATS_CALL] = "call",
+};
+
+/** A reported latency percentile */
+struct percentile {
+	/** Column heading */
+	const char *name;
+	/** Fraction of samples (in tenths of a percent) */
+	unsigned int permille;
+};
+
+/** Reported latency percentiles */
+static const struct percentile percentiles[] = {
+	{ "p50", 500 },
+	{ "p90", 900 },
+	{ "p99", 990 },
+	{ "p99.9", 999 },
+};
+
+/** Number of reported latency percentiles */
+#define PERCENTILES ( sizeof ( percentiles ) / sizeof ( percentiles[0] ) )
+
+/** Heavy-hitter sketch names */
+static const char *sketches[STATS_SKETCHES] = {
+	[STATS_FOUND] = "found",
+	[STATS_MISSING] = "missing",
+};
+
+/** Maximum number of merged heavy-hitter entries per sketch */
+#define MERGED_ENTRIES 1024
+
+/** Number of reported heavy-hitter paths per sketch */
+#define TOP_PATHS 20
+
+/** Aggregated statistics for a turd mapping */
+struct group {
+	/** Next group */
+	struct group *next;
+	/** Mapping description */
+	char desc[STATS_DESC_LEN];
+	/** Number of segments found in latest sample */
+	unsigned int segments;
+	/** Number of wrapped functions */
+	unsigned int funcs;
+	/** Wrapped function names */
+	char names[STATS_MAX_FUNCS][STATS_NAME_LEN];
+	/** Latest counter values */
+	uint64_t now[STATS_MAX_FUNCS][STATS_COUNTERS];
+	/** Previously reported counter values */
+	uint64_t prev[STATS_MAX_FUNCS][STATS_COUNTERS];
+	/** Latest latency histograms */
+	uint64_t hnow[STATS_MAX_FUNCS][STATS_PHASES][STATS_BUCKETS];
+	/** Previously reported latency histograms */
+	uint64_t hprev[STATS_MAX_FUNCS][STATS_PHASES][STATS_BUCKETS];
+	/** Latest merged heavy-hitter entries */
+	struct stats_entry hot[STATS_SKETCHES][MERGED_ENTRIES];
+	/** Number of latest merged heavy-hitter entries */
+	unsigned int hots[STATS_SKETCHES];
+};
+
+/**
+ * Find (or create) group
+ *
+ * @v groups		List of groups
+ * @v desc		Mapping description
+ * @ret group		Group, or NULL on error
+ */
+static struct group * find_group ( struct group **groups, const char *desc ) {
+	struct group *group;
+
+	for ( group = *groups ; group ; group = group->next ) {
+		if ( strcmp ( group->desc, desc ) == 0 )
+			return group;
+	}
+	group = calloc ( 1, sizeof ( *group ) );
+	if ( ! group )
+		return NULL;
+	strncpy ( group->desc, desc, ( sizeof ( group->desc ) - 1 ) );
+	group->next = *groups;
+	*groups = group;
+	return group;
+}
+
+/**
+ * Find (or add) wrapped function within group
+ *
+ * @v group		Group
+ * @v name		Wrapped function name
+ * @ret func		Wrapped function index, or negative if group is full
+ */
+static int find_func ( struct group *group, const char *name ) {
+	unsigned int i;
+
+	for ( i = 0 ; i < group->funcs ; i++ ) {
+		if ( strcmp ( group->names[i], name ) == 0 )
+			return i;
+	}
+	if ( group->funcs == STATS_MAX_FUNCS )
+		return -1;
+	strncpy ( group->names[i], name, ( sizeof ( group->names[i] ) - 1 ) );
+	return group->funcs++;
+}
+
+/**
+ * Merge heavy-hitter sketch entry into group
+ *
+ * @v group		Group
+ * @v sketch		Heavy-hitter sketch
+ * @v entry		Heavy-hitter sketch entry
+ *
+ * Counts (and maximum overestimates) for the same key within
+ * different shards and segments are summed.
+ */
+static void merge_entry ( struct group *group, enum stats_sketch sketch,
+			  const struct stats_entry *entry ) {
+	struct stats_entry copy;
+	struct stats_entry *merged;
+	unsigned int i;
+
+	/* Ignore unused entries */
+	memcpy ( &copy, entry, sizeof ( copy ) );
+	copy.key[ sizeof ( copy.key ) - 1 ] = '\0';
+	if ( ! copy.count )
+		return;
+
+	/* Add to existing merged entry, if any */
+	for ( i = 0 ; i < group->hots[sketch] ; i++ ) {
+		merged = &group->hot[sketch][i];
+		if ( merged->hash == copy.hash ) {
+			merged->count += copy.count;
+			merged->error += copy.error;
+			return;
+		}
+	}
+
+	/* Add new merged entry, if space remains */
+	if ( i < MERGED_ENTRIES ) {
+		memcpy ( &group->hot[sketch][i], &copy, sizeof ( copy ) );
+		group->hots[sketch]++;
+	}
+}
+
+/**
+ * Aggregate statistics segment into groups
+ *
+ * @v groups		List of groups
+ * @v name		Shared memory object name
+ * @ret rc		Return status code
+ *
+ * Segments for the same mapping (e.g. for worker processes running as
+ * different users) are aggregated into a single group.
+ */
+static int aggregate ( struct group **groups, const char *name ) {
+	struct stats stats;
+	struct group *group;
+	struct stats_hot *hot;
+	char desc[STATS_DESC_LEN];
+	char func_name[STATS_NAME_LEN];
+	uint64_t *histogram;
+	unsigned int i;
+	unsigned int j;
+	unsigned int k;
+	int func;
+	int rc;
+
+	/* Attach to segment */
+	if ( ( rc = stats_attach ( &stats, name ) ) != 0 )
+		goto err_attach;
+
+	/* Find group */
+	memcpy ( desc, stats.hdr->desc, sizeof ( desc ) );
+	desc[ sizeof ( desc ) - 1 ] = '\0';
+	group = find_group ( groups, desc );
+	if ( ! group ) {
+		rc = -1;
+		goto err_group;
+	}
+	group->segments++;
+
+	/* Add counters */
+	for ( i = 0 ; i < stats.hdr->funcs ; i++ ) {
+		memcpy ( func_name, stats.hdr->names[i], sizeof ( func_name ) );
+		func_name[ sizeof ( func_name ) - 1 ] = '\0';
+		func = find_func ( group, func_name );
+		if ( func < 0 )
+			continue;
+		for ( j = 0 ; j < STATS_COUNTERS ; j++ )
+			group->now[func][j] += stats_read ( &stats, i, j );
+		for ( j = 0 ; j < STATS_PHASES ; j++ ) {
+			histogram = &stats.histograms[ ( ( i * STATS_PHASES ) +
+							 j ) * STATS_BUCKETS ];
+			for ( k = 0 ; k < STATS_BUCKETS ; k++ ) {
+				group->hnow[func][j][k] +=
+					__atomic_load_n ( &histogram[k],
+							  __ATOMIC_RELAXED );
+			}
+		}
+	}
+
+	/* Merge heavy-hitter sketches */
+	for ( i = 0 ; i < stats.hdr->sketch_shards ; i++ ) {
+		for ( j = 0 ; j < STATS_SKETCHES ; j++ ) {
+			hot = stats_sketch ( &stats, i, j );
+			for ( k = 0 ; k < STATS_SKETCH_ENTRIES ; k++ )
+				merge_entry ( group, j, &hot->entries[k] );
+		}
+	}
+
+ err_group:
+	stats_close ( &stats );
+ err_attach:
+	return rc;
+}
+
+/**
+ * Sample all statistics segments
+ *
+ * @v groups		List of groups
+ * @ret rc		Return status code
+ */
+static int sample ( struct group **groups ) {
+	struct group *group;
+	struct dirent *dirent;
+	char name[ NAME_MAX + 2 /* "/" and NUL */ ];
+	char prefix[ sizeof ( STATS_PREFIX ) + 16 ];
+	DIR *dir;
+
+	/* Reset latest values */
+	for ( group = *groups ; group ; group = group->next ) {
+		group->segments = 0;
+		memset ( group->now, 0, sizeof ( group->now ) );
+		memset ( group->hnow, 0, sizeof ( group->hnow ) );
+		memset ( group->hots, 0, sizeof ( group->hots ) );
+	}
+
+	/* Scan for statistics segments (ignoring other format versions) */
+	snprintf ( prefix, sizeof ( prefix ), STATS_PREFIX "%u.",
+		   STATS_VERSION );
+	dir = opendir ( SHM_DIR );
+	if ( ! dir )
+		return -1;
+	while ( ( dirent = readdir ( dir ) ) ) {
+		if ( strncmp ( dirent->d_name, prefix,
+			       strlen ( prefix ) ) != 0 )
+			continue;
+		snprintf ( name, sizeof ( name ), "/%s", dirent->d_name );
+		if ( aggregate ( groups, name ) != 0 ) {
+			fprintf ( stderr, "Ignoring %s: %s\n",
+				  name, strerror ( errno ) );
+		}
+	}
+	closedir ( dir );
+
+	return 0;
+}
+
+/**
+ * Report statistics
+ *
+ * @v groups		List of groups
+ * @v all		Report functions with no activity
+ *
+ * Each report shows the activity since the previous report (or since
+ * the statistics segments were created, for the first report).
+ */
+static void report ( struct group *groups, int all ) {
+	struct group *group;
+	uint64_t total[STATS_COUNTERS];
+	uint64_t delta[STATS_COUNTERS];
+	unsigned int i;
+	unsigned int j;
+	int active;
+
+	for ( group = groups ; group ; group = group->next ) {
+
+		/* Skip groups with no remaining segments */
+		if ( ! group->segments )
+			continue;
+
+		/* Print headings */
+		printf ( "%s\n%-22s", group->desc, "function" );
+		for ( j = 0 ; j < STATS_COUNTERS ; j++ )
+			printf ( " %9s", columns[j] );
+		printf ( "\n" );
+
+		/* Print active functions */
+		memset ( total, 0, sizeof ( total ) );
+		for ( i = 0 ; i < group->funcs ; i++ ) {
+			active = all;
+			for ( j = 0 ; j < STATS_COUNTERS ; j++ ) {
+				delta[j] = ( group->now[i][j] -
+					     group->prev[i][j] );
+				total[j] += delta[j];
+				if ( delta[j] )
+					active = 1;
+			}
+			if ( ! active )
+				continue;
+			printf ( "%-22s", group->names[i] );
+			for ( j = 0 ; j < STATS_COUNTERS ; j++ )
+				printf ( " %9llu",
+					 ( ( unsigned long long ) delta[j] ) );
+			printf ( "\n" );
+		}
+
+		/* Print totals */
+		printf ( "%-22s", "total" );
+		for ( j = 0 ; j < STATS_COUNTERS ; j++ )
+			printf ( " %9llu",
+				 ( ( unsigned long long ) total[j] ) );
+		printf ( "\n\n" );
+
+		/* Record reported values */
+		memcpy ( group->prev, group->now, sizeof ( group->prev ) );
+	}
+	fflush ( stdout );
+}
+
+/**
+ * Get largest value within histogram bucket
+ *
+ * @v bucket		Histogram bucket
+ * @ret value		Largest value within bucket
+ */
+static uint64_t bucket_max ( unsigned int bucket ) {
+
+	if ( bucket == ( STATS_BUCKETS - 1 ) )
+		return stats_bucket_min ( bucket );
+	return ( stats_bucket_min ( bucket + 1 ) - 1 );
+}
+
+/**
+ * Print latency
+ *
+ * @v bucket		Histogram bucket
+ */
+static void print_latency ( unsigned int bucket ) {
+	uint64_t ns = bucket_max ( bucket );
+	char buf[16];
+
+	if ( ns < 10000 ) {
+		snprintf ( buf, sizeof ( buf ), "%lluns",
+			   ( ( unsigned long long ) ns ) );
+	} else if ( ns < 10000000 ) {
+		snprintf ( buf, sizeof ( buf ), "%.1fus", ( ns / 1000.0 ) );
+	} else {
+		snprintf ( buf, sizeof ( buf ), "%.1fms", ( ns / 1000000.0 ) );
+	}
+	printf ( " %9s", buf );
+}
+
+/**
+ * Report latency percentiles for a single phase
+ *
+ * @v name		Wrapped function name
+ * @v phase		Latency phase
+ * @v delta		Histogram of samples since previous report
+ * @v all		Report phases with no samples
+ */
+static void report_phase ( const char *name, enum stats_phase phase,
+			   const uint64_t *delta, int all ) {
+	uint64_t samples = 0;
+	uint64_t seen;
+	uint64_t want;
+	unsigned int highest = 0;
+	unsigned int bucket;
+	unsigned int i;
+
+	/* Count samples */
+	for ( bucket = 0 ; bucket < STATS_BUCKETS ; bucket++ ) {
+		samples += delta[bucket];
+		if ( delta[bucket] )
+			highest = bucket;
+	}
+	if ( ! ( samples || all ) )
+		return;
+
+	/* Print percentiles */
+	printf ( "%-22s %-9s %9llu", name, phases[phase],
+		 ( ( unsigned long long ) samples ) );
+	for ( i = 0 ; i < PERCENTILES ; i++ ) {
+		want = ( ( ( samples * percentiles[i].permille ) + 999 ) /
+			 1000 );
+		seen = 0;
+		for ( bucket = 0 ; bucket < highest ; bucket++ ) {
+			seen += delta[bucket];
+			if ( seen >= want )
+				break;
+		}
+		print_latency ( bucket );
+	}
+	print_latency ( highest );
+	printf ( "\n" );
+}
+
+/**
+ * Report latency percentiles
+ *
+ * @v groups		List of groups
+ * @v all		Report phases with no samples
+ *
+ * Each report shows the latencies sampled since the previous report
+ * (or since the statistics segments were created, for the first
+ * report).  Each percentile is reported as the largest value within
+ * the histogram bucket containing that percentile.
+ */
+static void report_latency ( struct group *groups, int all ) {
+	struct group *group;
+	uint64_t delta[STATS_BUCKETS];
+	unsigned int i;
+	unsigned int j;
+	unsigned int k;
+	unsigned int p;
+
+	for ( group = groups ; group ; group = group->next ) {
+
+		/* Skip groups with no remaining segments */
+		if ( ! group->segments )
+			continue;
+
+		/* Print headings */
+		printf ( "%s\n%-22s %-9s %9s", group->desc, "function",
+			 "phase", "samples" );
+		for ( p = 0 ; p < PERCENTILES ; p++ )
+			printf ( " %9s", percentiles[p].name );
+		printf ( " %9s\n", "max" );
+
+		/* Print sampled phases */
+		for ( i = 0 ; i < group->funcs ; i++ ) {
+			for ( j = 0 ; j < STATS_PHASES ; j++ ) {
+				for ( k = 0 ; k < STATS_BUCKETS ; k++ ) {
+					delta[k] = ( group->hnow[i][j][k] -
+						     group->hprev[i][j][k] );
+				}
+				report_phase ( group->names[i], j, delta, all );
+			}
+		}
+		printf ( "\n" );
+
+		/* Record reported values */
+		memcpy ( group->hprev, group->hnow, sizeof ( group->hprev ) );
+	}
+	fflush ( stdout );
+}
+
+/**
+ * Compare heavy-hitter entries by descending count
+ *
+ * @v first		First entry
+ * @v second		Second entry
+ * @ret diff		Difference
+ */
+static int compare_entries ( const void *first, const void *second ) {
+	const struct stats_entry *a = first;
+	const struct stats_entry *b = second;
+
+	return ( ( a->count < b->count ) - ( a->count > b->count ) );
+}
+
+/**
+ * Print heavy-hitter entry
+ *
+ * @v entry		Heavy-hitter entry
+ */
+static void print_entry ( const struct stats_entry *entry ) {
+
+	printf ( "%-8s %12llu %12llu  %s\n", "",
+		 ( ( unsigned long long ) entry->count ),
+		 ( ( unsigned long long ) entry->error ),
+		 ( entry->key[0] ? entry->key : "/" ) );
+}
+
+/**
+ * Report heavy-hitter paths
+ *
+ * @v groups		List of groups
+ *
+ * Each report shows the estimated number of library calls for each
+ * of the most frequently found (and not found) paths since the
+ * statistics segments were created, along with the maximum
+ * overestimate.
+ */
+static void report_hot ( struct group *groups ) {
+	struct group *group;
+	unsigned int i;
+	unsigned int j;
+
+	for ( group = groups ; group ; group = group->next ) {
+
+		/* Skip groups with no remaining segments */
+		if ( ! group->segments )
+			continue;
+
+		/* Print most frequent paths from each sketch */
+		printf ( "%s\n", group->desc );
+		for ( i = 0 ; i < STATS_SKETCHES ; i++ ) {
+			printf ( "%-8s %12s %12s  %s\n", sketches[i], "calls",
+				 "error", "path" );
+			qsort ( group->hot[i], group->hots[i],
+				sizeof ( group->hot[i][0] ), compare_entries );
+			for ( j = 0 ; ( ( j < group->hots[i] ) &&
+					( j < TOP_PATHS ) ) ; j++ ) {
+				print_entry ( &group->hot[i][j] );
+			}
+		}
+		printf ( "\n" );
+	}
+	fflush ( stdout );
+}
+
+/**
+ * Print usage information
+ *
+ * @v argv0		Program name
+ */
+static void usage ( const char *argv0 ) {
+
+	fprintf ( stderr, "Usage: %s [-a] [-l] [-t] [<interval> [<count>]]\n"
+		  "\n"
+		  "Report library call statistics for all turd mappings\n"
+		  "\n"
+		  "  -a          Include functions with no activity\n"
+		  "  -l          Report sampled latency percentiles\n"
+		  "  -t          Report most frequently probed paths\n",
+		  argv0 );
+}
+
+int main ( int argc, char **argv ) {
+	struct group *groups = NULL;
+	unsigned long interval = 0;
+	unsigned long count = 0;
+	unsigned long reports;
+	char *end;
+	int latency = 0;
+	int hot = 0;
+	int all = 0;
+	int c;
+
+	/* Parse command line */
+	while ( ( c = getopt ( argc, argv, "alth" ) ) != -1 ) {
+		switch ( c ) {
+		case 'a':
+			all = 1;
+			break;
+		case 'l':
+			latency = 1;
+			break;
+		case 't':
+			hot = 1;
+			break;
+		case 'h':
+			usage ( argv[0] );
+			exit ( EXIT_SUCCESS );
+		default:
+			usage ( argv[0] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	if ( ( argc - optind ) > 2 ) {
+		usage ( argv[0] );
+		exit ( EXIT_FAILURE );
+	}
+	if ( optind < argc ) {
+		interval = strtoul ( argv[optind], &end, 0 );
+		if ( *end || ( ! interval ) ) {
+			fprintf ( stderr, "Invalid interval: %s\n",
+				  argv[optind] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+	if ( ( optind + 1 ) < argc ) {
+		count = strtoul ( argv[ optind + 1 ], &end, 0 );
+		if ( *end || ( ! count ) ) {
+			fprintf ( stderr, "Invalid count: %s\n",
+				  argv[ optind + 1 ] );
+			exit ( EXIT_FAILURE );
+		}
+	}
+
+	/* Report statistics, repeatedly if applicable */
+	for ( reports = 0 ; ; ) {
+		if ( sample ( &groups ) != 0 ) {
+			perror ( SHM_DIR );
+			exit ( EXIT_FAILURE );
+		}
+		if ( ( ! reports ) && ( ! groups ) ) {
+			fprintf ( stderr, "No statistics found\n" );
+			exit ( EXIT_FAILURE );
+		}
+		if ( hot ) {
+			report_hot ( groups );
+		} else if ( latency ) {
+			report_latency ( groups, all );
+		} else {
+			report ( groups, all );
+		}
+		reports++;
+		if ( ( ! interval ) || ( count && ( reports >= count ) ) )
+			break;
+		sleep ( interval );
+	}
+
+	return 0;
+}
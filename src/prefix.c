@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "prefix.h"
+
+/**
+ * Get edge label
+ *
+ * @v trie		Prefix trie
+ * @v node		Node index
+ * @ret label		Edge label
+ */
+static inline const char * prefix_label ( const struct prefix_trie *trie,
+					  uint32_t node ) {
+
+	return ( trie->pool + trie->nodes[node].label );
+}
+
+/**
+ * Find child node
+ *
+ * @v trie		Prefix trie
+ * @v node		Parent node index
+ * @v byte		First byte of edge label
+ * @ret child		Child node index, or zero if not found
+ */
+static inline uint32_t prefix_child ( const struct prefix_trie *trie,
+				      uint32_t node, char byte ) {
+	uint32_t child;
+
+	for ( child = trie->nodes[node].child ; child ;
+	      child = trie->nodes[child].sibling ) {
+		if ( *prefix_label ( trie, child ) == byte )
+			break;
+	}
+	return child;
+}
+
+/**
+ * Allocate node
+ *
+ * @v trie		Prefix trie
+ * @ret node		Node index, or zero on error (or for the root node)
+ */
+static uint32_t prefix_alloc ( struct prefix_trie *trie ) {
+	struct prefix_node *nodes;
+	uint32_t max;
+
+	/* Grow node array if necessary */
+	if ( trie->count == trie->max ) {
+		max = ( trie->max ? ( trie->max * 2 ) : 64 );
+		nodes = realloc ( trie->nodes, ( max * sizeof ( nodes[0] ) ) );
+		if ( ! nodes )
+			return 0;
+		trie->nodes = nodes;
+		trie->max = max;
+	}
+
+	/* Initialise node */
+	memset ( &trie->nodes[trie->count], 0, sizeof ( trie->nodes[0] ) );
+	return trie->count++;
+}
+
+/**
+ * Add string to string pool
+ *
+ * @v trie		Prefix trie
+ * @v string		String
+ * @v len		Length of string
+ * @v offset		Offset within string pool to fill in
+ * @ret rc		Return status code
+ */
+static int prefix_string ( struct prefix_trie *trie, const char *string,
+			   size_t len, uint32_t *offset ) {
+	size_t max;
+	char *pool;
+
+	/* Grow string pool if necessary */
+	if ( ( trie->pool_len + len ) > trie->pool_max ) {
+		for ( max = ( trie->pool_max ? trie->pool_max : 256 ) ;
+		      max < ( trie->pool_len + len ) ; max *= 2 ) {}
+		if ( max > UINT32_MAX ) {
+			errno = ENOMEM;
+			return -1;
+		}
+		pool = realloc ( trie->pool, max );
+		if ( ! pool )
+			return -1;
+		trie->pool = pool;
+		trie->pool_max = max;
+	}
+
+	/* Append string */
+	memcpy ( ( trie->pool + trie->pool_len ), string, len );
+	*offset = trie->pool_len;
+	trie->pool_len += len;
+
+	return 0;
+}
+
+/**
+ * Add prefix to trie
+ *
+ * @v trie		Prefix trie
+ * @v prefix		Prefix directory (without trailing '/')
+ * @v len		Length of prefix
+ * @v value		Value
+ * @ret rc		Return status code
+ *
+ * A duplicate prefix is rejected with EEXIST.
+ */
+int prefix_add ( struct prefix_trie *trie, const char *prefix, size_t len,
+		 void *value ) {
+	const char *label;
+	uint32_t node;
+	uint32_t child;
+	uint32_t split;
+	uint32_t common;
+	size_t i;
+
+	/* Allocate root node, if necessary */
+	if ( ! trie->count ) {
+		prefix_alloc ( trie );
+		if ( ! trie->count )
+			return -1;
+	}
+
+	/* Find or create node for each edge */
+	for ( node = 0, i = 0 ; i < len ; node = child, i += common ) {
+
+		/* Create new leaf node if no edge matches */
+		child = prefix_child ( trie, node, prefix[i] );
+		if ( ! child ) {
+			child = prefix_alloc ( trie );
+			if ( ! child )
+				return -1;
+			if ( prefix_string ( trie, &prefix[i], ( len - i ),
+					     &trie->nodes[child].label ) != 0 )
+				return -1;
+			trie->nodes[child].len = ( len - i );
+			trie->nodes[child].sibling = trie->nodes[node].child;
+			trie->nodes[node].child = child;
+			node = child;
+			break;
+		}
+
+		/* Find length of common prefix of edge label */
+		label = prefix_label ( trie, child );
+		for ( common = 0 ; ( ( common < trie->nodes[child].len ) &&
+				     ( ( i + common ) < len ) ) ; common++ ) {
+			if ( label[common] != prefix[ i + common ] )
+				break;
+		}
+		if ( common == trie->nodes[child].len )
+			continue;
+
+		/* Split edge at end of common prefix, replacing the
+		 * child with an intermediate node in the sibling list.
+		 */
+		split = prefix_alloc ( trie );
+		if ( ! split )
+			return -1;
+		trie->nodes[split].label = trie->nodes[child].label;
+		trie->nodes[split].len = common;
+		trie->nodes[split].child = child;
+		trie->nodes[split].sibling = trie->nodes[child].sibling;
+		trie->nodes[child].label += common;
+		trie->nodes[child].len -= common;
+		trie->nodes[child].sibling = 0;
+		if ( trie->nodes[node].child == child ) {
+			trie->nodes[node].child = split;
+		} else {
+			for ( node = trie->nodes[node].child ;
+			      trie->nodes[node].sibling != child ;
+			      node = trie->nodes[node].sibling ) {}
+			trie->nodes[node].sibling = split;
+		}
+		child = split;
+	}
+
+	/* Record value */
+	if ( trie->nodes[node].value ) {
+		errno = EEXIST;
+		return -1;
+	}
+	trie->nodes[node].value = value;
+
+	return 0;
+}
+
+/**
+ * Find node for prefix
+ *
+ * @v trie		Prefix trie
+ * @v prefix		Prefix directory (without trailing '/')
+ * @v len		Length of prefix
+ * @ret node		Node index, or zero if not found
+ */
+static uint32_t prefix_find ( const struct prefix_trie *trie,
+			      const char *prefix, size_t len ) {
+	uint32_t node;
+	size_t i;
+
+	for ( node = 0, i = 0 ; i < len ; i += trie->nodes[node].len ) {
+		node = prefix_child ( trie, node, prefix[i] );
+		if ( ( ! node ) ||
+		     ( trie->nodes[node].len > ( len - i ) ) ||
+		     ( memcmp ( &prefix[i], prefix_label ( trie, node ),
+				trie->nodes[node].len ) != 0 ) )
+			return 0;
+	}
+	return node;
+}
+
+/**
+ * Remove prefix from trie
+ *
+ * @v trie		Prefix trie
+ * @v prefix		Prefix directory (without trailing '/')
+ * @v len		Length of prefix
+ * @v value		Value
+ *
+ * The prefix is removed only if it has the specified value.  Nodes
+ * are not freed.
+ */
+void prefix_remove ( struct prefix_trie *trie, const char *prefix,
+		     size_t len, void *value ) {
+	uint32_t node;
+
+	/* Find node */
+	if ( ! trie->count )
+		return;
+	node = prefix_find ( trie, prefix, len );
+	if ( len && ! node )
+		return;
+
+	/* Clear value */
+	if ( trie->nodes[node].value == value )
+		trie->nodes[node].value = NULL;
+}
+
+/**
+ * Find longest prefix directory containing path
+ *
+ * @v trie		Prefix trie
+ * @v path		Canonicalised absolute path
+ * @v len		Length of matched prefix to fill in
+ * @ret value		Value, or NULL if no prefix directory contains path
+ *
+ * A prefix matches only at a path component boundary, i.e. if the
+ * path is either equal to the prefix or continues with a '/'.
+ */
+void * prefix_match ( const struct prefix_trie *trie, const char *path,
+		      size_t *len ) {
+	const struct prefix_node *nodes = trie->nodes;
+	void *value = NULL;
+	uint32_t node;
+	size_t i;
+
+	/* Walk trie */
+	if ( ! trie->count )
+		return NULL;
+	for ( node = 0, i = 0 ; ; i += nodes[node].len ) {
+
+		/* Record longest matching prefix */
+		if ( nodes[node].value &&
+		     ( ( path[i] == '/' ) || ( path[i] == '\0' ) ) ) {
+			value = nodes[node].value;
+			*len = i;
+		}
+
+		/* Move to child node (comparing the whole edge label,
+		 * and stopping at the end of the path)
+		 */
+		if ( path[i] == '\0' )
+			break;
+		node = prefix_child ( trie, node, path[i] );
+		if ( ( ! node ) ||
+		     ( strncmp ( &path[i], prefix_label ( trie, node ),
+				 nodes[node].len ) != 0 ) )
+			break;
+	}
+
+	return value;
+}
+
+/**
+ * Free prefix trie
+ *
+ * @v trie		Prefix trie
+ */
+void prefix_free ( struct prefix_trie *trie ) {
+
+	free ( trie->nodes );
+	free ( trie->pool );
+	memset ( trie, 0, sizeof ( *trie ) );
+}
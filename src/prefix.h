@@ -0,0 +1,83 @@
+#ifndef _PREFIX_H
+#define _PREFIX_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Directory prefix trie
+ *
+ * A set of directory prefixes is compiled into a path-compressed
+ * trie, so that finding the longest prefix directory containing a
+ * path costs a single pass over the path, regardless of the number of
+ * prefixes.  Each node is reached via an edge labelled with a string
+ * (rather than a single byte), so that a run of bytes shared by all
+ * prefixes below a node (such as a common parent directory) is
+ * compared using a single string comparison.  Nodes are stored in a
+ * single array, with the children of each node (which have distinct
+ * first label bytes) held in a sibling list.  Labels are stored in a
+ * single string pool.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#pragma GCC visibility push ( hidden )
+
+/** A prefix trie node */
+struct prefix_node {
+	/** Value (if a prefix ends at this node), or NULL */
+	void *value;
+	/** Offset of edge label within string pool */
+	uint32_t label;
+	/** Length of edge label */
+	uint32_t len;
+	/** Index of first child node, or zero */
+	uint32_t child;
+	/** Index of next sibling node, or zero */
+	uint32_t sibling;
+};
+
+/** A prefix trie */
+struct prefix_trie {
+	/** Nodes (node zero is the root) */
+	struct prefix_node *nodes;
+	/** Number of nodes */
+	uint32_t count;
+	/** Number of allocated nodes */
+	uint32_t max;
+	/** String pool */
+	char *pool;
+	/** Length of string pool */
+	size_t pool_len;
+	/** Allocated length of string pool */
+	size_t pool_max;
+};
+
+extern int prefix_add ( struct prefix_trie *trie, const char *prefix,
+			size_t len, void *value );
+extern void prefix_remove ( struct prefix_trie *trie, const char *prefix,
+			    size_t len, void *value );
+extern void * prefix_match ( const struct prefix_trie *trie,
+			     const char *path, size_t *len );
+extern void prefix_free ( struct prefix_trie *trie );
+
+#pragma GCC visibility pop
+
+#endif /* _PREFIX_H */
@@ -0,0 +1,57 @@
+#ifndef _PROBE_H
+#define _PROBE_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Static tracing probes
+ *
+ * Probes are defined using the SystemTap SDT interface (if available
+ * at build time), and may be used by tracing tools such as bpftrace
+ * or perf.  Each probe compiles to a single no-op instruction, with
+ * the location of the probe and its arguments recorded in an ELF
+ * note, and so costs nothing unless a tracer is attached.
+ *
+ * All probes use the provider name "phpturd".
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define turd_probe1( name, a ) \
+	DTRACE_PROBE1 ( phpturd, name, a )
+#define turd_probe2( name, a, b ) \
+	DTRACE_PROBE2 ( phpturd, name, a, b )
+#define turd_probe3( name, a, b, c ) \
+	DTRACE_PROBE3 ( phpturd, name, a, b, c )
+
+#else /* HAVE_SYS_SDT_H */
+
+#define turd_probe1( name, a ) \
+	do { ( void ) (a); } while ( 0 )
+#define turd_probe2( name, a, b ) \
+	do { ( void ) (a); ( void ) (b); } while ( 0 )
+#define turd_probe3( name, a, b, c ) \
+	do { ( void ) (a); ( void ) (b); ( void ) (c); } while ( 0 )
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* _PROBE_H */
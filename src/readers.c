@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <sched.h>
+#include "readers.h"
+
+/** Reader count shard for this thread (or zero if not yet assigned) */
+__thread unsigned int readers_shard
+	__attribute__ (( tls_model ( "initial-exec" ) ));
+
+/** Most recently assigned reader count shard */
+static unsigned int readers_last;
+
+/**
+ * Assign reader count shard for this thread
+ *
+ * @ret shard		Reader count shard
+ *
+ * Shards are assigned to threads in turn, so that up to
+ * READERS_SHARDS threads each have a shard of their own.
+ */
+unsigned int readers_assign ( void ) {
+	unsigned int shard;
+
+	do {
+		shard = __atomic_add_fetch ( &readers_last, 1,
+					     __ATOMIC_RELAXED );
+	} while ( ! shard );
+	readers_shard = shard;
+	return shard;
+}
+
+/**
+ * Check for lookups in progress
+ *
+ * @v readers		Reader count
+ * @ret idle		No lookups are in progress
+ *
+ * The caller must already have made any retired memory unreachable.
+ */
+int readers_idle ( struct readers *readers ) {
+	unsigned int i;
+
+	/* Order the preceding removals before checking for lookups */
+	__atomic_thread_fence ( __ATOMIC_SEQ_CST );
+	for ( i = 0 ; i < READERS_SHARDS ; i++ ) {
+		if ( __atomic_load_n ( &readers->shards[i].count,
+				       __ATOMIC_ACQUIRE ) ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Wait for lookups in progress to complete
+ *
+ * @v readers		Reader count
+ *
+ * This cannot take long provided that no new lookups are entering
+ * via the same reader count, since lookups do not block.
+ */
+void readers_wait ( struct readers *readers ) {
+
+	while ( ! readers_idle ( readers ) )
+		sched_yield();
+}
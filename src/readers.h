@@ -0,0 +1,113 @@
+#ifndef _READERS_H
+#define _READERS_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Sharded reader counts
+ *
+ * A reader count records the number of lock-free lookups in progress
+ * that may be using a shared structure, so that memory retired from
+ * the structure is freed only once no lookup can still reach it.
+ *
+ * The count is sharded by thread, so that threads performing lookups
+ * concurrently do not contend for the same cache line.  Each thread
+ * is assigned a shard on first use, and always uses the same shard
+ * thereafter (so that a lookup leaves via the shard it entered).  The
+ * total count is the sum of the counts within each shard, and is
+ * meaningful only when checking for zero.
+ */
+
+#include <stddef.h>
+
+#pragma GCC visibility push ( hidden )
+
+/** A reader count shard
+ *
+ * Shards are padded (rather than aligned) to the size of a cache
+ * line, so that a reader count may be embedded within structures
+ * allocated using malloc().
+ */
+struct readers_shard {
+	/** Number of lookups in progress */
+	unsigned long count;
+	/** Padding */
+	char pad[ 64 - sizeof ( unsigned long ) ];
+};
+
+/** Number of reader count shards */
+#define READERS_SHARDS 16
+
+/** A sharded reader count */
+struct readers {
+	/** Shards */
+	struct readers_shard shards[READERS_SHARDS];
+};
+
+extern __thread unsigned int readers_shard
+	__attribute__ (( tls_model ( "initial-exec" ) ));
+
+extern unsigned int readers_assign ( void );
+extern int readers_idle ( struct readers *readers );
+extern void readers_wait ( struct readers *readers );
+
+/**
+ * Get reader count shard for this thread
+ *
+ * @v readers		Reader count
+ * @ret shard		Reader count shard
+ */
+static inline struct readers_shard *
+readers_this ( struct readers *readers ) {
+	unsigned int shard = readers_shard;
+
+	if ( ! shard )
+		shard = readers_assign();
+	return &readers->shards[ shard % READERS_SHARDS ];
+}
+
+/**
+ * Start lookup
+ *
+ * @v readers		Reader count
+ *
+ * Memory reachable after this call will not be freed until after the
+ * corresponding call to readers_leave().
+ */
+static inline void readers_enter ( struct readers *readers ) {
+
+	__atomic_add_fetch ( &readers_this ( readers )->count, 1,
+			     __ATOMIC_SEQ_CST );
+}
+
+/**
+ * Finish lookup
+ *
+ * @v readers		Reader count
+ */
+static inline void readers_leave ( struct readers *readers ) {
+
+	__atomic_sub_fetch ( &readers_this ( readers )->count, 1,
+			     __ATOMIC_RELEASE );
+}
+
+#pragma GCC visibility pop
+
+#endif /* _READERS_H */
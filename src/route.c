@@ -0,0 +1,652 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "index.h"
+#include "route.h"
+
+/** Routing action names */
+static const char *route_names[] = {
+	[ROUTE_PROBE] = "probe",
+	[ROUTE_SCRATCH] = "scratch",
+	[ROUTE_DIST] = "dist",
+};
+
+/** A set of automaton states under construction */
+struct route_states {
+	/** Sets of pattern elements (one per state) */
+	uint64_t *sets;
+	/** Number of 64-bit words per set */
+	size_t words;
+	/** Hash table of states (holding state index plus one) */
+	uint16_t *hash;
+	/** Hash table mask */
+	unsigned int mask;
+};
+
+/**
+ * Parse routing action name
+ *
+ * @v name		Action name
+ * @v len		Length of action name
+ * @v action		Action to fill in
+ * @ret rc		Return status code
+ */
+int route_parse_action ( const char *name, size_t len,
+			 enum route_action *action ) {
+	unsigned int i;
+
+	for ( i = 0 ; i < ( sizeof ( route_names ) /
+			    sizeof ( route_names[0] ) ) ; i++ ) {
+		if ( ( strlen ( route_names[i] ) == len ) &&
+		     ( memcmp ( route_names[i], name, len ) == 0 ) ) {
+			*action = i;
+			return 0;
+		}
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Add byte to set of bytes matched by element
+ *
+ * @v element		Pattern element
+ * @v byte		Byte
+ */
+static inline void route_set ( struct route_element *element,
+			       uint8_t byte ) {
+
+	element->set[ byte / 32 ] |= ( 1U << ( byte % 32 ) );
+}
+
+/**
+ * Remove byte from set of bytes matched by element
+ *
+ * @v element		Pattern element
+ * @v byte		Byte
+ */
+static inline void route_clear ( struct route_element *element,
+				 uint8_t byte ) {
+
+	element->set[ byte / 32 ] &= ~( 1U << ( byte % 32 ) );
+}
+
+/**
+ * Check if element matches byte
+ *
+ * @v element		Pattern element
+ * @v byte		Byte
+ * @ret matches		Element matches byte
+ */
+static inline int route_matches ( const struct route_element *element,
+				  uint8_t byte ) {
+
+	return ( element->set[ byte / 32 ] & ( 1U << ( byte % 32 ) ) );
+}
+
+/**
+ * Append pattern element
+ *
+ * @v routes		Routing rules
+ * @ret element		Pattern element, or NULL on error
+ */
+static struct route_element * route_append ( struct routes *routes ) {
+	struct route_element *elements;
+	struct route_element *element;
+	unsigned int max;
+
+	/* Grow element array if necessary */
+	if ( routes->count == routes->max ) {
+		max = ( routes->max ? ( routes->max * 2 ) : 16 );
+		elements = realloc ( routes->elements,
+				     ( max * sizeof ( elements[0] ) ) );
+		if ( ! elements )
+			return NULL;
+		routes->elements = elements;
+		routes->max = max;
+	}
+
+	/* Initialise element */
+	element = &routes->elements[ routes->count++ ];
+	memset ( element, 0, sizeof ( *element ) );
+	return element;
+}
+
+/**
+ * Append element matching a single byte
+ *
+ * @v routes		Routing rules
+ * @v byte		Byte
+ * @ret element		Pattern element, or NULL on error
+ */
+static struct route_element * route_literal ( struct routes *routes,
+					      uint8_t byte ) {
+	struct route_element *element;
+
+	element = route_append ( routes );
+	if ( element )
+		route_set ( element, byte );
+	return element;
+}
+
+/**
+ * Append element matching any byte
+ *
+ * @v routes		Routing rules
+ * @v loop		Element may match repeatedly
+ * @v slash		Element may match a path separator
+ * @ret element		Pattern element, or NULL on error
+ */
+static struct route_element * route_any ( struct routes *routes, int loop,
+					  int slash ) {
+	struct route_element *element;
+
+	element = route_append ( routes );
+	if ( element ) {
+		memset ( element->set, 0xff, sizeof ( element->set ) );
+		if ( ! slash )
+			route_clear ( element, '/' );
+		element->loop = loop;
+	}
+	return element;
+}
+
+/**
+ * Append elements matching zero or more leading directories ("**\/")
+ *
+ * @v routes		Routing rules
+ * @ret rc		Return status code
+ */
+static int route_dirs ( struct routes *routes ) {
+	struct route_element *element;
+
+	element = route_any ( routes, 1, 1 );
+	if ( ! element )
+		return -1;
+	element->skip = 2;
+	if ( ! route_literal ( routes, '/' ) )
+		return -1;
+	return 0;
+}
+
+/**
+ * Parse bracket expression
+ *
+ * @v element		Pattern element
+ * @v pattern		Pattern (starting at the opening '[')
+ * @v len		Length of pattern
+ * @ret used		Length of bracket expression, or zero if unterminated
+ */
+static size_t route_bracket ( struct route_element *element,
+			      const char *pattern, size_t len ) {
+	unsigned int first;
+	unsigned int last;
+	unsigned int byte;
+	unsigned int i;
+	size_t start;
+	size_t pos;
+	int negate;
+
+	/* Check for negation */
+	pos = 1;
+	negate = ( ( pos < len ) &&
+		   ( ( pattern[pos] == '!' ) || ( pattern[pos] == '^' ) ) );
+	if ( negate )
+		pos++;
+
+	/* Parse bytes and ranges (allowing a leading ']') */
+	for ( start = pos ; pos < len ; pos++ ) {
+		if ( ( pattern[pos] == ']' ) && ( pos > start ) )
+			break;
+		first = last = ( ( uint8_t ) pattern[pos] );
+		if ( ( ( pos + 2 ) < len ) && ( pattern[ pos + 1 ] == '-' ) &&
+		     ( pattern[ pos + 2 ] != ']' ) ) {
+			last = ( ( uint8_t ) pattern[ pos + 2 ] );
+			pos += 2;
+		}
+		for ( byte = first ; byte <= last ; byte++ )
+			route_set ( element, byte );
+	}
+	if ( pos == len )
+		return 0;
+
+	/* Apply negation, and never match a path separator */
+	if ( negate ) {
+		for ( i = 0 ; i < ( sizeof ( element->set ) /
+				    sizeof ( element->set[0] ) ) ; i++ ) {
+			element->set[i] = ~element->set[i];
+		}
+	}
+	route_clear ( element, '/' );
+
+	return ( pos + 1 );
+}
+
+/**
+ * Add routing rule
+ *
+ * @v routes		Routing rules
+ * @v pattern		Glob pattern
+ * @v len		Length of pattern
+ * @v action		Action
+ * @ret rc		Return status code
+ *
+ * Rules must be added in order of precedence.  Adding a rule discards
+ * any previously compiled automaton.
+ */
+int route_add ( struct routes *routes, const char *pattern, size_t len,
+		enum route_action action ) {
+	struct route_element *element;
+	unsigned int first = routes->count;
+	int anchored = 0;
+	int globstar;
+	int dir;
+	size_t used;
+	size_t i;
+
+	/* Strip leading and trailing separators */
+	while ( len && ( *pattern == '/' ) ) {
+		anchored = 1;
+		pattern++;
+		len--;
+	}
+	dir = ( len && ( pattern[ len - 1 ] == '/' ) );
+	while ( len && ( pattern[ len - 1 ] == '/' ) )
+		len--;
+	if ( ! len ) {
+		errno = EINVAL;
+		goto err_empty;
+	}
+	if ( memchr ( pattern, '/', len ) )
+		anchored = 1;
+
+	/* Match at any depth unless anchored */
+	if ( ( ! anchored ) && ( route_dirs ( routes ) != 0 ) )
+		goto err_append;
+
+	/* Parse pattern */
+	for ( i = 0 ; i < len ; i += used ) {
+		used = 1;
+		switch ( pattern[i] ) {
+		case '*':
+			while ( ( ( i + used ) < len ) &&
+				( pattern[ i + used ] == '*' ) ) {
+				used++;
+			}
+			globstar = ( used > 1 );
+			if ( globstar && ( ( i == 0 ) ||
+					   ( pattern[ i - 1 ] == '/' ) ) &&
+			     ( ( i + used ) < len ) &&
+			     ( pattern[ i + used ] == '/' ) ) {
+				if ( route_dirs ( routes ) != 0 )
+					goto err_append;
+				used++;
+			} else {
+				if ( ! route_any ( routes, 1, globstar ) )
+					goto err_append;
+			}
+			break;
+		case '?':
+			if ( ! route_any ( routes, 0, 0 ) )
+				goto err_append;
+			break;
+		case '[':
+			element = route_append ( routes );
+			if ( ! element )
+				goto err_append;
+			used = route_bracket ( element, &pattern[i],
+					       ( len - i ) );
+			if ( ! used ) {
+				memset ( element->set, 0,
+					 sizeof ( element->set ) );
+				route_set ( element, '[' );
+				used = 1;
+			}
+			break;
+		case '\\':
+			if ( ( i + 1 ) < len )
+				used = 2;
+			/* Fall through */
+		default:
+			if ( ! route_literal ( routes,
+					       pattern[ i + used - 1 ] ) )
+				goto err_append;
+			break;
+		}
+	}
+
+	/* Match everything within a directory, if applicable */
+	if ( dir ) {
+		element = route_literal ( routes, '/' );
+		if ( ! element )
+			goto err_append;
+		element->skip = 2;
+		if ( ! route_any ( routes, 1, 1 ) )
+			goto err_append;
+	}
+
+	/* Mark end of pattern */
+	element = route_append ( routes );
+	if ( ! element )
+		goto err_append;
+	element->accept = 1;
+	element->action = action;
+
+	/* Discard any compiled automaton */
+	routes->states = 0;
+
+	return 0;
+
+ err_append:
+	routes->count = first;
+ err_empty:
+	return -1;
+}
+
+/**
+ * Check if bytes are equivalent
+ *
+ * @v routes		Routing rules
+ * @v a			Byte
+ * @v b			Byte
+ * @ret equivalent	Bytes are matched by exactly the same elements
+ */
+static int route_equivalent ( struct routes *routes, uint8_t a, uint8_t b ) {
+	struct route_element *element;
+	unsigned int i;
+
+	for ( i = 0 ; i < routes->count ; i++ ) {
+		element = &routes->elements[i];
+		if ( ( ! route_matches ( element, a ) ) !=
+		     ( ! route_matches ( element, b ) ) )
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Check if element guarantees a match
+ *
+ * @v routes		Routing rules
+ * @v i			Element index
+ * @ret certain		Pattern will match regardless of any remaining bytes
+ */
+static int route_certain ( struct routes *routes, unsigned int i ) {
+	struct route_element *element = &routes->elements[i];
+	unsigned int j;
+
+	if ( ! ( element->loop && routes->elements[ i + 1 ].accept ) )
+		return 0;
+	for ( j = 0 ; j < ( sizeof ( element->set ) /
+			    sizeof ( element->set[0] ) ) ; j++ ) {
+		if ( element->set[j] != ~( ( uint32_t ) 0 ) )
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * Add all elements reachable without matching a byte
+ *
+ * @v routes		Routing rules
+ * @v set		Set of pattern elements
+ *
+ * Such transitions only ever lead forwards within the element array,
+ * so a single pass suffices.
+ *
+ * Once a pattern is certain to match (e.g. within a trailing "**"),
+ * the elements of all lower-precedence patterns are discarded, since
+ * they can no longer affect the outcome.  This avoids an explosion in
+ * the number of states for rules such as "cache/" that match at any
+ * depth.
+ */
+static void route_closure ( struct routes *routes, uint64_t *set ) {
+	struct route_element *element;
+	unsigned int i;
+	unsigned int j;
+
+	for ( i = 0 ; i < routes->count ; i++ ) {
+		if ( ! ( set[ i / 64 ] & ( 1ULL << ( i % 64 ) ) ) )
+			continue;
+		element = &routes->elements[i];
+		if ( element->loop )
+			set[ ( i + 1 ) / 64 ] |= ( 1ULL << ( ( i + 1 ) % 64 ) );
+		if ( element->skip ) {
+			set[ ( i + element->skip ) / 64 ] |=
+				( 1ULL << ( ( i + element->skip ) % 64 ) );
+		}
+		if ( route_certain ( routes, i ) ) {
+			for ( j = ( i + 2 ) ; j < routes->count ; j++ )
+				set[ j / 64 ] &= ~( 1ULL << ( j % 64 ) );
+			break;
+		}
+	}
+}
+
+/**
+ * Find or create automaton state
+ *
+ * @v routes		Routing rules
+ * @v states		States under construction
+ * @v set		Set of pattern elements
+ * @ret state		State, or negative error
+ */
+static int route_state ( struct routes *routes, struct route_states *states,
+			 const uint64_t *set ) {
+	size_t size = ( states->words * sizeof ( set[0] ) );
+	uint64_t *existing;
+	unsigned int state;
+	unsigned int i;
+
+	/* Find existing state, if any */
+	for ( i = index_hash ( ( ( const char * ) set ), size ) ; ; i++ ) {
+		state = states->hash[ i & states->mask ];
+		if ( ! state )
+			break;
+		existing = &states->sets[ ( state - 1 ) * states->words ];
+		if ( memcmp ( existing, set, size ) == 0 )
+			return ( state - 1 );
+	}
+
+	/* Create new state */
+	if ( routes->states == ROUTE_MAX_STATES ) {
+		errno = E2BIG;
+		return -1;
+	}
+	state = routes->states++;
+	memcpy ( &states->sets[ state * states->words ], set, size );
+	states->hash[ i & states->mask ] = ( state + 1 );
+
+	/* Record action of first matching rule, if any */
+	routes->actions[state] = ROUTE_PROBE;
+	for ( i = 0 ; i < routes->count ; i++ ) {
+		if ( ( set[ i / 64 ] & ( 1ULL << ( i % 64 ) ) ) &&
+		     routes->elements[i].accept ) {
+			routes->actions[state] = routes->elements[i].action;
+			break;
+		}
+	}
+
+	return state;
+}
+
+/**
+ * Compile routing rules
+ *
+ * @v routes		Routing rules
+ * @ret rc		Return status code
+ *
+ * An empty set of rules is left uncompiled (and so matches nothing).
+ * The pattern elements are compiled into a deterministic automaton
+ * using the subset construction, with bytes that are matched by
+ * exactly the same elements sharing a single column of the state
+ * transition table.
+ */
+int route_compile ( struct routes *routes ) {
+	struct route_states states;
+	struct route_element *element;
+	uint8_t reps[256];
+	uint64_t *next;
+	uint64_t *set;
+	unsigned int class;
+	unsigned int state;
+	unsigned int byte;
+	unsigned int pos;
+	unsigned int i;
+	void *tmp;
+	int target;
+	int rc;
+
+	/* Discard any previously compiled automaton */
+	free ( routes->next );
+	free ( routes->actions );
+	routes->next = NULL;
+	routes->actions = NULL;
+	routes->states = 0;
+	if ( ! routes->count )
+		return 0;
+
+	/* Construct byte equivalence classes */
+	routes->class_count = 0;
+	for ( byte = 0 ; byte < 256 ; byte++ ) {
+		for ( class = 0 ; class < routes->class_count ; class++ ) {
+			if ( route_equivalent ( routes, byte, reps[class] ) )
+				break;
+		}
+		if ( class == routes->class_count )
+			reps[ routes->class_count++ ] = byte;
+		routes->classes[byte] = class;
+	}
+
+	/* Allocate tables */
+	states.words = ( ( routes->count + 63 ) / 64 );
+	states.mask = ( ( 2 * ROUTE_MAX_STATES ) - 1 );
+	states.sets = calloc ( ( ROUTE_MAX_STATES + 1 /* scratch */ ),
+			       ( states.words * sizeof ( states.sets[0] ) ) );
+	if ( ! states.sets ) {
+		rc = -1;
+		goto err_sets;
+	}
+	states.hash = calloc ( ( states.mask + 1 ),
+			       sizeof ( states.hash[0] ) );
+	if ( ! states.hash ) {
+		rc = -1;
+		goto err_hash;
+	}
+	routes->next = malloc ( ROUTE_MAX_STATES * routes->class_count *
+				sizeof ( routes->next[0] ) );
+	routes->actions = malloc ( ROUTE_MAX_STATES *
+				   sizeof ( routes->actions[0] ) );
+	if ( ! ( routes->next && routes->actions ) ) {
+		rc = -1;
+		goto err_tables;
+	}
+	next = &states.sets[ ROUTE_MAX_STATES * states.words ];
+
+	/* Create dead state (matching nothing) */
+	memset ( next, 0, ( states.words * sizeof ( next[0] ) ) );
+	if ( ( target = route_state ( routes, &states, next ) ) < 0 ) {
+		rc = -1;
+		goto err_state;
+	}
+
+	/* Create initial state (at the start of every pattern) */
+	for ( i = 0 ; i < routes->count ; i++ ) {
+		if ( ( i == 0 ) || routes->elements[ i - 1 ].accept )
+			next[ i / 64 ] |= ( 1ULL << ( i % 64 ) );
+	}
+	route_closure ( routes, next );
+	if ( ( target = route_state ( routes, &states, next ) ) < 0 ) {
+		rc = -1;
+		goto err_state;
+	}
+
+	/* Construct transitions from each state in turn */
+	for ( state = 0 ; state < routes->states ; state++ ) {
+		set = &states.sets[ state * states.words ];
+		for ( class = 0 ; class < routes->class_count ; class++ ) {
+			memset ( next, 0,
+				 ( states.words * sizeof ( next[0] ) ) );
+			for ( i = 0 ; i < routes->count ; i++ ) {
+				if ( ! ( set[ i / 64 ] &
+					 ( 1ULL << ( i % 64 ) ) ) )
+					continue;
+				element = &routes->elements[i];
+				if ( ! route_matches ( element, reps[class] ) )
+					continue;
+				pos = ( element->loop ? i : ( i + 1 ) );
+				next[ pos / 64 ] |= ( 1ULL << ( pos % 64 ) );
+			}
+			route_closure ( routes, next );
+			target = route_state ( routes, &states, next );
+			if ( target < 0 ) {
+				rc = -1;
+				goto err_state;
+			}
+			routes->next[ ( state * routes->class_count ) +
+				      class ] = target;
+		}
+	}
+
+	/* Shrink tables (ignoring failures) */
+	tmp = realloc ( routes->next, ( routes->states * routes->class_count *
+					sizeof ( routes->next[0] ) ) );
+	if ( tmp )
+		routes->next = tmp;
+	tmp = realloc ( routes->actions, ( routes->states *
+					   sizeof ( routes->actions[0] ) ) );
+	if ( tmp )
+		routes->actions = tmp;
+
+	rc = 0;
+	goto done;
+
+ err_state:
+ err_tables:
+	free ( routes->next );
+	free ( routes->actions );
+	routes->next = NULL;
+	routes->actions = NULL;
+	routes->states = 0;
+ done:
+	free ( states.hash );
+ err_hash:
+	free ( states.sets );
+ err_sets:
+	return rc;
+}
+
+/**
+ * Free routing rules
+ *
+ * @v routes		Routing rules
+ */
+void route_free ( struct routes *routes ) {
+
+	free ( routes->elements );
+	free ( routes->next );
+	free ( routes->actions );
+	memset ( routes, 0, sizeof ( *routes ) );
+}
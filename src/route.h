@@ -0,0 +1,140 @@
+#ifndef _ROUTE_H
+#define _ROUTE_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Path routing rules
+ *
+ * Routing rules are glob patterns over paths relative to a turd
+ * directory, each with an action that overrides the normal probing of
+ * the readonly directories.  The rules are compiled into a single
+ * deterministic finite automaton, so that finding the first matching
+ * rule costs a single pass over the path regardless of the number of
+ * rules.
+ *
+ * A pattern may contain "*" (matching within a path component), "**"
+ * (matching across path components), "?", "[...]" and "\" escapes.  A
+ * pattern containing no "/" (other than a trailing "/") matches the
+ * final component of a path at any depth.  A pattern with a trailing
+ * "/" matches a directory and everything within it.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#pragma GCC visibility push ( hidden )
+
+/** A routing action */
+enum route_action {
+	/** Probe readonly directories (the default) */
+	ROUTE_PROBE = 0,
+	/** Always use the writable directory */
+	ROUTE_SCRATCH,
+	/** Always use the readonly directories */
+	ROUTE_DIST,
+};
+
+/** A pattern element (i.e. a position within the automaton) */
+struct route_element {
+	/** Set of bytes matched by this element */
+	uint32_t set[ 256 / 32 ];
+	/** Element may match repeatedly (or not at all) */
+	uint8_t loop;
+	/** Number of elements that may be skipped, or zero */
+	uint8_t skip;
+	/** Element is the end of a pattern */
+	uint8_t accept;
+	/** Action (for the end of a pattern) */
+	uint8_t action;
+};
+
+/** A set of routing rules */
+struct routes {
+	/** Pattern elements */
+	struct route_element *elements;
+	/** Number of pattern elements */
+	unsigned int count;
+	/** Number of allocated pattern elements */
+	unsigned int max;
+	/** Byte equivalence classes */
+	uint8_t classes[256];
+	/** Number of byte equivalence classes */
+	unsigned int class_count;
+	/** State transitions (indexed by state and byte class) */
+	uint16_t *next;
+	/** Actions (indexed by state) */
+	uint8_t *actions;
+	/** Number of states (or zero if not compiled) */
+	unsigned int states;
+};
+
+/** Maximum number of automaton states */
+#define ROUTE_MAX_STATES 4096
+
+/** Dead automaton state (matching no rule) */
+#define ROUTE_DEAD 0
+
+/** Initial automaton state */
+#define ROUTE_START 1
+
+/**
+ * Find action for path
+ *
+ * @v routes		Routing rules
+ * @v path		Path relative to turd directory
+ * @v len		Length of path
+ * @ret action		Action of first matching rule, or ROUTE_PROBE
+ */
+static inline enum route_action route_match ( const struct routes *routes,
+					      const char *path, size_t len ) {
+	const uint8_t *byte = ( ( const uint8_t * ) path );
+	unsigned int state;
+
+	/* Ignore leading and trailing separators */
+	if ( ! routes->states )
+		return ROUTE_PROBE;
+	while ( len && ( *byte == '/' ) ) {
+		byte++;
+		len--;
+	}
+	while ( len && ( byte[ len - 1 ] == '/' ) )
+		len--;
+
+	/* Run automaton */
+	for ( state = ROUTE_START ; len-- ; byte++ ) {
+		state = routes->next[ ( state * routes->class_count ) +
+				      routes->classes[*byte] ];
+		if ( state == ROUTE_DEAD )
+			return ROUTE_PROBE;
+	}
+	return routes->actions[state];
+}
+
+extern int route_parse_action ( const char *name, size_t len,
+				enum route_action *action );
+extern int route_add ( struct routes *routes, const char *pattern,
+		       size_t len, enum route_action action );
+extern int route_compile ( struct routes *routes );
+extern void route_free ( struct routes *routes );
+
+#pragma GCC visibility pop
+
+#endif /* _ROUTE_H */
@@ -0,0 +1,421 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.h"
+#include "stats.h"
+
+/**
+ * Calculate number of counters per shard
+ *
+ * @v hdr		Statistics segment header
+ * @ret stride		Number of counters per shard
+ *
+ * Each shard is padded to a whole number of cache lines.
+ */
+static size_t stats_stride ( const struct stats_header *hdr ) {
+	size_t count;
+
+	count = ( hdr->funcs * hdr->counters );
+	count += ( STATS_ALIGN - 1 );
+	return ( count - ( count % STATS_ALIGN ) );
+}
+
+/**
+ * Calculate length of statistics segment
+ *
+ * @v hdr		Statistics segment header
+ * @ret len		Length of segment
+ */
+static size_t stats_length ( const struct stats_header *hdr ) {
+	size_t count;
+
+	count = ( ( hdr->shards * stats_stride ( hdr ) ) +
+		  ( hdr->funcs * hdr->phases * hdr->buckets ) );
+	return ( sizeof ( *hdr ) + ( count * sizeof ( uint64_t ) ) +
+		 ( hdr->sketch_shards * hdr->sketches *
+		   sizeof ( struct stats_hot ) ) );
+}
+
+/**
+ * Validate statistics segment header
+ *
+ * @v hdr		Statistics segment header
+ * @ret valid		Header is valid
+ */
+static int stats_valid ( const struct stats_header *hdr ) {
+
+	return ( ( memcmp ( hdr->magic, STATS_MAGIC,
+			    sizeof ( hdr->magic ) ) == 0 ) &&
+		 ( hdr->version == STATS_VERSION ) &&
+		 ( hdr->shards >= 1 ) &&
+		 ( hdr->funcs <= STATS_MAX_FUNCS ) &&
+		 ( hdr->counters == STATS_COUNTERS ) &&
+		 ( hdr->phases == STATS_PHASES ) &&
+		 ( hdr->buckets == STATS_BUCKETS ) &&
+		 ( hdr->sketch_shards >= 1 ) &&
+		 ( hdr->sketches == STATS_SKETCHES ) &&
+		 ( hdr->sketch_entries == STATS_SKETCH_ENTRIES ) );
+}
+
+/**
+ * Map statistics segment
+ *
+ * @v stats		Statistics segment
+ * @v hdr		Statistics segment header
+ * @v fd		File descriptor
+ * @v prot		Memory protection
+ * @ret rc		Return status code
+ */
+static int stats_map ( struct stats *stats, const struct stats_header *hdr,
+		       int fd, int prot ) {
+	struct stat st;
+	size_t stride;
+	size_t len;
+	void *map;
+
+	/* Check length */
+	stride = stats_stride ( hdr );
+	len = stats_length ( hdr );
+	if ( fstat ( fd, &st ) != 0 )
+		return -1;
+	if ( ( ( size_t ) st.st_size ) < len ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Map segment */
+	map = mmap ( NULL, len, prot, MAP_SHARED, fd, 0 );
+	if ( map == MAP_FAILED )
+		return -1;
+	stats->hdr = map;
+	stats->counters = ( map + sizeof ( *hdr ) );
+	stats->histograms = ( stats->counters + ( hdr->shards * stride ) );
+	stats->sketches = ( ( void * ) ( stats->histograms +
+					 ( hdr->funcs * hdr->phases *
+					   hdr->buckets ) ) );
+	stats->stride = stride;
+	stats->len = len;
+
+	return 0;
+}
+
+/**
+ * Open (and create if necessary) statistics segment
+ *
+ * @v stats		Statistics segment
+ * @v name		Shared memory object name
+ * @v desc		Mapping description
+ * @v names		Wrapped function names
+ * @v funcs		Number of wrapped functions
+ * @ret rc		Return status code
+ *
+ * An existing segment is used only if it was created for the same
+ * mapping and the same set of wrapped functions.
+ */
+int stats_open ( struct stats *stats, const char *name, const char *desc,
+		 const char * const *names, unsigned int funcs ) {
+	struct stats_header hdr;
+	struct stats_header old;
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	/* Construct header */
+	memset ( stats, 0, sizeof ( *stats ) );
+	if ( funcs > STATS_MAX_FUNCS ) {
+		errno = EINVAL;
+		goto err_funcs;
+	}
+	memset ( &hdr, 0, sizeof ( hdr ) );
+	memcpy ( hdr.magic, STATS_MAGIC, sizeof ( hdr.magic ) );
+	hdr.version = STATS_VERSION;
+	hdr.shards = STATS_SHARDS;
+	hdr.funcs = funcs;
+	hdr.counters = STATS_COUNTERS;
+	hdr.phases = STATS_PHASES;
+	hdr.buckets = STATS_BUCKETS;
+	hdr.sketch_shards = STATS_SKETCH_SHARDS;
+	hdr.sketches = STATS_SKETCHES;
+	hdr.sketch_entries = STATS_SKETCH_ENTRIES;
+	strncpy ( hdr.desc, desc, ( sizeof ( hdr.desc ) - 1 ) );
+	for ( i = 0 ; i < funcs ; i++ ) {
+		strncpy ( hdr.names[i], names[i],
+			  ( sizeof ( hdr.names[i] ) - 1 ) );
+	}
+
+	/* Open segment */
+	fd = shm_open ( name, ( O_RDWR | O_CREAT | O_CLOEXEC ), 0644 );
+	if ( fd < 0 )
+		goto err_open;
+
+	/* Initialise segment if newly created.  The lock ensures that
+	 * only one process initialises the segment.
+	 */
+	if ( flock ( fd, LOCK_EX ) != 0 )
+		goto err_lock;
+	if ( fstat ( fd, &st ) != 0 )
+		goto err_stat;
+	if ( st.st_size == 0 ) {
+		if ( ( ftruncate ( fd, stats_length ( &hdr ) ) != 0 ) ||
+		     ( pwrite ( fd, &hdr, sizeof ( hdr ), 0 ) !=
+		       sizeof ( hdr ) ) )
+			goto err_init;
+	} else {
+		if ( pread ( fd, &old, sizeof ( old ), 0 ) != sizeof ( old ) )
+			goto err_read;
+		if ( memcmp ( &old, &hdr, sizeof ( hdr ) ) != 0 ) {
+			errno = EINVAL;
+			goto err_invalid;
+		}
+	}
+	flock ( fd, LOCK_UN );
+
+	/* Map segment */
+	if ( stats_map ( stats, &hdr, fd, ( PROT_READ | PROT_WRITE ) ) != 0 )
+		goto err_map;
+
+	close ( fd );
+	return 0;
+
+ err_map:
+ err_invalid:
+ err_read:
+ err_init:
+ err_stat:
+	flock ( fd, LOCK_UN );
+ err_lock:
+	close ( fd );
+ err_open:
+ err_funcs:
+	return -1;
+}
+
+/**
+ * Attach to existing statistics segment (read-only)
+ *
+ * @v stats		Statistics segment
+ * @v name		Shared memory object name
+ * @ret rc		Return status code
+ */
+int stats_attach ( struct stats *stats, const char *name ) {
+	struct stats_header hdr;
+	int fd;
+
+	/* Open segment */
+	memset ( stats, 0, sizeof ( *stats ) );
+	fd = shm_open ( name, ( O_RDONLY | O_CLOEXEC ), 0 );
+	if ( fd < 0 )
+		goto err_open;
+
+	/* Read and validate header */
+	if ( pread ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) )
+		goto err_read;
+	if ( ! stats_valid ( &hdr ) ) {
+		errno = EINVAL;
+		goto err_invalid;
+	}
+
+	/* Map segment */
+	if ( stats_map ( stats, &hdr, fd, PROT_READ ) != 0 )
+		goto err_map;
+
+	close ( fd );
+	return 0;
+
+ err_map:
+ err_invalid:
+ err_read:
+	close ( fd );
+ err_open:
+	return -1;
+}
+
+/**
+ * Read counter
+ *
+ * @v stats		Statistics segment
+ * @v func		Wrapped function index
+ * @v counter		Counter
+ * @ret value		Counter value (summed over all shards)
+ */
+uint64_t stats_read ( struct stats *stats, unsigned int func,
+		      enum stats_counter counter ) {
+	uint64_t value = 0;
+	unsigned int shard;
+	size_t offset;
+
+	offset = ( ( func * STATS_COUNTERS ) + counter );
+	for ( shard = 0 ; shard < stats->hdr->shards ; shard++ ) {
+		value += __atomic_load_n ( &stats->counters[offset],
+					   __ATOMIC_RELAXED );
+		offset += stats->stride;
+	}
+	return value;
+}
+
+/**
+ * Get smallest value within histogram bucket
+ *
+ * @v bucket		Histogram bucket
+ * @ret value		Smallest value within bucket
+ */
+uint64_t stats_bucket_min ( unsigned int bucket ) {
+	unsigned int shift;
+
+	if ( bucket < STATS_SUB_BUCKETS )
+		return bucket;
+	shift = ( ( bucket >> STATS_SUB_BITS ) - 1 );
+	return ( ( ( uint64_t ) ( STATS_SUB_BUCKETS |
+				  ( bucket & ( STATS_SUB_BUCKETS - 1 ) ) ) )
+		 << shift );
+}
+
+/**
+ * Get heavy-hitter sketch
+ *
+ * @v stats		Statistics segment
+ * @v shard		Sketch shard
+ * @v sketch		Sketch
+ * @ret hot		Heavy-hitter sketch
+ */
+struct stats_hot * stats_sketch ( struct stats *stats, unsigned int shard,
+				  enum stats_sketch sketch ) {
+
+	return &stats->sketches[ ( ( shard % stats->hdr->sketch_shards ) *
+				   STATS_SKETCHES ) + sketch ];
+}
+
+/**
+ * Lock heavy-hitter sketch
+ *
+ * @v hot		Heavy-hitter sketch
+ * @ret locked		Sketch is now locked
+ *
+ * The lock is never waited upon.  A lock that has been held for less
+ * than STATS_LOCK_EXPIRY (including one held by the calling thread
+ * itself, i.e. by an update interrupted by a signal handler) causes
+ * the update to be discarded.  A lock that has been held for longer
+ * can only have been abandoned (e.g. by a process killed while
+ * updating the sketch), and so has expired.
+ *
+ * This uses only atomic operations and the system-wide monotonic
+ * clock, and so is safe to use from within a signal handler and
+ * between processes in different PID namespaces.
+ */
+static int stats_lock ( struct stats_hot *hot ) {
+	struct timespec ts;
+	uint64_t holder;
+	uint64_t now;
+
+	/* Get current time (never zero) */
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	now = ( ( ( ( uint64_t ) ts.tv_sec ) * 1000000000ULL ) +
+		ts.tv_nsec + 1 );
+
+	/* Take lock if free or expired, unless another thread has
+	 * already done so.
+	 */
+	holder = __atomic_load_n ( &hot->lock, __ATOMIC_RELAXED );
+	if ( holder && ( ( now - holder ) < STATS_LOCK_EXPIRY ) )
+		return 0;
+	return __atomic_compare_exchange_n ( &hot->lock, &holder, now, 0,
+					     __ATOMIC_ACQUIRE,
+					     __ATOMIC_RELAXED );
+}
+
+/**
+ * Record key in heavy-hitter sketch
+ *
+ * @v stats		Statistics segment
+ * @v tid		Thread identifier (used to select the sketch shard)
+ * @v sketch		Sketch
+ * @v key		Key
+ * @v len		Length of key
+ * @v weight		Weight
+ *
+ * This is the Space-Saving algorithm: a key not already present
+ * replaces the entry with the smallest count, inheriting that count
+ * as its maximum overestimate.  The update is discarded if the sketch
+ * is locked (e.g. by another process, or by a signal handler within
+ * this thread).
+ */
+void stats_hot ( struct stats *stats, unsigned int tid,
+		 enum stats_sketch sketch, const char *key, size_t len,
+		 uint64_t weight ) {
+	struct stats_hot *hot;
+	struct stats_entry *entry;
+	struct stats_entry *min;
+	uint64_t hash;
+	unsigned int i;
+
+	/* Lock sketch */
+	if ( ! stats->sketches )
+		return;
+	hot = stats_sketch ( stats, tid, sketch );
+	if ( ! stats_lock ( hot ) )
+		return;
+
+	/* Find matching entry, or entry with the smallest count */
+	hash = index_hash ( key, len );
+	min = &hot->entries[0];
+	for ( i = 0 ; i < STATS_SKETCH_ENTRIES ; i++ ) {
+		entry = &hot->entries[i];
+		if ( entry->count && ( entry->hash == hash ) ) {
+			entry->count += weight;
+			goto done;
+		}
+		if ( entry->count < min->count )
+			min = entry;
+	}
+
+	/* Replace entry with the smallest count */
+	if ( len >= sizeof ( min->key ) )
+		len = ( sizeof ( min->key ) - 1 );
+	min->hash = hash;
+	min->error = min->count;
+	min->count += weight;
+	memcpy ( min->key, key, len );
+	min->key[len] = '\0';
+
+ done:
+	__atomic_store_n ( &hot->lock, 0, __ATOMIC_RELEASE );
+}
+
+/**
+ * Close statistics segment
+ *
+ * @v stats		Statistics segment
+ */
+void stats_close ( struct stats *stats ) {
+
+	if ( stats->hdr )
+		munmap ( stats->hdr, stats->len );
+	memset ( stats, 0, sizeof ( *stats ) );
+}
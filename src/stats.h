@@ -0,0 +1,302 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Shared statistics
+ *
+ * Statistics are held in a shared memory segment that is mapped into
+ * every process using the same turd mapping, so that a monitoring
+ * tool may aggregate the statistics across all processes (e.g. all
+ * php-fpm workers) while they are running.  Each segment holds a
+ * counter for each combination of wrapped function and event.
+ *
+ * Counters are sharded by thread identifier, so that threads (and
+ * processes) incrementing the same counter rarely share a cache
+ * line.  Counters are incremented atomically, since a shard may be
+ * shared by several processes, and are never reset.  A counter value
+ * is the sum of the values within each shard.
+ *
+ * Each segment also holds a latency histogram for each combination of
+ * wrapped function and phase (e.g. probing the readonly directories).
+ * Histogram buckets are log-linear: each power of two is divided into
+ * a fixed number of linear sub-buckets, so that every recorded value
+ * is accurate to within a fixed percentage.  Histograms are updated
+ * only for a sample of library calls, and so are not sharded.
+ *
+ * Each segment also holds Space-Saving heavy-hitter sketches of the
+ * paths (relative to the turd directory) that were probed and found
+ * (or not found) within the readonly directories.  A sketch holds a
+ * fixed number of entries, each with an estimated count and a bound
+ * on the overestimate.  Sketches are updated only for a sample of
+ * library calls (with each update weighted by the sampling rate), and
+ * are sharded by thread identifier.  Each shard is protected by a
+ * lock which is never waited upon: an update that finds the lock held
+ * is simply discarded.  The lock records the time at which it was
+ * taken, and expires after a period far longer than any update could
+ * take, so that a lock left held (e.g. by a process killed while
+ * updating a sketch) does not disable the shard forever.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#pragma GCC visibility push ( hidden )
+
+/** Statistics segment magic signature */
+#define STATS_MAGIC "TURDSTA"
+
+/** Statistics segment format version */
+#define STATS_VERSION 5
+
+/** Statistics segment name prefix */
+#define STATS_PREFIX "phpturd."
+
+/** Number of counter shards */
+#define STATS_SHARDS 32
+
+/** Maximum number of wrapped functions */
+#define STATS_MAX_FUNCS 64
+
+/** Maximum length of wrapped function name (including NUL) */
+#define STATS_NAME_LEN 24
+
+/** Maximum length of mapping description (including NUL) */
+#define STATS_DESC_LEN 4096
+
+/** Counter shard alignment (in counters) */
+#define STATS_ALIGN 8
+
+/** Number of histogram sub-bucket bits (per power of two) */
+#define STATS_SUB_BITS 3
+
+/** Number of histogram sub-buckets (per power of two) */
+#define STATS_SUB_BUCKETS ( 1 << STATS_SUB_BITS )
+
+/** Number of histogram buckets */
+#define STATS_BUCKETS 256
+
+/** Number of heavy-hitter sketch shards */
+#define STATS_SKETCH_SHARDS 8
+
+/** Number of entries per heavy-hitter sketch */
+#define STATS_SKETCH_ENTRIES 64
+
+/** Maximum length of heavy-hitter sketch key (including NUL) */
+#define STATS_KEY_LEN 104
+
+/** Heavy-hitter sketch lock expiry time (in nanoseconds) */
+#define STATS_LOCK_EXPIRY 1000000000ULL
+
+/** Statistics events */
+enum stats_counter {
+	/** Library calls */
+	STATS_CALLS = 0,
+	/** Paths routed without probing the readonly directories */
+	STATS_BYPASS,
+	/** Paths not within any turd directory */
+	STATS_NOPREFIX,
+	/** Paths resolved to a readonly directory */
+	STATS_DIST,
+	/** Paths resolved to the writable directory */
+	STATS_SCRATCH,
+	/** Directories created implicitly */
+	STATS_MKDIRS,
+	/** Readonly directory existence cache hits */
+	STATS_HITS,
+	/** Readonly directory existence cache misses */
+	STATS_MISSES,
+	/** Resolution cache entries evicted (from any cache) */
+	STATS_EVICTIONS,
+	/** Library calls that returned an error */
+	STATS_ERRORS,
+	/** Number of counters per wrapped function */
+	STATS_COUNTERS
+};
+
+/** Latency phases */
+enum stats_phase {
+	/** Turdifying path (including all of the following phases) */
+	STATS_TURDIFY = 0,
+	/** Converting to a canonical absolute path */
+	STATS_CANONICAL,
+	/** Probing the readonly directories */
+	STATS_PROBE,
+	/** Creating intermediate directories */
+	STATS_MKDIR,
+	/** Calling the original library function */
+	STATS_CALL,
+	/** Number of phases per wrapped function */
+	STATS_PHASES
+};
+
+/** Heavy-hitter sketches */
+enum stats_sketch {
+	/** Paths found within a readonly directory */
+	STATS_FOUND = 0,
+	/** Paths not found within any readonly directory */
+	STATS_MISSING,
+	/** Number of sketches per shard */
+	STATS_SKETCHES
+};
+
+/** A heavy-hitter sketch entry */
+struct stats_entry {
+	/** Key hash */
+	uint64_t hash;
+	/** Estimated count (or zero if entry is unused) */
+	uint64_t count;
+	/** Maximum overestimate of count */
+	uint64_t error;
+	/** Key (possibly truncated) */
+	char key[STATS_KEY_LEN];
+};
+
+/** A heavy-hitter sketch */
+struct stats_hot {
+	/** Lock (monotonic time taken, or zero if not held) */
+	uint64_t lock;
+	/** Entries */
+	struct stats_entry entries[STATS_SKETCH_ENTRIES]
+		__attribute__ (( aligned ( 64 ) ));
+} __attribute__ (( aligned ( 64 ) ));
+
+/** Statistics segment header */
+struct stats_header {
+	/** Magic signature */
+	char magic[8];
+	/** Format version */
+	uint32_t version;
+	/** Number of counter shards */
+	uint32_t shards;
+	/** Number of wrapped functions */
+	uint32_t funcs;
+	/** Number of counters per wrapped function */
+	uint32_t counters;
+	/** Number of latency phases per wrapped function */
+	uint32_t phases;
+	/** Number of buckets per latency histogram */
+	uint32_t buckets;
+	/** Number of heavy-hitter sketch shards */
+	uint32_t sketch_shards;
+	/** Number of heavy-hitter sketches per shard */
+	uint32_t sketches;
+	/** Number of entries per heavy-hitter sketch */
+	uint32_t sketch_entries;
+	/** Mapping description */
+	char desc[STATS_DESC_LEN];
+	/** Wrapped function names */
+	char names[STATS_MAX_FUNCS][STATS_NAME_LEN];
+} __attribute__ (( packed, aligned ( 64 ) ));
+
+/** A statistics segment */
+struct stats {
+	/** Mapped segment header (or NULL if not mapped) */
+	struct stats_header *hdr;
+	/** Counters */
+	uint64_t *counters;
+	/** Latency histograms */
+	uint64_t *histograms;
+	/** Heavy-hitter sketches */
+	struct stats_hot *sketches;
+	/** Number of counters per shard */
+	size_t stride;
+	/** Length of mapping */
+	size_t len;
+};
+
+/**
+ * Increment counter
+ *
+ * @v stats		Statistics segment
+ * @v shard		Counter shard
+ * @v func		Wrapped function index
+ * @v counter		Counter
+ */
+static inline void stats_inc ( struct stats *stats, unsigned int shard,
+			       unsigned int func, enum stats_counter counter ) {
+	uint64_t *value;
+
+	if ( ! stats->counters )
+		return;
+	value = &stats->counters[ ( ( shard % STATS_SHARDS ) * stats->stride ) +
+				  ( func * STATS_COUNTERS ) + counter ];
+	__atomic_fetch_add ( value, 1, __ATOMIC_RELAXED );
+}
+
+/**
+ * Find histogram bucket
+ *
+ * @v value		Value
+ * @ret bucket		Histogram bucket
+ *
+ * Values too large for the histogram are placed in the last bucket.
+ */
+static inline unsigned int stats_bucket ( uint64_t value ) {
+	unsigned int shift;
+	unsigned int bucket;
+
+	if ( value < STATS_SUB_BUCKETS )
+		return value;
+	shift = ( ( 63 - __builtin_clzll ( value ) ) - STATS_SUB_BITS );
+	bucket = ( ( ( shift + 1 ) << STATS_SUB_BITS ) |
+		   ( ( value >> shift ) & ( STATS_SUB_BUCKETS - 1 ) ) );
+	return ( ( bucket < STATS_BUCKETS ) ? bucket : ( STATS_BUCKETS - 1 ) );
+}
+
+/**
+ * Record value in latency histogram
+ *
+ * @v stats		Statistics segment
+ * @v func		Wrapped function index
+ * @v phase		Latency phase
+ * @v value		Value
+ */
+static inline void stats_record ( struct stats *stats, unsigned int func,
+				  enum stats_phase phase, uint64_t value ) {
+	uint64_t *bucket;
+
+	if ( ! stats->histograms )
+		return;
+	bucket = &stats->histograms[ ( ( func * STATS_PHASES ) + phase ) *
+				     STATS_BUCKETS ];
+	bucket += stats_bucket ( value );
+	__atomic_fetch_add ( bucket, 1, __ATOMIC_RELAXED );
+}
+
+extern int stats_open ( struct stats *stats, const char *name,
+			const char *desc, const char * const *names,
+			unsigned int funcs );
+extern int stats_attach ( struct stats *stats, const char *name );
+extern uint64_t stats_read ( struct stats *stats, unsigned int func,
+			     enum stats_counter counter );
+extern uint64_t stats_bucket_min ( unsigned int bucket );
+extern void stats_hot ( struct stats *stats, unsigned int tid,
+			enum stats_sketch sketch, const char *key,
+			size_t len, uint64_t weight );
+extern struct stats_hot * stats_sketch ( struct stats *stats,
+					 unsigned int shard,
+					 enum stats_sketch sketch );
+extern void stats_close ( struct stats *stats );
+
+#pragma GCC visibility pop
+
+#endif /* _STATS_H */
@@ -0,0 +1,336 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.h"
+#include "trace.h"
+
+/**
+ * Calculate length of trace file
+ *
+ * @v hdr		Trace file header
+ * @ret len		Length of trace file
+ */
+static size_t trace_length ( const struct trace_header *hdr ) {
+
+	return ( sizeof ( *hdr ) +
+		 ( hdr->rings * sizeof ( struct trace_ring ) ) );
+}
+
+/**
+ * Map trace file
+ *
+ * @v trace		Trace file
+ * @v hdr		Trace file header
+ * @v fd		File descriptor
+ * @v prot		Memory protection
+ * @ret rc		Return status code
+ */
+static int trace_map ( struct trace *trace, const struct trace_header *hdr,
+		       int fd, int prot ) {
+	struct stat st;
+	size_t len;
+	void *map;
+
+	/* Check length */
+	len = trace_length ( hdr );
+	if ( fstat ( fd, &st ) != 0 )
+		return -1;
+	if ( ( ( size_t ) st.st_size ) < len ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Map file */
+	map = mmap ( NULL, len, prot, MAP_SHARED, fd, 0 );
+	if ( map == MAP_FAILED )
+		return -1;
+	trace->hdr = map;
+	trace->rings = ( map + sizeof ( *hdr ) );
+	trace->len = len;
+
+	return 0;
+}
+
+/**
+ * Create trace file
+ *
+ * @v trace		Trace file
+ * @v filename		File name
+ * @v names		Wrapped function names
+ * @v funcs		Number of wrapped functions
+ * @ret rc		Return status code
+ *
+ * An existing file is never opened, since the file name may be
+ * predictable (and within a world-writable directory).  Any existing
+ * file (e.g. left behind by an earlier process with the same process
+ * ID) is instead removed, if permitted, and a new file is created.
+ * The file is sparse, and so consumes disk space only for the parts
+ * of each ring actually used.
+ */
+int trace_create ( struct trace *trace, const char *filename,
+		   const char * const *names, unsigned int funcs ) {
+	struct trace_header hdr;
+	struct timespec realtime;
+	struct timespec monotonic;
+	unsigned int i;
+	int fd;
+
+	/* Construct header */
+	memset ( trace, 0, sizeof ( *trace ) );
+	if ( funcs > STATS_MAX_FUNCS ) {
+		errno = EINVAL;
+		goto err_funcs;
+	}
+	clock_gettime ( CLOCK_REALTIME, &realtime );
+	clock_gettime ( CLOCK_MONOTONIC, &monotonic );
+	memset ( &hdr, 0, sizeof ( hdr ) );
+	memcpy ( hdr.magic, TRACE_MAGIC, sizeof ( hdr.magic ) );
+	hdr.version = TRACE_VERSION;
+	hdr.rings = TRACE_RINGS;
+	hdr.records = TRACE_RECORDS;
+	hdr.strings = TRACE_STRINGS;
+	hdr.funcs = funcs;
+	hdr.pid = getpid();
+	hdr.epoch = ( ( ( realtime.tv_sec - monotonic.tv_sec ) *
+			1000000000ULL ) +
+		      ( realtime.tv_nsec - monotonic.tv_nsec ) );
+	for ( i = 0 ; i < funcs ; i++ ) {
+		strncpy ( hdr.names[i], names[i],
+			  ( sizeof ( hdr.names[i] ) - 1 ) );
+	}
+
+	/* Create file, removing any existing file */
+	fd = openat ( AT_FDCWD, filename,
+		      ( O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC ), 0600 );
+	if ( ( fd < 0 ) && ( errno == EEXIST ) &&
+	     ( unlinkat ( AT_FDCWD, filename, 0 ) == 0 ) ) {
+		fd = openat ( AT_FDCWD, filename,
+			      ( O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC ),
+			      0600 );
+	}
+	if ( fd < 0 )
+		goto err_open;
+	if ( ( ftruncate ( fd, trace_length ( &hdr ) ) != 0 ) ||
+	     ( pwrite ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) ) )
+		goto err_init;
+
+	/* Map file */
+	if ( trace_map ( trace, &hdr, fd, ( PROT_READ | PROT_WRITE ) ) != 0 )
+		goto err_map;
+
+	close ( fd );
+	return 0;
+
+ err_map:
+ err_init:
+	close ( fd );
+ err_open:
+ err_funcs:
+	return -1;
+}
+
+/**
+ * Open existing trace file (read-only)
+ *
+ * @v trace		Trace file
+ * @v filename		File name
+ * @ret rc		Return status code
+ */
+int trace_open ( struct trace *trace, const char *filename ) {
+	struct trace_header hdr;
+	int fd;
+
+	/* Open file */
+	memset ( trace, 0, sizeof ( *trace ) );
+	fd = openat ( AT_FDCWD, filename, ( O_RDONLY | O_CLOEXEC ) );
+	if ( fd < 0 )
+		goto err_open;
+
+	/* Read and validate header */
+	if ( pread ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) )
+		goto err_read;
+	if ( ( memcmp ( hdr.magic, TRACE_MAGIC, sizeof ( hdr.magic ) ) != 0 ) ||
+	     ( hdr.version != TRACE_VERSION ) ||
+	     ( hdr.records != TRACE_RECORDS ) ||
+	     ( hdr.strings != TRACE_STRINGS ) ||
+	     ( hdr.funcs > STATS_MAX_FUNCS ) ) {
+		errno = EINVAL;
+		goto err_invalid;
+	}
+
+	/* Map file */
+	if ( trace_map ( trace, &hdr, fd, PROT_READ ) != 0 )
+		goto err_map;
+
+	close ( fd );
+	return 0;
+
+ err_map:
+ err_invalid:
+ err_read:
+	close ( fd );
+ err_open:
+	return -1;
+}
+
+/**
+ * Claim ring for the current thread
+ *
+ * @v trace		Trace file
+ * @v tid		Thread identifier
+ * @ret ring		Trace ring, or NULL if no rings remain
+ *
+ * A failure to claim a ring is recorded as a lost record.
+ */
+struct trace_ring * trace_claim ( struct trace *trace, unsigned int tid ) {
+	struct trace_header *hdr = trace->hdr;
+	struct trace_ring *ring;
+	uint32_t used;
+
+	/* Avoid modifying the shared count once all rings are claimed */
+	used = __atomic_load_n ( &hdr->used, __ATOMIC_RELAXED );
+	if ( used < hdr->rings )
+		used = __atomic_fetch_add ( &hdr->used, 1, __ATOMIC_RELAXED );
+	if ( used >= hdr->rings ) {
+		__atomic_fetch_add ( &hdr->lost, 1, __ATOMIC_RELAXED );
+		return NULL;
+	}
+
+	/* Record owning thread */
+	ring = &trace->rings[used];
+	ring->tid = tid;
+	return ring;
+}
+
+/**
+ * Write trace record
+ *
+ * @v ring		Trace ring
+ * @v record		Trace record (with all fields except the path)
+ * @v path		Path
+ *
+ * Paths longer than the maximum recorded path length are truncated.
+ * Only the owning thread may write to a ring.
+ */
+void trace_write ( struct trace_ring *ring, struct trace_record *record,
+		   const char *path ) {
+	uint64_t head = ring->head;
+	uint64_t strhead = ring->strhead;
+	size_t offset;
+	size_t frag;
+	size_t len;
+
+	/* Copy path into string area */
+	len = strnlen ( path, TRACE_PATH_LEN );
+	offset = ( strhead % TRACE_STRINGS );
+	frag = ( TRACE_STRINGS - offset );
+	if ( frag > len )
+		frag = len;
+	memcpy ( &ring->strings[offset], path, frag );
+	memcpy ( ring->strings, ( path + frag ), ( len - frag ) );
+	__atomic_store_n ( &ring->strhead, ( strhead + len ),
+			   __ATOMIC_RELEASE );
+
+	/* Write record */
+	record->seq = head;
+	record->hash = index_hash ( path, len );
+	record->offset = strhead;
+	record->len = len;
+	memcpy ( &ring->records[ head % TRACE_RECORDS ], record,
+		 sizeof ( *record ) );
+	__atomic_store_n ( &ring->head, ( head + 1 ), __ATOMIC_RELEASE );
+}
+
+/**
+ * Read trace record
+ *
+ * @v ring		Trace ring
+ * @v seq		Sequence number
+ * @v record		Trace record to fill in
+ * @v path		Path buffer (of at least TRACE_PATH_LEN + 1 bytes)
+ * @ret rc		Return status code
+ *
+ * The record may be read while the owning thread continues to write
+ * to the ring.  A record that has already been overwritten (or may
+ * have been overwritten while being read) is rejected.  A path that
+ * has already been overwritten is returned as an empty string.
+ */
+int trace_read ( struct trace_ring *ring, uint64_t seq,
+		 struct trace_record *record, char *path ) {
+	uint64_t head;
+	uint32_t used;
+	size_t offset;
+	size_t frag;
+
+	/* Copy record and path */
+	if ( seq >= __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE ) ) {
+		errno = ENOENT;
+		return -1;
+	}
+	memcpy ( record, &ring->records[ seq % TRACE_RECORDS ],
+		 sizeof ( *record ) );
+	if ( record->len > TRACE_PATH_LEN )
+		record->len = TRACE_PATH_LEN;
+	offset = ( record->offset % TRACE_STRINGS );
+	frag = ( TRACE_STRINGS - offset );
+	if ( frag > record->len )
+		frag = record->len;
+	memcpy ( path, &ring->strings[offset], frag );
+	memcpy ( ( path + frag ), ring->strings, ( record->len - frag ) );
+	path[record->len] = '\0';
+
+	/* Check that neither record nor path was overwritten, allowing
+	 * for a write that may be in progress.
+	 */
+	__atomic_thread_fence ( __ATOMIC_ACQUIRE );
+	head = __atomic_load_n ( &ring->head, __ATOMIC_RELAXED );
+	if ( ( record->seq != ( ( uint32_t ) seq ) ) ||
+	     ( ( head - seq ) >= TRACE_RECORDS ) ) {
+		errno = ESTALE;
+		return -1;
+	}
+	used = ( __atomic_load_n ( &ring->strhead, __ATOMIC_RELAXED ) -
+		 record->offset );
+	if ( ( used + TRACE_PATH_LEN ) > TRACE_STRINGS )
+		path[0] = '\0';
+
+	return 0;
+}
+
+/**
+ * Close trace file
+ *
+ * @v trace		Trace file
+ */
+void trace_close ( struct trace *trace ) {
+
+	if ( trace->hdr )
+		munmap ( trace->hdr, trace->len );
+	memset ( trace, 0, sizeof ( *trace ) );
+}
@@ -0,0 +1,185 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Binary trace buffers
+ *
+ * Trace records are written to a file-backed shared mapping, so that
+ * a decoder may read them either while the process is running or
+ * after it has exited (or crashed).  Each process writes to its own
+ * trace file.
+ *
+ * Each thread claims its own ring within the trace file on first use,
+ * and is the only writer to that ring, so that writing a record
+ * requires no locking and no atomic read-modify-write operations.
+ * Each ring holds a fixed number of fixed-size records, along with a
+ * circular string area holding the paths referred to by the records.
+ * The oldest records and strings are overwritten when the ring wraps.
+ *
+ * A record is written before the ring's record count is advanced, and
+ * each record holds (the low bits of) its own sequence number, so that
+ * a reader can detect records overwritten while being read.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include "stats.h"
+
+#pragma GCC visibility push ( hidden )
+
+/** Trace file magic signature */
+#define TRACE_MAGIC "TURDTRC"
+
+/** Trace file format version */
+#define TRACE_VERSION 1
+
+/** Number of rings (i.e. traced threads) per trace file */
+#define TRACE_RINGS 16
+
+/** Number of records per ring (must be a power of two) */
+#define TRACE_RECORDS 4096
+
+/** Length of string area per ring (must be a power of two) */
+#define TRACE_STRINGS 65536
+
+/** Maximum recorded path length */
+#define TRACE_PATH_LEN 1024
+
+/** Trace events */
+enum trace_event {
+	/** Path mapped */
+	TRACE_RESOLVE = 0,
+	/** Readonly directory probed */
+	TRACE_PROBE,
+	/** Intermediate directory created */
+	TRACE_MKDIR,
+	/** Number of trace events */
+	TRACE_EVENTS
+};
+
+/** Trace decisions */
+enum trace_decision {
+	/** Path is not within any turd directory */
+	TRACE_NOPREFIX = 0,
+	/** Path resolved to a readonly directory */
+	TRACE_DIST,
+	/** Path resolved to the writable directory */
+	TRACE_SCRATCH,
+	/** Operation succeeded (or probed path exists) */
+	TRACE_OK,
+	/** Operation failed (or probed path does not exist) */
+	TRACE_FAILED,
+	/** Number of trace decisions */
+	TRACE_DECISIONS
+};
+
+/** A trace record */
+struct trace_record {
+	/** Start time (in nanoseconds, from the monotonic clock) */
+	uint64_t time;
+	/** Sequence number (low bits) */
+	uint32_t seq;
+	/** Duration (in nanoseconds) */
+	uint32_t duration;
+	/** Path hash (low bits) */
+	uint32_t hash;
+	/** Offset of path within string area (low bits) */
+	uint32_t offset;
+	/** Length of path (possibly truncated) */
+	uint16_t len;
+	/** Wrapped function index */
+	uint8_t func;
+	/** Event */
+	uint8_t event;
+	/** Decision */
+	uint8_t decision;
+	/** Readonly layer number (or zero if not applicable) */
+	uint8_t layer;
+	/** Reserved */
+	uint16_t reserved;
+} __attribute__ (( packed ));
+
+/** A trace ring */
+struct trace_ring {
+	/** Number of records ever written */
+	uint64_t head;
+	/** Number of string bytes ever written */
+	uint64_t strhead;
+	/** Thread identifier */
+	uint32_t tid;
+	/** Records */
+	struct trace_record records[TRACE_RECORDS]
+		__attribute__ (( aligned ( 64 ) ));
+	/** String area */
+	char strings[TRACE_STRINGS];
+} __attribute__ (( aligned ( 64 ) ));
+
+/** Trace file header */
+struct trace_header {
+	/** Magic signature */
+	char magic[8];
+	/** Format version */
+	uint32_t version;
+	/** Number of rings */
+	uint32_t rings;
+	/** Number of records per ring */
+	uint32_t records;
+	/** Length of string area per ring */
+	uint32_t strings;
+	/** Number of wrapped functions */
+	uint32_t funcs;
+	/** Process identifier */
+	uint32_t pid;
+	/** Realtime clock value at monotonic clock zero (in nanoseconds) */
+	uint64_t epoch;
+	/** Number of rings claimed */
+	uint32_t used;
+	/** Number of records lost for lack of a ring */
+	uint32_t lost;
+	/** Wrapped function names */
+	char names[STATS_MAX_FUNCS][STATS_NAME_LEN];
+} __attribute__ (( packed, aligned ( 64 ) ));
+
+/** A trace file */
+struct trace {
+	/** Mapped file header (or NULL if not mapped) */
+	struct trace_header *hdr;
+	/** Rings */
+	struct trace_ring *rings;
+	/** Length of mapping */
+	size_t len;
+};
+
+extern int trace_create ( struct trace *trace, const char *filename,
+			  const char * const *names, unsigned int funcs );
+extern int trace_open ( struct trace *trace, const char *filename );
+extern struct trace_ring * trace_claim ( struct trace *trace,
+					 unsigned int tid );
+extern void trace_write ( struct trace_ring *ring,
+			  struct trace_record *record, const char *path );
+extern int trace_read ( struct trace_ring *ring, uint64_t seq,
+			struct trace_record *record, char *path );
+extern void trace_close ( struct trace *trace );
+
+#pragma GCC visibility pop
+
+#endif /* _TRACE_H */
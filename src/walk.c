@@ -0,0 +1,588 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include "walk.h"
+
+/** Initial size of a per-thread job queue */
+#define WALK_QUEUE_MIN 64
+
+/** Maximum default number of worker threads */
+#define WALK_MAX_THREADS 32
+
+/**
+ * Add job to tail of queue
+ *
+ * @v queue		Job queue
+ * @v job		Job
+ * @ret rc		Return status code
+ */
+static int walk_enqueue ( struct walk_queue *queue, struct walk_job *job ) {
+	struct walk_job **jobs;
+	size_t count;
+	size_t max;
+	size_t i;
+	int rc;
+
+	pthread_mutex_lock ( &queue->lock );
+
+	/* Grow ring buffer if necessary */
+	count = ( queue->tail - queue->head );
+	if ( count == queue->max ) {
+		max = ( queue->max ? ( queue->max * 2 ) : WALK_QUEUE_MIN );
+		jobs = malloc ( max * sizeof ( jobs[0] ) );
+		if ( ! jobs ) {
+			rc = -1;
+			goto err_alloc;
+		}
+		for ( i = 0 ; i < count ; i++ ) {
+			jobs[i] = queue->jobs[ ( queue->head + i ) &
+					       ( queue->max - 1 ) ];
+		}
+		free ( queue->jobs );
+		queue->jobs = jobs;
+		queue->max = max;
+		queue->head = 0;
+		queue->tail = count;
+	}
+
+	/* Add job */
+	queue->jobs[ queue->tail++ & ( queue->max - 1 ) ] = job;
+	rc = 0;
+
+ err_alloc:
+	pthread_mutex_unlock ( &queue->lock );
+	return rc;
+}
+
+/**
+ * Remove job from queue
+ *
+ * @v queue		Job queue
+ * @v steal		Remove from head (rather than tail) of queue
+ * @ret job		Job, or NULL if queue is empty
+ */
+static struct walk_job * walk_dequeue ( struct walk_queue *queue,
+					int steal ) {
+	struct walk_job *job = NULL;
+
+	pthread_mutex_lock ( &queue->lock );
+	if ( queue->tail != queue->head ) {
+		if ( steal ) {
+			job = queue->jobs[ queue->head++ &
+					   ( queue->max - 1 ) ];
+		} else {
+			job = queue->jobs[ --queue->tail &
+					   ( queue->max - 1 ) ];
+		}
+	}
+	pthread_mutex_unlock ( &queue->lock );
+	return job;
+}
+
+/**
+ * Take next job for a worker thread
+ *
+ * @v walker		Walker
+ * @v thread		Worker thread index
+ * @ret job		Job, or NULL if no jobs are queued
+ *
+ * A worker takes the most recently queued job from its own queue, or
+ * steals the least recently queued job from another worker's queue.
+ */
+static struct walk_job * walk_take ( struct walker *walker,
+				     unsigned int thread ) {
+	struct walk_job *job;
+	unsigned int i;
+
+	job = walk_dequeue ( &walker->queues[thread], 0 );
+	for ( i = 1 ; ( ! job ) && ( i < walker->threads ) ; i++ ) {
+		job = walk_dequeue ( &walker->queues[ ( thread + i ) %
+						      walker->threads ], 1 );
+	}
+	return job;
+}
+
+/**
+ * Free job
+ *
+ * @v job		Job
+ */
+static void walk_free ( struct walk_job *job ) {
+
+	if ( job->fd >= 0 )
+		close ( job->fd );
+	free ( job->path );
+	free ( job );
+}
+
+/**
+ * Queue job
+ *
+ * @v walker		Walker
+ * @v thread		Worker thread index
+ * @v path		Path (will be freed)
+ * @v len		Length of path
+ * @v context		Caller context
+ * @ret rc		Return status code
+ */
+static int walk_submit ( struct walker *walker, unsigned int thread,
+			 char *path, size_t len, void *context ) {
+	struct walk_job *job;
+
+	/* Allocate and populate job */
+	job = malloc ( sizeof ( *job ) );
+	if ( ! job )
+		goto err_alloc;
+	job->fd = -1;
+	job->path = path;
+	job->len = len;
+	job->context = context;
+
+	/* Add to this thread's queue */
+	__atomic_add_fetch ( &walker->pending, 1, __ATOMIC_SEQ_CST );
+	if ( walk_enqueue ( &walker->queues[thread], job ) != 0 )
+		goto err_enqueue;
+
+	/* Wake an idle thread, if any */
+	if ( __atomic_load_n ( &walker->idle, __ATOMIC_SEQ_CST ) ) {
+		pthread_mutex_lock ( &walker->lock );
+		pthread_cond_signal ( &walker->cond );
+		pthread_mutex_unlock ( &walker->lock );
+	}
+
+	return 0;
+
+ err_enqueue:
+	__atomic_sub_fetch ( &walker->pending, 1, __ATOMIC_SEQ_CST );
+	free ( job );
+ err_alloc:
+	free ( path );
+	return -1;
+}
+
+/**
+ * Queue subdirectory to be walked
+ *
+ * @v walker		Walker
+ * @v thread		Worker thread index
+ * @v parent		Parent directory walk job
+ * @v name		Subdirectory name
+ * @v len		Length of subdirectory name
+ * @v context		Caller context for subdirectory
+ * @ret rc		Return status code
+ *
+ * The subdirectory is not opened until it is visited, to avoid
+ * holding a file descriptor open for every queued directory.
+ */
+int walk_push ( struct walker *walker, unsigned int thread,
+		struct walk_job *parent, const char *name, size_t len,
+		void *context ) {
+	size_t path_len = ( parent->len + 1 /* '/' */ + len );
+	char *path;
+
+	/* Construct path */
+	if ( path_len >= PATH_MAX ) {
+		errno = ENAMETOOLONG;
+		goto err_len;
+	}
+	path = malloc ( path_len + 1 /* NUL */ );
+	if ( ! path )
+		goto err_alloc;
+	memcpy ( path, parent->path, parent->len );
+	path[parent->len] = '/';
+	memcpy ( &path[ parent->len + 1 ], name, len );
+	path[path_len] = '\0';
+
+	return walk_submit ( walker, thread, path, path_len, context );
+
+ err_alloc:
+ err_len:
+	return -1;
+}
+
+/**
+ * Run worker thread
+ *
+ * @v walker		Walker
+ * @v thread		Worker thread index
+ */
+static void walk_worker ( struct walker *walker, unsigned int thread ) {
+	struct walk_job *job;
+	int rc;
+
+	while ( 1 ) {
+
+		/* Take next job, waiting if necessary */
+		job = walk_take ( walker, thread );
+		if ( ! job ) {
+			pthread_mutex_lock ( &walker->lock );
+			__atomic_add_fetch ( &walker->idle, 1,
+					     __ATOMIC_SEQ_CST );
+			while ( ! ( job = walk_take ( walker, thread ) ) ) {
+				if ( ! __atomic_load_n ( &walker->pending,
+							 __ATOMIC_SEQ_CST ) )
+					break;
+				pthread_cond_wait ( &walker->cond,
+						    &walker->lock );
+			}
+			__atomic_sub_fetch ( &walker->idle, 1,
+					     __ATOMIC_SEQ_CST );
+			pthread_mutex_unlock ( &walker->lock );
+			if ( ! job )
+				break;
+		}
+
+		/* Open directory by path only (relative to the root
+		 * directory), to avoid the cost of a full open on
+		 * network filesystems for directories whose contents do
+		 * not need to be read.  A failure is left for the visit
+		 * method to handle.
+		 */
+		if ( ! __atomic_load_n ( &walker->rc, __ATOMIC_SEQ_CST ) ) {
+			job->fd = openat ( walker->root, ( job->len ?
+							   ( job->path + 1 ) :
+							   "." ),
+					   ( O_PATH | O_DIRECTORY |
+					     O_CLOEXEC ) );
+			if ( ( rc = walker->visit ( walker, thread,
+						    job ) ) != 0 ) {
+				pthread_mutex_lock ( &walker->lock );
+				if ( ! walker->rc ) {
+					walker->error = errno;
+					__atomic_store_n ( &walker->rc, rc,
+							   __ATOMIC_SEQ_CST );
+				}
+				pthread_mutex_unlock ( &walker->lock );
+			}
+		}
+		walk_free ( job );
+
+		/* Wake all idle threads if the walk is complete */
+		if ( __atomic_sub_fetch ( &walker->pending, 1,
+					  __ATOMIC_SEQ_CST ) == 0 ) {
+			pthread_mutex_lock ( &walker->lock );
+			pthread_cond_broadcast ( &walker->cond );
+			pthread_mutex_unlock ( &walker->lock );
+		}
+	}
+}
+
+/** A worker thread argument */
+struct walk_thread {
+	/** Walker */
+	struct walker *walker;
+	/** Worker thread index */
+	unsigned int thread;
+	/** Thread */
+	pthread_t pthread;
+};
+
+/**
+ * Start worker thread
+ *
+ * @v arg		Worker thread argument
+ * @ret ret		Return value
+ */
+static void * walk_start ( void *arg ) {
+	struct walk_thread *thread = arg;
+
+	walk_worker ( thread->walker, thread->thread );
+	return NULL;
+}
+
+/**
+ * Walk directory tree
+ *
+ * @v walker		Walker
+ * @v fd		Root directory file descriptor
+ * @v context		Caller context for root directory
+ * @ret rc		Return status code
+ *
+ * The root directory is visited by the calling thread, which then
+ * acts as one of the worker threads until the walk is complete.
+ */
+int walk_tree ( struct walker *walker, int fd, void *context ) {
+	struct walk_thread *threads;
+	unsigned int started;
+	unsigned int i;
+	char *path;
+	int rc;
+
+	/* Initialise walker */
+	if ( ! walker->threads )
+		walker->threads = 1;
+	walker->pending = 0;
+	walker->idle = 0;
+	walker->rc = 0;
+	walker->error = 0;
+	walker->root = fd;
+	pthread_mutex_init ( &walker->lock, NULL );
+	pthread_cond_init ( &walker->cond, NULL );
+
+	/* Allocate per-thread queues */
+	walker->queues = calloc ( walker->threads,
+				  sizeof ( walker->queues[0] ) );
+	threads = calloc ( walker->threads, sizeof ( threads[0] ) );
+	path = strdup ( "" );
+	if ( ! ( walker->queues && threads && path ) ) {
+		free ( path );
+		rc = -1;
+		goto err_alloc;
+	}
+	for ( i = 0 ; i < walker->threads ; i++ )
+		pthread_mutex_init ( &walker->queues[i].lock, NULL );
+
+	/* Queue root directory */
+	if ( ( rc = walk_submit ( walker, 0, path, 0, context ) ) != 0 )
+		goto err_queue;
+
+	/* Start additional worker threads.  Failure to start a thread
+	 * is not fatal: the walk will simply use fewer threads.
+	 */
+	for ( started = 1 ; started < walker->threads ; started++ ) {
+		threads[started].walker = walker;
+		threads[started].thread = started;
+		if ( pthread_create ( &threads[started].pthread, NULL,
+				      walk_start, &threads[started] ) != 0 )
+			break;
+	}
+
+	/* Act as worker thread, and wait for walk to complete */
+	walk_worker ( walker, 0 );
+	for ( i = 1 ; i < started ; i++ )
+		pthread_join ( threads[i].pthread, NULL );
+
+	/* Report first error, if any */
+	if ( ( rc = walker->rc ) != 0 )
+		errno = walker->error;
+
+ err_queue:
+	for ( i = 0 ; i < walker->threads ; i++ ) {
+		free ( walker->queues[i].jobs );
+		pthread_mutex_destroy ( &walker->queues[i].lock );
+	}
+ err_alloc:
+	free ( threads );
+	free ( walker->queues );
+	walker->queues = NULL;
+	pthread_cond_destroy ( &walker->cond );
+	pthread_mutex_destroy ( &walker->lock );
+	return rc;
+}
+
+/**
+ * Read raw directory entries
+ *
+ * @v fd		Directory file descriptor
+ * @v buf		Buffer for raw directory entries
+ * @v len		Length of buffer
+ * @ret len		Length of raw directory entries, or negative error
+ *
+ * The directory stream position is advanced past the returned
+ * entries.  A length of zero indicates the end of the directory.
+ */
+long walk_getdents ( int fd, void *buf, size_t len ) {
+	long rc;
+
+	do {
+		rc = syscall ( SYS_getdents64, fd, buf, len );
+	} while ( ( rc < 0 ) && ( errno == EINTR ) );
+	return rc;
+}
+
+/**
+ * Read directory entries
+ *
+ * @v job		Directory walk job
+ * @v entry		Entry handler
+ * @v arg		Entry handler argument
+ * @ret rc		Return status code
+ *
+ * Entries are read using getdents64() directly, to obtain the file
+ * type (where provided by the filesystem) without any further system
+ * calls.  The "." and ".." entries are omitted.  A failure to open or
+ * read the directory is reported as -1 with errno set; a failure from
+ * the entry handler is reported as the handler's return status code.
+ */
+int walk_read ( struct walk_job *job, walk_entry_t entry, void *arg ) {
+	struct walk_dirent64 *dirent;
+	unsigned int type;
+	char *buf;
+	long len;
+	long pos;
+	size_t name_len;
+	int fd;
+	int rc;
+
+	/* Open directory */
+	fd = openat ( job->fd, ".", ( O_RDONLY | O_DIRECTORY | O_CLOEXEC ) );
+	if ( fd < 0 ) {
+		rc = -1;
+		goto err_open;
+	}
+	buf = malloc ( WALK_DIRENT_BUF );
+	if ( ! buf ) {
+		rc = -1;
+		goto err_alloc;
+	}
+
+	/* Read directory entries */
+	while ( ( len = walk_getdents ( fd, buf, WALK_DIRENT_BUF ) ) != 0 ) {
+		if ( len < 0 ) {
+			rc = -1;
+			goto err_getdents;
+		}
+		for ( pos = 0 ; pos < len ; pos += dirent->d_reclen ) {
+			dirent = ( ( struct walk_dirent64 * ) ( buf + pos ) );
+
+			/* Skip "." and ".." */
+			if ( ( strcmp ( dirent->d_name, "." ) == 0 ) ||
+			     ( strcmp ( dirent->d_name, ".." ) == 0 ) )
+				continue;
+			name_len = strlen ( dirent->d_name );
+
+			/* Translate file type */
+			switch ( dirent->d_type ) {
+			case DT_UNKNOWN:
+				type = WALK_UNKNOWN;
+				break;
+			case DT_DIR:
+				type = WALK_DIR;
+				break;
+			case DT_LNK:
+				type = WALK_LINK;
+				break;
+			default:
+				type = WALK_FILE;
+				break;
+			}
+
+			/* Handle entry */
+			if ( ( rc = entry ( job, dirent->d_name, name_len,
+					    type, arg ) ) != 0 )
+				goto err_entry;
+		}
+	}
+	rc = 0;
+
+ err_entry:
+ err_getdents:
+	free ( buf );
+ err_alloc:
+	close ( fd );
+ err_open:
+	return rc;
+}
+
+/**
+ * Determine directory entry type, following symbolic links
+ *
+ * @v dirfd		Directory file descriptor
+ * @v name		Name
+ * @v type		Entry type to fill in (WALK_DIR or WALK_FILE)
+ * @ret rc		Return status code
+ *
+ * Only the file type is requested, to minimise the work required of
+ * network filesystems.  A dangling symbolic link is reported as an
+ * error.
+ */
+int walk_type ( int dirfd, const char *name, unsigned int *type ) {
+#ifdef HAVE_STATX
+	struct statx stx;
+
+	if ( statx ( dirfd, name, AT_NO_AUTOMOUNT, STATX_TYPE, &stx ) != 0 )
+		return -1;
+	*type = ( S_ISDIR ( stx.stx_mode ) ? WALK_DIR : WALK_FILE );
+#else
+	struct stat st;
+
+	if ( fstatat ( dirfd, name, &st, AT_NO_AUTOMOUNT ) != 0 )
+		return -1;
+	*type = ( S_ISDIR ( st.st_mode ) ? WALK_DIR : WALK_FILE );
+#endif
+	return 0;
+}
+
+/**
+ * Get directory stamp
+ *
+ * @v fd		Directory file descriptor
+ * @v stamp		Directory stamp to fill in
+ * @ret rc		Return status code
+ *
+ * Only the inode number and modification time are requested (the
+ * device number is always returned).
+ */
+int walk_get_stamp ( int fd, struct walk_stamp *stamp ) {
+#ifdef HAVE_STATX
+	struct statx stx;
+
+	if ( statx ( fd, "", ( AT_EMPTY_PATH | AT_NO_AUTOMOUNT ),
+		     ( STATX_INO | STATX_MTIME ), &stx ) != 0 )
+		return -1;
+	stamp->dev = makedev ( stx.stx_dev_major, stx.stx_dev_minor );
+	stamp->ino = stx.stx_ino;
+	stamp->mtime = stx.stx_mtime.tv_sec;
+	stamp->mtime_nsec = stx.stx_mtime.tv_nsec;
+#else
+	struct stat st;
+
+	if ( fstatat ( fd, "", &st, AT_EMPTY_PATH ) != 0 )
+		return -1;
+	stamp->dev = st.st_dev;
+	stamp->ino = st.st_ino;
+	stamp->mtime = st.st_mtim.tv_sec;
+	stamp->mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+	return 0;
+}
+
+/**
+ * Get default number of worker threads
+ *
+ * @ret threads		Number of worker threads
+ */
+unsigned int walk_default_threads ( void ) {
+	long cpus;
+
+	cpus = sysconf ( _SC_NPROCESSORS_ONLN );
+	if ( cpus < 1 )
+		return 1;
+	if ( cpus > WALK_MAX_THREADS )
+		return WALK_MAX_THREADS;
+	return cpus;
+}
@@ -0,0 +1,181 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Parallel directory tree walker
+ *
+ * Each directory is a job, processed by a caller-provided visit
+ * method running in one of several worker threads.  The visit method
+ * reads the directory's entries (if required) using walk_read(), and
+ * queues any subdirectories to be walked using walk_push().
+ *
+ * Each worker thread has its own double-ended queue of jobs.  A
+ * worker takes jobs from the tail of its own queue (i.e. depth-first,
+ * for locality), and when idle steals jobs from the head of another
+ * worker's queue (i.e. the largest remaining subtrees).
+ *
+ * Like the index, this code is linked into the interception library
+ * and so must not call any wrapped library functions.  The sole
+ * exception is close(), which is wrapped only to recognise the end of
+ * a request and does nothing else for any other descriptor.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#pragma GCC visibility push ( hidden )
+
+/** A directory walk job */
+struct walk_job {
+	/**
+	 * Directory file descriptor (opened with O_PATH)
+	 *
+	 * This is negative (with errno indicating the reason) if the
+	 * directory could not be opened.
+	 */
+	int fd;
+	/** Path relative to walk root directory ("" or starting with '/') */
+	char *path;
+	/** Length of path */
+	size_t len;
+	/** Caller context */
+	void *context;
+};
+
+/** A per-thread job queue */
+struct walk_queue {
+	/** Lock */
+	pthread_mutex_t lock;
+	/** Ring buffer of jobs */
+	struct walk_job **jobs;
+	/** Index of first job (consumer end for stealing) */
+	size_t head;
+	/** Index after last job (owner end) */
+	size_t tail;
+	/** Size of ring buffer (a power of two) */
+	size_t max;
+};
+
+/** A directory tree walker */
+struct walker {
+	/**
+	 * Visit directory
+	 *
+	 * @v walker		Walker
+	 * @v thread		Worker thread index
+	 * @v job		Directory walk job
+	 * @ret rc		Return status code
+	 */
+	int ( * visit ) ( struct walker *walker, unsigned int thread,
+			  struct walk_job *job );
+	/** Caller private data */
+	void *priv;
+	/** Number of worker threads */
+	unsigned int threads;
+
+	/** Root directory file descriptor */
+	int root;
+	/** Per-thread job queues */
+	struct walk_queue *queues;
+	/** Number of jobs queued or in progress */
+	unsigned long pending;
+	/** Lock (for idle threads) */
+	pthread_mutex_t lock;
+	/** Idle thread wakeup condition */
+	pthread_cond_t cond;
+	/** Number of idle threads */
+	unsigned int idle;
+	/** Overall status (first error encountered) */
+	int rc;
+	/** Error number for first error encountered */
+	int error;
+};
+
+/** A directory stamp */
+struct walk_stamp {
+	/** Device */
+	dev_t dev;
+	/** Inode */
+	ino_t ino;
+	/** Modification time (seconds) */
+	int64_t mtime;
+	/** Modification time (nanoseconds) */
+	uint32_t mtime_nsec;
+};
+
+/** Directory entry buffer size */
+#define WALK_DIRENT_BUF 32768
+
+/** A raw directory entry, as returned by getdents64() */
+struct walk_dirent64 {
+	/** Inode */
+	uint64_t d_ino;
+	/** Offset to next entry */
+	int64_t d_off;
+	/** Length of this entry */
+	unsigned short d_reclen;
+	/** File type */
+	unsigned char d_type;
+	/** Name */
+	char d_name[0];
+};
+
+/** Directory entry type is unknown (use walk_type()) */
+#define WALK_UNKNOWN 0
+
+/** Directory entry is a directory */
+#define WALK_DIR 1
+
+/** Directory entry is a symbolic link */
+#define WALK_LINK 2
+
+/** Directory entry is some other type of file */
+#define WALK_FILE 3
+
+/**
+ * Handle directory entry
+ *
+ * @v job		Directory walk job
+ * @v name		Name
+ * @v len		Length of name
+ * @v type		Entry type (WALK_XXX), as reported by the filesystem
+ * @v arg		Caller argument
+ * @ret rc		Return status code
+ */
+typedef int ( * walk_entry_t ) ( struct walk_job *job, const char *name,
+				 size_t len, unsigned int type, void *arg );
+
+extern int walk_tree ( struct walker *walker, int fd, void *context );
+extern int walk_push ( struct walker *walker, unsigned int thread,
+		       struct walk_job *parent, const char *name,
+		       size_t len, void *context );
+extern long walk_getdents ( int fd, void *buf, size_t len );
+extern int walk_read ( struct walk_job *job, walk_entry_t entry, void *arg );
+extern int walk_type ( int dirfd, const char *name, unsigned int *type );
+extern int walk_get_stamp ( int fd, struct walk_stamp *stamp );
+extern unsigned int walk_default_threads ( void );
+
+#pragma GCC visibility pop
+
+#endif /* _WALK_H */
@@ -0,0 +1,877 @@
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "index.h"
+#include "whiteout.h"
+
+/** Slot entry offset mask (the remainder of the slot holds a hash) */
+#define WHITEOUT_OFFSET_MASK 0xffffffffULL
+
+/** Suffix for replacement whiteout file name */
+#define WHITEOUT_NEW ".new"
+
+/**
+ * Strip trailing slashes from path
+ *
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path
+ * @ret len		Length of path without trailing slashes
+ */
+static size_t whiteout_trim ( const char *suffix, size_t len ) {
+
+	while ( len && ( suffix[ len - 1 ] == '/' ) )
+		len--;
+	return len;
+}
+
+/**
+ * Calculate whiteout hash
+ *
+ * @v ns		Namespace
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path
+ * @ret hash		Hash
+ */
+static uint64_t whiteout_hash ( uint64_t ns, const char *suffix,
+				size_t len ) {
+
+	return ( index_hash ( suffix, len ) ^ ns );
+}
+
+/**
+ * Calculate length of whiteout entry
+ *
+ * @v len		Length of path
+ * @ret len		Length of entry (including padding)
+ */
+static size_t whiteout_entry_len ( size_t len ) {
+
+	return ( ( sizeof ( struct whiteout_entry ) + len + 1 /* NUL */ +
+		   WHITEOUT_ALIGN - 1 ) & ~( WHITEOUT_ALIGN - 1 ) );
+}
+
+/**
+ * Get whiteout entry
+ *
+ * @v map		Whiteout mapping
+ * @v offset		Offset within entry log
+ * @ret entry		Whiteout entry, or NULL if invalid
+ */
+static struct whiteout_entry * whiteout_entry ( struct whiteout_map *map,
+						uint64_t offset ) {
+	struct whiteout_entry *entry;
+	uint64_t remaining;
+
+	if ( offset > map->size )
+		return NULL;
+	remaining = ( map->size - offset );
+	if ( remaining < sizeof ( *entry ) )
+		return NULL;
+	entry = ( ( void * ) ( map->entries + offset ) );
+	if ( entry->len >= ( remaining - sizeof ( *entry ) ) )
+		return NULL;
+	return entry;
+}
+
+/**
+ * Get next live whiteout entry
+ *
+ * @v map		Whiteout mapping
+ * @v offset		Offset within entry log (updated)
+ * @v used		Used length of entry log
+ * @ret entry		Whiteout entry, or NULL at end of log
+ */
+static struct whiteout_entry * whiteout_next ( struct whiteout_map *map,
+					       uint64_t *offset,
+					       uint64_t used ) {
+	struct whiteout_entry *entry;
+	uint32_t flags;
+
+	while ( *offset < used ) {
+		entry = whiteout_entry ( map, *offset );
+		if ( ! entry )
+			return NULL;
+		*offset += whiteout_entry_len ( entry->len );
+		flags = __atomic_load_n ( &entry->flags, __ATOMIC_ACQUIRE );
+		if ( ! ( flags & WHITEOUT_REMOVED ) )
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Find whiteout entry
+ *
+ * @v map		Whiteout mapping
+ * @v ns		Namespace
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path (excluding trailing slashes)
+ * @ret entry		Whiteout entry (possibly removed), or NULL if not found
+ */
+static struct whiteout_entry * whiteout_find ( struct whiteout_map *map,
+					       uint64_t ns,
+					       const char *suffix,
+					       size_t len ) {
+	struct whiteout_entry *entry;
+	uint64_t offset;
+	uint64_t value;
+	uint64_t hash;
+	uint64_t i;
+
+	/* Search slots, confirming any matching hash against the path */
+	hash = whiteout_hash ( ns, suffix, len );
+	for ( i = 0 ; i <= map->mask ; i++ ) {
+		value = __atomic_load_n ( &map->slots[ ( hash + i ) &
+						       map->mask ],
+					  __ATOMIC_ACQUIRE );
+		if ( ! value )
+			return NULL;
+		if ( ( value ^ hash ) & ~WHITEOUT_OFFSET_MASK )
+			continue;
+		offset = ( ( ( value & WHITEOUT_OFFSET_MASK ) - 1 ) *
+			   WHITEOUT_ALIGN );
+		entry = whiteout_entry ( map, offset );
+		if ( entry && ( entry->ns == ns ) && ( entry->len == len ) &&
+		     ( memcmp ( entry->path, suffix, len ) == 0 ) )
+			return entry;
+	}
+	return NULL;
+}
+
+/**
+ * Check for live whiteout of an exact path
+ *
+ * @v map		Whiteout mapping
+ * @v ns		Namespace
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path
+ * @ret whiteout	Path has been whited out
+ */
+static int whiteout_live ( struct whiteout_map *map, uint64_t ns,
+			   const char *suffix, size_t len ) {
+	struct whiteout_entry *entry;
+	uint32_t flags;
+
+	entry = whiteout_find ( map, ns, suffix,
+				whiteout_trim ( suffix, len ) );
+	if ( ! entry )
+		return 0;
+	flags = __atomic_load_n ( &entry->flags, __ATOMIC_ACQUIRE );
+	return ( ! ( flags & WHITEOUT_REMOVED ) );
+}
+
+/**
+ * Update whiteout counts
+ *
+ * @v hdr		Whiteout file header
+ * @v flags		Entry flags
+ * @v delta		Change in number of whiteouts
+ */
+static void whiteout_account ( struct whiteout_header *hdr, uint32_t flags,
+			       int delta ) {
+
+	if ( flags & WHITEOUT_PARENT )
+		__atomic_add_fetch ( &hdr->parents, delta, __ATOMIC_RELEASE );
+	__atomic_add_fetch ( &hdr->count, delta, __ATOMIC_RELEASE );
+}
+
+/**
+ * Initialise whiteout file
+ *
+ * @v fd		File descriptor
+ * @v slots		Number of slots
+ * @v size		Length of entry log
+ * @ret rc		Return status code
+ */
+static int whiteout_init ( int fd, uint64_t slots, uint64_t size ) {
+	struct whiteout_header hdr;
+	size_t len;
+
+	memset ( &hdr, 0, sizeof ( hdr ) );
+	memcpy ( hdr.magic, WHITEOUT_MAGIC, sizeof ( hdr.magic ) );
+	hdr.version = WHITEOUT_VERSION;
+	hdr.slots = slots;
+	hdr.size = size;
+	len = ( sizeof ( hdr ) + ( slots * sizeof ( uint64_t ) ) + size );
+	if ( ftruncate ( fd, len ) != 0 )
+		return -1;
+	if ( pwrite ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) )
+		return -1;
+	return 0;
+}
+
+/**
+ * Map whiteout file
+ *
+ * @v fd		File descriptor
+ * @ret map		Whiteout mapping, or NULL on error
+ */
+static struct whiteout_map * whiteout_map ( int fd ) {
+	struct whiteout_header hdr;
+	struct whiteout_map *map;
+	struct stat st;
+	size_t len;
+	void *data;
+
+	/* Read and validate header */
+	if ( pread ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) ) {
+		errno = EINVAL;
+		goto err_read;
+	}
+	if ( ( memcmp ( hdr.magic, WHITEOUT_MAGIC,
+			sizeof ( hdr.magic ) ) != 0 ) ||
+	     ( hdr.version != WHITEOUT_VERSION ) ||
+	     ( ! hdr.slots ) || ( hdr.slots & ( hdr.slots - 1 ) ) ||
+	     ( hdr.slots > ( SIZE_MAX / ( 2 * sizeof ( uint64_t ) ) ) ) ||
+	     ( ! hdr.size ) || ( hdr.size % WHITEOUT_ALIGN ) ||
+	     ( hdr.size >= WHITEOUT_MAX_SIZE ) ) {
+		errno = EINVAL;
+		goto err_invalid;
+	}
+	len = ( sizeof ( hdr ) + ( hdr.slots * sizeof ( uint64_t ) ) +
+		hdr.size );
+	if ( fstat ( fd, &st ) != 0 )
+		goto err_stat;
+	if ( ( ( size_t ) st.st_size ) < len ) {
+		errno = EINVAL;
+		goto err_size;
+	}
+
+	/* Allocate and fill in mapping */
+	map = malloc ( sizeof ( *map ) );
+	if ( ! map )
+		goto err_alloc;
+	data = mmap ( NULL, len, ( PROT_READ | PROT_WRITE ), MAP_SHARED,
+		      fd, 0 );
+	if ( data == MAP_FAILED )
+		goto err_mmap;
+	map->hdr = data;
+	map->slots = ( data + sizeof ( hdr ) );
+	map->entries = ( ( char * ) &map->slots[hdr.slots] );
+	map->mask = ( hdr.slots - 1 );
+	map->size = hdr.size;
+	map->len = len;
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	map->published = 0;
+
+	return map;
+
+ err_mmap:
+	free ( map );
+ err_alloc:
+ err_size:
+ err_stat:
+ err_invalid:
+ err_read:
+	return NULL;
+}
+
+/**
+ * Unmap whiteout file
+ *
+ * @v map		Whiteout mapping
+ */
+static void whiteout_unmap ( struct whiteout_map *map ) {
+
+	munmap ( map->hdr, map->len );
+	free ( map );
+}
+
+/**
+ * Publish whiteout mapping
+ *
+ * @v whiteouts		Whiteout set
+ * @v old		Expected current mapping
+ * @v map		New mapping
+ *
+ * The new mapping is published only if the current mapping has not
+ * been changed by another thread in the meantime.
+ */
+static void whiteout_publish ( struct whiteouts *whiteouts,
+			       struct whiteout_map *old,
+			       struct whiteout_map *map ) {
+
+	map->published = 1;
+	if ( ! __atomic_compare_exchange_n ( &whiteouts->map, &old, map, 0,
+					     __ATOMIC_RELEASE,
+					     __ATOMIC_RELAXED ) ) {
+		map->published = 0;
+	}
+}
+
+/**
+ * Reload replaced whiteout file
+ *
+ * @v whiteouts		Whiteout set
+ * @v old		Replaced mapping
+ *
+ * Only one thread reloads the file.  Any other threads continue to
+ * use the replaced mapping in the meantime.
+ */
+static void whiteout_reload ( struct whiteouts *whiteouts,
+			      struct whiteout_map *old ) {
+	struct whiteout_map *map;
+	int fd;
+
+	/* Claim reload */
+	if ( __atomic_exchange_n ( &whiteouts->reloading, 1,
+				   __ATOMIC_ACQUIRE ) )
+		return;
+
+	/* Map replacement file */
+	fd = openat ( AT_FDCWD, whiteouts->filename, ( O_RDWR | O_CLOEXEC ) );
+	if ( fd < 0 )
+		goto err_open;
+	map = whiteout_map ( fd );
+	if ( ! map )
+		goto err_map;
+	whiteout_publish ( whiteouts, old, map );
+	if ( ! map->published )
+		whiteout_unmap ( map );
+
+ err_map:
+	close ( fd );
+ err_open:
+	__atomic_store_n ( &whiteouts->reloading, 0, __ATOMIC_RELEASE );
+}
+
+/**
+ * Get current whiteout mapping
+ *
+ * @v whiteouts		Whiteout set
+ * @ret map		Whiteout mapping, or NULL if whiteouts are disabled
+ */
+static struct whiteout_map * whiteout_current ( struct whiteouts *whiteouts ) {
+	struct whiteout_map *map;
+
+	map = __atomic_load_n ( &whiteouts->map, __ATOMIC_ACQUIRE );
+	if ( map && __atomic_load_n ( &map->hdr->replaced,
+				      __ATOMIC_ACQUIRE ) ) {
+		whiteout_reload ( whiteouts, map );
+		map = __atomic_load_n ( &whiteouts->map, __ATOMIC_ACQUIRE );
+	}
+	return map;
+}
+
+/**
+ * Lock whiteout file for modification
+ *
+ * @v whiteouts		Whiteout set
+ * @v map		Whiteout mapping to fill in
+ * @ret fd		Locked file descriptor, or negative error
+ *
+ * The file is created if it does not already exist.  The lock
+ * ensures that only one process initialises or modifies the file.
+ */
+static int whiteout_lock ( struct whiteouts *whiteouts,
+			   struct whiteout_map **map ) {
+	struct whiteout_header hdr;
+	struct whiteout_map *current;
+	struct stat st;
+	int fd;
+
+	/* Open and lock file, retrying if the file was replaced while
+	 * we were waiting for the lock.
+	 */
+	while ( 1 ) {
+		fd = openat ( AT_FDCWD, whiteouts->filename,
+			      ( O_RDWR | O_CREAT | O_CLOEXEC ),
+			      WHITEOUT_MODE );
+		if ( fd < 0 )
+			goto err_open;
+		if ( flock ( fd, LOCK_EX ) != 0 )
+			goto err_lock;
+		if ( fstat ( fd, &st ) != 0 )
+			goto err_stat;
+		if ( ( st.st_size == 0 ) &&
+		     ( whiteout_init ( fd, WHITEOUT_SLOTS,
+				       WHITEOUT_SIZE ) != 0 ) )
+			goto err_init;
+		if ( pread ( fd, &hdr, sizeof ( hdr ), 0 ) != sizeof ( hdr ) ) {
+			errno = EINVAL;
+			goto err_read;
+		}
+		if ( ! hdr.replaced )
+			break;
+		close ( fd );
+	}
+
+	/* Use current mapping if it is of this file */
+	current = __atomic_load_n ( &whiteouts->map, __ATOMIC_ACQUIRE );
+	if ( current && ( current->dev == st.st_dev ) &&
+	     ( current->ino == st.st_ino ) ) {
+		*map = current;
+		return fd;
+	}
+
+	/* Otherwise, map file */
+	*map = whiteout_map ( fd );
+	if ( ! *map )
+		goto err_map;
+	whiteout_publish ( whiteouts, current, *map );
+
+	return fd;
+
+ err_map:
+ err_read:
+ err_init:
+ err_stat:
+ err_lock:
+	close ( fd );
+ err_open:
+	return -1;
+}
+
+/**
+ * Unlock whiteout file
+ *
+ * @v fd		Locked file descriptor
+ * @v map		Whiteout mapping
+ *
+ * The lock must be released explicitly, since a mapping of the file
+ * holds a reference to the open file description.
+ */
+static void whiteout_unlock ( int fd, struct whiteout_map *map ) {
+
+	flock ( fd, LOCK_UN );
+	if ( ! map->published )
+		whiteout_unmap ( map );
+	close ( fd );
+}
+
+/**
+ * Check for space for a new whiteout entry
+ *
+ * @v map		Whiteout mapping (locked)
+ * @v len		Length of path
+ * @ret ok		Entry may be inserted
+ */
+static int whiteout_space ( struct whiteout_map *map, size_t len ) {
+	struct whiteout_header *hdr = map->hdr;
+
+	return ( ( ( ( hdr->filled + 1 ) * 100 ) <=
+		   ( ( map->mask + 1 ) * WHITEOUT_MAX_LOAD ) ) &&
+		 ( hdr->used <= map->size ) &&
+		 ( whiteout_entry_len ( len ) <= ( map->size - hdr->used ) ) );
+}
+
+/**
+ * Insert new whiteout entry
+ *
+ * @v map		Whiteout mapping (locked, with space for entry)
+ * @v ns		Namespace
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path (excluding trailing slashes)
+ * @v flags		Entry flags
+ */
+static void whiteout_insert ( struct whiteout_map *map, uint64_t ns,
+			      const char *suffix, size_t len,
+			      uint32_t flags ) {
+	struct whiteout_header *hdr = map->hdr;
+	struct whiteout_entry *entry;
+	uint64_t offset = hdr->used;
+	uint64_t *slot;
+	uint64_t hash;
+	uint64_t i;
+
+	/* Append entry to log */
+	entry = ( ( void * ) ( map->entries + offset ) );
+	entry->ns = ns;
+	entry->len = len;
+	entry->flags = flags;
+	memcpy ( entry->path, suffix, len );
+	entry->path[len] = '\0';
+	__atomic_store_n ( &hdr->used, ( offset + whiteout_entry_len ( len ) ),
+			   __ATOMIC_RELEASE );
+
+	/* Publish entry in first empty slot */
+	hash = whiteout_hash ( ns, suffix, len );
+	for ( i = hash ; ; i++ ) {
+		slot = &map->slots[ i & map->mask ];
+		if ( ! *slot )
+			break;
+	}
+	__atomic_store_n ( slot, ( ( hash & ~WHITEOUT_OFFSET_MASK ) |
+				   ( ( offset / WHITEOUT_ALIGN ) + 1 ) ),
+			   __ATOMIC_RELEASE );
+	__atomic_add_fetch ( &hdr->filled, 1, __ATOMIC_RELEASE );
+	whiteout_account ( hdr, flags, 1 );
+}
+
+/**
+ * Rebuild whiteout file
+ *
+ * @v whiteouts		Whiteout set
+ * @v fd		Locked file descriptor (updated)
+ * @v map		Whiteout mapping (updated)
+ * @v count		Number of additional entries to allow for
+ * @v used		Length of additional entries to allow for
+ * @ret rc		Return status code
+ *
+ * The live entries are copied into a new file, which is renamed over
+ * the original file.  On success, the new file is locked and the
+ * original file is unlocked.
+ */
+static int whiteout_rebuild ( struct whiteouts *whiteouts, int *fd,
+			      struct whiteout_map **map, uint64_t count,
+			      uint64_t used ) {
+	struct whiteout_map *old = *map;
+	struct whiteout_map *new;
+	struct whiteout_entry *entry;
+	uint64_t slots = WHITEOUT_SLOTS;
+	uint64_t size = WHITEOUT_SIZE;
+	uint64_t offset;
+	uint64_t end;
+	char *filename;
+	int newfd;
+
+	/* Calculate required capacity, leaving room for as many again */
+	end = __atomic_load_n ( &old->hdr->used, __ATOMIC_ACQUIRE );
+	for ( offset = 0 ; ( entry = whiteout_next ( old, &offset, end ) ) ; ) {
+		count++;
+		used += whiteout_entry_len ( entry->len );
+	}
+	while ( ( 2 * count * 100 ) > ( slots * WHITEOUT_MAX_LOAD ) )
+		slots <<= 1;
+	while ( size < ( 2 * used ) )
+		size <<= 1;
+	if ( size >= WHITEOUT_MAX_SIZE ) {
+		errno = ENOSPC;
+		goto err_size;
+	}
+
+	/* Create and lock new file, removing any left behind by a
+	 * previous failed rebuild (which cannot be in use, since we
+	 * hold the lock on the original file).
+	 */
+	if ( asprintf ( &filename, "%s" WHITEOUT_NEW,
+			whiteouts->filename ) < 0 )
+		goto err_filename;
+	unlinkat ( AT_FDCWD, filename, 0 );
+	newfd = openat ( AT_FDCWD, filename,
+			 ( O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC ),
+			 WHITEOUT_MODE );
+	if ( newfd < 0 )
+		goto err_open;
+	if ( flock ( newfd, LOCK_EX ) != 0 )
+		goto err_lock;
+	if ( whiteout_init ( newfd, slots, size ) != 0 )
+		goto err_init;
+	new = whiteout_map ( newfd );
+	if ( ! new )
+		goto err_map;
+
+	/* Copy live entries */
+	for ( offset = 0 ; ( entry = whiteout_next ( old, &offset, end ) ) ; ) {
+		whiteout_insert ( new, entry->ns, entry->path, entry->len,
+				  entry->flags );
+	}
+
+	/* Replace original file */
+	if ( renameat ( AT_FDCWD, filename, AT_FDCWD,
+			whiteouts->filename ) != 0 )
+		goto err_rename;
+	__atomic_store_n ( &old->hdr->replaced, 1, __ATOMIC_RELEASE );
+	whiteout_publish ( whiteouts, old, new );
+	whiteout_unlock ( *fd, old );
+	*fd = newfd;
+	*map = new;
+
+	free ( filename );
+	return 0;
+
+ err_rename:
+	whiteout_unmap ( new );
+ err_map:
+ err_init:
+ err_lock:
+	close ( newfd );
+	unlinkat ( AT_FDCWD, filename, 0 );
+ err_open:
+	free ( filename );
+ err_filename:
+ err_size:
+	return -1;
+}
+
+/**
+ * Open (or create) whiteout file
+ *
+ * @v whiteouts		Whiteout set
+ * @v filename		Whiteout file name
+ * @ret rc		Return status code
+ */
+int whiteout_open ( struct whiteouts *whiteouts, const char *filename ) {
+	struct whiteout_map *map;
+	int fd;
+
+	/* Record file name */
+	memset ( whiteouts, 0, sizeof ( *whiteouts ) );
+	whiteouts->filename = strdup ( filename );
+	if ( ! whiteouts->filename )
+		goto err_filename;
+
+	/* Create (if necessary) and map file */
+	fd = whiteout_lock ( whiteouts, &map );
+	if ( fd < 0 )
+		goto err_lock;
+	whiteout_unlock ( fd, map );
+
+	return 0;
+
+ err_lock:
+	free ( whiteouts->filename );
+	whiteouts->filename = NULL;
+ err_filename:
+	return -1;
+}
+
+/**
+ * Get number of whiteouts
+ *
+ * @v whiteouts		Whiteout set
+ * @ret count		Number of whiteouts
+ */
+uint64_t whiteout_count ( struct whiteouts *whiteouts ) {
+	struct whiteout_map *map;
+
+	map = whiteout_current ( whiteouts );
+	if ( ! map )
+		return 0;
+	return __atomic_load_n ( &map->hdr->count, __ATOMIC_ACQUIRE );
+}
+
+/**
+ * Check for whiteout
+ *
+ * @v whiteouts		Whiteout set
+ * @v ns		Namespace
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path
+ * @ret whiteout	Path (or an ancestor symbolic link) has been whited out
+ */
+int whiteout_contains ( struct whiteouts *whiteouts, uint64_t ns,
+			const char *suffix, size_t len ) {
+	struct whiteout_map *map;
+	size_t parent_len;
+
+	/* Do nothing if whiteouts are disabled or none exist */
+	map = whiteout_current ( whiteouts );
+	if ( ! ( map && __atomic_load_n ( &map->hdr->count,
+					  __ATOMIC_ACQUIRE ) ) )
+		return 0;
+
+	/* Check path itself */
+	if ( whiteout_live ( map, ns, suffix, len ) )
+		return 1;
+
+	/* Check ancestors, if any whiteout may hide descendants */
+	if ( ! __atomic_load_n ( &map->hdr->parents, __ATOMIC_ACQUIRE ) )
+		return 0;
+	for ( parent_len = 1 ; parent_len < len ; parent_len++ ) {
+		if ( ( suffix[parent_len] == '/' ) &&
+		     whiteout_live ( map, ns, suffix, parent_len ) )
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Add whiteout
+ *
+ * @v whiteouts		Whiteout set
+ * @v ns		Namespace
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path
+ * @v parent		Whiteout may hide descendant paths
+ * @ret rc		Return status code
+ */
+int whiteout_add ( struct whiteouts *whiteouts, uint64_t ns,
+		   const char *suffix, size_t len, int parent ) {
+	uint32_t flags = ( parent ? WHITEOUT_PARENT : 0 );
+	struct whiteout_entry *entry;
+	struct whiteout_map *map;
+	int rc = -1;
+	int fd;
+
+	/* Fail if whiteouts are disabled */
+	if ( ! whiteout_enabled ( whiteouts ) ) {
+		errno = EPERM;
+		goto err_disabled;
+	}
+
+	/* Lock file */
+	fd = whiteout_lock ( whiteouts, &map );
+	if ( fd < 0 )
+		goto err_lock;
+
+	/* Reinstate existing entry, if any */
+	len = whiteout_trim ( suffix, len );
+	entry = whiteout_find ( map, ns, suffix, len );
+	if ( entry ) {
+		if ( entry->flags & WHITEOUT_REMOVED ) {
+			__atomic_store_n ( &entry->flags, flags,
+					   __ATOMIC_RELEASE );
+			whiteout_account ( map->hdr, flags, 1 );
+		}
+		rc = 0;
+		goto done;
+	}
+
+	/* Rebuild file if full, and insert new entry */
+	if ( ( ! whiteout_space ( map, len ) ) &&
+	     ( whiteout_rebuild ( whiteouts, &fd, &map, 1,
+				  whiteout_entry_len ( len ) ) != 0 ) )
+		goto err_rebuild;
+	whiteout_insert ( map, ns, suffix, len, flags );
+	rc = 0;
+
+ err_rebuild:
+ done:
+	whiteout_unlock ( fd, map );
+ err_lock:
+ err_disabled:
+	return rc;
+}
+
+/**
+ * Remove whiteout
+ *
+ * @v whiteouts		Whiteout set
+ * @v ns		Namespace
+ * @v suffix		Path relative to readonly directory
+ * @v len		Length of path
+ * @ret rc		Return status code
+ */
+int whiteout_remove ( struct whiteouts *whiteouts, uint64_t ns,
+		      const char *suffix, size_t len ) {
+	struct whiteout_entry *entry;
+	struct whiteout_map *map;
+	int rc = -1;
+	int fd;
+
+	/* Fail if whiteouts are disabled */
+	if ( ! whiteout_enabled ( whiteouts ) ) {
+		errno = EPERM;
+		goto err_disabled;
+	}
+
+	/* Lock file */
+	fd = whiteout_lock ( whiteouts, &map );
+	if ( fd < 0 )
+		goto err_lock;
+
+	/* Mark entry as removed */
+	len = whiteout_trim ( suffix, len );
+	entry = whiteout_find ( map, ns, suffix, len );
+	if ( ( ! entry ) || ( entry->flags & WHITEOUT_REMOVED ) ) {
+		errno = ENOENT;
+		goto err_find;
+	}
+	__atomic_store_n ( &entry->flags, ( entry->flags | WHITEOUT_REMOVED ),
+			   __ATOMIC_RELEASE );
+	whiteout_account ( map->hdr, entry->flags, -1 );
+	rc = 0;
+
+ err_find:
+	whiteout_unlock ( fd, map );
+ err_lock:
+ err_disabled:
+	return rc;
+}
+
+/**
+ * List whiteouts
+ *
+ * @v whiteouts		Whiteout set
+ * @v visit		Visitor function
+ * @v arg		Visitor argument
+ * @ret rc		Return status code (or first non-zero visitor result)
+ */
+int whiteout_list ( struct whiteouts *whiteouts,
+		    int ( * visit ) ( uint64_t ns, const char *path,
+				      size_t len, void *arg ),
+		    void *arg ) {
+	struct whiteout_entry *entry;
+	struct whiteout_map *map;
+	uint64_t offset;
+	uint64_t used;
+	int rc;
+
+	/* Fail if whiteouts are disabled */
+	map = whiteout_current ( whiteouts );
+	if ( ! map ) {
+		errno = EPERM;
+		return -1;
+	}
+
+	/* Visit each live entry */
+	used = __atomic_load_n ( &map->hdr->used, __ATOMIC_ACQUIRE );
+	offset = 0;
+	while ( ( entry = whiteout_next ( map, &offset, used ) ) ) {
+		if ( ( rc = visit ( entry->ns, entry->path, entry->len,
+				    arg ) ) != 0 )
+			return rc;
+	}
+	return 0;
+}
+
+/**
+ * Compact whiteout file
+ *
+ * @v whiteouts		Whiteout set
+ * @ret rc		Return status code
+ *
+ * The file is rebuilt without any removed entries.
+ */
+int whiteout_compact ( struct whiteouts *whiteouts ) {
+	struct whiteout_map *map;
+	int rc;
+	int fd;
+
+	/* Fail if whiteouts are disabled */
+	if ( ! whiteout_enabled ( whiteouts ) ) {
+		errno = EPERM;
+		return -1;
+	}
+
+	/* Lock file */
+	fd = whiteout_lock ( whiteouts, &map );
+	if ( fd < 0 )
+		return -1;
+
+	/* Rebuild file */
+	rc = whiteout_rebuild ( whiteouts, &fd, &map, 0, 0 );
+
+	whiteout_unlock ( fd, map );
+	return rc;
+}
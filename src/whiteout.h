@@ -0,0 +1,200 @@
+#ifndef _WHITEOUT_H
+#define _WHITEOUT_H
+
+/*
+ * Copyright (C) 2020 Michael Brown <mbrown@fensystems.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ */
+
+/*
+ * Whiteout set
+ *
+ * A whiteout records that a path within the readonly directory has
+ * been deleted, without modifying the readonly directory.  The set of
+ * whiteouts is stored in a file that is mapped (shared) into every
+ * process.  Whiteouts added by one process are therefore immediately
+ * visible to all other processes, and checking for a whiteout
+ * requires no system calls.
+ *
+ * The file holds an append-only log of entries, each recording the
+ * full path, and an open-addressing hash table of slots referring to
+ * those entries.  Each slot also holds the upper half of the path
+ * hash, so that most non-matching slots can be skipped without
+ * examining the entry, and a matching slot is confirmed by comparing
+ * the recorded path.  Removing a whiteout marks its entry as removed.
+ *
+ * Paths are recorded within a namespace (e.g. identifying the set of
+ * readonly directories), so that a single whiteout file may be shared
+ * between several sets of readonly directories.
+ *
+ * Modifications are serialised by an exclusive lock on the file, and
+ * are published using atomic stores, so that lookups require no
+ * locking.  When the table or the entry log is full (or on request),
+ * the live entries are copied into a new file with room for at least
+ * as many again, which is renamed over the original file.  The
+ * original file is then marked as replaced, and each process switches
+ * to the new file upon noticing the mark.  A superseded mapping is
+ * never unmapped, since a concurrent lookup may still be using it.
+ * Rebuilds are rare, so the memory held by superseded mappings is
+ * modest.
+ *
+ * A whiteout of a symbolic link must also hide any paths reached via
+ * that link.  Such whiteouts are counted separately, so that the
+ * ancestors of a path are checked only when necessary.
+ *
+ * Code in this file is linked into the interception library, and so
+ * must not call any of the library functions that the interception
+ * library wraps.  Use the unwrapped *at() variants instead.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#pragma GCC visibility push ( hidden )
+
+/** Whiteout file magic signature */
+#define WHITEOUT_MAGIC "TURDWHT"
+
+/** Whiteout file format version */
+#define WHITEOUT_VERSION 2
+
+/** Minimum number of whiteout slots (must be a power of two) */
+#define WHITEOUT_SLOTS ( 1 << 14 )
+
+/** Minimum length of whiteout entry log (must be a power of two) */
+#define WHITEOUT_SIZE ( 1 << 20 )
+
+/** Maximum length of whiteout entry log
+ *
+ * Slots refer to entries by their offset (in units of the entry
+ * alignment) within the lower half of the slot value.
+ */
+#define WHITEOUT_MAX_SIZE ( 1ULL << 35 )
+
+/** Maximum whiteout table load (percent) */
+#define WHITEOUT_MAX_LOAD 75
+
+/** Whiteout entry alignment */
+#define WHITEOUT_ALIGN 8
+
+/** Whiteout file mode */
+#define WHITEOUT_MODE 0600
+
+/** Whiteout file header */
+struct whiteout_header {
+	/** Magic signature */
+	char magic[8];
+	/** Format version */
+	uint32_t version;
+	/** Number of whiteouts that may hide descendant paths */
+	uint32_t parents;
+	/** Number of slots */
+	uint64_t slots;
+	/** Number of filled slots */
+	uint64_t filled;
+	/** Number of whiteouts (excluding removed entries) */
+	uint64_t count;
+	/** Length of entry log */
+	uint64_t size;
+	/** Used length of entry log */
+	uint64_t used;
+	/** File has been replaced */
+	uint32_t replaced;
+	/** Reserved */
+	uint32_t reserved;
+} __attribute__ (( packed ));
+
+/** A whiteout entry */
+struct whiteout_entry {
+	/** Namespace */
+	uint64_t ns;
+	/** Length of path */
+	uint32_t len;
+	/** Flags */
+	uint32_t flags;
+	/** Path (NUL-terminated) */
+	char path[0];
+} __attribute__ (( packed ));
+
+/** Whiteout has been removed */
+#define WHITEOUT_REMOVED 0x0001
+
+/** Whiteout may hide descendant paths */
+#define WHITEOUT_PARENT 0x0002
+
+/** A mapped whiteout file */
+struct whiteout_map {
+	/** Mapped file header */
+	struct whiteout_header *hdr;
+	/** Slots (hash and entry offset, or zero for an empty slot) */
+	uint64_t *slots;
+	/** Entry log */
+	char *entries;
+	/** Slot index mask */
+	uint64_t mask;
+	/** Length of entry log */
+	uint64_t size;
+	/** Length of mapping */
+	size_t len;
+	/** Device containing file */
+	dev_t dev;
+	/** Inode number of file */
+	ino_t ino;
+	/** Mapping has been published (and so must never be unmapped) */
+	int published;
+};
+
+/** A whiteout set */
+struct whiteouts {
+	/** Whiteout file name */
+	char *filename;
+	/** Current mapping (or NULL if whiteouts are disabled) */
+	struct whiteout_map *map;
+	/** Mapping is being reloaded */
+	int reloading;
+};
+
+/**
+ * Check if whiteouts are enabled
+ *
+ * @v whiteouts		Whiteout set
+ * @ret enabled		Whiteouts are enabled
+ */
+static inline int whiteout_enabled ( struct whiteouts *whiteouts ) {
+
+	return ( whiteouts->map != NULL );
+}
+
+extern int whiteout_open ( struct whiteouts *whiteouts,
+			   const char *filename );
+extern uint64_t whiteout_count ( struct whiteouts *whiteouts );
+extern int whiteout_contains ( struct whiteouts *whiteouts, uint64_t ns,
+			       const char *suffix, size_t len );
+extern int whiteout_add ( struct whiteouts *whiteouts, uint64_t ns,
+			  const char *suffix, size_t len, int parent );
+extern int whiteout_remove ( struct whiteouts *whiteouts, uint64_t ns,
+			     const char *suffix, size_t len );
+extern int whiteout_list ( struct whiteouts *whiteouts,
+			   int ( * visit ) ( uint64_t ns, const char *path,
+					     size_t len, void *arg ),
+			   void *arg );
+extern int whiteout_compact ( struct whiteouts *whiteouts );
+
+#pragma GCC visibility pop
+
+#endif /* _WHITEOUT_H */